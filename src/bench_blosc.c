@@ -0,0 +1,378 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    End-to-end benchmark of the Blosc filter through HDF5.
+
+    Writes and reads back a dataset for every combination of compressor,
+    compression level, shuffle, chunk shape, thread count and data set,
+    and prints one CSV line per combination with the write and read
+    speeds (in uncompressed MB/s), the compression ratio and the peak
+    resident memory.  Files are kept in memory (core driver) so that
+    disk speed does not get in the way.
+
+    To run the full sweep:
+
+    $ ./bench_blosc > results.csv
+
+    Every dimension of the sweep can be narrowed down with a comma
+    separated list:
+
+    $ ./bench_blosc -c lz4,zstd -l 1,5,9 -s 1,2 -k medium -t 1,4 -d smooth
+
+      -c  compressors (default: all those blosc_list_compressors() reports)
+      -l  compression levels (default: 0 to 9)
+      -s  shuffle modes, 0 none, 1 byte, 2 bit (default: 0,1,2)
+      -k  chunk shapes: small, medium, large (default: all)
+      -t  threads per chunk (default: 1,2,4 and the number of processors)
+      -d  data sets: zeros, ramp, noise, smooth, sparse, counter
+          (default: all)
+      -r  repetitions, the best time is kept (default: 3)
+      -m  minimum sampled ratio in hundredths (slot 8), chunks that
+          sample below it are stored uncompressed (default: 0, off)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+#include "h5blosc_tools.h"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#define NDIMS 3
+#define SHAPE {64, 256, 256}
+#define SIZE (64 * 256 * 256)
+
+typedef struct {
+    const char *name;
+    hsize_t dims[NDIMS];
+} chunk_shape_t;
+
+static const chunk_shape_t chunk_shapes[] = {
+    {"small", {2, 64, 64}},         /* 32 KB */
+    {"medium", {8, 128, 128}},      /* 512 KB */
+    {"large", {16, 256, 256}},      /* 4 MB */
+};
+#define NSHAPES (sizeof(chunk_shapes) / sizeof(chunk_shapes[0]))
+
+/* Data sets: all of them hold 4-byte items */
+static const char *data_names[] = {
+    "zeros", "ramp", "noise", "smooth", "sparse", "counter"
+};
+#define NDATA (sizeof(data_names) / sizeof(data_names[0]))
+
+/* A small reproducible generator (xorshift32) */
+static unsigned int rand_state = 2463534242U;
+
+static unsigned int next_rand(void){
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static float rand_float(void){
+    return (next_rand() >> 8) / 16777216.0f;
+}
+
+/* Fill `data` with SIZE items of the data set `name`; returns its type */
+static hid_t make_data(const char *name, void *data){
+
+    float *f = (float *)data;
+    int *n = (int *)data;
+    int i, x, y, z;
+
+    rand_state = 2463534242U;
+    if (strcmp(name, "zeros") == 0) {
+        memset(data, 0, SIZE * sizeof(float));
+    } else if (strcmp(name, "ramp") == 0) {
+        for (i = 0; i < SIZE; i++) f[i] = (float)i;
+    } else if (strcmp(name, "noise") == 0) {
+        for (i = 0; i < SIZE; i++) f[i] = rand_float();
+    } else if (strcmp(name, "smooth") == 0) {
+        /* Like a simulation field: smooth waves plus a little noise */
+        for (i = 0, z = 0; z < 64; z++) {
+            for (y = 0; y < 256; y++) {
+                for (x = 0; x < 256; x++, i++) {
+                    f[i] = (float)(sin(x * 0.05) * cos(y * 0.03) +
+                                   0.5 * sin(z * 0.1) +
+                                   0.001 * rand_float());
+                }
+            }
+        }
+    } else if (strcmp(name, "sparse") == 0) {
+        for (i = 0; i < SIZE; i++) {
+            f[i] = next_rand() % 20 == 0 ? rand_float() : 0.0f;
+        }
+    } else if (strcmp(name, "counter") == 0) {
+        /* Like timestamps: increasing with small irregular steps */
+        n[0] = 1000000;
+        for (i = 1; i < SIZE; i++) n[i] = n[i - 1] + 1 + next_rand() % 4;
+        return H5T_NATIVE_INT;
+    } else {
+        return -1;
+    }
+    return H5T_NATIVE_FLOAT;
+}
+
+static double now(void){
+#if defined(_WIN32)
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* Peak resident memory in KB since the last reset_peak_rss() */
+static long peak_rss(void){
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+        }
+        fclose(f);
+    }
+    return kb;
+#elif !defined(_WIN32)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+/* Restart the peak memory count; only possible on Linux, elsewhere the
+   peak of the whole run is reported */
+static void reset_peak_rss(void){
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+typedef struct {
+    double write_time, read_time;
+    hsize_t storage;
+    long rss;
+} result_t;
+
+/* Write and read back one dataset in a new in-memory file; returns -1 on
+   errors */
+static int run_one(hid_t fapl, hid_t type, const void *data, void *data_out,
+                   const hsize_t *chunkdims, int compcode, int clevel,
+                   int doshuffle, unsigned min_ratio, result_t *result){
+
+    const hsize_t shape[] = SHAPE;
+    unsigned int cd_values[9] = {0};
+    hid_t fid = -1, sid = -1, plist = -1, dset = -1;
+    double t0;
+    int r = -1;
+
+    fid = H5Fcreate("bench_blosc.h5", H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    sid = H5Screate_simple(NDIMS, shape, NULL);
+    plist = H5Pcreate(H5P_DATASET_CREATE);
+    if (fid < 0 || sid < 0 || plist < 0) goto failed;
+    if (H5Pset_chunk(plist, NDIMS, chunkdims) < 0) goto failed;
+    cd_values[4] = clevel;
+    cd_values[5] = doshuffle;
+    cd_values[6] = compcode;
+    cd_values[8] = min_ratio;
+    if (H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL,
+                      min_ratio > 0 ? 9 : 7, cd_values) < 0) goto failed;
+
+    reset_peak_rss();
+    t0 = now();
+    dset = H5Dcreate(fid, "bench", type, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if (dset < 0) goto failed;
+    if (H5Dwrite(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) < 0)
+        goto failed;
+    H5Dclose(dset);
+    dset = -1;
+    result->write_time = now() - t0;
+
+    t0 = now();
+    dset = H5Dopen(fid, "bench", H5P_DEFAULT);
+    if (dset < 0) goto failed;
+    if (H5Dread(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data_out) < 0)
+        goto failed;
+    result->read_time = now() - t0;
+    result->rss = peak_rss();
+    result->storage = H5Dget_storage_size(dset);
+
+    if (memcmp(data, data_out, SIZE * sizeof(float)) != 0) {
+        fprintf(stderr, "Round-trip mismatch\n");
+        goto failed;
+    }
+    r = 0;
+
+ failed:
+    if (dset >= 0) H5Dclose(dset);
+    if (plist >= 0) H5Pclose(plist);
+    if (sid >= 0) H5Sclose(sid);
+    if (fid >= 0) H5Fclose(fid);
+    return r;
+}
+
+int main(int argc, char **argv){
+
+    static char compressors[256];
+    const char *codecs[MAX_ITEMS], *shapes[MAX_ITEMS], *datasets[MAX_ITEMS];
+    int levels[MAX_ITEMS], shuffles[MAX_ITEMS], threads[MAX_ITEMS];
+    int ncodecs, nlevels = 10, nshuffles = 3, nshapes = 0, nthreads = 0;
+    int ndatasets = 0, repeats = 3;
+    unsigned min_ratio = 0;
+    int c, l, s, k, t, d, i, rep, compcode;
+    const size_t nbytes = SIZE * sizeof(float);
+    const hsize_t *chunkdims;
+    char *version, *date;
+    void *data, *data_out;
+    result_t best, result;
+    hid_t fapl, type;
+    long ncpus = 1;
+
+    strncpy(compressors, blosc_list_compressors(), sizeof(compressors) - 1);
+    ncodecs = h5blosc_split_list(compressors, codecs);
+    for (i = 0; i < 10; i++) levels[i] = i;
+    for (i = 0; i < 3; i++) shuffles[i] = i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) {
+            ncodecs = h5blosc_split_list(argv[i + 1], codecs);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            nlevels = h5blosc_parse_ints(argv[i + 1], levels);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            nshuffles = h5blosc_parse_ints(argv[i + 1], shuffles);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            nshapes = h5blosc_split_list(argv[i + 1], shapes);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            nthreads = h5blosc_parse_ints(argv[i + 1], threads);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            ndatasets = h5blosc_split_list(argv[i + 1], datasets);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            repeats = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            min_ratio = (unsigned)atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i < argc) {
+        fprintf(stderr, "Usage: %s [-c codecs] [-l levels] [-s shuffles] "
+                "[-k shapes] [-t threads] [-d datasets] [-r repeats] "
+                "[-m min_ratio]\n",
+                argv[0]);
+        return 2;
+    }
+    if (nshapes == 0) {
+        for (k = 0; k < (int)NSHAPES; k++) shapes[nshapes++] = chunk_shapes[k].name;
+    }
+    if (ndatasets == 0) {
+        for (d = 0; d < (int)NDATA; d++) datasets[ndatasets++] = data_names[d];
+    }
+    if (nthreads == 0) {
+#if defined(_SC_NPROCESSORS_ONLN)
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        for (i = 1; i <= 4; i *= 2) threads[nthreads++] = i;
+        if (ncpus > 4) threads[nthreads++] = (int)ncpus;
+    }
+    if (repeats < 1) repeats = 1;
+
+    if (register_blosc(&version, &date) < 0) return 1;
+    data = malloc(nbytes);
+    data_out = malloc(nbytes);
+    if (data == NULL || data_out == NULL) return 1;
+
+    fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (fapl < 0 || H5Pset_fapl_core(fapl, 16 * 1024 * 1024, 0) < 0) return 1;
+
+    printf("blosc,codec,clevel,shuffle,chunk,chunk_bytes,threads,data,"
+           "write_MBps,read_MBps,ratio,peak_rss_kB\n");
+    for (d = 0; d < ndatasets; d++) {
+        type = make_data(datasets[d], data);
+        if (type < 0) {
+            fprintf(stderr, "Unknown data set '%s'\n", datasets[d]);
+            return 2;
+        }
+        for (k = 0; k < nshapes; k++) {
+            for (i = 0; i < (int)NSHAPES; i++) {
+                if (strcmp(shapes[k], chunk_shapes[i].name) == 0) break;
+            }
+            if (i == (int)NSHAPES) {
+                fprintf(stderr, "Unknown chunk shape '%s'\n", shapes[k]);
+                return 2;
+            }
+            chunkdims = chunk_shapes[i].dims;
+            for (c = 0; c < ncodecs; c++) {
+                compcode = blosc_compname_to_compcode(codecs[c]);
+                if (compcode < 0) {
+                    fprintf(stderr, "Unknown compressor '%s'\n", codecs[c]);
+                    return 2;
+                }
+                for (l = 0; l < nlevels; l++) {
+                    for (s = 0; s < nshuffles; s++) {
+                        for (t = 0; t < nthreads; t++) {
+                            blosc_filter_set_nthreads(threads[t]);
+                            for (rep = 0; rep < repeats; rep++) {
+                                if (run_one(fapl, type, data, data_out,
+                                            chunkdims, compcode, levels[l],
+                                            shuffles[s], min_ratio,
+                                            &result) < 0) {
+                                    return 1;
+                                }
+                                if (rep == 0 ||
+                                    result.write_time < best.write_time) {
+                                    best.write_time = result.write_time;
+                                }
+                                if (rep == 0 ||
+                                    result.read_time < best.read_time) {
+                                    best.read_time = result.read_time;
+                                }
+                                best.storage = result.storage;
+                                best.rss = result.rss;
+                            }
+                            printf("%s,%s,%d,%d,%s,%lu,%d,%s,%.1f,%.1f,"
+                                   "%.3f,%ld\n", version, codecs[c],
+                                   levels[l], shuffles[s], chunk_shapes[i].name,
+                                   (unsigned long)(chunkdims[0] * chunkdims[1] *
+                                                   chunkdims[2] * 4),
+                                   threads[t], datasets[d],
+                                   nbytes / best.write_time / 1e6,
+                                   nbytes / best.read_time / 1e6,
+                                   best.storage > 0 ?
+                                   (double)nbytes / best.storage : 0.,
+                                   best.rss);
+                            fflush(stdout);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    H5Pclose(fapl);
+    free(data);
+    free(data_out);
+    free(version);
+    free(date);
+    return 0;
+}
@@ -0,0 +1,280 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Micro-benchmark of the fixed per-call cost of the Blosc filter.
+
+    blosc_filter() is called directly, compressing and decompressing the
+    same small chunk over and over the way HDF5 does, and compared with
+    raw blosc_compress_ctx()/blosc_decompress_ctx() calls on preallocated
+    buffers.  The difference is the overhead of the filter itself
+    (buffer handling, parameter parsing, accounting).  The cost of
+    blosc_set_local() is measured as well.
+
+    Overheads are kept relative to the raw Blosc time, so that a baseline
+    carries over from one machine to another: that of the filter over the
+    raw calls on the same chunk, and that of blosc_set_local() over the
+    raw calls on the smallest chunk.  They are checked against a baseline
+    file of lines like
+
+        <chunk bytes or "set_local">  <overhead / raw Blosc time>
+
+    and the program fails if one of them goes over TOLERANCE times its
+    baseline plus RATIO_SLACK.  Each filter call is timed right before a
+    raw call on the same data, and the overhead is taken from the median
+    ratio of the two, so that both see the same machine load; this keeps
+    the noise to about 1% of the raw time, where a malloc() and free() of
+    the chunk per call (what the filter did before its buffer pool) costs
+    2 to 5%.
+
+    To run (this is the bench_filter_overhead test):
+
+    $ ./bench_filter bench_filter_baseline.txt
+
+    To write the measured overheads as a new baseline:
+
+    $ ./bench_filter -w bench_filter_baseline.txt
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+
+#define NITER_BYTES (16 * 1024 * 1024)  /* Chunk bytes per measurement */
+#define MAX_ITER 4096
+#define NREPEAT 7       /* set_local() measurements, the fastest is kept */
+#define TOLERANCE 1.5
+#define RATIO_SLACK 0.02
+#define NITER_SET_LOCAL 1000
+
+/* Not in blosc_filter.h: HDF5 calls these through the filter class */
+size_t blosc_filter(unsigned flags, size_t cd_nelmts,
+                    const unsigned cd_values[], size_t nbytes,
+                    size_t *buf_size, void **buf);
+herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space);
+
+static const size_t chunk_sizes[] = {4096, 16384, 65536};
+#define NSIZES (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+static double now(void){
+#if defined(_WIN32)
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* Fill a chunk with mildly compressible floats */
+static void fill_chunk(float *data, size_t n){
+
+    size_t i;
+
+    for (i = 0; i < n; i++) data[i] = (float)(i % 97) * 0.5f;
+}
+
+static int compare_doubles(const void *a, const void *b){
+
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Time compress + decompress pairs through blosc_filter() and with the
+   raw Blosc calls on preallocated buffers, one of each in turn.  Gives
+   the median time of a raw pair in `raw_ns` and the median ratio of a
+   filter pair to the raw pair next to it in `ratio`. */
+static int time_pairs(const unsigned int *cd_values, const float *data,
+                      size_t nbytes, double *raw_ns, double *ratio){
+
+    static double ratios[MAX_ITER], raws[MAX_ITER];
+    size_t buf_size = nbytes, n;
+    void *buf = malloc(nbytes);
+    char *rawbuf = malloc(nbytes);
+    char *cbuf = malloc(nbytes + BLOSC_MAX_OVERHEAD);
+    int i, cbytes, niter = (int)(NITER_BYTES / nbytes);
+    double t0, t1, t2;
+
+    if (niter > MAX_ITER) niter = MAX_ITER;
+    if (buf == NULL || rawbuf == NULL || cbuf == NULL) goto failed;
+    for (i = 0; i < niter; i++) {
+        t0 = now();
+        memcpy(buf, data, nbytes);
+        n = blosc_filter(0, 7, cd_values, nbytes, &buf_size, &buf);
+        if (n == 0) goto failed;
+        n = blosc_filter(H5Z_FLAG_REVERSE, 7, cd_values, n, &buf_size, &buf);
+        if (n != nbytes) goto failed;
+        t1 = now();
+        /* Same copy as what the filter pair does */
+        memcpy(rawbuf, data, nbytes);
+        cbytes = blosc_compress_ctx(5, 1, sizeof(float), nbytes, rawbuf,
+                                    cbuf, nbytes, "blosclz", 0, 1);
+        if (cbytes <= 0) goto failed;
+        if (blosc_decompress_ctx(cbuf, rawbuf, nbytes, 1) != (int)nbytes)
+            goto failed;
+        t2 = now();
+        raws[i] = (t2 - t1) * 1e9;
+        ratios[i] = t2 > t1 ? (t1 - t0) / (t2 - t1) : 1;
+    }
+    qsort(raws, niter, sizeof(double), compare_doubles);
+    qsort(ratios, niter, sizeof(double), compare_doubles);
+    *raw_ns = raws[niter / 2];
+    *ratio = ratios[niter / 2];
+    free(buf);
+    free(rawbuf);
+    free(cbuf);
+    return 0;
+
+ failed:
+    fprintf(stderr, "blosc_filter() or Blosc failed\n");
+    free(buf);
+    free(rawbuf);
+    free(cbuf);
+    return -1;
+}
+
+/* Nanoseconds per blosc_set_local() call */
+static double time_set_local(void){
+
+    const hsize_t shape[] = {1024, 1024}, chunkshape[] = {64, 64};
+    unsigned int cd_values[7] = {0, 0, 0, 0, 5, 1, BLOSC_BLOSCLZ};
+    hid_t sid, plist;
+    double t0, best = -1;
+    int rep, i;
+
+    sid = H5Screate_simple(2, shape, NULL);
+    plist = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist, 2, chunkshape);
+    H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7, cd_values);
+    for (rep = 0; rep < NREPEAT; rep++) {
+        t0 = now();
+        for (i = 0; i < NITER_SET_LOCAL; i++) {
+            if (blosc_set_local(plist, H5T_NATIVE_FLOAT, sid) < 0) {
+                best = -1;
+                goto done;
+            }
+        }
+        t0 = (now() - t0) / NITER_SET_LOCAL * 1e9;
+        if (best < 0 || t0 < best) best = t0;
+    }
+
+ done:
+    H5Pclose(plist);
+    H5Sclose(sid);
+    return best;
+}
+
+/* Look up the baseline of `key` in the file, -1 if there is none */
+static double get_baseline(FILE *f, const char *key){
+
+    char line[256], name[64];
+    double value;
+
+    rewind(f);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", name, &value) == 2 &&
+            strcmp(name, key) == 0) return value;
+    }
+    return -1;
+}
+
+/* Compare an overhead of `overhead` ns with its baseline, or append it to
+   `out`, both relative to the `raw` ns of raw Blosc calls */
+static int check(FILE *f, FILE *out, const char *key, double overhead,
+                 double raw){
+
+    double relative = overhead / raw, baseline, limit;
+
+    if (out != NULL) {
+        fprintf(out, "%s %.4f\n", key, relative);
+        return 0;
+    }
+    baseline = get_baseline(f, key);
+    if (baseline < 0) {
+        printf("%-10s overhead %8.0f ns, %.4f of raw (no baseline)\n", key,
+               overhead, relative);
+        return 0;
+    }
+    limit = baseline * TOLERANCE + RATIO_SLACK;
+    printf("%-10s overhead %8.0f ns, %.4f of raw (baseline %.4f, "
+           "limit %.4f)\n", key, overhead, relative, baseline, limit);
+    if (relative > limit) {
+        printf("  REGRESSION\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+
+    unsigned int cd_values[7] = {0, 0, 0, 0, 5, 1, BLOSC_BLOSCLZ};
+    const char *path;
+    FILE *f = NULL, *out = NULL;
+    float *data;
+    double ratio, raw_ns, first_raw_ns = 0, set_local_ns;
+    char key[32];
+    int failed = 0;
+    size_t k;
+
+    if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        path = argv[2];
+    } else if (argc == 2) {
+        path = argv[1];
+    } else {
+        fprintf(stderr, "Usage: %s [-w] baseline_file\n", argv[0]);
+        return 2;
+    }
+    if (argc == 3) {
+        out = fopen(path, "w");
+        if (out == NULL) return 2;
+        fprintf(out, "# Per-call overhead of blosc_filter() over raw Blosc "
+                "(compress + decompress),\n# and time of blosc_set_local(), "
+                "relative to the raw Blosc time\n# (of the smallest chunk "
+                "for set_local); regenerate with: bench_filter -w <this "
+                "file>\n");
+    } else {
+        f = fopen(path, "r");
+        if (f == NULL) {
+            fprintf(stderr, "Can't open baseline file %s\n", path);
+            return 2;
+        }
+    }
+
+    blosc_init();
+    data = malloc(chunk_sizes[NSIZES - 1]);
+    fill_chunk(data, chunk_sizes[NSIZES - 1] / sizeof(float));
+    cd_values[0] = FILTER_BLOSC_VERSION;
+    cd_values[1] = BLOSC_VERSION_FORMAT;
+    cd_values[2] = sizeof(float);
+
+    for (k = 0; k < NSIZES; k++) {
+        cd_values[3] = (unsigned int)chunk_sizes[k];
+        if (time_pairs(cd_values, data, chunk_sizes[k], &raw_ns, &ratio) < 0)
+            return 1;
+        sprintf(key, "%lu", (unsigned long)chunk_sizes[k]);
+        printf("%-10s raw Blosc %8.0f ns, filter/raw %.4f\n", key, raw_ns,
+               ratio);
+        if (k == 0) first_raw_ns = raw_ns;
+        if (check(f, out, key, ratio > 1 ? (ratio - 1) * raw_ns : 0,
+                  raw_ns) < 0) failed = 1;
+    }
+
+    set_local_ns = time_set_local();
+    if (set_local_ns < 0) return 1;
+    if (check(f, out, "set_local", set_local_ns, first_raw_ns) < 0) {
+        failed = 1;
+    }
+
+    free(data);
+    if (f != NULL) fclose(f);
+    if (out != NULL) fclose(out);
+    blosc_destroy();
+    return failed;
+}
@@ -0,0 +1,219 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Scaling benchmark of parallel writes through the Blosc filter.
+
+    Every rank writes its own slab of rows of a shared dataset, first
+    with a plain collective H5Dwrite(), in which each rank compresses its
+    chunks one after the other inside the filter, then with
+    blosc_write_chunks_mpi(), which compresses them ahead on threads.
+    Rank 0 prints one CSV line per method and thread count with the
+    aggregate write speed (in uncompressed MB/s, the slowest rank
+    counting) and the compression ratio.  Only with a parallel HDF5.
+
+    To run on 4 ranks:
+
+    $ mpirun -np 4 ./bench_mpi > results.csv
+
+      -c  compressor (default: lz4)
+      -l  compression level (default: 5)
+      -t  threads per rank (default: 1,2,4)
+      -n  chunks written by each rank (default: 32)
+      -r  repetitions, the best time is kept (default: 3)
+      -f  file to write (default: bench_mpi.h5)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+
+#define CHUNK_ROWS 256
+#define COLS 1024               /* 1 MB chunks of floats */
+#define MAX_ITEMS 16
+
+static int parse_ints(char *list, int *values){
+
+    char *item;
+    int n = 0;
+
+    for (item = strtok(list, ","); item != NULL && n < MAX_ITEMS;
+         item = strtok(NULL, ",")) values[n++] = atoi(item);
+    return n;
+}
+
+/* Smooth data with some noise, different on each rank */
+static void fill_slab(float *data, size_t nrows, int rank){
+
+    size_t i, j;
+    unsigned seed = 12345u + (unsigned)rank;
+
+    for (i = 0; i < nrows; i++) {
+        for (j = 0; j < COLS; j++) {
+            seed = seed * 1103515245u + 12345u;
+            data[i * COLS + j] = (float)(i + j) * 0.01f +
+                                 (float)(seed >> 24) * 1e-4f;
+        }
+    }
+}
+
+/* Write the slab of this rank once, with `nthreads` < 0 for a plain
+   H5Dwrite(); returns the time of the slowest rank, -1 on errors */
+static double run_one(const char *path, int compcode, int clevel,
+                      hsize_t nchunks, int nthreads, const float *data,
+                      double *ratio){
+
+    unsigned int cd_values[7] = {0};
+    hsize_t dims[2], chunkdims[2] = {CHUNK_ROWS, COLS};
+    hsize_t start[2], count[2];
+    hid_t fapl = -1, fid = -1, sid = -1, mspace = -1, dcpl = -1, dxpl = -1;
+    hid_t dset = -1;
+    double t0, elapsed = -1, slowest;
+    int rank, nranks, failed = 1, anyfailed;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+    dims[0] = (hsize_t)nranks * nchunks * CHUNK_ROWS;
+    dims[1] = COLS;
+    start[0] = (hsize_t)rank * nchunks * CHUNK_ROWS;
+    start[1] = 0;
+    count[0] = nchunks * CHUNK_ROWS;
+    count[1] = COLS;
+
+    fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (fapl < 0 || H5Pset_fapl_mpio(fapl, MPI_COMM_WORLD,
+                                     MPI_INFO_NULL) < 0) goto done;
+    fid = H5Fcreate(path, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    sid = H5Screate_simple(2, dims, NULL);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if (fid < 0 || sid < 0 || dcpl < 0) goto done;
+    cd_values[4] = clevel;
+    cd_values[5] = 1;
+    cd_values[6] = compcode;
+    if (H5Pset_chunk(dcpl, 2, chunkdims) < 0 ||
+        H5Pset_filter(dcpl, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7,
+                      cd_values) < 0) goto done;
+    dset = H5Dcreate(fid, "bench", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, dcpl,
+                     H5P_DEFAULT);
+    if (dset < 0) goto done;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    t0 = MPI_Wtime();
+    if (nthreads < 0) {
+        mspace = H5Screate_simple(2, count, NULL);
+        dxpl = H5Pcreate(H5P_DATASET_XFER);
+        if (mspace < 0 || dxpl < 0 ||
+            H5Pset_dxpl_mpio(dxpl, H5FD_MPIO_COLLECTIVE) < 0 ||
+            H5Sselect_hyperslab(sid, H5S_SELECT_SET, start, NULL, count,
+                                NULL) < 0 ||
+            H5Dwrite(dset, H5T_NATIVE_FLOAT, mspace, sid, dxpl, data) < 0)
+            goto done;
+    } else if (blosc_write_chunks_mpi(dset, start, count, data,
+                                      nthreads) < 0) {
+        goto done;
+    }
+    elapsed = MPI_Wtime() - t0;
+    *ratio = (double)(dims[0] * dims[1] * sizeof(float)) /
+             (double)H5Dget_storage_size(dset);
+    failed = 0;
+
+ done:
+    if (dset >= 0) H5Dclose(dset);
+    if (dxpl >= 0) H5Pclose(dxpl);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (mspace >= 0) H5Sclose(mspace);
+    if (sid >= 0) H5Sclose(sid);
+    if (fid >= 0) H5Fclose(fid);
+    if (fapl >= 0) H5Pclose(fapl);
+    MPI_Allreduce(&failed, &anyfailed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    return anyfailed ? -1 : slowest;
+}
+
+int main(int argc, char **argv){
+
+    const char *compname = "lz4", *path = "bench_mpi.h5";
+    int threads[MAX_ITEMS] = {1, 2, 4}, nthreads = 3;
+    int clevel = 5, repeats = 3, nchunks = 32;
+    int rank, nranks, compcode, i, t, rep;
+    char *version, *date;
+    double best, elapsed, ratio = 0, mbytes;
+    float *data;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) {
+            compname = argv[i + 1];
+        } else if (strcmp(argv[i], "-l") == 0) {
+            clevel = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            nthreads = parse_ints(argv[i + 1], threads);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            nchunks = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            repeats = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            path = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+    compcode = blosc_compname_to_compcode(compname);
+    if (i < argc || compcode < 0 || nchunks < 1) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: %s [-c compressor] [-l level] "
+                    "[-t threads] [-n chunks] [-r repeats] [-f file]\n",
+                    argv[0]);
+        }
+        MPI_Finalize();
+        return 2;
+    }
+    if (repeats < 1) repeats = 1;
+
+    if (register_blosc(&version, &date) < 0) {
+        MPI_Finalize();
+        return 1;
+    }
+    data = (float *)malloc((size_t)nchunks * CHUNK_ROWS * COLS *
+                           sizeof(float));
+    if (data == NULL) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fill_slab(data, (size_t)nchunks * CHUNK_ROWS, rank);
+    mbytes = (double)nranks * nchunks * CHUNK_ROWS * COLS * sizeof(float) /
+             1e6;
+
+    if (rank == 0) printf("method,ranks,threads,write_mb_s,ratio\n");
+    /* t == -1 is the plain H5Dwrite(), which compresses on one thread */
+    for (t = -1; t < nthreads; t++) {
+        best = -1;
+        for (rep = 0; rep < repeats; rep++) {
+            elapsed = run_one(path, compcode, clevel, (hsize_t)nchunks,
+                              t < 0 ? -1 : threads[t], data, &ratio);
+            if (elapsed < 0) {
+                if (rank == 0) fprintf(stderr, "Write failed\n");
+                free(data);
+                MPI_Finalize();
+                return 1;
+            }
+            if (best < 0 || elapsed < best) best = elapsed;
+        }
+        if (rank == 0) {
+            printf("%s,%d,%d,%.1f,%.2f\n",
+                   t < 0 ? "h5dwrite" : "blosc_write_chunks_mpi", nranks,
+                   t < 0 ? 1 : threads[t], mbytes / best, ratio);
+        }
+    }
+
+    free(data);
+    MPI_Finalize();
+    return 0;
+}
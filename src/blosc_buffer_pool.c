@@ -0,0 +1,367 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Per-thread pool of chunk buffers for the Blosc filter.
+
+    HDF5 hands every chunk to the filter in a malloc'ed buffer that the
+    filter has to free, while the filter has to malloc the buffer it
+    returns.  Instead of freeing the input buffer, we keep it around in
+    a small pool owned by the calling thread and hand it out the next
+    time a buffer of a similar size is needed, which avoids the
+    mmap/munmap churn of large allocations.
+
+    Buffers are filed by size class (the power of two below their
+    capacity) and the pool never holds more than a configurable amount
+    of memory (HDF5_BLOSC_POOL_BYTES or blosc_filter_set_pool_limit()).
+
+    The memory budget of the process lives here too: the direct chunk
+    functions take their buffers out of it before allocating them, and
+    wait for other threads to give some back when it runs out.
+
+*/
+
+
+#include <stdlib.h>
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+#define POOL_MIN_CLASS 12       /* 4 KB; smaller buffers are not pooled */
+#define POOL_NCLASSES 36        /* up to 256 TB, i.e. everything */
+#define POOL_DEPTH 4            /* buffers kept per size class */
+#define POOL_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+/* Limit of bytes held by each thread's pool.  It starts out as the
+   value of the HDF5_BLOSC_POOL_BYTES environment variable, read once
+   before the first call of blosc_filter_set_pool_limit() or the first
+   buffer given back, and from then on blosc_filter_set_pool_limit() sets
+   it.  Threads read it at any time, hence the atomic accesses. */
+static size_t pool_limit = POOL_DEFAULT_LIMIT;
+
+static void init_pool_limit(void){
+
+    char *envvar = getenv("HDF5_BLOSC_POOL_BYTES");
+
+    if (envvar != NULL) {
+        BLOSC_ATOMIC_STORE(pool_limit, (size_t)strtoull(envvar, NULL, 10));
+    }
+}
+
+#if defined(_WIN32)
+
+/* No thread-local pool on Windows yet: plain malloc/free */
+
+size_t blosc_filter_set_pool_limit(size_t nbytes){
+
+    static int initialized = 0;
+    size_t previous;
+
+    if (!initialized) {
+        initialized = 1;
+        init_pool_limit();
+    }
+    previous = pool_limit;
+    pool_limit = nbytes;
+    return previous;
+}
+
+void *blosc_filter_buffer_get(size_t size, size_t *capacity){
+    *capacity = size;
+    return malloc(size > 0 ? size : 1);
+}
+
+void blosc_filter_buffer_put(void *buf, size_t capacity){
+    (void)capacity;
+    free(buf);
+}
+
+void blosc_filter_buffer_flush(void){
+}
+
+static size_t *thread_budget(void){
+
+    static size_t held = 0;
+
+    return &held;
+}
+
+#else
+
+#include <pthread.h>
+
+static pthread_once_t pool_limit_once = PTHREAD_ONCE_INIT;
+
+static size_t get_pool_limit(void){
+    pthread_once(&pool_limit_once, init_pool_limit);
+    return BLOSC_ATOMIC_LOAD(pool_limit);
+}
+
+size_t blosc_filter_set_pool_limit(size_t nbytes){
+    pthread_once(&pool_limit_once, init_pool_limit);
+    return BLOSC_ATOMIC_EXCHANGE(pool_limit, nbytes);
+}
+
+/* Return the size class of a capacity, or -1 if it is not pooled */
+static int size_class(size_t capacity){
+
+    int k = 0;
+
+    while (k + 1 < (int)(8 * sizeof(size_t)) && (capacity >> (k + 1)) != 0)
+        k++;
+    if (k < POOL_MIN_CLASS || k >= POOL_MIN_CLASS + POOL_NCLASSES) return -1;
+    return k - POOL_MIN_CLASS;
+}
+
+
+typedef struct {
+    void *buf[POOL_DEPTH];
+    size_t capacity[POOL_DEPTH];
+    int n;
+} pool_class_t;
+
+typedef struct {
+    pool_class_t classes[POOL_NCLASSES];
+    size_t held;                /* Bytes currently held by the pool */
+    size_t budget_held;         /* Bytes of the memory budget the thread
+                                   has taken */
+} buffer_pool_t;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+/* Free the buffers held by a pool */
+static void empty_pool(buffer_pool_t *pool){
+
+    int k, i;
+
+    for (k = 0; k < POOL_NCLASSES; k++) {
+        for (i = 0; i < pool->classes[k].n; i++) {
+            free(pool->classes[k].buf[i]);
+        }
+        pool->classes[k].n = 0;
+    }
+    pool->held = 0;
+}
+
+/* Release a thread's pool when it exits */
+static void destroy_pool(void *arg){
+
+    buffer_pool_t *pool = (buffer_pool_t *)arg;
+
+    empty_pool(pool);
+    free(pool);
+}
+
+static void create_pool_key(void){
+    pthread_key_create(&pool_key, destroy_pool);
+}
+
+static buffer_pool_t *get_pool(int create){
+
+    buffer_pool_t *pool;
+
+    pthread_once(&pool_key_once, create_pool_key);
+    pool = (buffer_pool_t *)pthread_getspecific(pool_key);
+    if (pool == NULL && create) {
+        pool = (buffer_pool_t *)calloc(1, sizeof(buffer_pool_t));
+        if (pool != NULL && pthread_setspecific(pool_key, pool) != 0) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+    return pool;
+}
+
+/* Bytes of the memory budget the calling thread has taken, NULL if
+   that can't be told */
+static size_t *thread_budget(void){
+
+    buffer_pool_t *pool = get_pool(1);
+
+    return pool != NULL ? &pool->budget_held : NULL;
+}
+
+void *blosc_filter_buffer_get(size_t size, size_t *capacity){
+
+    buffer_pool_t *pool;
+    pool_class_t *cls;
+    void *buf;
+    int first, k, i;
+
+    first = size_class(size);
+    pool = first < 0 ? NULL : get_pool(0);
+    if (pool != NULL) {
+        /* A buffer in the class of `size` may be too small, one in the
+           next class is always large enough; never hand out more than
+           twice what was asked for. */
+        for (k = first; k < POOL_NCLASSES && k <= first + 1; k++) {
+            cls = &pool->classes[k];
+            for (i = cls->n - 1; i >= 0; i--) {
+                if (cls->capacity[i] >= size && cls->capacity[i] / 2 < size) {
+                    buf = cls->buf[i];
+                    *capacity = cls->capacity[i];
+                    cls->n--;
+                    cls->buf[i] = cls->buf[cls->n];
+                    cls->capacity[i] = cls->capacity[cls->n];
+                    pool->held -= *capacity;
+                    return buf;
+                }
+            }
+        }
+    }
+
+    *capacity = size;
+    return malloc(size > 0 ? size : 1);
+}
+
+void blosc_filter_buffer_put(void *buf, size_t capacity){
+
+    buffer_pool_t *pool;
+    pool_class_t *cls;
+    size_t limit;
+    int k;
+
+    if (buf == NULL) return;
+
+    k = size_class(capacity);
+    limit = get_pool_limit();
+    if (k < 0 || capacity > limit) {
+        free(buf);
+        return;
+    }
+    pool = get_pool(1);
+    if (pool == NULL || pool->held + capacity > limit
+        || pool->classes[k].n == POOL_DEPTH) {
+        free(buf);
+        return;
+    }
+
+    cls = &pool->classes[k];
+    cls->buf[cls->n] = buf;
+    cls->capacity[cls->n] = capacity;
+    cls->n++;
+    pool->held += capacity;
+}
+
+void blosc_filter_buffer_flush(void){
+
+    buffer_pool_t *pool = get_pool(0);
+
+    if (pool != NULL) empty_pool(pool);
+}
+
+#endif
+
+
+/* Memory budget of the chunk buffers in flight in the direct chunk
+   functions, for the whole process.  (size_t)-1 means the
+   HDF5_BLOSC_MEMORY_BUDGET environment variable has not been read yet,
+   0 that there is no budget. */
+static size_t budget = (size_t)-1;
+static size_t budget_used = 0;
+static size_t budget_peak = 0;
+
+static void load_budget(void){
+
+    char *envvar;
+
+    if (budget == (size_t)-1) {
+        envvar = getenv("HDF5_BLOSC_MEMORY_BUDGET");
+        budget = envvar != NULL ? (size_t)strtoull(envvar, NULL, 10) : 0;
+        if (budget == (size_t)-1) budget--;
+    }
+}
+
+#if defined(_WIN32)
+
+/* No threads on Windows yet: nothing to wait for */
+#define LOCK_BUDGET()
+#define UNLOCK_BUDGET()
+#define WAIT_BUDGET()
+#define BUDGET_RELEASED()
+
+#else
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+
+#define LOCK_BUDGET() pthread_mutex_lock(&budget_mutex)
+#define UNLOCK_BUDGET() pthread_mutex_unlock(&budget_mutex)
+#define WAIT_BUDGET() pthread_cond_wait(&budget_cond, &budget_mutex)
+#define BUDGET_RELEASED() pthread_cond_broadcast(&budget_cond)
+
+#endif
+
+size_t blosc_filter_set_memory_budget(size_t nbytes){
+
+    size_t previous;
+
+    if (nbytes == (size_t)-1) nbytes--;
+    LOCK_BUDGET();
+    previous = budget;
+    budget = nbytes;
+    /* A larger budget may let waiting calls go ahead */
+    BUDGET_RELEASED();
+    UNLOCK_BUDGET();
+    return previous == (size_t)-1 ? 0 : previous;
+}
+
+int blosc_budget_acquire(size_t nbytes, int wait){
+
+    size_t *held = thread_budget();
+    size_t mine = held != NULL ? *held : 0;
+
+    LOCK_BUDGET();
+    load_budget();
+    /* With nothing in flight it would never fit, so it goes anyway; so it
+       does when waiting, if all in flight is held by the calling thread,
+       which would otherwise wait for itself forever */
+    while (budget > 0 && budget_used > 0 &&
+           (budget_used >= budget || nbytes > budget - budget_used)) {
+#if defined(_WIN32)
+        wait = 0;
+#endif
+        if (!wait) {
+            UNLOCK_BUDGET();
+            return -1;
+        }
+        if (budget_used <= mine) break;
+        WAIT_BUDGET();
+    }
+    budget_used += nbytes;
+    if (budget_used > budget_peak) budget_peak = budget_used;
+    UNLOCK_BUDGET();
+    if (held != NULL) *held += nbytes;
+    return 0;
+}
+
+size_t blosc_budget_acquire_jobs(size_t njobs, size_t jobsize){
+
+    size_t n;
+
+    if (blosc_budget_acquire(jobsize, 1) < 0) return 0;
+    for (n = 1; n < njobs && blosc_budget_acquire(jobsize, 0) == 0; n++);
+    return n;
+}
+
+void blosc_budget_release(size_t nbytes){
+
+    size_t *held = thread_budget();
+
+    if (nbytes == 0) return;
+    if (held != NULL) *held -= nbytes < *held ? nbytes : *held;
+    LOCK_BUDGET();
+    budget_used -= nbytes;
+    BUDGET_RELEASED();
+    UNLOCK_BUDGET();
+}
+
+void blosc_filter_get_memory(size_t *in_flight, size_t *peak, int reset){
+
+    LOCK_BUDGET();
+    if (in_flight != NULL) *in_flight = budget_used;
+    if (peak != NULL) *peak = budget_peak;
+    if (reset) budget_peak = budget_used;
+    UNLOCK_BUDGET();
+}
@@ -0,0 +1,440 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Zstd dictionaries for datasets of small chunks.
+
+    A chunk of a few KB compresses poorly on its own, as the codec starts
+    every chunk knowing nothing about the data.  A dictionary trained
+    once on sample chunks gives it that knowledge.  It is stored in the
+    cd_values of the dataset, after the known slots, since cd_values are
+    all the filter gets from HDF5; chunks are then compressed by zstd with
+    the dictionary instead of Blosc.
+
+    Preparing a dictionary takes much longer than compressing a small
+    chunk, so the prepared dictionaries and the zstd contexts are kept
+    per thread, for the few datasets a thread is working on at a time.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+#ifdef HAVE_ZSTD_DICT
+
+#include <zstd.h>
+#include <zdict.h>
+
+/* Chunks are stored as a frame laid out like the constant frames of
+   blosc_filter.c, followed by the zstd frame:
+
+     byte 0       DICT_FRAME_MARKER
+     byte 1       DICT_FRAME_KIND
+     byte 2       size of the items shuffled, 1 if not shuffled
+     byte 3       reserved (0)
+     bytes 4-11   chunk size in bytes, little endian
+     bytes 12-    the zstd frame
+*/
+#define DICT_FRAME_MARKER 0xff
+#define DICT_FRAME_KIND 2
+#define DICT_FRAME_HEADER 12
+
+#define DICT_ENTRIES 4          /* Dictionaries prepared per thread */
+
+typedef struct {
+    size_t nslots;              /* 0 for an unused entry */
+    unsigned *slots;            /* The dictionary as stored in cd_values */
+    size_t dictsize;
+    int level;                  /* Compression level of cdict */
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+} dict_entry_t;
+
+typedef struct {
+    dict_entry_t entries[DICT_ENTRIES];
+    int next;                   /* Entry replaced on the next miss */
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} dict_cache_t;
+
+static void clear_entry(dict_entry_t *entry){
+    free(entry->slots);
+    ZSTD_freeCDict(entry->cdict);
+    ZSTD_freeDDict(entry->ddict);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static void destroy_cache(void *arg){
+
+    dict_cache_t *cache = (dict_cache_t *)arg;
+    int i;
+
+    for (i = 0; i < DICT_ENTRIES; i++) clear_entry(&cache->entries[i]);
+    ZSTD_freeCCtx(cache->cctx);
+    ZSTD_freeDCtx(cache->dctx);
+    free(cache);
+}
+
+#if defined(_WIN32)
+
+/* No thread-local cache on Windows yet: dictionaries are prepared for
+   every chunk */
+
+static dict_cache_t *get_cache(void){
+    return (dict_cache_t *)calloc(1, sizeof(dict_cache_t));
+}
+
+static void release_cache(dict_cache_t *cache){
+    if (cache != NULL) destroy_cache(cache);
+}
+
+#else
+
+#include <pthread.h>
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void create_cache_key(void){
+    pthread_key_create(&cache_key, destroy_cache);
+}
+
+static dict_cache_t *get_cache(void){
+
+    dict_cache_t *cache;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    cache = (dict_cache_t *)pthread_getspecific(cache_key);
+    if (cache == NULL) {
+        cache = (dict_cache_t *)calloc(1, sizeof(dict_cache_t));
+        if (cache != NULL && pthread_setspecific(cache_key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static void release_cache(dict_cache_t *cache){
+    (void)cache;
+}
+
+#endif
+
+/* Get the entry of a dictionary, replacing the oldest one on a miss */
+static dict_entry_t *get_entry(dict_cache_t *cache, const unsigned *slots,
+                               size_t dictsize){
+
+    size_t nslots = BLOSC_DICT_SLOTS(dictsize);
+    dict_entry_t *entry;
+    int i;
+
+    for (i = 0; i < DICT_ENTRIES; i++) {
+        entry = &cache->entries[i];
+        if (entry->nslots == nslots && entry->dictsize == dictsize &&
+            memcmp(entry->slots, slots, nslots * sizeof(unsigned)) == 0) {
+            return entry;
+        }
+    }
+
+    entry = &cache->entries[cache->next];
+    clear_entry(entry);
+    entry->slots = (unsigned *)malloc(nslots * sizeof(unsigned));
+    if (entry->slots == NULL) return NULL;
+    memcpy(entry->slots, slots, nslots * sizeof(unsigned));
+    entry->nslots = nslots;
+    entry->dictsize = dictsize;
+    cache->next = (cache->next + 1) % DICT_ENTRIES;
+    return entry;
+}
+
+/* Get the bytes of a dictionary out of its slots */
+static unsigned char *unpack_dict(const dict_entry_t *entry){
+
+    unsigned char *dict = (unsigned char *)malloc(entry->dictsize);
+    size_t i;
+
+    if (dict == NULL) return NULL;
+    for (i = 0; i < entry->dictsize; i++) {
+        dict[i] = (unsigned char)(entry->slots[i / 4] >> (8 * (i % 4)));
+    }
+    return dict;
+}
+
+/* Zstd level of a Blosc compression level, as Blosc maps them */
+static int zstd_level(int clevel){
+    return clevel < 9 ? clevel * 2 - 1 : ZSTD_maxCLevel();
+}
+
+static int prepare_cdict(dict_entry_t *entry, int level){
+
+    unsigned char *dict;
+
+    if (entry->cdict != NULL && entry->level == level) return 0;
+    ZSTD_freeCDict(entry->cdict);
+    dict = unpack_dict(entry);
+    if (dict == NULL) return -1;
+    entry->cdict = ZSTD_createCDict(dict, entry->dictsize, level);
+    entry->level = level;
+    free(dict);
+    return entry->cdict != NULL ? 0 : -1;
+}
+
+static int prepare_ddict(dict_entry_t *entry){
+
+    unsigned char *dict;
+
+    if (entry->ddict != NULL) return 0;
+    dict = unpack_dict(entry);
+    if (dict == NULL) return -1;
+    entry->ddict = ZSTD_createDDict(dict, entry->dictsize);
+    free(dict);
+    return entry->ddict != NULL ? 0 : -1;
+}
+
+int blosc_filter_dict_encode(const blosc_params_t *params, const void *src,
+                             size_t nbytes, void *dest, size_t destsize,
+                             size_t *cbytes){
+
+    unsigned char *d = (unsigned char *)dest;
+    dict_cache_t *cache;
+    dict_entry_t *entry;
+    void *shuffled = NULL;
+    size_t capacity = 0, typesize = 1, n;
+    int i, r = -1;
+
+    /* Level 0 stores chunks as they are, as with Blosc */
+    if (params->clevel <= 0 || destsize <= DICT_FRAME_HEADER) return 1;
+
+    cache = get_cache();
+    if (cache == NULL) return -1;
+    entry = get_entry(cache, params->dict, params->dictsize);
+    if (entry == NULL || prepare_cdict(entry, zstd_level(params->clevel)) < 0)
+        goto done;
+    if (cache->cctx == NULL && (cache->cctx = ZSTD_createCCtx()) == NULL)
+        goto done;
+
+    /* Bit shuffle is not available outside of Blosc: any shuffle asked
+       for is a byte shuffle here */
+    if (params->doshuffle != BLOSC_NOSHUFFLE && params->typesize > 1) {
+        shuffled = blosc_filter_buffer_get(nbytes, &capacity);
+        if (shuffled == NULL) goto done;
+        blosc_kernel_shuffle(shuffled, src, nbytes, params->typesize);
+        src = shuffled;
+        typesize = params->typesize;
+    }
+
+    n = ZSTD_compress_usingCDict(cache->cctx, d + DICT_FRAME_HEADER,
+                                 destsize - DICT_FRAME_HEADER, src, nbytes,
+                                 entry->cdict);
+    if (ZSTD_isError(n)) {
+        r = 1;                  /* Does not fit in dest */
+        goto done;
+    }
+    d[0] = DICT_FRAME_MARKER;
+    d[1] = DICT_FRAME_KIND;
+    d[2] = (unsigned char)typesize;
+    d[3] = 0;
+    for (i = 0; i < 8; i++) {
+        d[4 + i] = (unsigned char)((unsigned long long)nbytes >> (8 * i));
+    }
+    *cbytes = DICT_FRAME_HEADER + n;
+    r = 0;
+
+ done:
+    blosc_filter_buffer_put(shuffled, capacity);
+    release_cache(cache);
+    return r;
+}
+
+int blosc_filter_dict_decoded_size(const void *src, size_t srcsize,
+                                   size_t *nbytes){
+
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned long long n = 0;
+    int i;
+
+    if (srcsize <= DICT_FRAME_HEADER || s[0] != DICT_FRAME_MARKER ||
+        s[1] != DICT_FRAME_KIND || s[2] == 0) return -1;
+    for (i = 0; i < 8; i++) n |= (unsigned long long)s[4 + i] << (8 * i);
+    *nbytes = (size_t)n;
+    return 0;
+}
+
+int blosc_filter_dict_decode(const unsigned *dict, size_t dictsize,
+                             const void *src, size_t srcsize,
+                             void *dest, size_t destsize){
+
+    const unsigned char *s = (const unsigned char *)src;
+    dict_cache_t *cache;
+    dict_entry_t *entry;
+    void *shuffled = NULL, *out = dest;
+    size_t capacity = 0, nbytes, n;
+    int r = -1;
+
+    if (blosc_filter_dict_decoded_size(src, srcsize, &nbytes) < 0 ||
+        nbytes > destsize) return -1;
+
+    cache = get_cache();
+    if (cache == NULL) return -1;
+    entry = get_entry(cache, dict, dictsize);
+    if (entry == NULL || prepare_ddict(entry) < 0) goto done;
+    if (cache->dctx == NULL && (cache->dctx = ZSTD_createDCtx()) == NULL)
+        goto done;
+
+    if (s[2] > 1) {
+        shuffled = blosc_filter_buffer_get(nbytes, &capacity);
+        if (shuffled == NULL) goto done;
+        out = shuffled;
+    }
+    n = ZSTD_decompress_usingDDict(cache->dctx, out, nbytes,
+                                   s + DICT_FRAME_HEADER,
+                                   srcsize - DICT_FRAME_HEADER, entry->ddict);
+    if (ZSTD_isError(n) || n != nbytes) goto done;
+    if (shuffled != NULL) blosc_kernel_unshuffle(dest, shuffled, nbytes, s[2]);
+    r = 0;
+
+ done:
+    blosc_filter_buffer_put(shuffled, capacity);
+    release_cache(cache);
+    return r;
+}
+
+#endif  /* HAVE_ZSTD_DICT */
+
+
+int blosc_filter_train_dict(hid_t dcpl, hid_t type, const void *samples,
+                            size_t nbytes, size_t dictsize){
+
+#ifndef HAVE_ZSTD_DICT
+    (void)dcpl;
+    (void)type;
+    (void)samples;
+    (void)nbytes;
+    (void)dictsize;
+    PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+             "This build of the filter does not support zstd dictionaries");
+    return -1;
+#else
+    unsigned int values[BLOSC_NPARAMS] = {0};
+    unsigned int flags, *slots = NULL;
+    size_t nelements = BLOSC_NPARAMS;
+    hsize_t chunkdims[32];
+    size_t typesize, basetypesize, chunksize, nsamples, offset, n, k;
+    size_t *sizes = NULL, trained;
+    const unsigned char *s = (const unsigned char *)samples;
+    unsigned char *buf = NULL, *dict = NULL;
+    hid_t super_type, space;
+    int ndims, i, shuffle, r = -1;
+
+    if (dictsize == 0 || dictsize > FILTER_BLOSC_MAX_DICT_SIZE) {
+        dictsize = FILTER_BLOSC_MAX_DICT_SIZE;
+    }
+
+    ndims = H5Pget_chunk(dcpl, 32, chunkdims);
+    if (ndims < 0) return -1;
+    if (ndims > 32) {
+        PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+                 "Chunk rank exceeds limit");
+        return -1;
+    }
+
+    /* Drop any previous dictionary, then let blosc_set_local() fill in
+       the parameters now: it cannot do it once the dictionary is there,
+       as H5Pget_filter() returns at most 256 cd_values */
+    if (GET_FILTER(dcpl, FILTER_BLOSC, &flags, &nelements, values, 0,
+                   NULL) < 0) return -1;
+    if (nelements > BLOSC_NPARAMS) nelements = BLOSC_NPARAMS;
+    if (nelements >= 17) values[16] = 0;
+    if (H5Pmodify_filter(dcpl, FILTER_BLOSC, flags, nelements, values) < 0)
+        return -1;
+    space = H5Screate_simple(ndims, chunkdims, NULL);
+    if (space < 0) return -1;
+    r = blosc_set_local(dcpl, type, space) < 0 ? -1 : 0;
+    H5Sclose(space);
+    if (r < 0) return -1;
+    nelements = BLOSC_NPARAMS;
+    if (GET_FILTER(dcpl, FILTER_BLOSC, &flags, &nelements, values, 0,
+                   NULL) < 0) return -1;
+    if (nelements > BLOSC_NPARAMS) nelements = BLOSC_NPARAMS;
+    if (nelements >= 19 && values[18] != 0) {
+        PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+                 "Field-split storage cannot use a zstd dictionary");
+        return -1;
+    }
+    r = -1;
+    typesize = H5Tget_size(type);
+    if (typesize == 0) return -1;
+    basetypesize = typesize;
+    if (H5Tget_class(type) == H5T_ARRAY) {
+        super_type = H5Tget_super(type);
+        basetypesize = H5Tget_size(super_type);
+        H5Tclose(super_type);
+    }
+    if (basetypesize > BLOSC_MAX_TYPESIZE) basetypesize = 1;
+    chunksize = typesize;
+    for (i = 0; i < ndims; i++) chunksize *= chunkdims[i];
+
+    nsamples = (nbytes + chunksize - 1) / chunksize;
+    if (nsamples == 0) {
+        PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+                 "No sample data to train a dictionary on");
+        return -1;
+    }
+
+    /* Samples get the shuffle their chunks will get when compressed */
+    shuffle = values[5] != BLOSC_NOSHUFFLE && basetypesize > 1;
+    buf = (unsigned char *)malloc(nbytes);
+    sizes = (size_t *)malloc(nsamples * sizeof(size_t));
+    dict = (unsigned char *)malloc(dictsize);
+    slots = (unsigned int *)calloc(BLOSC_DICT_OFFSET +
+                                   BLOSC_DICT_SLOTS(dictsize),
+                                   sizeof(unsigned int));
+    if (buf == NULL || sizes == NULL || dict == NULL || slots == NULL) {
+        PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+                 "Can't allocate dictionary training buffers");
+        goto done;
+    }
+    for (k = 0; k < nsamples; k++) {
+        offset = k * chunksize;
+        n = nbytes - offset < chunksize ? nbytes - offset : chunksize;
+        if (shuffle) {
+            blosc_kernel_shuffle(buf + offset, s + offset, n, basetypesize);
+        } else {
+            memcpy(buf + offset, s + offset, n);
+        }
+        sizes[k] = n;
+    }
+
+    trained = ZDICT_trainFromBuffer(dict, dictsize, buf, sizes,
+                                    (unsigned)nsamples);
+    if (ZDICT_isError(trained)) {
+        PUSH_ERR("blosc_filter_train_dict", H5E_CALLBACK,
+                 "Zstd dictionary training failed (too few samples?)");
+        goto done;
+    }
+
+    /* Slots past those set keep their defaults, which are all 0, up to
+       the dictionary */
+    memcpy(slots, values, nelements * sizeof(unsigned int));
+    slots[16] = (unsigned int)trained;
+    for (k = 0; k < trained; k++) {
+        slots[BLOSC_DICT_OFFSET + k / 4] |=
+            (unsigned int)dict[k] << (8 * (k % 4));
+    }
+    r = H5Pmodify_filter(dcpl, FILTER_BLOSC, flags,
+                         BLOSC_DICT_OFFSET + BLOSC_DICT_SLOTS(trained), slots);
+    if (r > 0) r = 0;
+
+ done:
+    free(buf);
+    free(sizes);
+    free(dict);
+    free(slots);
+    return r;
+#endif
+}
@@ -0,0 +1,1771 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Direct chunk access for datasets compressed with the Blosc filter.
+
+    These functions read and write the chunks of a dataset with
+    H5Dread_chunk()/H5Dwrite_chunk(), bypassing the HDF5 filter
+    pipeline, and run the Blosc codec on them themselves.  They need
+    HDF5 1.10.2 or later.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+#if !H5_VERSION_GE(1,10,2)
+#error "The direct chunk functions need HDF5 1.10.2 or later"
+#endif
+
+/* Maximum rank of the datasets handled here, same as blosc_set_local() */
+#define MAX_NDIMS 32
+
+/* Decompress whole chunks instead of their pieces when more than
+   1/FULL_DECODE_FRACTION of them is read */
+#define FULL_DECODE_FRACTION 4
+
+/* Everything needed to walk the chunks of a dataset */
+typedef struct {
+    hid_t dset;
+    hid_t type;                 /* Stored type of the dataset */
+    size_t typesize;
+    int ndims;
+    hsize_t dims[MAX_NDIMS];
+    hsize_t chunkdims[MAX_NDIMS];
+    size_t chunksize;           /* Bytes in a (full) chunk */
+    size_t outsize;             /* Bytes to compress a chunk into */
+    int blosc_only;             /* Blosc is the only filter applied */
+    int split;                  /* Chunks are stored field-split */
+    size_t cd_nelmts;
+    unsigned cd_values[BLOSC_MAX_SLOTS];
+} dset_info_t;
+
+
+/* Gather the layout and Blosc parameters of a chunked dataset.  For
+   datasets that are not chunked, or not compressed with Blosc alone,
+   `blosc_only` is set to 0 and callers fall back to H5Dread(). */
+static int get_dset_info(const char *func, hid_t dset, dset_info_t *info){
+
+    hid_t dcpl = -1, space = -1;
+    unsigned flags;
+    int i, nfilters, r = -1;
+
+    memset(info, 0, sizeof(*info));
+    info->dset = dset;
+    info->type = -1;
+
+    info->type = H5Dget_type(dset);
+    if (info->type < 0) goto done;
+    info->typesize = H5Tget_size(info->type);
+    if (info->typesize == 0) goto done;
+
+    space = H5Dget_space(dset);
+    if (space < 0) goto done;
+    info->ndims = H5Sget_simple_extent_ndims(space);
+    if (info->ndims < 0) goto done;
+    if (info->ndims > MAX_NDIMS) {
+        PUSH_ERR(func, H5E_BADRANGE, "Dataset rank exceeds limit");
+        goto done;
+    }
+    if (H5Sget_simple_extent_dims(space, info->dims, NULL) < 0) goto done;
+
+    dcpl = H5Dget_create_plist(dset);
+    if (dcpl < 0) goto done;
+    r = 0;
+    if (H5Pget_layout(dcpl) != H5D_CHUNKED) goto done;
+    if (H5Pget_chunk(dcpl, MAX_NDIMS, info->chunkdims) != info->ndims) {
+        r = -1;
+        goto done;
+    }
+    info->chunksize = info->typesize;
+    for (i = 0; i < info->ndims; i++) {
+        info->chunksize *= info->chunkdims[i];
+    }
+
+    nfilters = H5Pget_nfilters(dcpl);
+    info->cd_nelmts = BLOSC_MAX_SLOTS;
+    if (nfilters == 1 &&
+        GET_FILTER_BY_IDX(dcpl, 0, &flags, &info->cd_nelmts, info->cd_values,
+                          0, NULL) == FILTER_BLOSC) {
+        /* The zstd dictionary after the known slots is not kept here,
+           datasets having one go through the pipeline */
+        info->blosc_only = info->cd_nelmts < 17 ||
+                           info->cd_values[16] == 0;
+        if (info->cd_nelmts > BLOSC_MAX_SLOTS) {
+            info->cd_nelmts = BLOSC_MAX_SLOTS;
+        }
+        info->split = info->cd_nelmts >= 20 && info->cd_values[18] != 0;
+        info->outsize = blosc_filter_encode_bound(info->cd_nelmts,
+                                                  info->cd_values,
+                                                  info->chunksize);
+    }
+
+ done:
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (space >= 0) H5Sclose(space);
+    if (r < 0 && info->type >= 0) {
+        H5Tclose(info->type);
+        info->type = -1;
+    }
+    return r;
+}
+
+static void free_dset_info(dset_info_t *info){
+    if (info->type >= 0) H5Tclose(info->type);
+}
+
+/* Check that a hyperslab lies within the dataset */
+static int check_hyperslab(const char *func, const dset_info_t *info,
+                           const hsize_t *start, const hsize_t *count){
+
+    int i;
+
+    for (i = 0; i < info->ndims; i++) {
+        if (count[i] == 0 || start[i] + count[i] > info->dims[i]) {
+            PUSH_ERR(func, H5E_BADRANGE, "Hyperslab out of the dataset bounds");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read (or write) the `sub_start`/`sub_count` part of the hyperslab
+   `start`/`count`, whose dense buffer of `memtype` is `buf`, through the
+   filter pipeline with H5Dread() (or H5Dwrite()) */
+static int use_pipeline_as(const dset_info_t *info, hid_t memtype, int write,
+                           const hsize_t *start, const hsize_t *count,
+                           const hsize_t *sub_start, const hsize_t *sub_count,
+                           void *buf){
+
+    hid_t fspace = -1, mspace = -1;
+    hsize_t mstart[MAX_NDIMS];
+    int i, r = -1;
+
+    for (i = 0; i < info->ndims; i++) {
+        mstart[i] = sub_start[i] - start[i];
+    }
+
+    fspace = H5Dget_space(info->dset);
+    if (fspace < 0) goto done;
+    if (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, sub_start, NULL,
+                            sub_count, NULL) < 0) goto done;
+    mspace = H5Screate_simple(info->ndims, count, NULL);
+    if (mspace < 0) goto done;
+    if (H5Sselect_hyperslab(mspace, H5S_SELECT_SET, mstart, NULL,
+                            sub_count, NULL) < 0) goto done;
+
+    if (write) {
+        r = H5Dwrite(info->dset, memtype, mspace, fspace, H5P_DEFAULT, buf);
+    } else {
+        r = H5Dread(info->dset, memtype, mspace, fspace, H5P_DEFAULT, buf);
+    }
+
+ done:
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    return r < 0 ? -1 : 0;
+}
+
+/* The same with the stored type as memory type: no conversion */
+static int use_pipeline(const dset_info_t *info, int write,
+                        const hsize_t *start, const hsize_t *count,
+                        const hsize_t *sub_start, const hsize_t *sub_count,
+                        void *buf){
+    return use_pipeline_as(info, info->type, write, start, count, sub_start,
+                           sub_count, buf);
+}
+
+/* Advance the multidimensional index `idx` within [lo, hi).  Returns 0
+   once every index has been visited. */
+static int next_index(int ndims, const hsize_t *lo, const hsize_t *hi,
+                      hsize_t *idx){
+
+    int i;
+
+    for (i = ndims - 1; i >= 0; i--) {
+        if (++idx[i] < hi[i]) return 1;
+        idx[i] = lo[i];
+    }
+    return 0;
+}
+
+/* What copy_runs() does with each contiguous run */
+enum {
+    CHUNK_TO_BUF,               /* Copy from an uncompressed chunk */
+    BUF_TO_CHUNK,               /* Copy into an uncompressed chunk */
+    DECODE_TO_BUF,              /* Decompress from a Blosc chunk */
+    CHUNK_EQUALS_BUF            /* Compare with an uncompressed chunk */
+};
+
+/* Move the part `lo`/`ext` (in dataset coordinates) of the chunk at
+   `offset` between `chunk` and the dense buffer `buf` of the hyperslab
+   `start`/`count`.  With DECODE_TO_BUF, `chunk` holds the `chunksize`
+   bytes of a Blosc-compressed chunk and only the bytes needed are
+   decompressed.  With CHUNK_EQUALS_BUF, returns 1 at the first run that
+   differs. */
+static int copy_runs(const dset_info_t *info, int op,
+                     const hsize_t *start, const hsize_t *count,
+                     const hsize_t *offset, const hsize_t *lo,
+                     const hsize_t *ext, char *chunk, size_t chunksize,
+                     char *buf){
+
+    size_t cstride[MAX_NDIMS], bstride[MAX_NDIMS];
+    hsize_t zero[MAX_NDIMS], idx[MAX_NDIMS];
+    size_t runsize, coff, boff;
+    int i, k, r;
+
+    /* Byte strides within the chunk and within the buffer */
+    cstride[info->ndims - 1] = bstride[info->ndims - 1] = info->typesize;
+    for (i = info->ndims - 1; i > 0; i--) {
+        cstride[i - 1] = cstride[i] * info->chunkdims[i];
+        bstride[i - 1] = bstride[i] * count[i];
+    }
+
+    /* Contiguous runs span dimension k and every full one after it */
+    k = info->ndims - 1;
+    while (k > 0 && ext[k] == info->chunkdims[k] && ext[k] == count[k]) k--;
+    runsize = ext[k] * cstride[k];
+
+    for (i = 0; i < info->ndims; i++) {
+        zero[i] = idx[i] = 0;
+    }
+    do {
+        coff = boff = 0;
+        for (i = 0; i < info->ndims; i++) {
+            hsize_t pos = lo[i] + (i < k ? idx[i] : 0);
+            coff += (pos - offset[i]) * cstride[i];
+            boff += (pos - start[i]) * bstride[i];
+        }
+        switch (op) {
+        case CHUNK_TO_BUF:
+            memcpy(buf + boff, chunk + coff, runsize);
+            break;
+        case BUF_TO_CHUNK:
+            memcpy(chunk + coff, buf + boff, runsize);
+            break;
+        case CHUNK_EQUALS_BUF:
+            if (memcmp(chunk + coff, buf + boff, runsize) != 0) return 1;
+            break;
+        default:
+            r = blosc_filter_decode_range(info->cd_nelmts, info->cd_values,
+                                          chunk, chunksize, coff, runsize,
+                                          buf + boff);
+            if (r < 0) return r;
+        }
+    } while (k > 0 && next_index(k, zero, ext, idx));
+
+    return 0;
+}
+
+/* Compute the part `lo`/`ext` of the hyperslab `start`/`count` that
+   falls in the chunk with index `cidx`, whose offset goes in `offset`.
+   Returns the number of bytes in that part. */
+static size_t chunk_part(const dset_info_t *info, const hsize_t *start,
+                         const hsize_t *count, const hsize_t *cidx,
+                         hsize_t *offset, hsize_t *lo, hsize_t *ext){
+
+    hsize_t end;
+    size_t nbytes = info->typesize;
+    int i;
+
+    for (i = 0; i < info->ndims; i++) {
+        offset[i] = cidx[i] * info->chunkdims[i];
+        lo[i] = start[i] > offset[i] ? start[i] : offset[i];
+        end = offset[i] + info->chunkdims[i];
+        if (end > start[i] + count[i]) end = start[i] + count[i];
+        ext[i] = end - lo[i];
+        nbytes *= ext[i];
+    }
+    return nbytes;
+}
+
+/* Get where the chunk at `offset` goes in the dense buffer `buf` of the
+   hyperslab `start`/`count`, if it is wholly inside the hyperslab and
+   lies there contiguously, i.e. exactly as it comes out of Blosc; NULL
+   otherwise. */
+static char *contiguous_dest(const dset_info_t *info, const hsize_t *start,
+                             const hsize_t *count, const hsize_t *offset,
+                             size_t nbytes, char *buf){
+
+    size_t boff = 0, bstride = info->typesize;
+    int i;
+
+    if (nbytes != info->chunksize) return NULL;
+    for (i = info->ndims - 1; i >= 0; i--) {
+        if (i > 0 && count[i] != info->chunkdims[i]) return NULL;
+        boff += (offset[i] - start[i]) * bstride;
+        bstride *= count[i];
+    }
+    return buf + boff;
+}
+
+/* Get the range [clo, chi) of indices of the chunks a hyperslab covers */
+static void chunk_range(const dset_info_t *info, const hsize_t *start,
+                        const hsize_t *count, hsize_t *clo, hsize_t *chi){
+
+    int i;
+
+    for (i = 0; i < info->ndims; i++) {
+        clo[i] = start[i] / info->chunkdims[i];
+        chi[i] = (start[i] + count[i] - 1) / info->chunkdims[i] + 1;
+    }
+}
+
+/* The linear index, in C order over the whole chunk grid, of the chunk
+   with indices `cidx`, as zone maps number them */
+static hsize_t chunk_index(const dset_info_t *info, const hsize_t *cidx){
+
+    hsize_t index = 0;
+    int i;
+
+    for (i = 0; i < info->ndims; i++) {
+        index = index * ((info->dims[i] + info->chunkdims[i] - 1) /
+                         info->chunkdims[i]) + cidx[i];
+    }
+    return index;
+}
+
+/* Read the hyperslab `start`/`count` into `buf`, decoding only the parts
+   of each chunk that are needed */
+int blosc_read_hyperslab(hid_t dset, const hsize_t *start,
+                         const hsize_t *count, void *buf){
+
+    dset_info_t info;
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t offset[MAX_NDIMS], lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hsize_t rawsize;
+    size_t raw_capacity = 0, chunk_capacity = 0, nbytes;
+    char *raw = NULL, *chunk = NULL, *dest;
+    uint32_t filter_mask;
+    int r = -1;
+
+    if (get_dset_info("blosc_read_hyperslab", dset, &info) < 0) return -1;
+    if (check_hyperslab("blosc_read_hyperslab", &info, start, count) < 0)
+        goto done;
+
+    if (!info.blosc_only) {
+        r = use_pipeline(&info, 0, start, count, start, count, buf);
+        goto done;
+    }
+
+    chunk_range(&info, start, count, clo, chi);
+    memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+
+    do {
+        nbytes = chunk_part(&info, start, count, cidx, offset, lo, ext);
+
+        /* Chunks never written hold the fill value: let HDF5 do it */
+        H5E_BEGIN_TRY {
+            if (H5Dget_chunk_storage_size(dset, offset, &rawsize) < 0)
+                rawsize = 0;
+        } H5E_END_TRY;
+        if (rawsize == 0) {
+            if (use_pipeline(&info, 0, start, count, lo, ext, buf) < 0)
+                goto done;
+            continue;
+        }
+
+        if (rawsize > raw_capacity) {
+            blosc_filter_buffer_put(raw, raw_capacity);
+            raw = blosc_filter_buffer_get((size_t)rawsize, &raw_capacity);
+        }
+        if (raw == NULL) {
+            PUSH_ERR("blosc_read_hyperslab", H5E_CANTALLOC,
+                     "Can't allocate chunk buffer");
+            goto done;
+        }
+        if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &filter_mask, raw) < 0)
+            goto done;
+
+        if (filter_mask & 1) {
+            /* Blosc was skipped for this chunk: it is stored as is */
+            r = copy_runs(&info, CHUNK_TO_BUF, start, count, offset, lo, ext,
+                          raw, rawsize, buf);
+        } else if ((dest = contiguous_dest(&info, start, count, offset,
+                                           nbytes, buf)) != NULL) {
+            /* The whole chunk is needed and can go right into place */
+            r = blosc_filter_decode(info.cd_nelmts, info.cd_values, 0,
+                                    raw, rawsize, dest, info.chunksize);
+        } else if (nbytes >= info.chunksize / FULL_DECODE_FRACTION ||
+                   info.split) {
+            /* Most of the chunk is needed anyway, or it only decodes
+               whole */
+            if (chunk == NULL) {
+                chunk = blosc_filter_buffer_get(info.chunksize,
+                                                &chunk_capacity);
+                if (chunk == NULL) {
+                    PUSH_ERR("blosc_read_hyperslab", H5E_CANTALLOC,
+                             "Can't allocate chunk buffer");
+                    goto done;
+                }
+            }
+            r = blosc_filter_decode(info.cd_nelmts, info.cd_values, 0,
+                                    raw, rawsize, chunk, info.chunksize);
+            if (r == 0) {
+                r = copy_runs(&info, CHUNK_TO_BUF, start, count, offset, lo,
+                              ext, chunk, info.chunksize, buf);
+            }
+        } else {
+            r = copy_runs(&info, DECODE_TO_BUF, start, count, offset, lo,
+                          ext, raw, rawsize, buf);
+        }
+        if (r < 0) {
+            PUSH_ERR("blosc_read_hyperslab", H5E_READERROR,
+                     r == -2 ? "Blosc chunk checksum mismatch" :
+                     "Blosc decompression error");
+            goto done;
+        }
+        r = -1;
+    } while (next_index(info.ndims, clo, chi, cidx));
+    r = 0;
+
+ done:
+    blosc_filter_buffer_put(raw, raw_capacity);
+    blosc_filter_buffer_put(chunk, chunk_capacity);
+    free_dset_info(&info);
+    return r;
+}
+
+
+/* A chunk being compressed for blosc_write_chunks() */
+typedef struct {
+    const dset_info_t *info;
+    const hsize_t *start;
+    const hsize_t *count;
+    const char *buf;
+    hsize_t offset[MAX_NDIMS];
+    hsize_t lo[MAX_NDIMS];
+    hsize_t ext[MAX_NDIMS];
+    size_t nbytes;              /* Bytes of the hyperslab in the chunk */
+    char *chunk;                /* The uncompressed chunk */
+    char *out;                  /* The compressed chunk */
+    size_t cbytes;
+    const blosc_zonemap_t *map; /* The zone map of the dataset, if any */
+    blosc_zone_t *zone;         /* Where the zone of the chunk goes */
+    int status;                 /* As returned by blosc_filter_encode() */
+    int busy;                   /* Submitted but not written yet */
+    int done;
+} write_job_t;
+
+/* The origin, for zones of the rows at the start of a chunk */
+static const hsize_t zero_lo[MAX_NDIMS];
+
+/* Worker job: gather a chunk from the hyperslab and compress it */
+static void compress_chunk(void *arg){
+
+    write_job_t *job = (write_job_t *)arg;
+    const dset_info_t *info = job->info;
+
+    /* Chunks sticking out of the dataset are padded with zeros */
+    if (job->nbytes < info->chunksize) memset(job->chunk, 0, info->chunksize);
+    copy_runs(info, BUF_TO_CHUNK, job->start, job->count, job->offset,
+              job->lo, job->ext, job->chunk, info->chunksize,
+              (char *)job->buf);
+
+    /* Before compressing, which may change the chunk in place */
+    if (job->map != NULL) {
+        blosc_zonemap_compute(job->map, job->chunk, info->chunkdims, zero_lo,
+                              job->ext, job->zone);
+    }
+
+    /* Chunks are compressed in parallel, so one thread for each */
+    job->status = blosc_filter_encode(info->cd_nelmts, info->cd_values, 1,
+                                      job->chunk, info->chunksize, job->out,
+                                      info->outsize, &job->cbytes);
+}
+
+/* Wait for a chunk to be compressed and write it */
+static int write_compressed(blosc_workers_t *workers, write_job_t *job){
+
+    const dset_info_t *info = job->info;
+    herr_t r;
+
+    blosc_workers_wait(workers, &job->done);
+    job->busy = 0;
+
+    if (job->status < 0) {
+        PUSH_ERR("blosc_write_chunks", H5E_WRITEERROR,
+                 "Blosc compression error");
+        return -1;
+    }
+    if (job->status > 0) {
+        /* Not compressible: store it as is, like the filter does */
+        r = H5Dwrite_chunk(info->dset, H5P_DEFAULT, 1, job->offset,
+                           info->chunksize, job->chunk);
+    } else {
+        r = H5Dwrite_chunk(info->dset, H5P_DEFAULT, 0, job->offset,
+                           job->cbytes, job->out);
+    }
+    return r < 0 ? -1 : 0;
+}
+
+/* Update the zone map `map` for the hyperslab `start`/`count` written
+   from `buf` through the filter pipeline */
+static int put_buffer_zones(const dset_info_t *info, blosc_zonemap_t *map,
+                            const hsize_t *start, const hsize_t *count,
+                            const char *buf){
+
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t offset[MAX_NDIMS], lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hsize_t *indices;
+    blosc_zone_t *zones;
+    size_t n = 0, nchunks = 1;
+    int i, whole, r = -1;
+
+    chunk_range(info, start, count, clo, chi);
+    for (i = 0; i < info->ndims; i++) {
+        nchunks *= (size_t)(chi[i] - clo[i]);
+    }
+    zones = (blosc_zone_t *)malloc(nchunks * sizeof(blosc_zone_t));
+    indices = (hsize_t *)malloc(nchunks * info->ndims * sizeof(hsize_t));
+    if (zones == NULL || indices == NULL) {
+        PUSH_ERR("blosc_write_chunks", H5E_CANTALLOC,
+                 "Can't allocate zone map records");
+        goto done;
+    }
+
+    /* Chunks written whole get their zone, the others are left
+       unindexed, as their other values are not at hand */
+    memcpy(cidx, clo, info->ndims * sizeof(hsize_t));
+    do {
+        chunk_part(info, start, count, cidx, offset, lo, ext);
+        whole = 1;
+        for (i = 0; i < info->ndims; i++) {
+            whole = whole && lo[i] == offset[i] &&
+                    (ext[i] == info->chunkdims[i] ||
+                     offset[i] + ext[i] == info->dims[i]);
+            indices[n * info->ndims + i] = cidx[i];
+            lo[i] -= start[i];
+        }
+        if (whole) {
+            blosc_zonemap_compute(map, buf, count, lo, ext, &zones[n]);
+        } else {
+            memset(&zones[n], 0, sizeof(blosc_zone_t));
+        }
+        n++;
+    } while (next_index(info->ndims, clo, chi, cidx));
+    r = blosc_zonemap_put(map, n, indices, zones);
+
+ done:
+    free(zones);
+    free(indices);
+    return r;
+}
+
+/* Write the hyperslab `start`/`count` from `buf`, compressing its chunks
+   in parallel */
+int blosc_write_chunks(hid_t dset, const hsize_t *start,
+                       const hsize_t *count, const void *buf, int nthreads){
+
+    dset_info_t info;
+    blosc_workers_t *workers = NULL;
+    write_job_t *jobs = NULL, *job;
+    blosc_zonemap_t *map = NULL;
+    blosc_zone_t *zones = NULL;
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t *indices = NULL;
+    size_t njobs = 0, n = 0, i, jobsize, budget = 0, nchunks = 1;
+    int r = -1;
+
+    if (get_dset_info("blosc_write_chunks", dset, &info) < 0) return -1;
+    if (check_hyperslab("blosc_write_chunks", &info, start, count) < 0)
+        goto done;
+    if (blosc_zonemap_open("blosc_write_chunks", dset, 0, &map) < 0) {
+        goto done;
+    }
+
+    if (!info.blosc_only) {
+        r = use_pipeline(&info, 1, start, count, start, count, (void *)buf);
+        if (r >= 0 && map != NULL) {
+            r = put_buffer_zones(&info, map, start, count,
+                                 (const char *)buf);
+        }
+        goto done;
+    }
+
+    for (i = 0; i < (size_t)info.ndims; i++) {
+        if (start[i] % info.chunkdims[i] != 0 ||
+            ((start[i] + count[i]) % info.chunkdims[i] != 0 &&
+             start[i] + count[i] != info.dims[i])) {
+            PUSH_ERR("blosc_write_chunks", H5E_BADRANGE,
+                     "Hyperslab not aligned with the chunks");
+            goto done;
+        }
+    }
+
+    if (nthreads <= 0) nthreads = blosc_workers_ncpus();
+    workers = blosc_workers_create(nthreads);
+    if (workers == NULL) {
+        PUSH_ERR("blosc_write_chunks", H5E_CANTINIT,
+                 "Can't start compression threads");
+        goto done;
+    }
+
+    /* Keep every thread busy while the main one writes, as far as the
+       memory budget goes */
+    jobsize = info.chunksize + info.outsize;
+    njobs = blosc_budget_acquire_jobs(2 * (size_t)nthreads, jobsize);
+    budget = njobs * jobsize;
+    if (njobs == 0) {
+        PUSH_ERR("blosc_write_chunks", H5E_CANTALLOC, "Memory budget exhausted");
+        goto done;
+    }
+    jobs = (write_job_t *)calloc(njobs, sizeof(write_job_t));
+    if (jobs == NULL) goto nomem;
+    chunk_range(&info, start, count, clo, chi);
+    if (map != NULL) {
+        /* The jobs compute the zones of the chunks along */
+        for (i = 0; i < (size_t)info.ndims; i++) {
+            nchunks *= (size_t)(chi[i] - clo[i]);
+        }
+        zones = (blosc_zone_t *)malloc(nchunks * sizeof(blosc_zone_t));
+        indices = (hsize_t *)malloc(nchunks * info.ndims * sizeof(hsize_t));
+        if (zones == NULL || indices == NULL) goto nomem;
+    }
+    for (i = 0; i < njobs; i++) {
+        jobs[i].info = &info;
+        jobs[i].start = start;
+        jobs[i].count = count;
+        jobs[i].buf = (const char *)buf;
+        jobs[i].map = map;
+        jobs[i].chunk = (char *)malloc(info.chunksize);
+        jobs[i].out = (char *)malloc(info.outsize);
+        if (jobs[i].chunk == NULL || jobs[i].out == NULL) goto nomem;
+    }
+
+    /* Chunks are written in order, as soon as they are compressed */
+    memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+    do {
+        if (map != NULL) {
+            memcpy(indices + n * info.ndims, cidx,
+                   info.ndims * sizeof(hsize_t));
+        }
+        job = &jobs[n % njobs];
+        if (job->busy && write_compressed(workers, job) < 0) goto done;
+        job->zone = zones != NULL ? &zones[n] : NULL;
+        n++;
+        job->nbytes = chunk_part(&info, start, count, cidx, job->offset,
+                                 job->lo, job->ext);
+        /* Near the buffers of the job, once they have been touched */
+        if (blosc_workers_submit_near(workers, compress_chunk, job,
+                                      job->chunk, &job->done) < 0)
+            goto nomem;
+        job->busy = 1;
+    } while (next_index(info.ndims, clo, chi, cidx));
+
+    for (i = 0; i < njobs; i++) {
+        job = &jobs[n++ % njobs];
+        if (job->busy && write_compressed(workers, job) < 0) goto done;
+    }
+    r = 0;
+    if (map != NULL) r = blosc_zonemap_put(map, nchunks, indices, zones);
+    goto done;
+
+ nomem:
+    PUSH_ERR("blosc_write_chunks", H5E_CANTALLOC,
+             "Can't allocate chunk buffers");
+
+ done:
+    /* Let pending jobs finish before their buffers go away */
+    blosc_workers_destroy(workers);
+    if (jobs != NULL) {
+        for (i = 0; i < njobs; i++) {
+            free(jobs[i].chunk);
+            free(jobs[i].out);
+        }
+        free(jobs);
+    }
+    if (blosc_zonemap_close(map) < 0) r = -1;
+    free(zones);
+    free(indices);
+    blosc_budget_release(budget);
+    free_dset_info(&info);
+    return r;
+}
+
+
+/* A chunk being decompressed for blosc_read_chunks() */
+typedef struct {
+    const dset_info_t *info;
+    const hsize_t *start;
+    const hsize_t *count;
+    char *buf;
+    hsize_t offset[MAX_NDIMS];
+    hsize_t lo[MAX_NDIMS];
+    hsize_t ext[MAX_NDIMS];
+    size_t nbytes;              /* Bytes of the hyperslab in the chunk */
+    char *raw;                  /* The chunk as stored */
+    size_t rawsize;
+    size_t raw_capacity;
+    uint32_t filter_mask;
+    char *dest;                 /* Where the chunk goes in buf, if in place */
+    char *chunk;                /* The uncompressed chunk otherwise */
+    int status;
+    int busy;                   /* Submitted but not checked yet */
+    int done;
+} read_job_t;
+
+/* Worker job: decompress a chunk and scatter it into the hyperslab */
+static void decompress_chunk(void *arg){
+
+    read_job_t *job = (read_job_t *)arg;
+    const dset_info_t *info = job->info;
+
+    if (job->filter_mask & 1) {
+        /* Blosc was skipped for this chunk: it is stored as is */
+        job->status = copy_runs(info, CHUNK_TO_BUF, job->start, job->count,
+                                job->offset, job->lo, job->ext, job->raw,
+                                job->rawsize, job->buf);
+    } else if (job->dest != NULL) {
+        /* Decompress right into place, without any staging copy.  Chunks
+           are decompressed in parallel, so one thread for each. */
+        job->status = blosc_filter_decode(info->cd_nelmts, info->cd_values, 1,
+                                          job->raw, job->rawsize, job->dest,
+                                          info->chunksize);
+    } else if (job->nbytes >= info->chunksize / FULL_DECODE_FRACTION ||
+               info->split) {
+        /* Most of the chunk is needed anyway, or it only decodes whole */
+        job->status = blosc_filter_decode(info->cd_nelmts, info->cd_values, 1,
+                                          job->raw, job->rawsize, job->chunk,
+                                          info->chunksize);
+        if (job->status == 0) {
+            job->status = copy_runs(info, CHUNK_TO_BUF, job->start,
+                                    job->count, job->offset, job->lo,
+                                    job->ext, job->chunk, info->chunksize,
+                                    job->buf);
+        }
+    } else {
+        job->status = copy_runs(info, DECODE_TO_BUF, job->start, job->count,
+                                job->offset, job->lo, job->ext, job->raw,
+                                job->rawsize, job->buf);
+    }
+}
+
+/* Wait for a chunk to be decompressed and check how it went */
+static int check_decompressed(blosc_workers_t *workers, read_job_t *job){
+
+    blosc_workers_wait(workers, &job->done);
+    job->busy = 0;
+    if (job->status < 0) {
+        PUSH_ERR("blosc_read_chunks", H5E_READERROR,
+                 job->status == -2 ? "Blosc chunk checksum mismatch" :
+                 "Blosc decompression error");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the hyperslab `start`/`count` into `buf`, decompressing its chunks
+   in parallel while the next ones are read.  With `wanted`, only the
+   chunks it flags, by chunk_index(), are read, and counted in `nread`. */
+static int read_chunks(const char *func, hid_t dset, const hsize_t *start,
+                       const hsize_t *count, void *buf, int nthreads,
+                       const unsigned char *wanted, size_t *nread){
+
+    dset_info_t info;
+    blosc_workers_t *workers = NULL;
+    read_job_t *jobs = NULL, *job;
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t offset[MAX_NDIMS], lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hsize_t rawsize;
+    size_t njobs = 0, n = 0, i, jobsize, budget = 0;
+    int r = -1;
+
+    if (get_dset_info(func, dset, &info) < 0) return -1;
+    if (check_hyperslab(func, &info, start, count) < 0) goto done;
+
+    chunk_range(&info, start, count, clo, chi);
+    if (!info.blosc_only && wanted == NULL) {
+        r = use_pipeline(&info, 0, start, count, start, count, buf);
+        goto done;
+    }
+    if (!info.blosc_only) {
+        /* Through the pipeline too, but a chunk at a time */
+        memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+        do {
+            if (!wanted[chunk_index(&info, cidx)]) continue;
+            chunk_part(&info, start, count, cidx, offset, lo, ext);
+            if (use_pipeline(&info, 0, start, count, lo, ext, buf) < 0)
+                goto done;
+            (*nread)++;
+        } while (next_index(info.ndims, clo, chi, cidx));
+        r = 0;
+        goto done;
+    }
+
+    if (nthreads <= 0) nthreads = blosc_workers_ncpus();
+    workers = blosc_workers_create(nthreads);
+    if (workers == NULL) {
+        PUSH_ERR(func, H5E_CANTINIT, "Can't start decompression threads");
+        goto done;
+    }
+
+    /* While the threads decompress, the main one reads ahead, as far as
+       the memory budget goes */
+    jobsize = info.chunksize + info.outsize;
+    njobs = blosc_budget_acquire_jobs(2 * (size_t)nthreads, jobsize);
+    budget = njobs * jobsize;
+    if (njobs == 0) {
+        PUSH_ERR(func, H5E_CANTALLOC, "Memory budget exhausted");
+        goto done;
+    }
+    jobs = (read_job_t *)calloc(njobs, sizeof(read_job_t));
+    if (jobs == NULL) goto nomem;
+    for (i = 0; i < njobs; i++) {
+        jobs[i].info = &info;
+        jobs[i].start = start;
+        jobs[i].count = count;
+        jobs[i].buf = (char *)buf;
+    }
+
+    memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+    do {
+        if (wanted != NULL) {
+            if (!wanted[chunk_index(&info, cidx)]) continue;
+            (*nread)++;
+        }
+        job = &jobs[n++ % njobs];
+        if (job->busy && check_decompressed(workers, job) < 0) goto done;
+        job->nbytes = chunk_part(&info, start, count, cidx, job->offset,
+                                 job->lo, job->ext);
+
+        /* Chunks never written hold the fill value: let HDF5 do it */
+        H5E_BEGIN_TRY {
+            if (H5Dget_chunk_storage_size(dset, job->offset, &rawsize) < 0)
+                rawsize = 0;
+        } H5E_END_TRY;
+        if (rawsize == 0) {
+            if (use_pipeline(&info, 0, start, count, job->lo, job->ext,
+                             buf) < 0) goto done;
+            continue;
+        }
+
+        if (rawsize > job->raw_capacity) {
+            free(job->raw);
+            job->raw = (char *)malloc(rawsize);
+            job->raw_capacity = job->raw != NULL ? rawsize : 0;
+            if (job->raw == NULL) goto nomem;
+        }
+        job->dest = contiguous_dest(&info, start, count, job->offset,
+                                    job->nbytes, (char *)buf);
+        if (job->dest == NULL && job->chunk == NULL) {
+            job->chunk = (char *)malloc(info.chunksize);
+            if (job->chunk == NULL) goto nomem;
+        }
+        job->rawsize = rawsize;
+        if (H5Dread_chunk(dset, H5P_DEFAULT, job->offset, &job->filter_mask,
+                          job->raw) < 0) goto done;
+
+        if (blosc_workers_submit_near(workers, decompress_chunk, job,
+                                      job->dest != NULL ? job->dest :
+                                      job->chunk, &job->done) < 0)
+            goto nomem;
+        job->busy = 1;
+    } while (next_index(info.ndims, clo, chi, cidx));
+
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].busy && check_decompressed(workers, &jobs[i]) < 0)
+            goto done;
+    }
+    r = 0;
+    goto done;
+
+ nomem:
+    PUSH_ERR(func, H5E_CANTALLOC, "Can't allocate chunk buffers");
+
+ done:
+    /* Let pending jobs finish before their buffers go away */
+    blosc_workers_destroy(workers);
+    if (jobs != NULL) {
+        for (i = 0; i < njobs; i++) {
+            free(jobs[i].raw);
+            free(jobs[i].chunk);
+        }
+        free(jobs);
+    }
+    blosc_budget_release(budget);
+    free_dset_info(&info);
+    return r;
+}
+
+int blosc_read_chunks(hid_t dset, const hsize_t *start, const hsize_t *count,
+                      void *buf, int nthreads){
+    return read_chunks("blosc_read_chunks", dset, start, count, buf,
+                       nthreads, NULL, NULL);
+}
+
+/* Read the chunks the zone map of `dset` says may hold values in
+   [lo, hi] into `buf`, which holds the whole dataset */
+hssize_t blosc_read_where(hid_t dset, double lo, double hi, void *buf,
+                          int nthreads){
+
+    hsize_t start[MAX_NDIMS], count[MAX_NDIMS], nchunks;
+    unsigned char *wanted;
+    size_t nread = 0;
+    hid_t space;
+    int i, ndims, r;
+
+    space = H5Dget_space(dset);
+    if (space < 0) return -1;
+    ndims = H5Sget_simple_extent_ndims(space);
+    if (ndims > MAX_NDIMS) {
+        PUSH_ERR("blosc_read_where", H5E_BADRANGE,
+                 "Dataset rank exceeds limit");
+        ndims = -1;
+    }
+    if (ndims >= 0) ndims = H5Sget_simple_extent_dims(space, count, NULL);
+    H5Sclose(space);
+    if (ndims < 0) return -1;
+    for (i = 0; i < ndims; i++) {
+        start[i] = 0;
+    }
+    wanted = blosc_zonemap_wanted("blosc_read_where", dset, lo, hi,
+                                  &nchunks);
+    if (wanted == NULL) return -1;
+    r = read_chunks("blosc_read_where", dset, start, count, buf, nthreads,
+                    wanted, &nread);
+    free(wanted);
+    return r < 0 ? -1 : (hssize_t)nread;
+}
+
+
+/* A member read by blosc_read_fields() */
+typedef struct {
+    size_t field;               /* Its field in the stored records */
+    size_t offset;              /* Its offset in the stored records */
+    size_t mem_offset;          /* Its offset in the records of `buf` */
+    size_t size;
+} member_map_t;
+
+/* Match the members of the compound `mem_type` with the fields of the
+   stored records.  Returns their number, 0 if one of them is not in the
+   stored type, has another type there or is not a field of its own. */
+static size_t map_members(const dset_info_t *info, hid_t mem_type,
+                          member_map_t *map){
+
+    const unsigned *fields = info->cd_values + BLOSC_FIELDS_OFFSET;
+    size_t nfields = info->cd_values[19], nmap, k;
+    int nmembers = H5Tget_nmembers(mem_type), index, same;
+    hid_t mtype, stype;
+    char *name;
+
+    if (nmembers <= 0 || nmembers > FILTER_BLOSC_MAX_FIELDS ||
+        info->cd_nelmts < BLOSC_FIELDS_OFFSET + BLOSC_FIELD_SLOTS * nfields) {
+        return 0;
+    }
+    for (nmap = 0; nmap < (size_t)nmembers; nmap++) {
+        name = H5Tget_member_name(mem_type, (unsigned)nmap);
+        if (name == NULL) return 0;
+        H5E_BEGIN_TRY {
+            index = H5Tget_member_index(info->type, name);
+        } H5E_END_TRY;
+        H5free_memory(name);
+        if (index < 0) return 0;
+
+        mtype = H5Tget_member_type(mem_type, (unsigned)nmap);
+        stype = H5Tget_member_type(info->type, (unsigned)index);
+        same = mtype >= 0 && stype >= 0 && H5Tequal(mtype, stype) > 0;
+        map[nmap].size = same ? H5Tget_size(stype) : 0;
+        if (mtype >= 0) H5Tclose(mtype);
+        if (stype >= 0) H5Tclose(stype);
+        if (!same) return 0;
+
+        map[nmap].offset = H5Tget_member_offset(info->type, (unsigned)index);
+        map[nmap].mem_offset = H5Tget_member_offset(mem_type,
+                                                    (unsigned)nmap);
+        for (k = 0; k < nfields; k++) {
+            if (fields[BLOSC_FIELD_SLOTS * k] == map[nmap].offset &&
+                fields[BLOSC_FIELD_SLOTS * k + 1] == map[nmap].size) break;
+        }
+        if (k == nfields) return 0;
+        map[nmap].field = k;
+    }
+    return nmap;
+}
+
+/* Copy the members in `map` of the records in the part `lo`/`ext` of the
+   chunk at `offset` into the dense buffer `buf` of the hyperslab
+   `start`/`count`, whose records have `mem_size` bytes.  The member `m`
+   of the record `i` of the chunk is found at
+   `bases[m] + i * strides[m]`. */
+static void copy_members(const dset_info_t *info, const hsize_t *start,
+                         const hsize_t *count, const hsize_t *offset,
+                         const hsize_t *lo, const hsize_t *ext,
+                         const member_map_t *map, size_t nmap,
+                         size_t mem_size, char *const *bases,
+                         const size_t *strides, char *buf){
+
+    size_t cstride[MAX_NDIMS], bstride[MAX_NDIMS];
+    hsize_t zero[MAX_NDIMS], idx[MAX_NDIMS];
+    size_t runsize, crec, brec, m, j;
+    char *dest;
+    const char *src;
+    int i, k;
+
+    /* Record strides within the chunk and within the buffer */
+    cstride[info->ndims - 1] = bstride[info->ndims - 1] = 1;
+    for (i = info->ndims - 1; i > 0; i--) {
+        cstride[i - 1] = cstride[i] * info->chunkdims[i];
+        bstride[i - 1] = bstride[i] * count[i];
+    }
+
+    /* Contiguous runs, as in copy_runs() */
+    k = info->ndims - 1;
+    while (k > 0 && ext[k] == info->chunkdims[k] && ext[k] == count[k]) k--;
+    runsize = ext[k] * cstride[k];
+
+    for (i = 0; i < info->ndims; i++) {
+        zero[i] = idx[i] = 0;
+    }
+    do {
+        crec = brec = 0;
+        for (i = 0; i < info->ndims; i++) {
+            hsize_t pos = lo[i] + (i < k ? idx[i] : 0);
+            crec += (pos - offset[i]) * cstride[i];
+            brec += (pos - start[i]) * bstride[i];
+        }
+        for (m = 0; m < nmap; m++) {
+            src = bases[m] + crec * strides[m];
+            dest = buf + brec * mem_size + map[m].mem_offset;
+            for (j = 0; j < runsize; j++) {
+                memcpy(dest + j * mem_size, src + j * strides[m],
+                       map[m].size);
+            }
+        }
+    } while (k > 0 && next_index(k, zero, ext, idx));
+}
+
+int blosc_read_fields(hid_t dset, hid_t mem_type, const hsize_t *start,
+                      const hsize_t *count, void *buf){
+
+    dset_info_t info;
+    member_map_t map[FILTER_BLOSC_MAX_FIELDS];
+    size_t sel[FILTER_BLOSC_MAX_FIELDS], strides[FILTER_BLOSC_MAX_FIELDS];
+    char *columns[FILTER_BLOSC_MAX_FIELDS], *bases[FILTER_BLOSC_MAX_FIELDS];
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t offset[MAX_NDIMS], lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hsize_t rawsize;
+    size_t raw_capacity = 0, chunk_capacity = 0, col_capacity = 0;
+    size_t nmap = 0, nrecords, mem_size, colsize = 0, m;
+    char *raw = NULL, *chunk = NULL, *colbuf = NULL, *records;
+    uint32_t filter_mask;
+    int r = -1;
+
+    if (get_dset_info("blosc_read_fields", dset, &info) < 0) return -1;
+    if (check_hyperslab("blosc_read_fields", &info, start, count) < 0)
+        goto done;
+    if (H5Tget_class(mem_type) != H5T_COMPOUND) {
+        PUSH_ERR("blosc_read_fields", H5E_BADTYPE,
+                 "Not a compound memory type");
+        goto done;
+    }
+
+    if (info.blosc_only && info.split) {
+        nmap = map_members(&info, mem_type, map);
+    }
+    if (nmap == 0) {
+        r = use_pipeline_as(&info, mem_type, 0, start, count, start, count,
+                            buf);
+        goto done;
+    }
+
+    /* One column for each member read, in a single buffer */
+    mem_size = H5Tget_size(mem_type);
+    nrecords = info.chunksize / info.typesize;
+    for (m = 0; m < nmap; m++) {
+        sel[m] = map[m].field;
+        colsize += nrecords * map[m].size;
+    }
+    colbuf = blosc_filter_buffer_get(colsize, &col_capacity);
+    if (colbuf == NULL) goto nomem;
+    for (m = 0, colsize = 0; m < nmap; m++) {
+        columns[m] = colbuf + colsize;
+        colsize += nrecords * map[m].size;
+    }
+
+    chunk_range(&info, start, count, clo, chi);
+    memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+
+    do {
+        chunk_part(&info, start, count, cidx, offset, lo, ext);
+
+        /* Chunks never written hold the fill value: let HDF5 do it */
+        H5E_BEGIN_TRY {
+            if (H5Dget_chunk_storage_size(dset, offset, &rawsize) < 0)
+                rawsize = 0;
+        } H5E_END_TRY;
+        if (rawsize == 0) {
+            if (use_pipeline_as(&info, mem_type, 0, start, count, lo, ext,
+                                buf) < 0) goto done;
+            continue;
+        }
+
+        if (rawsize > raw_capacity) {
+            blosc_filter_buffer_put(raw, raw_capacity);
+            raw = blosc_filter_buffer_get((size_t)rawsize, &raw_capacity);
+        }
+        if (raw == NULL) goto nomem;
+        if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &filter_mask, raw) < 0)
+            goto done;
+
+        /* Only the columns of the members read get decompressed; other
+           chunks (stored as is, constant...) are taken whole */
+        records = raw;
+        r = filter_mask & 1 ? 1 :
+            blosc_filter_decode_fields(info.cd_nelmts, info.cd_values, raw,
+                                       (size_t)rawsize, nmap, sel,
+                                       (void *const *)columns);
+        if (r == 1 && !(filter_mask & 1)) {
+            if (chunk == NULL) {
+                chunk = blosc_filter_buffer_get(info.chunksize,
+                                                &chunk_capacity);
+                if (chunk == NULL) goto nomem;
+            }
+            r = blosc_filter_decode(info.cd_nelmts, info.cd_values, 0, raw,
+                                    (size_t)rawsize, chunk, info.chunksize);
+            records = chunk;
+            if (r == 0) r = 1;
+        }
+        if (r < 0) {
+            PUSH_ERR("blosc_read_fields", H5E_READERROR,
+                     r == -2 ? "Blosc chunk checksum mismatch" :
+                     "Blosc decompression error");
+            goto done;
+        }
+        for (m = 0; m < nmap; m++) {
+            if (r == 0) {
+                bases[m] = columns[m];
+                strides[m] = map[m].size;
+            } else {
+                bases[m] = records + map[m].offset;
+                strides[m] = info.typesize;
+            }
+        }
+        copy_members(&info, start, count, offset, lo, ext, map, nmap,
+                     mem_size, bases, strides, (char *)buf);
+        r = -1;
+    } while (next_index(info.ndims, clo, chi, cidx));
+    r = 0;
+    goto done;
+
+ nomem:
+    PUSH_ERR("blosc_read_fields", H5E_CANTALLOC,
+             "Can't allocate chunk buffers");
+
+ done:
+    blosc_filter_buffer_put(raw, raw_capacity);
+    blosc_filter_buffer_put(chunk, chunk_capacity);
+    blosc_filter_buffer_put(colbuf, col_capacity);
+    free_dset_info(&info);
+    return r;
+}
+
+
+/* A chunk staged by a blosc_appender_t */
+typedef struct {
+    const dset_info_t *info;
+    char *chunk;                /* The rows staged, chunk-sized */
+    char *out;                  /* The compressed chunk */
+    size_t cbytes;
+    hsize_t row;                /* First row of the chunk */
+    size_t nrows;               /* Rows staged so far */
+    const blosc_zonemap_t *map; /* The zone map of the dataset, if any */
+    blosc_zone_t zone;          /* The zone of the rows staged */
+    int status;                 /* As returned by blosc_filter_encode() */
+    int busy;                   /* Submitted but not written yet */
+    int done;
+} append_buf_t;
+
+struct blosc_appender {
+    dset_info_t info;
+    blosc_workers_t *workers;
+    blosc_zonemap_t *map;       /* The zone map of the dataset, if any */
+    append_buf_t *bufs;         /* Ring of staging buffers */
+    size_t nbufs;
+    size_t budget;              /* Bytes of the memory budget taken */
+    size_t cur;                 /* The buffer being filled */
+    size_t oldest;              /* The oldest buffer not written yet */
+    size_t chunkrows;           /* Rows in a chunk */
+    size_t rowsize;             /* Bytes in a row */
+    hsize_t extent;             /* Rows of the dataset as committed */
+    int failed;
+};
+
+/* Worker job: compress a full chunk of rows */
+static void compress_rows(void *arg){
+
+    append_buf_t *buf = (append_buf_t *)arg;
+    const dset_info_t *info = buf->info;
+    hsize_t ext[MAX_NDIMS];
+
+    if (buf->map != NULL) {
+        memcpy(ext, info->chunkdims, info->ndims * sizeof(hsize_t));
+        ext[0] = buf->nrows;
+        blosc_zonemap_compute(buf->map, buf->chunk, info->chunkdims, zero_lo,
+                              ext, &buf->zone);
+    }
+    if (!info->blosc_only) return;      /* Written through the pipeline */
+    buf->status = blosc_filter_encode(info->cd_nelmts, info->cd_values, 1,
+                                      buf->chunk, info->chunksize, buf->out,
+                                      info->outsize, &buf->cbytes);
+}
+
+/* Write the `nrows` rows from `row` on of a chunk, compressed by
+   compress_rows() into `buf` (or staged in `chunk` for datasets using
+   other filters), growing the dataset to hold them */
+static int commit_rows(blosc_appender_t *app, const append_buf_t *buf,
+                       const char *chunk, size_t nrows){
+
+    const dset_info_t *info = &app->info;
+    hsize_t dims[MAX_NDIMS], offset[MAX_NDIMS], count[MAX_NDIMS];
+    hsize_t cidx[MAX_NDIMS];
+    herr_t r;
+    int i;
+
+    memcpy(dims, info->dims, info->ndims * sizeof(hsize_t));
+    memcpy(count, info->dims, info->ndims * sizeof(hsize_t));
+    for (i = 0; i < info->ndims; i++) {
+        offset[i] = cidx[i] = 0;
+    }
+    dims[0] = buf->row + nrows;
+    offset[0] = buf->row;
+    count[0] = nrows;
+    if (dims[0] > app->extent) {
+        if (H5Dset_extent(info->dset, dims) < 0) return -1;
+        app->extent = dims[0];
+    }
+    cidx[0] = buf->row / app->chunkrows;
+    if (app->map != NULL &&
+        blosc_zonemap_put(app->map, 1, cidx, &buf->zone) < 0) return -1;
+
+    if (!info->blosc_only) {
+        return use_pipeline(info, 1, offset, count, offset, count,
+                            (void *)chunk);
+    }
+    if (buf->status < 0) {
+        PUSH_ERR("blosc_append", H5E_WRITEERROR, "Blosc compression error");
+        return -1;
+    }
+    if (buf->status > 0) {
+        /* Not compressible: store it as is, like the filter does */
+        r = H5Dwrite_chunk(info->dset, H5P_DEFAULT, 1, offset,
+                           info->chunksize, chunk);
+    } else {
+        r = H5Dwrite_chunk(info->dset, H5P_DEFAULT, 0, offset, buf->cbytes,
+                           buf->out);
+    }
+    return r < 0 ? -1 : 0;
+}
+
+/* Wait for the oldest submitted chunk and write it */
+static int write_oldest(blosc_appender_t *app){
+
+    append_buf_t *buf = &app->bufs[app->oldest];
+    int r;
+
+    blosc_workers_wait(app->workers, &buf->done);
+    buf->busy = 0;
+    r = commit_rows(app, buf, buf->chunk, buf->nrows);
+    buf->nrows = 0;
+    app->oldest = (app->oldest + 1) % app->nbufs;
+    if (r < 0) app->failed = 1;
+    return r;
+}
+
+/* Write the chunks already compressed, in order, without waiting */
+static int write_done(blosc_appender_t *app){
+
+    append_buf_t *buf;
+
+    for (;;) {
+        buf = &app->bufs[app->oldest];
+        if (!buf->busy || !blosc_workers_poll(app->workers, &buf->done)) {
+            return 0;
+        }
+        if (write_oldest(app) < 0) return -1;
+    }
+}
+
+blosc_appender_t *blosc_appender_open(hid_t dset, int nthreads){
+
+    blosc_appender_t *app;
+    hsize_t maxdims[MAX_NDIMS], start[MAX_NDIMS], count[MAX_NDIMS];
+    hid_t space;
+    append_buf_t *buf;
+    size_t i, bufsize;
+    int k, ok;
+
+    app = (blosc_appender_t *)calloc(1, sizeof(blosc_appender_t));
+    if (app == NULL) goto nomem;
+    if (get_dset_info("blosc_appender_open", dset, &app->info) < 0) {
+        free(app);
+        return NULL;
+    }
+
+    /* Rows go along the first dimension, which must be unlimited, and
+       each chunk holds whole rows */
+    space = H5Dget_space(dset);
+    ok = space >= 0 &&
+         H5Sget_simple_extent_dims(space, NULL, maxdims) == app->info.ndims &&
+         maxdims[0] == H5S_UNLIMITED && app->info.chunkdims[0] > 0;
+    if (space >= 0) H5Sclose(space);
+    for (k = 1; ok && k < app->info.ndims; k++) {
+        ok = app->info.chunkdims[k] == app->info.dims[k];
+    }
+    if (!ok) {
+        PUSH_ERR("blosc_appender_open", H5E_BADRANGE,
+                 "Appending needs an unlimited first dimension and chunks "
+                 "spanning every other one");
+        goto failed;
+    }
+    app->chunkrows = (size_t)app->info.chunkdims[0];
+    app->rowsize = app->info.chunksize / app->chunkrows;
+    app->extent = app->info.dims[0];
+    if (blosc_zonemap_open("blosc_appender_open", dset, 0, &app->map) < 0) {
+        goto failed;
+    }
+
+    /* Two buffers per thread keep the threads busy while more rows come,
+       as far as the memory budget goes */
+    if (nthreads <= 0) nthreads = blosc_workers_ncpus();
+    app->workers = blosc_workers_create(nthreads);
+    if (app->workers == NULL) {
+        PUSH_ERR("blosc_appender_open", H5E_CANTINIT,
+                 "Can't start compression threads");
+        goto failed;
+    }
+    bufsize = app->info.chunksize +
+              (app->info.blosc_only ? app->info.outsize : 0);
+    app->nbufs = blosc_budget_acquire_jobs(2 * (size_t)nthreads, bufsize);
+    app->budget = app->nbufs * bufsize;
+    if (app->nbufs == 0) {
+        PUSH_ERR("blosc_appender_open", H5E_CANTALLOC,
+                 "Memory budget exhausted");
+        goto failed;
+    }
+    app->bufs = (append_buf_t *)calloc(app->nbufs, sizeof(append_buf_t));
+    if (app->bufs == NULL) goto nomem;
+    for (i = 0; i < app->nbufs; i++) {
+        buf = &app->bufs[i];
+        buf->info = &app->info;
+        buf->map = app->map;
+        buf->chunk = (char *)malloc(app->info.chunksize);
+        buf->out = (char *)malloc(app->info.blosc_only ? app->info.outsize :
+                                                         1);
+        if (buf->chunk == NULL || buf->out == NULL) goto nomem;
+    }
+
+    /* Append to the last chunk if it is not full, after its rows */
+    buf = &app->bufs[0];
+    buf->row = app->extent - app->extent % app->chunkrows;
+    buf->nrows = (size_t)(app->extent - buf->row);
+    if (buf->nrows > 0) {
+        memcpy(count, app->info.dims, app->info.ndims * sizeof(hsize_t));
+        for (k = 0; k < app->info.ndims; k++) {
+            start[k] = 0;
+        }
+        start[0] = buf->row;
+        count[0] = buf->nrows;
+        if (use_pipeline(&app->info, 0, start, count, start, count,
+                         buf->chunk) < 0) goto failed;
+    }
+    return app;
+
+ nomem:
+    PUSH_ERR("blosc_appender_open", H5E_CANTALLOC,
+             "Can't allocate staging buffers");
+
+ failed:
+    if (app != NULL) {
+        app->failed = 1;
+        blosc_appender_close(app);
+    }
+    return NULL;
+}
+
+int blosc_append(blosc_appender_t *app, const void *buf, size_t nrows){
+
+    const char *rows = (const char *)buf;
+    append_buf_t *cur;
+    size_t n;
+
+    if (app->failed) {
+        PUSH_ERR("blosc_append", H5E_WRITEERROR,
+                 "A previous append failed");
+        return -1;
+    }
+    while (nrows > 0) {
+        cur = &app->bufs[app->cur];
+        n = app->chunkrows - cur->nrows;
+        if (n > nrows) n = nrows;
+        memcpy(cur->chunk + cur->nrows * app->rowsize, rows,
+               n * app->rowsize);
+        cur->nrows += n;
+        rows += n * app->rowsize;
+        nrows -= n;
+        if (cur->nrows < app->chunkrows) break;
+
+        /* A full chunk: compress it in the background and move on to the
+           next buffer, waiting for it only if it is still in flight */
+        if (blosc_workers_submit_near(app->workers, compress_rows, cur,
+                                      cur->chunk, &cur->done) < 0) {
+            PUSH_ERR("blosc_append", H5E_CANTALLOC,
+                     "Can't queue a chunk for compression");
+            app->failed = 1;
+            return -1;
+        }
+        cur->busy = 1;
+        app->cur = (app->cur + 1) % app->nbufs;
+        if (app->bufs[app->cur].busy && write_oldest(app) < 0) return -1;
+        app->bufs[app->cur].row = cur->row + app->chunkrows;
+        if (write_done(app) < 0) return -1;
+    }
+    return 0;
+}
+
+int blosc_appender_flush(blosc_appender_t *app){
+
+    append_buf_t *cur = &app->bufs[app->cur], tail;
+    size_t capacity;
+    int r;
+
+    if (app->failed) {
+        PUSH_ERR("blosc_appender_flush", H5E_WRITEERROR,
+                 "A previous append failed");
+        return -1;
+    }
+    while (app->bufs[app->oldest].busy) {
+        if (write_oldest(app) < 0) return -1;
+    }
+    if (cur->nrows == 0) return 0;
+
+    /* The partial chunk is compressed from a copy padded with zeros, as
+       the rows staged stay there for the next appends */
+    tail = *cur;
+    tail.chunk = (char *)blosc_filter_buffer_get(app->info.chunksize,
+                                                 &capacity);
+    if (tail.chunk == NULL) {
+        PUSH_ERR("blosc_appender_flush", H5E_CANTALLOC,
+                 "Can't allocate chunk buffer");
+        app->failed = 1;
+        return -1;
+    }
+    memcpy(tail.chunk, cur->chunk, cur->nrows * app->rowsize);
+    memset(tail.chunk + cur->nrows * app->rowsize, 0,
+           app->info.chunksize - cur->nrows * app->rowsize);
+    compress_rows(&tail);
+    r = commit_rows(app, &tail, tail.chunk, cur->nrows);
+    blosc_filter_buffer_put(tail.chunk, capacity);
+    if (r < 0) app->failed = 1;
+    return r;
+}
+
+int blosc_appender_close(blosc_appender_t *app){
+
+    int r = 0;
+    size_t i;
+
+    if (app == NULL) return 0;
+    if (!app->failed) r = blosc_appender_flush(app);
+    else r = -1;
+
+    /* Let pending jobs finish before their buffers go away */
+    blosc_workers_destroy(app->workers);
+    if (app->bufs != NULL) {
+        for (i = 0; i < app->nbufs; i++) {
+            free(app->bufs[i].chunk);
+            free(app->bufs[i].out);
+        }
+        free(app->bufs);
+    }
+    if (blosc_zonemap_close(app->map) < 0) r = -1;
+    blosc_budget_release(app->budget);
+    free_dset_info(&app->info);
+    free(app);
+    return r;
+}
+
+
+#if defined(FILTER_BLOSC_MPI_WRITES)
+
+/* Collective writes with parallel HDF5.  Chunks can't be written with
+   H5Dwrite_chunk() there, as their space has to be allocated by all
+   ranks together, so blosc_write_chunks_mpi() goes through the filtered
+   collective path of H5Dwrite(), where HDF5 has each rank compress the
+   chunks it owns, exchanges their sizes and allocates them collectively.
+   What it adds is that each rank compresses its whole chunks ahead, in
+   parallel, and blosc_filter() then picks them up instead of compressing
+   them one by one, on one thread, as HDF5 hands them over.  Chunks are
+   recognized by the CRC-32C of their contents and then compared with the
+   hyperslab written, so anything else HDF5 passes to the filter in the
+   meantime is compressed as usual. */
+
+/* A chunk compressed ahead of H5Dwrite() */
+typedef struct {
+    const dset_info_t *info;
+    const hsize_t *start;
+    const hsize_t *count;
+    const char *buf;
+    hsize_t offset[MAX_NDIMS];
+    uint32_t crc;               /* Of the uncompressed chunk */
+    char *out;                  /* The compressed chunk, NULL if none */
+    size_t cbytes;
+    int used;
+    int done;
+} prepared_t;
+
+/* Chunks taken by blosc_filter(), for blosc_mpi_chunks_taken() */
+static unsigned long long chunks_taken = 0;
+
+/* The chunks compressed ahead for the H5Dwrite() in progress, sorted by
+   CRC */
+typedef struct {
+    const dset_info_t *info;
+    prepared_t **chunks;
+    size_t nchunks;
+} prepared_set_t;
+
+#if defined(_WIN32)
+
+static prepared_set_t *prepared_set = NULL;
+
+static prepared_set_t *get_prepared(void){
+    return prepared_set;
+}
+
+static void set_prepared(prepared_set_t *set){
+    prepared_set = set;
+}
+
+#else
+
+#include <pthread.h>
+
+/* HDF5 runs the filter on the thread calling H5Dwrite(), so the set is
+   only seen by that thread */
+static pthread_key_t prepared_key;
+static pthread_once_t prepared_key_once = PTHREAD_ONCE_INIT;
+
+static void create_prepared_key(void){
+    pthread_key_create(&prepared_key, NULL);
+}
+
+static prepared_set_t *get_prepared(void){
+    pthread_once(&prepared_key_once, create_prepared_key);
+    return (prepared_set_t *)pthread_getspecific(prepared_key);
+}
+
+static void set_prepared(prepared_set_t *set){
+    pthread_once(&prepared_key_once, create_prepared_key);
+    pthread_setspecific(prepared_key, set);
+}
+
+#endif
+
+/* Worker job: gather a whole chunk from the hyperslab and compress it */
+static void prepare_chunk(void *arg){
+
+    prepared_t *p = (prepared_t *)arg;
+    const dset_info_t *info = p->info;
+    size_t capacity;
+    char *chunk, *out;
+
+    chunk = (char *)blosc_filter_buffer_get(info->chunksize, &capacity);
+    out = (char *)malloc(info->outsize);
+    if (chunk != NULL && out != NULL) {
+        copy_runs(info, BUF_TO_CHUNK, p->start, p->count, p->offset,
+                  p->offset, info->chunkdims, chunk, info->chunksize,
+                  (char *)p->buf);
+        /* Before the pre-filters, which run in place */
+        p->crc = blosc_kernel_crc32c(chunk, info->chunksize);
+        if (blosc_filter_encode(info->cd_nelmts, info->cd_values, 1, chunk,
+                                info->chunksize, out, info->outsize,
+                                &p->cbytes) == 0) {
+            p->out = out;
+            out = NULL;
+        }
+    }
+    free(out);
+    if (chunk != NULL) blosc_filter_buffer_put(chunk, capacity);
+}
+
+static int by_crc(const void *a, const void *b){
+
+    const prepared_t *x = *(const prepared_t *const *)a;
+    const prepared_t *y = *(const prepared_t *const *)b;
+
+    return (x->crc > y->crc) - (x->crc < y->crc);
+}
+
+int blosc_mpi_take_prepared(size_t cd_nelmts, const unsigned cd_values[],
+                            const void *src, size_t nbytes, void *dest,
+                            size_t destsize, size_t *cbytes){
+
+    prepared_set_t *set = get_prepared();
+    const dset_info_t *info;
+    prepared_t *p;
+    size_t lo, hi, mid;
+    uint32_t crc;
+
+    if (set == NULL) return 1;
+    info = set->info;
+    if (nbytes != info->chunksize || cd_nelmts != info->cd_nelmts ||
+        memcmp(cd_values, info->cd_values,
+               cd_nelmts * sizeof(unsigned)) != 0) return 1;
+
+    crc = blosc_kernel_crc32c(src, nbytes);
+    lo = 0;
+    hi = set->nchunks;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (set->chunks[mid]->crc < crc) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < set->nchunks && set->chunks[lo]->crc == crc; lo++) {
+        p = set->chunks[lo];
+        if (p->used || p->out == NULL || p->cbytes > destsize) continue;
+        if (copy_runs(info, CHUNK_EQUALS_BUF, p->start, p->count, p->offset,
+                      p->offset, info->chunkdims, (char *)src, nbytes,
+                      (char *)p->buf) != 0) continue;
+        memcpy(dest, p->out, p->cbytes);
+        *cbytes = p->cbytes;
+        p->used = 1;
+        BLOSC_ATOMIC_ADD(chunks_taken, 1);
+        return 0;
+    }
+    return 1;
+}
+
+unsigned long long blosc_mpi_chunks_taken(void){
+    return BLOSC_ATOMIC_LOAD(chunks_taken);
+}
+
+int blosc_write_chunks_mpi(hid_t dset, const hsize_t *start,
+                           const hsize_t *count, const void *buf,
+                           int nthreads){
+
+    dset_info_t info;
+    prepared_set_t set;
+    prepared_t *chunks = NULL;
+    blosc_workers_t *workers = NULL;
+    hsize_t clo[MAX_NDIMS], chi[MAX_NDIMS], cidx[MAX_NDIMS];
+    hsize_t lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hid_t file = -1, fapl = -1, fspace = -1, mspace = -1, dxpl = -1;
+    MPI_Comm comm = MPI_COMM_NULL;
+    MPI_Info mpi_info = MPI_INFO_NULL;
+    size_t total = 1, n = 0, i, budget = 0;
+    int empty = 0, ok = 0, all_ok = 0, r = -1;
+
+    memset(&set, 0, sizeof(set));
+    if (get_dset_info("blosc_write_chunks_mpi", dset, &info) < 0) return -1;
+
+    /* The ranks agree on going ahead, not to be left waiting in the
+       collective H5Dwrite() for one that gave up */
+    file = H5Iget_file_id(dset);
+    fapl = file >= 0 ? H5Fget_access_plist(file) : -1;
+    if (fapl < 0 || H5Pget_fapl_mpio(fapl, &comm, &mpi_info) < 0) {
+        PUSH_ERR("blosc_write_chunks_mpi", H5E_BADVALUE,
+                 "The file is not open with the MPI-IO driver");
+        goto done;
+    }
+    for (i = 0; i < (size_t)info.ndims; i++) {
+        if (count[i] == 0) empty = 1;
+    }
+    ok = empty || check_hyperslab("blosc_write_chunks_mpi", &info, start,
+                                  count) == 0;
+    MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!all_ok) {
+        if (ok) {
+            PUSH_ERR("blosc_write_chunks_mpi", H5E_BADRANGE,
+                     "Another rank passed an invalid hyperslab");
+        }
+        goto done;
+    }
+
+    /* Compress the whole chunks of this rank in parallel */
+    if (!empty && info.blosc_only) {
+        chunk_range(&info, start, count, clo, chi);
+        for (i = 0; i < (size_t)info.ndims; i++) {
+            total *= (size_t)(chi[i] - clo[i]);
+        }
+        chunks = (prepared_t *)calloc(total, sizeof(prepared_t));
+        set.chunks = (prepared_t **)malloc(total * sizeof(prepared_t *));
+        if (nthreads <= 0) nthreads = blosc_workers_ncpus();
+        if (chunks != NULL && set.chunks != NULL) {
+            workers = blosc_workers_create(nthreads);
+        }
+        /* Without them HDF5 compresses every chunk itself */
+        if (workers != NULL) {
+            memcpy(cidx, clo, info.ndims * sizeof(hsize_t));
+            do {
+                prepared_t *p = &chunks[n];
+                if (chunk_part(&info, start, count, cidx, p->offset, lo,
+                               ext) != info.chunksize) continue;
+                p->info = &info;
+                p->start = start;
+                p->count = count;
+                p->buf = (const char *)buf;
+                /* Chunks past the memory budget are left to HDF5 too */
+                if (blosc_budget_acquire(info.outsize, 0) < 0) break;
+                budget += info.outsize;
+                if (blosc_workers_submit(workers, prepare_chunk, p,
+                                         &p->done) < 0) break;
+                set.chunks[n++] = p;
+            } while (next_index(info.ndims, clo, chi, cidx));
+            blosc_workers_destroy(workers);
+            qsort(set.chunks, n, sizeof(prepared_t *), by_crc);
+            set.info = &info;
+            set.nchunks = n;
+        }
+    }
+
+    fspace = H5Dget_space(dset);
+    if (fspace < 0) goto done;
+    mspace = H5Scopy(fspace);
+    if (mspace < 0) goto done;
+    if (empty) {
+        if (H5Sselect_none(fspace) < 0 || H5Sselect_none(mspace) < 0) {
+            goto done;
+        }
+    } else {
+        H5Sclose(mspace);
+        mspace = H5Screate_simple(info.ndims, count, NULL);
+        if (mspace < 0 ||
+            H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count,
+                                NULL) < 0) goto done;
+    }
+    dxpl = H5Pcreate(H5P_DATASET_XFER);
+    if (dxpl < 0 || H5Pset_dxpl_mpio(dxpl, H5FD_MPIO_COLLECTIVE) < 0) {
+        goto done;
+    }
+    if (set.nchunks > 0) set_prepared(&set);
+    r = H5Dwrite(dset, info.type, mspace, fspace, dxpl, buf) < 0 ? -1 : 0;
+    set_prepared(NULL);
+
+ done:
+    if (chunks != NULL) {
+        for (i = 0; i < total; i++) {
+            free(chunks[i].out);
+        }
+        free(chunks);
+    }
+    blosc_budget_release(budget);
+    free(set.chunks);
+    if (dxpl >= 0) H5Pclose(dxpl);
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    if (fapl >= 0) H5Pclose(fapl);
+    if (file >= 0) H5Fclose(file);
+    if (comm != MPI_COMM_NULL) MPI_Comm_free(&comm);
+    if (mpi_info != MPI_INFO_NULL) MPI_Info_free(&mpi_info);
+    free_dset_info(&info);
+    return r;
+}
+
+#endif
@@ -0,0 +1,424 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Field-split chunks for compound datasets.
+
+    Records of many members compress as one stream with the size of the
+    whole record as shuffle type size, which mixes unrelated bytes, and a
+    read of a few members has to decompress all of them.  Here each field
+    of the records is gathered into a column and compressed as a Blosc
+    chunk of its own, shuffled with the size of the field, so that
+    blosc_read_fields() decompresses only the columns it needs.  The
+    fields, members and the padding between them, are laid out in the
+    cd_values of the dataset by blosc_set_local().  When the dataset asks
+    for several threads, the fields are compressed side by side on the
+    worker threads, one thread each.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+/* Chunks are stored as a frame laid out like the constant frames of
+   blosc_filter.c, followed by the index of the streams and the streams:
+
+     byte 0       FIELDS_FRAME_MARKER
+     byte 1       FIELDS_FRAME_KIND
+     bytes 2-3    reserved (0)
+     bytes 4-11   chunk size in bytes, little endian
+     bytes 12-15  number of fields, little endian
+     then         the size of the Blosc chunk of each field, 4 bytes
+                  each, little endian
+     then         the Blosc chunks, one after the other
+*/
+#define FIELDS_FRAME_MARKER 0xff
+#define FIELDS_FRAME_KIND 4
+#define FIELDS_FRAME_HEADER 16
+
+/* With several threads, the fields are compressed side by side on the
+   worker pool, which Blosc before 1.5 cannot do: it has no contexts */
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+#define FIELDS_IN_PARALLEL 0
+#else
+#define FIELDS_IN_PARALLEL 1
+#endif
+
+static void put32(unsigned char *d, size_t v){
+
+    int i;
+
+    for (i = 0; i < 4; i++) d[i] = (unsigned char)(v >> (8 * i));
+}
+
+static size_t get32(const unsigned char *s){
+    return (size_t)s[0] | (size_t)s[1] << 8 | (size_t)s[2] << 16 |
+           (size_t)s[3] << 24;
+}
+
+/* Bytes of a record, i.e. the end of the last field */
+static size_t record_size(const unsigned *fields, size_t nfields){
+
+    const unsigned *last;
+
+    if (nfields == 0) return 0;
+    last = fields + BLOSC_FIELD_SLOTS * (nfields - 1);
+    return (size_t)last[0] + last[1];
+}
+
+/* A field compressed or decompressed on a worker thread, when the
+   dataset asks for several threads: each field gets one */
+typedef struct {
+    const unsigned *field;
+    size_t nrecords, recsize;
+    const char *records;        /* The chunk */
+    char *dest;                 /* The chunk, to decompress into */
+    const unsigned char *stream;
+    char *column;
+    size_t column_capacity;
+    char *out;                  /* The Blosc chunk, when compressing */
+    size_t out_capacity;
+    const blosc_params_t *params;
+    int n;                      /* Compressed size, or status */
+    int done;
+} field_job_t;
+
+static void encode_field(void *arg){
+
+    field_job_t *job = (field_job_t *)arg;
+    const blosc_params_t *params = job->params;
+    size_t colsize = job->nrecords * job->field[1];
+
+    blosc_kernel_gather(job->column, job->records + job->field[0],
+                        job->nrecords, job->recsize, job->field[1]);
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+    job->n = blosc_compress(params->clevel, params->doshuffle, job->field[2],
+                            colsize, job->column, job->out,
+                            job->out_capacity);
+#else
+    job->n = blosc_compress_ctx(params->clevel, params->doshuffle,
+                                job->field[2], colsize, job->column, job->out,
+                                job->out_capacity, params->compname, 0, 1);
+#endif
+}
+
+/* Run `fn` on every job, on up to `nthreads` workers; returns -1 if
+   the buffers of the jobs could not be had */
+static int run_fields(field_job_t *jobs, size_t njobs, blosc_work_fn fn,
+                      int nthreads, int encode){
+
+    blosc_workers_t *workers;
+    size_t k, colsize;
+    int status = 0;
+
+    for (k = 0; k < njobs; k++) {
+        colsize = jobs[k].nrecords * jobs[k].field[1];
+        jobs[k].column = (char *)blosc_filter_buffer_get(
+                             colsize, &jobs[k].column_capacity);
+        if (encode) {
+            jobs[k].out_capacity = colsize + BLOSC_MAX_OVERHEAD;
+            jobs[k].out = (char *)blosc_filter_buffer_get(
+                              jobs[k].out_capacity, &jobs[k].out_capacity);
+        }
+        if (jobs[k].column == NULL || (encode && jobs[k].out == NULL)) {
+            status = -1;
+        }
+    }
+    workers = status == 0 ? blosc_workers_create(nthreads) : NULL;
+    if (workers == NULL) return -1;
+    for (k = 0; k < njobs; k++) {
+        if (blosc_workers_submit(workers, fn, &jobs[k], &jobs[k].done) < 0) {
+            fn(&jobs[k]);
+        }
+    }
+    blosc_workers_destroy(workers);
+    return 0;
+}
+
+static void free_fields(field_job_t *jobs, size_t njobs){
+
+    size_t k;
+
+    for (k = 0; k < njobs; k++) {
+        blosc_filter_buffer_put(jobs[k].column, jobs[k].column_capacity);
+        blosc_filter_buffer_put(jobs[k].out, jobs[k].out_capacity);
+    }
+    free(jobs);
+}
+
+/* Compress the fields side by side into their own buffers, then put
+   them one after the other in `d` from `pos` */
+static int encode_parallel(const blosc_params_t *params, const char *s,
+                           size_t nrecords, size_t recsize, unsigned char *d,
+                           size_t pos, size_t destsize, size_t *end){
+
+    field_job_t *jobs;
+    size_t k;
+    int status = 0;
+
+    jobs = (field_job_t *)calloc(params->nfields, sizeof(field_job_t));
+    if (jobs == NULL) return -1;
+    for (k = 0; k < params->nfields; k++) {
+        jobs[k].field = params->fields + BLOSC_FIELD_SLOTS * k;
+        jobs[k].nrecords = nrecords;
+        jobs[k].recsize = recsize;
+        jobs[k].records = s;
+        jobs[k].params = params;
+    }
+    if (run_fields(jobs, params->nfields, encode_field, params->nthreads,
+                   1) < 0) {
+        free_fields(jobs, params->nfields);
+        return -1;
+    }
+    for (k = 0; k < params->nfields && status == 0; k++) {
+        if (jobs[k].n < 0) {
+            status = -1;
+        } else if (jobs[k].n == 0 || (size_t)jobs[k].n > destsize - pos) {
+            status = 1;                 /* Does not fit in dest */
+        } else {
+            memcpy(d + pos, jobs[k].out, jobs[k].n);
+            put32(d + FIELDS_FRAME_HEADER + 4 * k, (size_t)jobs[k].n);
+            pos += (size_t)jobs[k].n;
+        }
+    }
+    free_fields(jobs, params->nfields);
+    *end = pos;
+    return status;
+}
+
+/* Compress the fields one after the other right into `d`, from `pos` */
+static int encode_serial(const blosc_params_t *params, const char *s,
+                         size_t nrecords, size_t recsize, unsigned char *d,
+                         size_t pos, size_t destsize, size_t *end){
+
+    const unsigned *field;
+    size_t colsize, maxsize = 0, capacity, k;
+    char *column;
+    int n, status = 0;
+
+    for (k = 0; k < params->nfields; k++) {
+        field = params->fields + BLOSC_FIELD_SLOTS * k;
+        if (field[1] > maxsize) maxsize = field[1];
+    }
+    column = (char *)blosc_filter_buffer_get(nrecords * maxsize, &capacity);
+    if (column == NULL) return -1;
+
+    for (k = 0; k < params->nfields; k++) {
+        field = params->fields + BLOSC_FIELD_SLOTS * k;
+        colsize = nrecords * field[1];
+        blosc_kernel_gather(column, s + field[0], nrecords, recsize, field[1]);
+        /* Blosc chooses the blocksize of each column */
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+        n = blosc_compress(params->clevel, params->doshuffle, field[2],
+                           colsize, column, d + pos, destsize - pos);
+#else
+        n = blosc_compress_ctx(params->clevel, params->doshuffle, field[2],
+                               colsize, column, d + pos, destsize - pos,
+                               params->compname, 0, params->nthreads);
+#endif
+        if (n <= 0) {
+            status = n < 0 ? -1 : 1;     /* 0: does not fit in dest */
+            break;
+        }
+        put32(d + FIELDS_FRAME_HEADER + 4 * k, (size_t)n);
+        pos += (size_t)n;
+    }
+    blosc_filter_buffer_put(column, capacity);
+    *end = pos;
+    return status;
+}
+
+int blosc_filter_fields_encode(const blosc_params_t *params, const void *src,
+                               size_t nbytes, void *dest, size_t destsize,
+                               size_t *cbytes){
+
+    unsigned char *d = (unsigned char *)dest;
+    size_t recsize = record_size(params->fields, params->nfields);
+    size_t nrecords, pos;
+    int status;
+
+    if (recsize == 0 || nbytes % recsize != 0) return -1;
+    nrecords = nbytes / recsize;
+    pos = FIELDS_FRAME_HEADER + 4 * params->nfields;
+    if (pos >= destsize) return 1;
+
+    status = FIELDS_IN_PARALLEL && params->nthreads > 1 &&
+             params->nfields > 1 ?
+             encode_parallel(params, (const char *)src, nrecords, recsize, d,
+                             pos, destsize, &pos) :
+             encode_serial(params, (const char *)src, nrecords, recsize, d,
+                           pos, destsize, &pos);
+    if (status != 0) return status;
+
+    d[0] = FIELDS_FRAME_MARKER;
+    d[1] = FIELDS_FRAME_KIND;
+    d[2] = d[3] = 0;
+    put32(d + 4, nbytes & 0xffffffffU);
+    put32(d + 8, (size_t)((unsigned long long)nbytes >> 32));
+    put32(d + 12, params->nfields);
+    *cbytes = pos;
+    return 0;
+}
+
+int blosc_filter_fields_decoded_size(const void *src, size_t srcsize,
+                                     size_t *nbytes){
+
+    const unsigned char *s = (const unsigned char *)src;
+
+    if (srcsize < FIELDS_FRAME_HEADER || s[0] != FIELDS_FRAME_MARKER ||
+        s[1] != FIELDS_FRAME_KIND) return -1;
+    *nbytes = (size_t)((unsigned long long)get32(s + 8) << 32 | get32(s + 4));
+    return 0;
+}
+
+/* Find the stream of field `k` in a chunk, checking it against the index
+   and against the layout in `fields`.  Returns its size, 0 if it is not
+   valid. */
+static size_t find_stream(const unsigned *fields, size_t nfields,
+                          const unsigned char *s, size_t srcsize, size_t k,
+                          size_t nrecords, const unsigned char **stream){
+
+    size_t pos = FIELDS_FRAME_HEADER + 4 * nfields, n, i;
+    size_t colsize, cbytes, blocksize;
+
+    if (srcsize < pos || get32(s + 12) != nfields) return 0;
+    for (i = 0; i < k; i++) {
+        pos += get32(s + FIELDS_FRAME_HEADER + 4 * i);
+    }
+    n = get32(s + FIELDS_FRAME_HEADER + 4 * k);
+    if (n < BLOSC_MIN_HEADER_LENGTH || pos > srcsize || n > srcsize - pos) {
+        return 0;
+    }
+    blosc_cbuffer_sizes(s + pos, &colsize, &cbytes, &blocksize);
+    if (cbytes != n ||
+        colsize != nrecords * fields[BLOSC_FIELD_SLOTS * k + 1]) return 0;
+    *stream = s + pos;
+    return n;
+}
+
+static int decode_stream(const unsigned char *stream, void *dest,
+                         size_t destsize, int nthreads){
+
+    int n;
+
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+    (void)nthreads;
+    n = blosc_decompress(stream, dest, destsize);
+#else
+    n = blosc_decompress_ctx(stream, dest, destsize, nthreads);
+#endif
+    return n == (int)destsize ? 0 : -1;
+}
+
+static void decode_field(void *arg){
+
+    field_job_t *job = (field_job_t *)arg;
+
+    job->n = decode_stream(job->stream, job->column,
+                           job->nrecords * job->field[1], 1);
+    if (job->n == 0) {
+        blosc_kernel_scatter(job->dest + job->field[0], job->column,
+                             job->nrecords, job->recsize, job->field[1]);
+    }
+}
+
+/* Decompress the fields side by side, each with one thread */
+static int decode_parallel(const unsigned *fields, size_t nfields,
+                           int nthreads, const unsigned char *src,
+                           size_t srcsize, size_t nrecords, size_t recsize,
+                           char *dest){
+
+    field_job_t *jobs;
+    size_t k;
+    int status = 0;
+
+    jobs = (field_job_t *)calloc(nfields, sizeof(field_job_t));
+    if (jobs == NULL) return -1;
+    for (k = 0; k < nfields && status == 0; k++) {
+        jobs[k].field = fields + BLOSC_FIELD_SLOTS * k;
+        jobs[k].nrecords = nrecords;
+        jobs[k].recsize = recsize;
+        jobs[k].dest = dest;
+        if (find_stream(fields, nfields, src, srcsize, k, nrecords,
+                        &jobs[k].stream) == 0) status = -1;
+    }
+    if (status == 0) {
+        status = run_fields(jobs, nfields, decode_field, nthreads, 0);
+    }
+    for (k = 0; k < nfields && status == 0; k++) {
+        if (jobs[k].n < 0) status = -1;
+    }
+    free_fields(jobs, nfields);
+    return status;
+}
+
+int blosc_filter_fields_decode(const unsigned *fields, size_t nfields,
+                               int nthreads, const void *src, size_t srcsize,
+                               void *dest, size_t destsize){
+
+    const unsigned char *stream;
+    const unsigned *field;
+    size_t recsize = record_size(fields, nfields);
+    size_t nbytes, nrecords, maxsize = 0, capacity, k;
+    char *column;
+    int status = -1;
+
+    if (blosc_filter_fields_decoded_size(src, srcsize, &nbytes) < 0 ||
+        nbytes > destsize || recsize == 0 || nbytes % recsize != 0) {
+        return -1;
+    }
+    nrecords = nbytes / recsize;
+    if (FIELDS_IN_PARALLEL && nthreads > 1 && nfields > 1) {
+        return decode_parallel(fields, nfields, nthreads,
+                               (const unsigned char *)src, srcsize, nrecords,
+                               recsize, (char *)dest);
+    }
+    for (k = 0; k < nfields; k++) {
+        field = fields + BLOSC_FIELD_SLOTS * k;
+        if (field[1] > maxsize) maxsize = field[1];
+    }
+    column = (char *)blosc_filter_buffer_get(nrecords * maxsize, &capacity);
+    if (column == NULL) return -1;
+
+    for (k = 0; k < nfields; k++) {
+        field = fields + BLOSC_FIELD_SLOTS * k;
+        if (find_stream(fields, nfields, (const unsigned char *)src, srcsize,
+                        k, nrecords, &stream) == 0 ||
+            decode_stream(stream, column, nrecords * field[1],
+                          nthreads) < 0) goto done;
+        blosc_kernel_scatter((char *)dest + field[0], column, nrecords,
+                             recsize, field[1]);
+    }
+    status = 0;
+
+ done:
+    blosc_filter_buffer_put(column, capacity);
+    return status;
+}
+
+int blosc_filter_fields_decode_columns(const unsigned *fields, size_t nfields,
+                                       const void *src, size_t srcsize,
+                                       size_t nsel, const size_t *sel,
+                                       void *const *columns){
+
+    const unsigned char *stream;
+    size_t recsize = record_size(fields, nfields);
+    size_t nbytes, nrecords, k;
+
+    if (blosc_filter_fields_decoded_size(src, srcsize, &nbytes) < 0 ||
+        recsize == 0 || nbytes % recsize != 0) return -1;
+    nrecords = nbytes / recsize;
+    for (k = 0; k < nsel; k++) {
+        if (sel[k] >= nfields ||
+            find_stream(fields, nfields, (const unsigned char *)src, srcsize,
+                        sel[k], nrecords, &stream) == 0 ||
+            decode_stream(stream, columns[k],
+                          nrecords * fields[BLOSC_FIELD_SLOTS * sel[k] + 1],
+                          1) < 0) return -1;
+    }
+    return 0;
+}
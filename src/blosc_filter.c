@@ -15,24 +15,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
 #include "hdf5.h"
 #include "blosc_filter.h"
-
-#if H5Epush_vers == 2
-/* 1.8.x */
-#define PUSH_ERR(func, minor, str...) H5Epush(H5E_DEFAULT, __FILE__, func, __LINE__, H5E_ERR_CLS, H5E_PLINE, minor, str)
-#else
-/* 1.6.x */
-#define PUSH_ERR(func, minor, str) H5Epush(__FILE__, func, __LINE__, H5E_PLINE, minor, str)
-#endif
-
-#if H5Pget_filter_by_id_vers == 2
-/* 1.8.x */
-#define GET_FILTER(a,b,c,d,e,f,g) H5Pget_filter_by_id(a,b,c,d,e,f,g,NULL)
-#else
-/* 1.6.x */
-#define GET_FILTER H5Pget_filter_by_id
-#endif
+#include "blosc_filter_internal.h"
 
 #if H5Z_class_t_vers == 2
 /* 1.8.x where x >= 3 */
@@ -48,6 +37,72 @@ size_t blosc_filter(unsigned flags, size_t cd_nelmts,
 
 herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space);
 
+/* Process-wide thread count override, 0 for none.  It starts out as
+   the value of the HDF5_BLOSC_NTHREADS environment variable, read once
+   before the first call of either function below takes effect, and from
+   then on blosc_filter_set_nthreads() sets it.  Filter threads read it
+   at any time, hence the atomic accesses. */
+static int nthreads_override = 0;
+
+static void init_nthreads(void){
+
+    char *envvar = getenv("HDF5_BLOSC_NTHREADS");
+    int nthreads = envvar != NULL ? atoi(envvar) : 0;
+
+    if (nthreads < 0) nthreads = 0;
+    if (nthreads > BLOSC_MAX_THREADS) nthreads = BLOSC_MAX_THREADS;
+    BLOSC_ATOMIC_STORE(nthreads_override, nthreads);
+}
+
+#if defined(_WIN32)
+
+static void call_init_nthreads(void){
+
+    static int initialized = 0;
+
+    if (!initialized) {
+        initialized = 1;
+        init_nthreads();
+    }
+}
+
+#else
+
+static pthread_once_t nthreads_once = PTHREAD_ONCE_INIT;
+
+static void call_init_nthreads(void){
+    pthread_once(&nthreads_once, init_nthreads);
+}
+
+#endif
+
+/* Set the process-wide number of threads Blosc uses for every chunk */
+int blosc_filter_set_nthreads(int nthreads){
+
+    call_init_nthreads();
+    if (nthreads < 0) nthreads = 0;
+    if (nthreads > BLOSC_MAX_THREADS) nthreads = BLOSC_MAX_THREADS;
+    return BLOSC_ATOMIC_EXCHANGE(nthreads_override, nthreads);
+}
+
+/* Compute the number of threads to use for a chunk.  A process override
+   (set via blosc_filter_set_nthreads() or HDF5_BLOSC_NTHREADS) wins over the
+   per-dataset request in cd_values[7]; without either, stay single-threaded
+   so as to not interfere with threads launched by the host application. */
+static int get_nthreads(size_t cd_nelmts, const unsigned cd_values[]){
+
+    int nthreads;
+
+    call_init_nthreads();
+    nthreads = BLOSC_ATOMIC_LOAD(nthreads_override);
+    if (nthreads == 0 && cd_nelmts >= 8) {
+        nthreads = (int)cd_values[7];
+    }
+    if (nthreads <= 0) nthreads = 1;
+    if (nthreads > BLOSC_MAX_THREADS) nthreads = BLOSC_MAX_THREADS;
+    return nthreads;
+}
+
 
 /* Register the filter, passing on the HDF5 return value */
 int register_blosc(char **version, char **date){
@@ -83,6 +138,145 @@ int register_blosc(char **version, char **date){
     return 1; /* lib is available */
 }
 
+/* Fallback when the cache size of the host cannot be detected */
+#define DEFAULT_CACHE_SIZE (256 * 1024)
+
+/* Get the size in bytes of the per-core (L2) cache of the host */
+static size_t get_cache_size(void){
+
+    long size = 0;
+#if defined(__linux__)
+    FILE *f;
+    char unit = 0;
+#endif
+
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+#if defined(__linux__)
+    /* Not every architecture reports it through sysconf() */
+    if (size <= 0) {
+        f = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
+        if (f != NULL) {
+            if (fscanf(f, "%ld%c", &size, &unit) < 1) size = 0;
+            if (unit == 'K') size *= 1024;
+            if (unit == 'M') size *= 1024 * 1024;
+            fclose(f);
+        }
+    }
+#endif
+    return size > 0 ? (size_t)size : DEFAULT_CACHE_SIZE;
+}
+
+/* Choose a Blosc blocksize for a chunk so that blocks are made of whole
+   rows of its innermost dimension (or of even pieces of a row, for very
+   wide rows) and a block, with the compressor's working buffers, fits
+   in the per-core cache. */
+static unsigned int compute_blocksize(int ndims, const hsize_t *chunkdims,
+                                      size_t typesize, size_t chunksize){
+
+    size_t target, rowsize, nrows, npieces, blocksize;
+
+    target = get_cache_size() / 4;
+    if (target < 8 * 1024) target = 8 * 1024;
+    if (target > 1024 * 1024) target = 1024 * 1024;
+
+    rowsize = ndims > 0 ? (size_t)chunkdims[ndims - 1] * typesize : typesize;
+    if (rowsize <= target) {
+        nrows = target / rowsize;
+        blocksize = nrows * rowsize;
+    } else {
+        npieces = (rowsize + target - 1) / target;
+        blocksize = rowsize / npieces;
+        blocksize -= blocksize % typesize;
+    }
+    if (blocksize > chunksize) blocksize = chunksize;
+    if (blocksize < typesize) blocksize = typesize;
+
+#ifdef BLOSC_DEBUG
+    fprintf(stderr, "Blosc: Automatic blocksize %zd (target %zd)\n",
+            blocksize, target);
+#endif
+
+    return (unsigned int)blocksize;
+}
+
+/* Choose the shuffle for items of class `classt` and `typesize` bytes:
+   none for single bytes, bit shuffle for floating point (whose exponent
+   and top mantissa bits vary slowly) and byte shuffle otherwise. */
+static unsigned int auto_shuffle(H5T_class_t classt, size_t typesize){
+
+    if (typesize <= 1) return BLOSC_NOSHUFFLE;
+#ifdef BLOSC_BITSHUFFLE
+    if (classt == H5T_FLOAT) return BLOSC_BITSHUFFLE;
+#endif
+    (void)classt;
+    return BLOSC_SHUFFLE;
+}
+
+/* Lay out the fields of the records of the compound `type` in `layout`
+   (BLOSC_FIELD_SLOTS slots each, see blosc_filter_internal.h): its
+   members in order of offset, and the padding between them as fields of
+   bytes.  Returns the number of fields, 0 if there are too many. */
+static size_t split_fields(hid_t type, unsigned *layout){
+
+    size_t offsets[FILTER_BLOSC_MAX_FIELDS], sizes[FILTER_BLOSC_MAX_FIELDS];
+    size_t typesizes[FILTER_BLOSC_MAX_FIELDS];
+    size_t recsize = H5Tget_size(type), pos, end, tmp, nfields = 0, n, i, j;
+    int nmembers = H5Tget_nmembers(type);
+    hid_t mtype, super_type;
+    unsigned *field;
+
+    if (nmembers <= 0 || nmembers > FILTER_BLOSC_MAX_FIELDS) return 0;
+    for (n = 0; n < (size_t)nmembers; n++) {
+        mtype = H5Tget_member_type(type, (unsigned)n);
+        if (mtype < 0) return 0;
+        offsets[n] = H5Tget_member_offset(type, (unsigned)n);
+        sizes[n] = typesizes[n] = H5Tget_size(mtype);
+        /* Arrays are shuffled by their base type */
+        if (H5Tget_class(mtype) == H5T_ARRAY) {
+            super_type = H5Tget_super(mtype);
+            typesizes[n] = H5Tget_size(super_type);
+            H5Tclose(super_type);
+        }
+        H5Tclose(mtype);
+        if (typesizes[n] == 0 || typesizes[n] > BLOSC_MAX_TYPESIZE) {
+            typesizes[n] = 1;
+        }
+        /* Insertion sort by offset, members being few */
+        for (i = n; i > 0 && offsets[i - 1] > offsets[i]; i--) {
+            tmp = offsets[i]; offsets[i] = offsets[i - 1]; offsets[i - 1] = tmp;
+            tmp = sizes[i]; sizes[i] = sizes[i - 1]; sizes[i - 1] = tmp;
+            tmp = typesizes[i];
+            typesizes[i] = typesizes[i - 1];
+            typesizes[i - 1] = tmp;
+        }
+    }
+
+    /* Walk the record from start to end, padding included */
+    pos = 0;
+    for (j = 0; j <= n; j++) {
+        end = j < n ? offsets[j] : recsize;
+        if (end < pos) return 0;
+        if (end > pos) {
+            if (nfields == FILTER_BLOSC_MAX_FIELDS) return 0;
+            field = layout + BLOSC_FIELD_SLOTS * nfields++;
+            field[0] = (unsigned)pos;
+            field[1] = (unsigned)(end - pos);
+            field[2] = 1;
+        }
+        if (j == n) break;
+        if (sizes[j] == 0) continue;
+        if (nfields == FILTER_BLOSC_MAX_FIELDS) return 0;
+        field = layout + BLOSC_FIELD_SLOTS * nfields++;
+        field[0] = (unsigned)offsets[j];
+        field[1] = (unsigned)sizes[j];
+        field[2] = (unsigned)typesizes[j];
+        pos = offsets[j] + sizes[j];
+    }
+    return nfields;
+}
+
 /*  Filter setup.  Records the following inside the DCPL:
 
     1. If version information is not present, set slots 0 and 1 to the filter
@@ -91,6 +285,33 @@ int register_blosc(char **version, char **date){
     2. Compute the type size in bytes and store it in slot 2.
 
     3. Compute the chunk size in bytes and store it in slot 3.
+
+    4. Refuse chunks Blosc cannot handle.
+
+    5. If the shuffle is not given in slot 5 or is
+       FILTER_BLOSC_SHUFFLE_AUTO, choose it from the type.
+
+    6. Turn off precision trimming (slot 14) for anything but native
+       floats, or when it would keep every mantissa bit.
+
+    7. Turn off delta coding (slot 15) for anything but native integers
+       of 1, 2, 4 or 8 bytes, and ask for an automatic blocksize when
+       none is given, as delta blocks follow it.
+
+    8. If an automatic blocksize was asked for in slot 9, replace it with
+       the blocksize computed from the chunk shape and the cache size.
+
+    9. For field-split storage (slot 18), store the number of fields of
+       the records in slot 19 and their layout from slot 32 on, or turn
+       it off for anything but compounds compressed with Blosc.
+
+    Unknown delta coding (slot 15), checksum (slot 17) or field split
+    (slot 18) values are rejected.
+
+    A filter with a zstd dictionary is left as blosc_filter_train_dict()
+    set it, as H5Pget_filter() gives at most 256 cd_values back (the
+    filter itself gets them all); the parameters must still be those the
+    dictionary was trained with.
 */
 herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space){
 
@@ -99,18 +320,45 @@ herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space){
     herr_t r;
 
     unsigned int typesize, basetypesize;
-    unsigned int bufsize;
+    hsize_t bufsize;
     hsize_t chunkdims[32];
     unsigned int flags;
-    size_t nelements = 8;
-    unsigned int values[] = {0,0,0,0,0,0,0,0};
+    size_t nelements = BLOSC_NPARAMS, ntotal;
+    unsigned int values[BLOSC_NPARAMS] = {0};
+    unsigned int trained[BLOSC_NPARAMS];
+    unsigned int split[BLOSC_MAX_SLOTS] = {0};
+    size_t nfields = 0;
     hid_t super_type;
     H5T_class_t classt;
+    H5T_order_t order;
 
     r = GET_FILTER(dcpl, FILTER_BLOSC, &flags, &nelements, values, 0, NULL);
     if(r<0) return -1;
 
     if(nelements < 4) nelements = 4;  /* First 4 slots reserved. */
+    ntotal = nelements;
+    if(nelements > BLOSC_NPARAMS) nelements = BLOSC_NPARAMS;  /* Unknown slots */
+
+    if (nelements >= 17 && values[16] != 0) {
+#ifndef HAVE_ZSTD_DICT
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "This build of the filter does not support zstd "
+                 "dictionaries (cd_values[16])");
+        return -1;
+#endif
+        if (nelements >= 19 && values[18] != 0) {
+            PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                     "Field-split storage cannot use a zstd dictionary");
+            return -1;
+        }
+        if (values[16] > FILTER_BLOSC_MAX_DICT_SIZE ||
+            ntotal < BLOSC_DICT_OFFSET + BLOSC_DICT_SLOTS(values[16])) {
+            PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                     "Invalid zstd dictionary in cd_values[16] and after");
+            return -1;
+        }
+    }
+    memcpy(trained, values, sizeof(values));
 
     /* Set Blosc info in first two slots */
     values[0] = FILTER_BLOSC_VERSION;
@@ -131,11 +379,14 @@ herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space){
       /* Get the array base component */
       super_type = H5Tget_super(type);
       basetypesize = H5Tget_size(super_type);
+      classt = H5Tget_class(super_type);
+      order = H5Tget_order(super_type);
       /* Release resources */
       H5Tclose(super_type);
     }
     else {
       basetypesize = typesize;
+      order = H5Tget_order(type);
     }
 
     /* Limit large typesizes (they are pretty inneficient to shuffle
@@ -144,24 +395,1027 @@ herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space){
     if (basetypesize > BLOSC_MAX_TYPESIZE) basetypesize = 1;
     values[2] = basetypesize;
 
+    /* Without a shuffle slot, or with FILTER_BLOSC_SHUFFLE_AUTO in it,
+       choose the shuffle from the base type */
+    if (nelements < 6) {
+        if (nelements < 5) values[4] = DEFAULT_CLEVEL;
+        nelements = 6;
+        values[5] = FILTER_BLOSC_SHUFFLE_AUTO;
+    }
+    if (values[5] == FILTER_BLOSC_SHUFFLE_AUTO) {
+        values[5] = auto_shuffle(classt, basetypesize);
+    }
+
+    /* Precision trimming only ever applies to native floats */
+    if (nelements >= 15 && values[14] != 0) {
+        if (classt != H5T_FLOAT || order != H5Tget_order(H5T_NATIVE_FLOAT) ||
+            (basetypesize != 4 && basetypesize != 8) ||
+            values[14] >= (basetypesize == 4 ? 23U : 52U)) values[14] = 0;
+    }
+
+    /* Delta coding only ever applies to native integers.  Its blocks are
+       those of Blosc, and must not depend on what Blosc would choose, so
+       they are fixed in slot 9. */
+    if (nelements >= 16 && values[15] > FILTER_BLOSC_DELTA) {
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "Unsupported delta coding in cd_values[15]");
+        return -1;
+    }
+    if (nelements >= 16 && values[15] != 0) {
+        if (classt != H5T_INTEGER ||
+            (basetypesize != 1 && basetypesize != 2 && basetypesize != 4 &&
+             basetypesize != 8) ||
+            (basetypesize > 1 && order != H5Tget_order(H5T_NATIVE_INT))) {
+            values[15] = 0;
+        } else if (values[9] == 0) {
+            values[9] = FILTER_BLOSC_BLOCKSIZE_AUTO;
+        }
+    }
+
+    if (nelements >= 18 && values[17] > FILTER_BLOSC_CHECKSUM_CRC32C) {
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "Unsupported checksum in cd_values[17]");
+        return -1;
+    }
+
     /* Get the size of the chunk */
     bufsize = typesize;
     for (i=0; i<ndims; i++) {
         bufsize *= chunkdims[i];
     }
-    values[3] = bufsize;
+    /* Blosc chunks are limited to BLOSC_MAX_BUFFERSIZE (about 2 GB),
+       which also keeps the size within slot 3 */
+    if (bufsize > BLOSC_MAX_BUFFERSIZE) {
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "Chunk size exceeds the 2 GB limit of Blosc");
+        return -1;
+    }
+    values[3] = (unsigned int)bufsize;
+    if (nelements >= 13 && values[12] > FILTER_BLOSC_POLICY_SPEED) {
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "Unsupported codec policy in cd_values[12]");
+        return -1;
+    }
+    if (nelements == 13) nelements = 14;    /* Policy with default target */
+
+    /* Field-split storage only ever applies to compounds, with Blosc */
+    if (nelements >= 19 && values[18] > FILTER_BLOSC_SPLIT_FIELDS) {
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "Unsupported field split in cd_values[18]");
+        return -1;
+    }
+    if (nelements >= 19 && values[18] != 0) {
+        if (H5Tget_class(type) == H5T_COMPOUND) {
+            nfields = split_fields(type, split + BLOSC_FIELDS_OFFSET);
+        }
+        if (nfields == 0) values[18] = 0;
+        if (nelements < 20) nelements = 20;
+    }
+    if (nelements >= 20) values[19] = (unsigned int)nfields;
+
+    if (nelements >= 10 && values[9] == FILTER_BLOSC_BLOCKSIZE_AUTO) {
+        values[9] = compute_blocksize(ndims, chunkdims, typesize,
+                                      (size_t)bufsize);
+    }
 
 #ifdef BLOSC_DEBUG
-    fprintf(stderr, "Blosc: Computed buffer size %d\n", bufsize);
+    fprintf(stderr, "Blosc: Computed buffer size %llu\n",
+            (unsigned long long)bufsize);
 #endif
 
-    r = H5Pmodify_filter(dcpl, FILTER_BLOSC, flags, nelements, values);
+    if (nelements >= 17 && values[16] != 0) {
+        if (memcmp(values, trained, sizeof(values)) == 0) return 1;
+        PUSH_ERR("blosc_set_local", H5E_CALLBACK,
+                 "The Blosc filter parameters changed after the zstd "
+                 "dictionary was trained");
+        return -1;
+    }
+
+    if (nfields > 0) {
+        memcpy(split, values, sizeof(values));
+        r = H5Pmodify_filter(dcpl, FILTER_BLOSC, flags,
+                             BLOSC_FIELDS_OFFSET + BLOSC_FIELD_SLOTS * nfields,
+                             split);
+    } else {
+        r = H5Pmodify_filter(dcpl, FILTER_BLOSC, flags, nelements, values);
+    }
     if(r<0) return -1;
 
     return 1;
 }
 
 
+#if !( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+
+/* Incompressibility detection: the chunk is sampled in SAMPLE_COUNT
+   evenly spaced pieces of up to SAMPLE_SIZE bytes, which together make
+   at most 1/SAMPLE_MIN_FRACTION of the whole chunk.  Pieces shrink with
+   the chunk down to SAMPLE_MIN_SIZE bytes, so chunks from 64 KB on are
+   sampled. */
+#define SAMPLE_COUNT 4
+#define SAMPLE_SIZE (32 * 1024)
+#define SAMPLE_MIN_SIZE (2 * 1024)
+#define SAMPLE_MIN_FRACTION 8
+
+/* Estimate the compression ratio of a chunk, in hundredths (so 110 means
+   1.1x), from a few samples of it compressed with `compname` at
+   `clevel`.  Chunks too small to be sampled give 0, unless `small_ok`
+   is set, in which case their first SAMPLE_SIZE bytes (or all of them)
+   make up a single sample.  The compression speed in MB/s is returned in `mbps` if it is
+   not NULL. */
+static unsigned sample_ratio(const blosc_params_t *params,
+                             const char *compname, int clevel,
+                             size_t nbytes, const void *src, int small_ok,
+                             double *mbps){
+
+    char *scratch;
+    size_t scratch_capacity;
+    size_t typesize = params->typesize;
+    size_t samplesize, offset;
+    size_t sampled = 0, compressed = 0;
+    int i, nsamples = SAMPLE_COUNT, cbytes;
+    double start;
+
+    samplesize = nbytes / (SAMPLE_MIN_FRACTION * SAMPLE_COUNT);
+    if (samplesize > SAMPLE_SIZE) samplesize = SAMPLE_SIZE;
+    samplesize -= samplesize % typesize;
+    if (samplesize < SAMPLE_MIN_SIZE) {
+        if (!small_ok) return 0;
+        nsamples = 1;
+        samplesize = nbytes < SAMPLE_SIZE ? nbytes : SAMPLE_SIZE;
+        samplesize -= samplesize % typesize;
+        if (samplesize == 0) return 0;
+    }
+
+    scratch = blosc_filter_buffer_get(samplesize + BLOSC_MAX_OVERHEAD,
+                                      &scratch_capacity);
+    if (scratch == NULL) return 0;
+
+    start = blosc_stats_now();
+    for (i = 0; i < nsamples; i++) {
+        offset = nsamples > 1 ? (nbytes - samplesize) / (nsamples - 1) * i : 0;
+        offset -= offset % typesize;
+        cbytes = blosc_compress_ctx(clevel, params->doshuffle, typesize,
+                                    samplesize, (const char *)src + offset,
+                                    scratch, samplesize + BLOSC_MAX_OVERHEAD,
+                                    compname, params->blocksize, 1);
+        if (cbytes <= 0) {
+            blosc_filter_buffer_put(scratch, scratch_capacity);
+            return 0;
+        }
+        sampled += samplesize;
+        compressed += cbytes;
+    }
+    if (mbps != NULL) {
+        start = blosc_stats_now() - start;
+        *mbps = start > 0 ? sampled / start / 1e6 : 1e9;
+    }
+    blosc_filter_buffer_put(scratch, scratch_capacity);
+
+#ifdef BLOSC_DEBUG
+    fprintf(stderr, "Blosc: Sampled ratio %.2f with %s/%d\n",
+            (double)sampled / compressed, compname, clevel);
+#endif
+
+    return (unsigned)(sampled * 100 / compressed);
+}
+
+/* Returns 1 if the sampled ratio of a chunk reaches params->min_ratio or
+   the chunk is too small to be worth sampling, and 0 if compressing the
+   whole chunk would most probably be a waste of time. */
+static int worth_compressing(const blosc_params_t *params, size_t nbytes,
+                             const void *src){
+
+    unsigned ratio = sample_ratio(params, params->compname, params->clevel,
+                                  nbytes, src, 0, NULL);
+
+    /* On sampling failures, let the real compression report the problem */
+    return ratio == 0 || ratio >= params->min_ratio;
+}
+
+/* Stronger codecs tried, in this order, by the adaptive policies, and
+   the fast one tried instead when the codec of the dataset is too slow
+   for FILTER_BLOSC_POLICY_SPEED */
+static const char *policy_codecs[] = {"lz4hc", "zstd"};
+#define NPOLICY_CODECS (sizeof(policy_codecs) / sizeof(policy_codecs[0]))
+#define POLICY_FAST_CODEC "lz4"
+
+/* A stronger codec is only picked when it beats the current choice by
+   this much (in percent) on the samples */
+#define POLICY_MIN_GAIN 10
+
+/* Try `compname` on a chunk for the adaptive policies: returns its ratio
+   in hundredths (0 on errors), with its speed in MB/s in `mbps`.  When
+   `out` is not NULL the chunk is compressed whole into it, with the
+   compressed size in *outbytes (0 if it does not fit in `outsize`), so
+   that the trial of the codec picked is the real compression; otherwise
+   the chunk is sampled. */
+static unsigned try_codec(const blosc_params_t *params, const char *compname,
+                          size_t nbytes, const void *src, void *out,
+                          size_t outsize, size_t *outbytes, double *mbps){
+
+    double start;
+    int status;
+
+    if (out == NULL) {
+        return sample_ratio(params, compname, params->clevel, nbytes, src, 1,
+                            mbps);
+    }
+    start = blosc_stats_now();
+    status = blosc_compress_ctx(params->clevel, params->doshuffle,
+                                params->typesize, nbytes, src, out, outsize,
+                                compname, params->blocksize,
+                                params->nthreads);
+    start = blosc_stats_now() - start;
+    if (status < 0) return 0;
+    *mbps = start > 0 ? nbytes / start / 1e6 : 1e9;
+    *outbytes = (size_t)status;
+    return status > 0 ? (unsigned)(nbytes * 100 / status) : 100;
+}
+
+/* Pick the codec for one chunk under params->policy.  The codec of the
+   dataset is tried first; stronger ones are only tried when it misses
+   the target ratio (FILTER_BLOSC_POLICY_RATIO), or when it compresses at
+   the target speed (FILTER_BLOSC_POLICY_SPEED), and are then kept only
+   if they do so too.  In both cases a stronger codec must improve the
+   ratio by POLICY_MIN_GAIN percent to be picked.  A codec of the dataset
+   slower than the target speed is replaced by POLICY_FAST_CODEC if that
+   one is faster.
+
+   Chunks that fit in a single sample are not sampled but compressed
+   whole into `dest` with each codec tried, the best result staying
+   there: 1 is then returned, with its size in *cbytes (0 if it does not
+   fit), and -1 on errors.  Otherwise 0 is returned and the chunk is left
+   to compress with the codec picked. */
+static int choose_codec(blosc_params_t *params, size_t nbytes,
+                        const void *src, void *dest, size_t destsize,
+                        size_t *cbytes){
+
+    const char *compname;
+    unsigned best, ratio;
+    double mbps, best_mbps;
+    size_t i, trybytes = 0, capacity = 0;
+    char *scratch = NULL;
+    int compcode, whole = params->nfields == 0 && nbytes <= SAMPLE_SIZE;
+
+    best = try_codec(params, params->compname, nbytes, src,
+                     whole ? dest : NULL, destsize, cbytes, &best_mbps);
+    if (best == 0) return whole ? -1 : 0;
+    if (whole) {
+        scratch = blosc_filter_buffer_get(destsize, &capacity);
+        if (scratch == NULL) return 1;    /* The codec of the dataset */
+    }
+
+    if (params->policy == FILTER_BLOSC_POLICY_SPEED &&
+        best_mbps < params->policy_target) {
+        /* Stronger codecs are slower still */
+        compcode = blosc_compname_to_compcode(POLICY_FAST_CODEC);
+        if (compcode >= 0 && compcode != params->compcode) {
+            blosc_compcode_to_compname(compcode, &compname);
+            ratio = try_codec(params, compname, nbytes, src, scratch,
+                              destsize, &trybytes, &mbps);
+            if (ratio > 0 && mbps > best_mbps) {
+                best = ratio;
+                params->compcode = compcode;
+                params->compname = compname;
+                if (whole) {
+                    memcpy(dest, scratch, trybytes);
+                    *cbytes = trybytes;
+                }
+            }
+        }
+    } else {
+        for (i = 0; i < NPOLICY_CODECS; i++) {
+            if (params->policy == FILTER_BLOSC_POLICY_RATIO &&
+                best >= params->policy_target) break;
+            compcode = blosc_compname_to_compcode(policy_codecs[i]);
+            if (compcode < 0 || compcode == params->compcode) continue;
+            blosc_compcode_to_compname(compcode, &compname);
+            ratio = try_codec(params, compname, nbytes, src, scratch,
+                              destsize, &trybytes, &mbps);
+            if (ratio * 100 < best * (100 + POLICY_MIN_GAIN)) continue;
+            if (params->policy == FILTER_BLOSC_POLICY_SPEED &&
+                mbps < params->policy_target) continue;
+            best = ratio;
+            params->compcode = compcode;
+            params->compname = compname;
+            if (whole) {
+                memcpy(dest, scratch, trybytes);
+                *cbytes = trybytes;
+            }
+        }
+    }
+    blosc_filter_buffer_put(scratch, capacity);
+
+#ifdef BLOSC_DEBUG
+    fprintf(stderr, "Blosc: Policy picked %s (ratio %.2f)\n",
+            params->compname, best / 100.);
+#endif
+    return whole;
+}
+
+#endif
+
+
+/* Whether a dataset is delta coded (cd_values[15]), with the type size
+   and the size of the delta blocks (0 for a single one) */
+static int get_delta(size_t cd_nelmts, const unsigned cd_values[],
+                     size_t *typesize, size_t *blocksize){
+
+    if (cd_nelmts < 16 || cd_values[15] == 0) return 0;
+    *typesize = cd_values[2];
+    *blocksize = cd_values[9] != FILTER_BLOSC_BLOCKSIZE_AUTO ? cd_values[9] : 0;
+    return 1;
+}
+
+/* Whether a dataset has a zstd dictionary (cd_values[16]), with its size
+   and its slots (NULL if cd_values stops before the end of them) */
+static int get_dict(size_t cd_nelmts, const unsigned cd_values[],
+                    const unsigned **dict, size_t *dictsize){
+
+    if (cd_nelmts < 17 || cd_values[16] == 0) return 0;
+    *dictsize = cd_values[16];
+    *dict = cd_nelmts >= BLOSC_DICT_OFFSET + BLOSC_DICT_SLOTS(*dictsize) ?
+            cd_values + BLOSC_DICT_OFFSET : NULL;
+    return 1;
+}
+
+/* Whether a dataset is field-split (cd_values[18]), with its number of
+   fields and their layout (NULL if cd_values stops before the end of
+   it) */
+static int get_fields(size_t cd_nelmts, const unsigned cd_values[],
+                      const unsigned **fields, size_t *nfields){
+
+    if (cd_nelmts < 20 || cd_values[18] == 0) return 0;
+    *nfields = cd_values[19];
+    *fields = *nfields > 0 && *nfields <= FILTER_BLOSC_MAX_FIELDS &&
+              cd_nelmts >= BLOSC_FIELDS_OFFSET +
+                           BLOSC_FIELD_SLOTS * *nfields ?
+              cd_values + BLOSC_FIELDS_OFFSET : NULL;
+    return 1;
+}
+
+/* Whether a dataset has checksums (cd_values[17]) */
+static int has_checksum(size_t cd_nelmts, const unsigned cd_values[]){
+    return cd_nelmts >= 18 && cd_values[17] != 0;
+}
+
+/* Read the parameters in cd_values but the number of threads, filling
+   in the defaults for the optional ones.  Returns -1 if the compressor
+   is not supported by this Blosc library, -2 if the zstd dictionary is
+   not supported by this build (or is truncated), and -3 if the field
+   layout is truncated. */
+static int parse_params(size_t cd_nelmts, const unsigned cd_values[],
+                        blosc_params_t *params){
+
+    /* Filter params that are always set */
+    params->typesize = cd_values[2];  /* The datatype size */
+    /* Optional params */
+    params->clevel = DEFAULT_CLEVEL;  /* Compression level default */
+    params->doshuffle = 1;            /* Shuffle default */
+    params->compcode = BLOSC_BLOSCLZ; /* The compressor by default */
+    params->compname = "blosclz";
+    params->min_ratio = 0;            /* No sampling by default */
+    params->blocksize = 0;            /* Blosc chooses by default */
+    if (cd_nelmts >= 5) {
+        params->clevel = cd_values[4];    /* The compression level */
+    }
+    if (cd_nelmts >= 6) {
+        params->doshuffle = cd_values[5]; /* Shuffle? */
+    }
+    params->nthreads = 1;
+    if (cd_nelmts >= 9) {
+        params->min_ratio = cd_values[8]; /* Minimum ratio (x100) when sampling */
+    }
+    if (cd_nelmts >= 10 && cd_values[9] != FILTER_BLOSC_BLOCKSIZE_AUTO) {
+        params->blocksize = cd_values[9]; /* Forced Blosc blocksize */
+    }
+    params->policy = FILTER_BLOSC_POLICY_NONE;
+    params->policy_target = 0;
+    if (cd_nelmts >= 14) {
+        params->policy = cd_values[12];        /* Adaptive codec policy */
+        params->policy_target = cd_values[13]; /* and its target */
+    }
+    params->trim_bits = 0;
+    if (cd_nelmts >= 15) {
+        params->trim_bits = cd_values[14]; /* Mantissa bits kept */
+    }
+    params->delta = 0;
+    if (cd_nelmts >= 16) {
+        params->delta = cd_values[15] != 0; /* Delta coding */
+    }
+    params->checksum = has_checksum(cd_nelmts, cd_values); /* CRC-32C */
+    params->nfields = 0;
+    params->fields = NULL;
+    if (get_fields(cd_nelmts, cd_values, &params->fields, &params->nfields) &&
+        params->fields == NULL) return -3;
+    params->dictsize = 0;
+    params->dict = NULL;
+    if (get_dict(cd_nelmts, cd_values, &params->dict, &params->dictsize)) {
+#ifndef HAVE_ZSTD_DICT
+        return -2;
+#endif
+        if (params->dict == NULL) return -2;
+    }
+    if (cd_nelmts >= 7) {
+        params->compcode = cd_values[6];  /* The Blosc compressor used */
+        /* Check that we actually have support for the compressor code */
+        if (blosc_compcode_to_compname(params->compcode,
+                                       &params->compname) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Get the parameters of a dataset, from the cache of the thread when it
+   has them.  `nthreads` > 0 overrides the configured number of threads,
+   which is never cached as it may change at any time.  Same return
+   values as parse_params(). */
+static int get_params(size_t cd_nelmts, const unsigned cd_values[],
+                      int nthreads, blosc_params_t *params){
+
+    const blosc_params_t *cached;
+    int r;
+
+    cached = blosc_params_cache_get(cd_nelmts, cd_values);
+    if (cached != NULL) {
+        *params = *cached;
+    } else {
+        r = parse_params(cd_nelmts, cd_values, params);
+        if (r < 0) return r;
+        blosc_params_cache_put(cd_nelmts, cd_values, params);
+    }
+    params->nthreads = nthreads > 0 ? nthreads :
+                                      get_nthreads(cd_nelmts, cd_values);
+    return 0;
+}
+
+
+/* Constant chunks (filter revision 3 and later) are not run through
+   Blosc but stored as a small frame which cannot be mistaken for a Blosc
+   header, whose first byte is a format version:
+
+     byte 0       CONST_FRAME_MARKER
+     byte 1       CONST_FRAME_KIND
+     byte 2       item size
+     byte 3       reserved (0)
+     bytes 4-11   chunk size in bytes, little endian
+     bytes 12-    the item repeated all over the chunk
+*/
+#define CONST_FRAME_MARKER 0xff
+#define CONST_FRAME_KIND 1
+#define CONST_FRAME_HEADER 12
+
+/* Whether the chunks of a dataset may be constant frames */
+static int has_const_frames(const unsigned cd_values[]){
+    return cd_values[0] >= 3;
+}
+
+/* Write the constant frame of a chunk of `nbytes` bytes made of copies of
+   the item at `value`; returns its size, or 0 if it does not fit */
+static size_t write_const_frame(const void *value, size_t typesize,
+                                size_t nbytes, void *dest, size_t destsize){
+
+    unsigned char *d = (unsigned char *)dest;
+    int i;
+
+    if (CONST_FRAME_HEADER + typesize > destsize) return 0;
+    d[0] = CONST_FRAME_MARKER;
+    d[1] = CONST_FRAME_KIND;
+    d[2] = (unsigned char)typesize;
+    d[3] = 0;
+    for (i = 0; i < 8; i++) {
+        d[4 + i] = (unsigned char)((unsigned long long)nbytes >> (8 * i));
+    }
+    memcpy(d + CONST_FRAME_HEADER, value, typesize);
+    return CONST_FRAME_HEADER + typesize;
+}
+
+/* If `src` is a constant frame, return its item size and chunk size (in
+   `nbytes`); otherwise return 0 */
+static size_t read_const_frame(const unsigned cd_values[], const void *src,
+                               size_t srcsize, size_t *nbytes){
+
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned long long n = 0;
+    int i;
+
+    if (!has_const_frames(cd_values) || srcsize < CONST_FRAME_HEADER ||
+        s[0] != CONST_FRAME_MARKER || s[1] != CONST_FRAME_KIND || s[2] == 0 ||
+        srcsize < CONST_FRAME_HEADER + (size_t)s[2]) return 0;
+    for (i = 0; i < 8; i++) n |= (unsigned long long)s[4 + i] << (8 * i);
+    *nbytes = (size_t)n;
+    return s[2];
+}
+
+/* With checksums, chunks that do not compress are not handed back to HDF5
+   to be stored as they are, which would leave them unchecked, but stored
+   as they are in a frame like the constant ones (STORED_FRAME_KIND, and
+   an item size of 1) */
+#define STORED_FRAME_KIND 3
+
+static size_t write_stored_frame(const void *src, size_t nbytes, void *dest,
+                                 size_t destsize){
+
+    unsigned char *d = (unsigned char *)dest;
+
+    if (CONST_FRAME_HEADER + nbytes > destsize) return 0;
+    write_const_frame(src, 1, nbytes, dest, destsize);
+    d[1] = STORED_FRAME_KIND;
+    memcpy(d + CONST_FRAME_HEADER, src, nbytes);
+    return CONST_FRAME_HEADER + nbytes;
+}
+
+/* Whether `src` is a stored frame, with its chunk size in `nbytes` */
+static int read_stored_frame(size_t cd_nelmts, const unsigned cd_values[],
+                             const void *src, size_t srcsize, size_t *nbytes){
+
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned long long n = 0;
+    int i;
+
+    if (!has_checksum(cd_nelmts, cd_values) || srcsize < CONST_FRAME_HEADER ||
+        s[0] != CONST_FRAME_MARKER || s[1] != STORED_FRAME_KIND) return 0;
+    for (i = 0; i < 8; i++) n |= (unsigned long long)s[4 + i] << (8 * i);
+    if (n != srcsize - CONST_FRAME_HEADER) return 0;
+    *nbytes = (size_t)n;
+    return 1;
+}
+
+/* Checksums are the CRC-32C of the stored chunk, appended to it in
+   CHECKSUM_SIZE bytes, little endian.  They cover the compressed bytes,
+   which are fewer to go through than the data itself. */
+#define CHECKSUM_SIZE 4
+
+static void append_checksum(void *dest, size_t *cbytes){
+
+    unsigned char *d = (unsigned char *)dest + *cbytes;
+    uint32_t crc = blosc_kernel_crc32c(dest, *cbytes);
+    int i;
+
+    for (i = 0; i < CHECKSUM_SIZE; i++) d[i] = (unsigned char)(crc >> (8 * i));
+    *cbytes += CHECKSUM_SIZE;
+}
+
+/* Take the checksum off the end of a chunk of a dataset with checksums,
+   checking it first when `verify` is set.  Returns -2 on a mismatch. */
+static int strip_checksum(size_t cd_nelmts, const unsigned cd_values[],
+                          const void *src, size_t *srcsize, int verify){
+
+    const unsigned char *s = (const unsigned char *)src;
+    uint32_t crc = 0;
+    int i;
+
+    if (!has_checksum(cd_nelmts, cd_values)) return 0;
+    if (*srcsize < CHECKSUM_SIZE) return -1;
+    *srcsize -= CHECKSUM_SIZE;
+    if (!verify) return 0;
+    for (i = 0; i < CHECKSUM_SIZE; i++) {
+        crc |= (uint32_t)s[*srcsize + i] << (8 * i);
+    }
+    return blosc_kernel_crc32c(src, *srcsize) == crc ? 0 : -2;
+}
+
+
+/* Compress a chunk once the pre-filters have run, with the same return
+   values as blosc_filter_encode() */
+static int compress_chunk(blosc_params_t *params, const void *src,
+                          size_t nbytes, void *dest, size_t destsize,
+                          size_t *cbytes){
+
+    int status;
+
+#ifdef HAVE_ZSTD_DICT
+    /* With a dictionary, zstd is the codec of every chunk */
+    if (params->dictsize > 0) {
+        return blosc_filter_dict_encode(params, src, nbytes, dest, destsize,
+                                        cbytes);
+    }
+#endif
+
+    /* When asked to, first compress a few samples of the chunk and give
+       up right away if they do not compress well enough; the chunk is
+       then stored uncompressed just as if Blosc had tried. */
+#if !( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+    if (params->min_ratio > 0 && !worth_compressing(params, nbytes, src)) {
+        return 1;
+    }
+
+    /* Under an adaptive policy, the codec is chosen per chunk; Blosc
+       records it in the chunk header, so decoding needs nothing more. */
+    if (params->policy != FILTER_BLOSC_POLICY_NONE) {
+        status = choose_codec(params, nbytes, src, dest, destsize, cbytes);
+        if (status < 0) return -1;
+        if (status > 0) return *cbytes > 0 ? 0 : 1;
+    }
+#endif
+
+    if (params->nfields > 0) {
+        return blosc_filter_fields_encode(params, src, nbytes, dest, destsize,
+                                          cbytes);
+    }
+
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+    status = blosc_compress(params->clevel, params->doshuffle,
+                            params->typesize, nbytes, src, dest, destsize);
+#else
+    /* Starting from Blosc 1.5 on, there is not an internal global
+       lock anymore, so the number of threads can be chosen per call.
+       It defaults to 1 so as to not interfering with other possible
+       threads launched by the main Python application */
+    status = blosc_compress_ctx(params->clevel, params->doshuffle,
+                                params->typesize, nbytes, src, dest, destsize,
+                                params->compname, params->blocksize,
+                                params->nthreads);
+#endif
+    if (status < 0) return -1;
+    if (status == 0) return 1;    /* Does not fit in dest */
+    *cbytes = (size_t)status;
+    return 0;
+}
+
+
+/* Chunk codec, see blosc_filter_internal.h */
+
+int blosc_filter_encode(size_t cd_nelmts, const unsigned cd_values[],
+                        int nthreads, void *src, size_t nbytes,
+                        void *dest, size_t destsize, size_t *cbytes){
+
+    blosc_params_t params;
+    size_t room;
+    int status;
+
+    if (get_params(cd_nelmts, cd_values, nthreads, &params) < 0) return -1;
+    if (params.checksum) {
+        if (destsize <= CHECKSUM_SIZE) return 1;
+        destsize -= CHECKSUM_SIZE;
+    }
+    /* Whatever room dest has past the chunk size is only for frames */
+    room = destsize < nbytes ? destsize : nbytes;
+
+    /* Lossy precision trimming comes first, so that everything after it
+       sees the data as it will be read back */
+    if (params.trim_bits > 0) {
+        blosc_kernel_trim(src, nbytes, params.typesize, params.trim_bits);
+    }
+
+    /* Chunks holding a single value (zeros above all) skip Blosc */
+    if (has_const_frames(cd_values) &&
+        blosc_kernel_is_constant(src, nbytes, params.typesize)) {
+        *cbytes = write_const_frame(src, params.typesize, nbytes, dest,
+                                    room);
+        status = *cbytes > 0 ? 0 : 1;
+    } else {
+        /* Delta coding runs before Blosc shuffles, in Blosc blocks, and is
+           undone when the chunk ends up stored as is */
+        if (params.delta) {
+            blosc_kernel_delta_encode(src, nbytes, params.typesize,
+                                      params.blocksize);
+        }
+        status = compress_chunk(&params, src, nbytes, dest, room, cbytes);
+        if (status != 0 && params.delta) {
+            blosc_kernel_delta_decode(src, nbytes, params.typesize,
+                                      params.blocksize);
+        }
+    }
+
+    if (params.checksum && status == 1) {
+        *cbytes = write_stored_frame(src, nbytes, dest, destsize);
+        status = *cbytes > 0 ? 0 : 1;
+    }
+    if (params.checksum && status == 0) append_checksum(dest, cbytes);
+    return status;
+}
+
+size_t blosc_filter_encode_bound(size_t cd_nelmts, const unsigned cd_values[],
+                                 size_t nbytes){
+    if (!has_checksum(cd_nelmts, cd_values)) return nbytes;
+    return nbytes + CONST_FRAME_HEADER + CHECKSUM_SIZE;
+}
+
+/* The decoders below work on chunks whose checksum, if any, is off */
+
+static int frame_decoded_size(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t *nbytes){
+
+    size_t cbytes, blocksize, dictsize, nfields;
+    const unsigned *dict, *fields;
+
+    if (read_const_frame(cd_values, src, srcsize, nbytes) > 0) return 0;
+    if (read_stored_frame(cd_nelmts, cd_values, src, srcsize, nbytes)) {
+        return 0;
+    }
+    if (get_fields(cd_nelmts, cd_values, &fields, &nfields)) {
+        return blosc_filter_fields_decoded_size(src, srcsize, nbytes);
+    }
+    if (get_dict(cd_nelmts, cd_values, &dict, &dictsize)) {
+#ifdef HAVE_ZSTD_DICT
+        return blosc_filter_dict_decoded_size(src, srcsize, nbytes);
+#else
+        return -1;
+#endif
+    }
+    if (srcsize < BLOSC_MAX_OVERHEAD) return -1;
+    blosc_cbuffer_sizes(src, nbytes, &cbytes, &blocksize);
+    if (cbytes > srcsize) return -1;
+    return 0;
+}
+
+static int decode_frame(size_t cd_nelmts, const unsigned cd_values[],
+                        int nthreads, const void *src, size_t srcsize,
+                        void *dest, size_t destsize){
+
+    size_t nbytes, typesize, blocksize, dictsize, nfields;
+    const unsigned *dict, *fields;
+    int status;
+
+    if (frame_decoded_size(cd_nelmts, cd_values, src, srcsize,
+                           &nbytes) < 0 || nbytes > destsize) {
+        return -1;
+    }
+    typesize = read_const_frame(cd_values, src, srcsize, &nbytes);
+    if (typesize > 0) {
+        blosc_kernel_fill(dest, nbytes, (const char *)src + CONST_FRAME_HEADER,
+                          typesize);
+        return 0;
+    }
+    if (read_stored_frame(cd_nelmts, cd_values, src, srcsize, &nbytes)) {
+        memcpy(dest, (const char *)src + CONST_FRAME_HEADER, nbytes);
+        return 0;
+    }
+    if (nthreads <= 0) nthreads = get_nthreads(cd_nelmts, cd_values);
+
+    if (get_fields(cd_nelmts, cd_values, &fields, &nfields)) {
+        if (fields == NULL || blosc_filter_fields_decode(fields, nfields,
+                                                         nthreads, src,
+                                                         srcsize, dest,
+                                                         nbytes) < 0) {
+            return -1;
+        }
+    } else if (get_dict(cd_nelmts, cd_values, &dict, &dictsize)) {
+#ifdef HAVE_ZSTD_DICT
+        if (dict == NULL || blosc_filter_dict_decode(dict, dictsize, src,
+                                                     srcsize, dest,
+                                                     nbytes) < 0) return -1;
+#else
+        return -1;
+#endif
+    } else {
+#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+        (void)nthreads;
+        status = blosc_decompress(src, dest, destsize);
+#else
+        /* See the note on threads in blosc_filter_encode() */
+        status = blosc_decompress_ctx(src, dest, destsize, nthreads);
+#endif
+        if (status < 0 || (size_t)status != nbytes) return -1;
+    }
+
+    if (get_delta(cd_nelmts, cd_values, &typesize, &blocksize)) {
+        blosc_kernel_delta_decode(dest, nbytes, typesize, blocksize);
+    }
+    return 0;
+}
+
+/* Decompress the bytes [offset, offset + nbytes) of a chunk as Blosc
+   stored them, i.e. before undoing delta coding */
+static int decode_stored_range(size_t cd_nelmts, const unsigned cd_values[],
+                               const void *src, size_t srcsize,
+                               size_t offset, size_t nbytes, void *dest){
+
+    size_t typesize, dictsize, nfields, total, capacity;
+    const unsigned *dict, *fields;
+    char *buf;
+    int flags, status;
+
+    /* Field-split chunks decode as a whole, one field after the other */
+    if (get_fields(cd_nelmts, cd_values, &fields, &nfields)) {
+        if (fields == NULL ||
+            blosc_filter_fields_decoded_size(src, srcsize, &total) < 0) {
+            return -1;
+        }
+        buf = blosc_filter_buffer_get(total, &capacity);
+        if (buf == NULL) return -1;
+        status = blosc_filter_fields_decode(fields, nfields, 1, src, srcsize,
+                                            buf, total);
+        if (status == 0) memcpy(dest, buf + offset, nbytes);
+        blosc_filter_buffer_put(buf, capacity);
+        return status;
+    }
+
+    /* Zstd frames only decode as a whole */
+    if (get_dict(cd_nelmts, cd_values, &dict, &dictsize)) {
+#ifdef HAVE_ZSTD_DICT
+        if (dict == NULL ||
+            blosc_filter_dict_decoded_size(src, srcsize, &total) < 0) {
+            return -1;
+        }
+        buf = blosc_filter_buffer_get(total, &capacity);
+        if (buf == NULL) return -1;
+        status = blosc_filter_dict_decode(dict, dictsize, src, srcsize, buf,
+                                          total);
+        if (status == 0) memcpy(dest, buf + offset, nbytes);
+        blosc_filter_buffer_put(buf, capacity);
+        return status;
+#else
+        return -1;
+#endif
+    }
+    (void)srcsize;
+    blosc_cbuffer_metainfo(src, &typesize, &flags);
+    if (typesize == 0 || offset % typesize != 0 || nbytes % typesize != 0) {
+        return -1;
+    }
+
+    /* Only the blocks holding the items asked for get decompressed */
+    status = blosc_getitem(src, (int)(offset / typesize),
+                           (int)(nbytes / typesize), dest);
+    return status < 0 ? -1 : 0;
+}
+
+static int decode_frame_range(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t offset, size_t nbytes, void *dest){
+
+    size_t total, typesize, blocksize, start, capacity;
+    char *buf;
+    int r;
+
+    if (frame_decoded_size(cd_nelmts, cd_values, src, srcsize,
+                           &total) < 0 || offset + nbytes > total) {
+        return -1;
+    }
+    typesize = read_const_frame(cd_values, src, srcsize, &total);
+    if (typesize > 0) {
+        if (offset % typesize != 0) return -1;
+        blosc_kernel_fill(dest, nbytes, (const char *)src + CONST_FRAME_HEADER,
+                          typesize);
+        return 0;
+    }
+    if (read_stored_frame(cd_nelmts, cd_values, src, srcsize, &total)) {
+        memcpy(dest, (const char *)src + CONST_FRAME_HEADER + offset, nbytes);
+        return 0;
+    }
+    if (!get_delta(cd_nelmts, cd_values, &typesize, &blocksize)) {
+        return decode_stored_range(cd_nelmts, cd_values, src, srcsize, offset,
+                                   nbytes, dest);
+    }
+
+    /* Delta coded items only decode from the start of their block */
+    if (typesize == 0) return -1;
+    blocksize -= blocksize % typesize;
+    if (blocksize == 0) blocksize = total;
+    start = offset - offset % blocksize;
+    if (start == offset) {
+        r = decode_stored_range(cd_nelmts, cd_values, src, srcsize, offset,
+                                nbytes, dest);
+        if (r == 0) {
+            blosc_kernel_delta_decode(dest, nbytes, typesize, blocksize);
+        }
+        return r;
+    }
+    buf = blosc_filter_buffer_get(offset + nbytes - start, &capacity);
+    if (buf == NULL) return -1;
+    r = decode_stored_range(cd_nelmts, cd_values, src, srcsize, start,
+                            offset + nbytes - start, buf);
+    if (r == 0) {
+        blosc_kernel_delta_decode(buf, offset + nbytes - start, typesize,
+                                  blocksize);
+        memcpy(dest, buf + (offset - start), nbytes);
+    }
+    blosc_filter_buffer_put(buf, capacity);
+    return r;
+}
+
+/* Filters running before Blosc may hand it more than the chunk size of
+   the dataset, but not much more */
+#define MAX_CHUNK_GROWTH 2
+#define CHUNK_GROWTH_SLACK 4096
+
+/* Whether a chunk of `nbytes` is one to believe a header about: it must
+   fit in an HDF5 chunk and, when the chunk size of the dataset is known,
+   in MAX_CHUNK_GROWTH times that.  The memory budget is left out, as it
+   only covers the buffers of the direct chunk functions. */
+static int sane_decoded_size(size_t cd_nelmts, const unsigned cd_values[],
+                             size_t nbytes){
+
+    unsigned long long chunksize = cd_nelmts >= 4 ? cd_values[3] : 0;
+
+    if ((unsigned long long)nbytes > 0xffffffffULL) return 0;
+    return chunksize == 0 || (unsigned long long)nbytes <=
+           MAX_CHUNK_GROWTH * chunksize + CHUNK_GROWTH_SLACK;
+}
+
+int blosc_filter_decoded_size(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t *nbytes){
+
+    if (strip_checksum(cd_nelmts, cd_values, src, &srcsize, 0) < 0) return -1;
+    if (frame_decoded_size(cd_nelmts, cd_values, src, srcsize, nbytes) < 0) {
+        return -1;
+    }
+    return sane_decoded_size(cd_nelmts, cd_values, *nbytes) ? 0 : -2;
+}
+
+int blosc_filter_decode(size_t cd_nelmts, const unsigned cd_values[],
+                        int nthreads, const void *src, size_t srcsize,
+                        void *dest, size_t destsize){
+
+    int r = strip_checksum(cd_nelmts, cd_values, src, &srcsize, 1);
+
+    if (r < 0) return r;
+    return decode_frame(cd_nelmts, cd_values, nthreads, src, srcsize, dest,
+                        destsize);
+}
+
+int blosc_filter_decode_range(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t offset, size_t nbytes, void *dest){
+
+    int r = strip_checksum(cd_nelmts, cd_values, src, &srcsize, 1);
+
+    if (r < 0) return r;
+    return decode_frame_range(cd_nelmts, cd_values, src, srcsize, offset,
+                              nbytes, dest);
+}
+
+int blosc_filter_decode_fields(size_t cd_nelmts, const unsigned cd_values[],
+                               const void *src, size_t srcsize,
+                               size_t nsel, const size_t *sel,
+                               void *const *columns){
+
+    size_t nfields, nbytes;
+    const unsigned *fields;
+    int r = strip_checksum(cd_nelmts, cd_values, src, &srcsize, 1);
+
+    if (r < 0) return r;
+    if (!get_fields(cd_nelmts, cd_values, &fields, &nfields) ||
+        blosc_filter_fields_decoded_size(src, srcsize, &nbytes) < 0) {
+        return 1;
+    }
+    if (fields == NULL) return -1;
+    return blosc_filter_fields_decode_columns(fields, nfields, src, srcsize,
+                                              nsel, sel, columns);
+}
+
+
+/* The codec a stored chunk was compressed with, for the stats and the
+   traces: the one in its Blosc header, as the adaptive policies pick it
+   per chunk, or `codec` (the one of the dataset) for the frames that are
+   not a single Blosc stream */
+static const char *stored_codec(size_t cd_nelmts, const unsigned cd_values[],
+                                const void *src, size_t srcsize,
+                                const char *codec){
+
+#if !( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
+    const unsigned *layout;
+    const char *name;
+    size_t typesize, n;
+    int flags;
+
+    if (codec == NULL || srcsize < BLOSC_MAX_OVERHEAD ||
+        get_fields(cd_nelmts, cd_values, &layout, &n) ||
+        get_dict(cd_nelmts, cd_values, &layout, &n)) return codec;
+    if (((const unsigned char *)src)[0] == CONST_FRAME_MARKER &&
+        (has_const_frames(cd_values) || has_checksum(cd_nelmts, cd_values))) {
+        return codec;
+    }
+    blosc_cbuffer_metainfo(src, &typesize, &flags);
+    if (blosc_compcode_to_compname(flags >> 5, &name) < 0) return codec;
+    return name;
+#else
+    (void)cd_nelmts;
+    (void)cd_values;
+    (void)src;
+    (void)srcsize;
+    return codec;
+#endif
+}
+
+
+/* Copy into `dest` the chunk at `src` if blosc_write_chunks_mpi()
+   compressed it ahead, and return 0; return 1 if it didn't, or without
+   collective writes. */
+static int take_prepared(size_t cd_nelmts, const unsigned cd_values[],
+                         const void *src, size_t nbytes, void *dest,
+                         size_t destsize, size_t *cbytes){
+#if defined(FILTER_BLOSC_MPI_WRITES)
+    return blosc_mpi_take_prepared(cd_nelmts, cd_values, src, nbytes, dest,
+                                   destsize, cbytes);
+#else
+    (void)cd_nelmts;
+    (void)cd_values;
+    (void)src;
+    (void)nbytes;
+    (void)dest;
+    (void)destsize;
+    (void)cbytes;
+    return 1;
+#endif
+}
+
 /* The filter function */
 size_t blosc_filter(unsigned flags, size_t cd_nelmts,
                     const unsigned cd_values[], size_t nbytes,
@@ -169,97 +1423,117 @@ size_t blosc_filter(unsigned flags, size_t cd_nelmts,
 
     void* outbuf = NULL;
     int status = 0;                /* Return code from Blosc routines */
-    size_t typesize;
     size_t outbuf_size;
-    int clevel = 5;                /* Compression level default */
-    int doshuffle = 1;             /* Shuffle default */
-    int compcode;                  /* Blosc compressor */
-    int code;
-    char *compname = "blosclz";    /* The compressor by default */
-    char *complist;
+    size_t outbuf_capacity = 0;    /* Real size of outbuf */
+    blosc_params_t params;
+    const char *compname;
+    const char *complist;
     char errmsg[256];
+    double start = blosc_stats_now();
+    blosc_filter_trace_event_t event;
+    int reverse = (flags & H5Z_FLAG_REVERSE) != 0;
+    const char *codec;
+    int traced, outcome = -1;    /* For the end of the trace */
 
-    /* Filter params that are always set */
-    typesize = cd_values[2];      /* The datatype size */
     outbuf_size = cd_values[3];   /* Precomputed buffer guess */
-    /* Optional params */
-    if (cd_nelmts >= 5) {
-        clevel = cd_values[4];        /* The compression level */
+
+    status = get_params(cd_nelmts, cd_values, 0, &params);
+    codec = status >= 0 ? params.compname : NULL;
+    traced = blosc_trace_begin(&event, reverse, cd_nelmts, cd_values, codec,
+                               reverse ? 0 : nbytes, reverse ? nbytes : 0,
+                               start);
+    if (status == -2) {
+        PUSH_ERR("blosc_filter", H5E_CALLBACK,
+                 "this build of the filter does not support the zstd "
+                 "dictionary of the dataset (cd_values[16]), or it is "
+                 "truncated");
+        goto failed;
     }
-    if (cd_nelmts >= 6) {
-        doshuffle = cd_values[5];     /* Shuffle? */
+    if (status == -3) {
+        PUSH_ERR("blosc_filter", H5E_CALLBACK,
+                 "the field layout of the dataset (cd_values[19] and "
+                 "after) is truncated");
+        goto failed;
     }
-    if (cd_nelmts >= 7) {
-        compcode = cd_values[6];     /* The Blosc compressor used */
-	/* Check that we actually have support for the compressor code */
-        complist = blosc_list_compressors();
-	code = blosc_compcode_to_compname(compcode, &compname);
-	if (code == -1) {
+
+    /* We're compressing */
+    if(!(flags & H5Z_FLAG_REVERSE)){
+
+#ifdef BLOSC_DEBUG
+        fprintf(stderr, "Blosc: Compress %zd chunk w/buffer %zd\n",
+		nbytes, outbuf_size);
+#endif
+
+        if (status < 0) {
+            complist = blosc_list_compressors();
+            compname = params.compname != NULL ? params.compname : "unknown";
 #if H5Epush_vers == 2
             PUSH_ERR("blosc_filter", H5E_CALLBACK,
                      "this Blosc library does not have support for "
                      "the '%s' compressor, but only for: %s",
                      compname, complist);
+            (void)errmsg;
 #else
 	    sprintf(errmsg, "this Blosc library does not have support for "
                     "the '%s' compressor, but only for: %s",
 		    compname, complist);
             PUSH_ERR("blosc_filter", H5E_CALLBACK, errmsg);
-            goto failed;
-#endif
-	}
-    }
-
-    /* We're compressing */
-    if(!(flags & H5Z_FLAG_REVERSE)){
-
-#ifdef BLOSC_DEBUG
-        fprintf(stderr, "Blosc: Compress %zd chunk w/buffer %zd\n",
-		nbytes, outbuf_size);
 #endif
+            goto failed;
+        }
 
         /* Allocate an output buffer exactly as long as the input data; if
            the result is larger, we simply return 0.  The filter is flagged
            as optional, so HDF5 marks the chunk as uncompressed and
-           proceeds.
+           proceeds.  The buffer comes from the thread's pool, which is
+           mostly fed with the chunk-sized input buffers of earlier calls.
+           With checksums, chunks are never left uncompressed, and the
+           buffer gets room for the frame they are stored in otherwise.
         */
 
-        outbuf_size = (*buf_size);
-        outbuf = malloc(outbuf_size);
+        outbuf_size = blosc_filter_encode_bound(cd_nelmts, cd_values, nbytes);
+        if (outbuf_size < *buf_size) outbuf_size = *buf_size;
+        outbuf = blosc_filter_buffer_get(outbuf_size, &outbuf_capacity);
 
         if(outbuf == NULL){
+            blosc_stats_alloc_failure();
             PUSH_ERR("blosc_filter", H5E_CALLBACK,
                      "Can't allocate compression buffer");
             goto failed;
         }
 
-#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
-        status = blosc_compress(clevel, doshuffle, typesize, nbytes,
-                                *buf, outbuf, nbytes);
-#else
-        /* Starting from Blosc 1.5 on, there is not an internal global
-	   lock anymore, so do not try to run in multithreading mode
-	   so as to not interfering with other possible threads
-	   launched by the main Python application */
-        status = blosc_compress_ctx(clevel, doshuffle, typesize, nbytes,
-                                    *buf, outbuf, nbytes, compname, 0, 1);
-#endif
+        status = take_prepared(cd_nelmts, cd_values, *buf, nbytes, outbuf,
+                               outbuf_capacity, &outbuf_size);
+        if (status > 0) {
+            status = blosc_filter_encode(cd_nelmts, cd_values, 0, *buf,
+                                         nbytes, outbuf,
+                                         blosc_filter_encode_bound(cd_nelmts,
+                                                                   cd_values,
+                                                                   nbytes),
+                                         &outbuf_size);
+        }
         if (status < 0) {
           PUSH_ERR("blosc_filter", H5E_CALLBACK, "Blosc compression error");
           goto failed;
         }
+        if (status == 0) {
+            codec = stored_codec(cd_nelmts, cd_values, outbuf, outbuf_size,
+                                 codec);
+        }
+        if (status > 0) {               /* Not compressible */
+            blosc_stats_record(0, codec, nbytes, nbytes,
+                               blosc_stats_now() - start, 1);
+            outcome = 1;
+            goto failed;
+        }
 
     /* We're decompressing */
     } else {
-        /* declare dummy variables */
-        size_t cbytes, blocksize;
 
 #ifdef BLOSC_DEBUG
         fprintf(stderr, "Blosc: Decompress %zd chunk w/buffer %zd\n", nbytes, outbuf_size);
 #endif
 
-        free(outbuf);
-
         /* Extract the exact outbuf_size from the buffer header.
          *
          * NOTE: the guess value got from "cd_values" corresponds to the
@@ -267,41 +1541,61 @@ size_t blosc_filter(unsigned flags, size_t cd_nelmts,
          * cases since other filters in the pipeline can modify the buffere
          *  size.
          */
-        blosc_cbuffer_sizes(*buf, &outbuf_size, &cbytes, &blocksize);
+        status = blosc_filter_decoded_size(cd_nelmts, cd_values, *buf,
+                                           nbytes, &outbuf_size);
+        if (status == -2) {
+          PUSH_ERR("blosc_filter", H5E_CALLBACK,
+                   "Blosc chunk header claims more bytes than the chunk "
+                   "size of the dataset or the memory budget allow");
+          goto failed;
+        }
+        if (status < 0) {
+          PUSH_ERR("blosc_filter", H5E_CALLBACK, "Corrupted Blosc chunk header");
+          goto failed;
+        }
+        codec = stored_codec(cd_nelmts, cd_values, *buf, nbytes, codec);
 
-        outbuf = malloc(outbuf_size);
+        outbuf = blosc_filter_buffer_get(outbuf_size, &outbuf_capacity);
 
         if(outbuf == NULL){
+          blosc_stats_alloc_failure();
           PUSH_ERR("blosc_filter", H5E_CALLBACK, "Can't allocate decompression buffer");
           goto failed;
         }
 
-#if ( (BLOSC_VERSION_MAJOR <= 1) && (BLOSC_VERSION_MINOR < 5) )
-	status = blosc_decompress(*buf, outbuf, outbuf_size);
-#else
-        /* Starting from Blosc 1.5 on, there is not an internal global
-	   lock anymore, so do not try to run in multithreading mode
-	   so as to not interfering with other possible threads
-	   launched by the main Python application */
-        status = blosc_decompress_ctx(*buf, outbuf, outbuf_size, 1);
-#endif
-
-        if(status <= 0){    /* decompression failed */
+        status = blosc_filter_decode(cd_nelmts, cd_values, 0, *buf, nbytes,
+                                     outbuf, outbuf_size);
+        if (status == -2) {
+          PUSH_ERR("blosc_filter", H5E_CALLBACK, "Blosc chunk checksum mismatch");
+          goto failed;
+        }
+        if (status < 0) {
           PUSH_ERR("blosc_filter", H5E_CALLBACK, "Blosc decompression error");
           goto failed;
-        } /* if !status */
+        }
 
     } /* compressing vs decompressing */
 
-    if(status != 0){
-        free(*buf);
-        *buf = outbuf;
-        *buf_size = outbuf_size;
-        return status;  /* Size of compressed/decompressed data */
+    blosc_stats_record(reverse, codec, nbytes, outbuf_size,
+                       blosc_stats_now() - start, 0);
+    if (traced) {
+        blosc_trace_end(&event, codec, reverse ? outbuf_size : nbytes,
+                        reverse ? nbytes : outbuf_size, 0);
     }
 
+    /* Recycle the input buffer instead of freeing it.  Sizes are kept in
+       size_t all along. */
+    blosc_filter_buffer_put(*buf, *buf_size);
+    *buf = outbuf;
+    *buf_size = outbuf_capacity;
+    return outbuf_size;  /* Size of compressed/decompressed data */
+
  failed:
-    free(outbuf);
+    blosc_filter_buffer_put(outbuf, outbuf_capacity);
+    if (traced) {
+        blosc_trace_end(&event, codec, nbytes, outcome > 0 ? nbytes : 0,
+                        outcome);
+    }
     return 0;
 
 } /* End filter function */
@@ -5,18 +5,358 @@
 extern "C" {
 #endif
 
+#include "hdf5.h"
 #include "blosc.h"
 
 /* Filter revision number, starting at 1 */
 /* #define FILTER_BLOSC_VERSION 1 */
-#define FILTER_BLOSC_VERSION 2	/* multiple compressors since Blosc 1.3 */
+/* #define FILTER_BLOSC_VERSION 2 */	/* multiple compressors since Blosc 1.3 */
+#define FILTER_BLOSC_VERSION 3	/* constant chunks stored as a tiny frame */
 
 /* Filter ID registered with the HDF Group */
 #define FILTER_BLOSC 32001
 
+/* Value for the blocksize slot (cd_values[9]) asking blosc_set_local()
+   to derive the blocksize from the chunk shape and the cache size */
+#define FILTER_BLOSC_BLOCKSIZE_AUTO 1
+
+/* Value for the shuffle slot (cd_values[5]) asking blosc_set_local() to
+   choose the shuffle from the datatype: none for 1-byte types, bit
+   shuffle for floating point and byte shuffle for the rest.  This is
+   also what happens when the slot is not given. */
+#define FILTER_BLOSC_SHUFFLE_AUTO 0xff
+
+/* Values for the policy slot (cd_values[12]), choosing the codec of each
+   chunk from samples of it.  With FILTER_BLOSC_POLICY_RATIO, lz4hc and
+   then zstd are tried when the codec of the dataset does not reach the
+   ratio in cd_values[13] (in hundredths); with FILTER_BLOSC_POLICY_SPEED
+   the best ratio compressing at least at cd_values[13] MB/s wins, and lz4
+   replaces a codec of the dataset slower than that. */
+#define FILTER_BLOSC_POLICY_NONE 0
+#define FILTER_BLOSC_POLICY_RATIO 1
+#define FILTER_BLOSC_POLICY_SPEED 2
+
+/* Value for the delta slot (cd_values[15]) asking for the items of each
+   Blosc block to be replaced by their differences before shuffling.  It
+   only applies to native integers of 1, 2, 4 or 8 bytes, and suits
+   counters and timestamps that grow slowly. */
+#define FILTER_BLOSC_DELTA 1
+
+/* Largest zstd dictionary, whose size goes in cd_values[16] and which is
+   stored in the cd_values from cd_values[32] on (see
+   blosc_filter_train_dict()) */
+#define FILTER_BLOSC_MAX_DICT_SIZE (32 * 1024)
+
+/* Value for the checksum slot (cd_values[17]) asking for a CRC-32C of
+   each stored chunk, checked on every read.  It is computed over the
+   compressed bytes as they are written, which makes it cheaper than the
+   fletcher32 filter of HDF5, a separate pass over the uncompressed
+   chunk. */
+#define FILTER_BLOSC_CHECKSUM_CRC32C 1
+
+/* Value for the field split slot (cd_values[18]) asking for each member
+   of the records of a compound dataset to be compressed as a stream of
+   its own, shuffled with the size of the member, so that reading a few
+   members (see blosc_read_fields()) only decompresses their streams.
+   blosc_set_local() turns it off for other types and for compounds of
+   more than FILTER_BLOSC_MAX_FIELDS fields (padding between members
+   counts as a field), and stores the fields from cd_values[32] on. */
+#define FILTER_BLOSC_SPLIT_FIELDS 1
+#define FILTER_BLOSC_MAX_FIELDS 64
+
 /* Register the filter with the library */
 int register_blosc(char **version, char **date);
 
+/* Set the number of threads Blosc uses per chunk for the whole process,
+   overriding the per-dataset value in cd_values[7].  The override starts
+   out as the HDF5_BLOSC_NTHREADS environment variable, and this replaces
+   it from then on, whether called before or after the first chunk; pass
+   0 to remove it, going back to cd_values[7].  Can be called from any
+   thread.  Returns the previous override (0 if none). */
+int blosc_filter_set_nthreads(int nthreads);
+
+/* Set up the worker threads shared by the direct chunk functions, the
+   tools and blosc_filter(): `nthreads` of them (-1, the default, for
+   one per processor, 0 to run every job in the calling thread instead,
+   for applications with thread pools of their own), pinned each to one
+   of the CPUs in `cpus`, a list like "0-7,16-23" (NULL to only keep
+   them on their NUMA node).  The HDF5_BLOSC_WORKERS and
+   HDF5_BLOSC_WORKER_CPUS environment variables set the same before the
+   first call.  The `nthreads` given to each function then caps how
+   many of these threads it uses at once.  Threads start on first use;
+   fails while some call is using them.  Returns a negative value on
+   errors. */
+int blosc_filter_set_workers(int nthreads, const char *cpus);
+
+/* Set how many bytes of recycled chunk buffers each thread may keep
+   around (64 MB by default, or the HDF5_BLOSC_POOL_BYTES environment
+   variable).  Pass 0 to disable buffer recycling.  Returns the previous
+   limit. */
+size_t blosc_filter_set_pool_limit(size_t nbytes);
+
+/* Set a budget of bytes for the chunk buffers the direct chunk
+   functions and the tools have in flight, for the whole process (none
+   by default, or the HDF5_BLOSC_MEMORY_BUDGET environment variable).
+   Calls wait for others to give memory back rather than go over it,
+   and run with fewer chunks in flight when they can.  The filter also
+   refuses chunks whose header claims more than the budget.  Pass 0 to
+   remove it.  Returns the previous budget (0 if none). */
+size_t blosc_filter_set_memory_budget(size_t nbytes);
+
+/* Bytes of the budget in flight now, and the most there has been since
+   the last call with `reset` */
+void blosc_filter_get_memory(size_t *in_flight, size_t *peak, int reset);
+
+/* Use the data kernels (constant detection, trimming, delta coding and
+   shuffling) built for instruction set `isa`: "generic", "avx2" or
+   "avx512" on x86-64, "neon" on ARM64.  NULL picks the best the CPU has,
+   which is what is used by default, unless the HDF5_BLOSC_ISA
+   environment variable names another.  Meant for benchmarks and tests,
+   before the filter is used.  Returns a negative value if the CPU or
+   the build lacks it. */
+int blosc_filter_set_isa(const char *isa);
+
+/* The instruction set of the data kernels in use */
+const char *blosc_filter_get_isa(void);
+
+/* Train a zstd dictionary of at most `dictsize` bytes (0 for
+   FILTER_BLOSC_MAX_DICT_SIZE) on `nbytes` bytes of sample data of
+   `type`, cut in chunks of the chunk shape of `dcpl`, and store it in the
+   Blosc filter of `dcpl`, which must be set already.  The chunks of
+   datasets created with `dcpl` are then compressed with zstd and the
+   dictionary, which pays off for chunks of a few KB.  Only available when
+   the filter is built with zstd dictionaries (HAVE_ZSTD_DICT).  Returns a
+   negative value on errors. */
+int blosc_filter_train_dict(hid_t dcpl, hid_t type, const void *samples,
+                            size_t nbytes, size_t dictsize);
+
+/* Performance counters of blosc_filter(), kept for the whole process.
+   Bytes in and out are the sizes of the chunks handed to the filter and
+   returned by it (an incompressible chunk "comes out" at its full size).
+   Setting the HDF5_BLOSC_STATS environment variable prints them to
+   stderr at exit. */
+
+/* Bins of the compression ratio histogram, with lower bounds 0, 1.25,
+   1.5, 2, 3, 4, 8 and 16 */
+#define FILTER_BLOSC_RATIO_BINS 8
+
+typedef struct {
+    unsigned long long chunks;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    double seconds;             /* Wall time spent in the filter */
+} blosc_filter_direction_stats_t;
+
+typedef struct {
+    blosc_filter_direction_stats_t compress;
+    blosc_filter_direction_stats_t decompress;
+    unsigned long long incompressible;  /* Chunks stored uncompressed */
+    unsigned long long alloc_failures;
+    unsigned long long ratio_hist[FILTER_BLOSC_RATIO_BINS];
+} blosc_filter_stats_t;
+
+/* Get a snapshot of the counters, each read atomically; a call being
+   accounted meanwhile may be only partly in it */
+void blosc_filter_get_stats(blosc_filter_stats_t *stats);
+
+/* Set all the counters back to zero, latency histograms included */
+void blosc_filter_reset_stats(void);
+
+/* Latency histograms of blosc_filter(), kept with the counters for each
+   compressor and direction.  Bins are log-linear, HDR style: 1 us wide
+   up to 32 us, then 16 per power of two, i.e. within 1/16 of the value,
+   the last one holding everything from about 65 s on. */
+#define FILTER_BLOSC_LATENCY_BINS 368
+
+/* Compressors with a histogram of their own; those seen after the first
+   ones share the last */
+#define FILTER_BLOSC_MAX_CODECS 8
+
+typedef struct {
+    unsigned long long count;
+    double max_seconds;
+    unsigned long long bins[FILTER_BLOSC_LATENCY_BINS];
+} blosc_filter_latency_t;
+
+/* Get the histogram of the calls compressing (or, with `reverse`,
+   decompressing) with `codec` ("blosclz", "lz4", ...), or with any of
+   them for NULL.  A codec never used gets an empty histogram. */
+void blosc_filter_get_latency(const char *codec, int reverse,
+                              blosc_filter_latency_t *hist);
+
+/* Lower bound of the latency bin `bin`, in seconds */
+double blosc_filter_latency_bound(int bin);
+
+/* The latency, in seconds, that a fraction `q` (e.g. 0.99) of the calls
+   in `hist` did not exceed, as the upper bound of its bin */
+double blosc_filter_latency_quantile(const blosc_filter_latency_t *hist,
+                                     double q);
+
+/* Tracing of blosc_filter(): a callback is called at the beginning and
+   at the end of every call, from the thread making it.  When no callback
+   is set, which is the default, tracing costs a flag check per chunk. */
+#define FILTER_BLOSC_TRACE_BEGIN 0
+#define FILTER_BLOSC_TRACE_END 1
+
+typedef struct {
+    int reverse;                /* 1 when decompressing */
+    unsigned long long dataset; /* Hash of the cd_values of the dataset,
+                                   the same for datasets of the same
+                                   type, chunks and parameters */
+    const char *codec;          /* Compressor of the dataset */
+    size_t nbytes;              /* Uncompressed bytes (0 when not known
+                                   yet, at the beginning of decompressing) */
+    size_t cbytes;              /* Compressed bytes (0 when not known yet,
+                                   at the beginning of compressing) */
+    unsigned long thread;       /* Id of the calling thread, from 1 */
+    double time;                /* Beginning of the call, in seconds of
+                                   the clock of the counters */
+    double seconds;             /* Time spent, at the end */
+    int status;                 /* At the end: 0, 1 if the chunk was
+                                   stored uncompressed, -1 on failure */
+} blosc_filter_trace_event_t;
+
+typedef void (*blosc_filter_trace_fn)(int phase,
+                                      const blosc_filter_trace_event_t *event,
+                                      void *arg);
+
+/* Call `fn(phase, event, arg)` for every call of blosc_filter() from now
+   on, replacing any callback set before (NULL to stop tracing).  Calls
+   under way may still report to the previous callback. */
+void blosc_filter_set_trace(blosc_filter_trace_fn fn, void *arg);
+
+/* Trace into a file at `path`, in the JSON trace event format of Chrome
+   and Perfetto, with a begin and an end event per call of the filter, or
+   finish and close that file for NULL.  The HDF5_BLOSC_TRACE environment
+   variable starts this at load, and the file is closed at exit.  Returns
+   a negative value if the file can't be created. */
+int blosc_filter_trace_to_file(const char *path);
+
+/* Direct chunk access (HDF5 1.10.2 or later).  These functions read and
+   write chunks with H5Dread_chunk()/H5Dwrite_chunk() and run Blosc
+   themselves.  Buffers hold the hyperslab densely in C order, in the
+   stored type of the dataset (no type conversion is done).  They return
+   a negative value on failure, with the error pushed on the HDF5 error
+   stack. */
+
+/* Read the hyperslab `start`/`count` of `dset` into `buf`, decompressing
+   only the Blosc blocks covering it (with blosc_getitem()) rather than
+   whole chunks.  Datasets using other filters are read with H5Dread(). */
+int blosc_read_hyperslab(hid_t dset, const hsize_t *start,
+                         const hsize_t *count, void *buf);
+
+/* Write the hyperslab `start`/`count` of `dset` from `buf`, compressing
+   its chunks in parallel on `nthreads` threads (0 for one per processor)
+   while they are written in order with H5Dwrite_chunk().  Chunks come
+   out exactly as the filter would have stored them.  The hyperslab must
+   start on chunk boundaries and end on chunk boundaries or at the edges
+   of the dataset; chunks sticking out of the dataset are padded with
+   zeros.  Datasets using other filters are written with H5Dwrite(). */
+int blosc_write_chunks(hid_t dset, const hsize_t *start,
+                       const hsize_t *count, const void *buf, int nthreads);
+
+/* Read the hyperslab `start`/`count` of `dset` into `buf`, decompressing
+   the chunks it covers in parallel on `nthreads` threads (0 for one per
+   processor) while the calling thread reads the next chunks with
+   H5Dread_chunk().  Datasets using other filters are read with
+   H5Dread(). */
+int blosc_read_chunks(hid_t dset, const hsize_t *start, const hsize_t *count,
+                      void *buf, int nthreads);
+
+/* Read some members of the records in the hyperslab `start`/`count` of
+   the compound dataset `dset` into `buf`, as records of `mem_type`,
+   a compound type whose members are a subset of those of the dataset,
+   matched by name, with the same types.  For field-split datasets
+   (FILTER_BLOSC_SPLIT_FIELDS) only the streams of these members are
+   decompressed.  Other datasets, or member types needing a conversion,
+   are read with H5Dread(). */
+int blosc_read_fields(hid_t dset, hid_t mem_type, const hsize_t *start,
+                      const hsize_t *count, void *buf);
+
+/* Appender of rows (slices along the first dimension) to a dataset whose
+   first dimension is unlimited and whose chunks span every other
+   dimension whole.  Rows are staged in chunk-sized buffers; full chunks
+   are compressed on `nthreads` background threads (0 for one per
+   processor) and committed in order, growing the dataset with
+   H5Dset_extent() and writing them with H5Dwrite_chunk(), so appending
+   only waits when compression falls behind.  A last partial chunk is
+   written on flush and close, and taken up again by the next appender
+   opened on the dataset.  Datasets using other filters are written with
+   H5Dwrite().  All calls on an appender must come from one thread. */
+typedef struct blosc_appender blosc_appender_t;
+
+blosc_appender_t *blosc_appender_open(hid_t dset, int nthreads);
+
+/* Append `nrows` rows from `buf`, in the stored type of the dataset */
+int blosc_append(blosc_appender_t *appender, const void *buf, size_t nrows);
+
+/* Commit every row appended so far */
+int blosc_appender_flush(blosc_appender_t *appender);
+
+/* Commit every row appended so far and free the appender */
+int blosc_appender_close(blosc_appender_t *appender);
+
+/* Defined when blosc_write_chunks_mpi() is there: with a parallel HDF5
+   having filtered collective I/O (1.10.2 or later) */
+#if defined(H5_HAVE_PARALLEL) && H5_VERSION_GE(1,10,2)
+#define FILTER_BLOSC_MPI_WRITES 1
+#endif
+
+#if defined(FILTER_BLOSC_MPI_WRITES)
+/* Collective write with parallel HDF5, called by every rank of the
+   communicator `dset` was opened with, each writing its own hyperslab
+   `start`/`count` from `buf` (a `count` with a 0 for a rank writing
+   nothing).  Each rank compresses the chunks wholly inside its
+   hyperslab ahead, in parallel on `nthreads` threads (0 for one per
+   processor), then the data goes through a collective H5Dwrite(), in
+   which HDF5 allocates the chunks collectively and the filter takes the
+   chunks compressed ahead. */
+int blosc_write_chunks_mpi(hid_t dset, const hsize_t *start,
+                           const hsize_t *count, const void *buf,
+                           int nthreads);
+
+/* Number of chunks the filter has taken compressed ahead by
+   blosc_write_chunks_mpi() in this process so far; the others were
+   compressed as HDF5 handed them over */
+unsigned long long blosc_mpi_chunks_taken(void);
+#endif
+
+/* Zone maps: the smallest and largest value of every chunk of a dataset
+   of a native integer or floating-point type, kept in a companion
+   dataset named after it with a ".zonemap" suffix, one record per chunk
+   in C order of the chunk grid.  Once built, blosc_write_chunks() and
+   the appenders keep it up to date; writes by other means leave it
+   stale, and it must be built again after them, or after the dataset
+   grows along any dimension but the first. */
+typedef struct {
+    double min;                 /* Smallest value, NaNs left out */
+    double max;                 /* Largest value, NaNs left out */
+    unsigned long long nnan;    /* NaNs */
+    unsigned long long nfill;   /* Values equal to the fill value */
+    int valid;                  /* 0 if the chunk is not indexed */
+} blosc_zone_t;
+
+/* Build (or rebuild) the zone map of `dset`, reading its chunks with
+   blosc_read_chunks() on `nthreads` threads (0 for one per processor) */
+int blosc_zonemap_build(hid_t dset, int nthreads);
+
+/* Get the zone of the chunk at `offset` of `dset` */
+int blosc_zonemap_get(hid_t dset, const hsize_t *offset, blosc_zone_t *zone);
+
+/* Find the chunks of `dset` that may hold values in [lo, hi], i.e. those
+   not indexed and those whose range meets it, and put the offsets of the
+   first `maxchunks` of them, rank values each, in `offsets`.  Returns
+   the number of chunks found, which may be more than `maxchunks`. */
+hssize_t blosc_zonemap_select(hid_t dset, double lo, double hi,
+                              hsize_t *offsets, size_t maxchunks);
+
+/* Read into `buf`, which holds the whole dataset `dset` as for
+   blosc_read_chunks(), only the chunks that may hold values in [lo, hi]
+   according to its zone map, leaving the rest of `buf` untouched.
+   Returns the number of chunks read. */
+hssize_t blosc_read_where(hid_t dset, double lo, double hi, void *buf,
+                          int nthreads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,429 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Declarations shared by the translation units of the Blosc filter.
+    Nothing in here is part of the public API.
+
+*/
+
+
+#ifndef FILTER_BLOSC_INTERNAL_H
+#define FILTER_BLOSC_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if H5Epush_vers == 2
+/* 1.8.x */
+#define PUSH_ERR(func, minor, str...) H5Epush(H5E_DEFAULT, __FILE__, func, __LINE__, H5E_ERR_CLS, H5E_PLINE, minor, str)
+#else
+/* 1.6.x */
+#define PUSH_ERR(func, minor, str) H5Epush(__FILE__, func, __LINE__, H5E_PLINE, minor, str)
+#endif
+
+#if H5Pget_filter_by_id_vers == 2
+/* 1.8.x */
+#define GET_FILTER(a,b,c,d,e,f,g) H5Pget_filter_by_id(a,b,c,d,e,f,g,NULL)
+#else
+/* 1.6.x */
+#define GET_FILTER H5Pget_filter_by_id
+#endif
+
+#if H5Pget_filter_vers == 2
+/* 1.8.x */
+#define GET_FILTER_BY_IDX(a,b,c,d,e,f,g) H5Pget_filter(a,b,c,d,e,f,g,NULL)
+#else
+/* 1.6.x */
+#define GET_FILTER_BY_IDX H5Pget_filter
+#endif
+
+/* Plain integers and pointers shared between threads without a lock.  Windows builds
+   have no threads of their own yet, so plain accesses do there. */
+#if defined(__GNUC__) || defined(__clang__)
+#define BLOSC_ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define BLOSC_ATOMIC_STORE(var, v) \
+    __atomic_store_n(&(var), (v), __ATOMIC_RELEASE)
+#define BLOSC_ATOMIC_EXCHANGE(var, v) \
+    __atomic_exchange_n(&(var), (v), __ATOMIC_ACQ_REL)
+#define BLOSC_ATOMIC_ADD(var, v) \
+    __atomic_fetch_add(&(var), (v), __ATOMIC_RELAXED)
+/* Store `v` if `var` holds `expected`, returning 1, or else load `var`
+   into `expected` and return 0 */
+#define BLOSC_ATOMIC_CAS(var, expected, v) \
+    __atomic_compare_exchange_n(&(var), &(expected), (v), 1, \
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define BLOSC_ATOMIC_LOAD(var) (var)
+#define BLOSC_ATOMIC_STORE(var, v) ((var) = (v))
+static int blosc_atomic_exchange(int *var, int v){
+    int previous = *var;
+    *var = v;
+    return previous;
+}
+#define BLOSC_ATOMIC_EXCHANGE(var, v) blosc_atomic_exchange(&(var), (v))
+#define BLOSC_ATOMIC_ADD(var, v) ((var) += (v))
+#define BLOSC_ATOMIC_CAS(var, expected, v) \
+    ((var) == (expected) ? ((var) = (v), 1) : ((expected) = (var), 0))
+#endif
+
+/* Number of cd_values slots known to the filter.  A zstd dictionary of
+   cd_values[16] bytes may come after them, 4 bytes per slot (little
+   endian), in BLOSC_DICT_SLOTS(cd_values[16]) slots from slot
+   BLOSC_DICT_OFFSET on; the slots up to there are kept for parameters. */
+#define BLOSC_NPARAMS 20
+#define BLOSC_DICT_OFFSET 32
+#define BLOSC_DICT_SLOTS(size) (((size) + 3) / 4)
+
+/* The field layout of field-split datasets (cd_values[18]), which
+   cannot have a dictionary, takes its place: cd_values[19] fields of
+   BLOSC_FIELD_SLOTS slots each (offset in the record, size and shuffle
+   type size), in order of offset and covering the whole record */
+#define BLOSC_FIELDS_OFFSET BLOSC_DICT_OFFSET
+#define BLOSC_FIELD_SLOTS 3
+#define BLOSC_MAX_SLOTS \
+    (BLOSC_FIELDS_OFFSET + BLOSC_FIELD_SLOTS * FILTER_BLOSC_MAX_FIELDS)
+
+/* Compression level when cd_values[4] is not given */
+#define DEFAULT_CLEVEL 5
+
+
+/* The set_local callback of the filter (blosc_filter.c), which fills in
+   the cd_values of `dcpl` for datasets of `type` */
+herr_t blosc_set_local(hid_t dcpl, hid_t type, hid_t space);
+
+
+/* Compression parameters of a dataset, as read from its cd_values */
+typedef struct {
+    size_t typesize;
+    int clevel;
+    int doshuffle;
+    int compcode;
+    const char *compname;
+    int nthreads;
+    unsigned min_ratio;
+    size_t blocksize;
+    int policy;
+    unsigned policy_target;
+    int trim_bits;
+    int delta;
+    size_t dictsize;            /* Bytes of the zstd dictionary, if any */
+    const unsigned *dict;       /* Its slots, within the cd_values */
+    int checksum;
+    size_t nfields;             /* Fields of a field-split dataset */
+    const unsigned *fields;     /* Their layout, within the cd_values */
+} blosc_params_t;
+
+
+/* Per-thread cache of the parameters of the last datasets a thread
+   worked on (blosc_params_cache.c), keyed by their cd_values.  get()
+   returns NULL on a miss; the entry stays valid until the next put(). */
+const blosc_params_t *blosc_params_cache_get(size_t cd_nelmts,
+                                             const unsigned cd_values[]);
+void blosc_params_cache_put(size_t cd_nelmts, const unsigned cd_values[],
+                            const blosc_params_t *params);
+
+
+/* Chunk codec (blosc_filter.c).  These work on chunks exactly as stored
+   by blosc_filter(), given the cd_values of the dataset.  They do not
+   touch the HDF5 error stack, so they can be called from any thread;
+   they return a negative value on errors. */
+
+/* Compress a chunk of `nbytes` bytes into `dest`, which holds `destsize`
+   bytes, using `nthreads` threads (0 for the configured number).  On
+   success returns 0 and the compressed size in `cbytes`; returns 1 if the
+   chunk does not compress and should be stored as is, which then means
+   `src` as left by the lossy pre-filters (precision trimming), as they
+   run in place; lossless ones (delta) are undone first.  With checksums,
+   chunks are never stored as is, and `dest` must hold
+   blosc_filter_encode_bound() bytes for them to always fit. */
+int blosc_filter_encode(size_t cd_nelmts, const unsigned cd_values[],
+                        int nthreads, void *src, size_t nbytes,
+                        void *dest, size_t destsize, size_t *cbytes);
+
+/* Size of the output buffer blosc_filter_encode() needs for a chunk of
+   `nbytes` bytes */
+size_t blosc_filter_encode_bound(size_t cd_nelmts, const unsigned cd_values[],
+                                 size_t nbytes);
+
+/* Get the uncompressed size of a chunk.  Returns -2 when the header
+   claims more than the chunk size of the dataset (with some room for
+   filters before Blosc), the memory budget or an HDF5 chunk allow. */
+int blosc_filter_decoded_size(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t *nbytes);
+
+/* Decompress a whole chunk into `dest`, which holds `destsize` bytes,
+   using `nthreads` threads (0 for the configured number).  This and
+   blosc_filter_decode_range() return -2 when the checksum of the chunk
+   does not match. */
+int blosc_filter_decode(size_t cd_nelmts, const unsigned cd_values[],
+                        int nthreads, const void *src, size_t srcsize,
+                        void *dest, size_t destsize);
+
+/* Decompress only the bytes [offset, offset + nbytes) of a chunk, which
+   must be whole items of the type size used when compressing */
+int blosc_filter_decode_range(size_t cd_nelmts, const unsigned cd_values[],
+                              const void *src, size_t srcsize,
+                              size_t offset, size_t nbytes, void *dest);
+
+
+/* Data kernels (blosc_kernels.c) */
+
+/* Whether the `nbytes` bytes at `buf` are all copies of one item of
+   `typesize` bytes */
+int blosc_kernel_is_constant(const void *buf, size_t nbytes, size_t typesize);
+
+/* Fill `nbytes` bytes at `dest` with copies of the item at `value` */
+void blosc_kernel_fill(void *dest, size_t nbytes, const void *value,
+                       size_t typesize);
+
+/* Zero all but the `keep_bits` top mantissa bits of the native floats
+   (`typesize` 4 or 8) in `buf`.  NaNs and infinities are left alone. */
+void blosc_kernel_trim(void *buf, size_t nbytes, size_t typesize,
+                       int keep_bits);
+
+/* Delta code (or decode) the unsigned integers (`typesize` 1, 2, 4 or 8)
+   in `buf`, independently in each block of `blocksize` bytes so that
+   blocks decode on their own.  A `blocksize` of 0 means a single block. */
+void blosc_kernel_delta_encode(void *buf, size_t nbytes, size_t typesize,
+                               size_t blocksize);
+void blosc_kernel_delta_decode(void *buf, size_t nbytes, size_t typesize,
+                               size_t blocksize);
+
+/* Byte shuffle (or unshuffle) the items of `typesize` bytes in `src`
+   into `dest`, which must not overlap: byte j of every item goes to the
+   j-th stream.  Trailing bytes not making a whole item are copied. */
+void blosc_kernel_shuffle(void *dest, const void *src, size_t nbytes,
+                          size_t typesize);
+void blosc_kernel_unshuffle(void *dest, const void *src, size_t nbytes,
+                            size_t typesize);
+
+/* Gather the `size` bytes found every `stride` bytes of `src`, for
+   `nitems` items, densely into `dest` (or scatter them back) */
+void blosc_kernel_gather(void *dest, const void *src, size_t nitems,
+                         size_t stride, size_t size);
+void blosc_kernel_scatter(void *dest, const void *src, size_t nitems,
+                          size_t stride, size_t size);
+
+/* CRC-32C (Castagnoli) of the `nbytes` bytes at `buf` */
+uint32_t blosc_kernel_crc32c(const void *buf, size_t nbytes);
+
+/* The native types zone statistics are kept for */
+enum {
+    BLOSC_ZONE_INT8,
+    BLOSC_ZONE_INT16,
+    BLOSC_ZONE_INT32,
+    BLOSC_ZONE_INT64,
+    BLOSC_ZONE_UINT8,
+    BLOSC_ZONE_UINT16,
+    BLOSC_ZONE_UINT32,
+    BLOSC_ZONE_UINT64,
+    BLOSC_ZONE_FLOAT,
+    BLOSC_ZONE_DOUBLE
+};
+
+/* Merge the statistics of the `nitems` values of type `kind` at `buf`
+   into `zone`, counting those equal to the one at `fill` (0 if NULL) */
+void blosc_kernel_zone(const void *buf, size_t nitems, int kind,
+                       const void *fill, blosc_zone_t *zone);
+
+
+/* Zstd dictionaries (blosc_dict.c, only built with HAVE_ZSTD_DICT).
+   Chunks of datasets with a dictionary are compressed by zstd alone,
+   after a byte shuffle, and stored as a small frame header followed by
+   the zstd frame.  Same conventions as the chunk codec above. */
+
+int blosc_filter_dict_encode(const blosc_params_t *params, const void *src,
+                             size_t nbytes, void *dest, size_t destsize,
+                             size_t *cbytes);
+
+int blosc_filter_dict_decoded_size(const void *src, size_t srcsize,
+                                   size_t *nbytes);
+
+int blosc_filter_dict_decode(const unsigned *dict, size_t dictsize,
+                             const void *src, size_t srcsize,
+                             void *dest, size_t destsize);
+
+
+/* Field-split chunks (blosc_fields.c).  Each field of the records of a
+   compound dataset is gathered and compressed by Blosc as a stream of
+   its own, with the shuffle type size of the field, behind an index of
+   the stream sizes.  Same conventions as the chunk codec above. */
+
+int blosc_filter_fields_encode(const blosc_params_t *params, const void *src,
+                               size_t nbytes, void *dest, size_t destsize,
+                               size_t *cbytes);
+
+/* Whether `src` is a field-split chunk, with its uncompressed size in
+   `nbytes` */
+int blosc_filter_fields_decoded_size(const void *src, size_t srcsize,
+                                     size_t *nbytes);
+
+int blosc_filter_fields_decode(const unsigned *fields, size_t nfields,
+                               int nthreads, const void *src, size_t srcsize,
+                               void *dest, size_t destsize);
+
+/* Decompress only the fields with the indices in `sel` of a field-split
+   chunk, each into its own dense column in `columns` */
+int blosc_filter_fields_decode_columns(const unsigned *fields, size_t nfields,
+                                       const void *src, size_t srcsize,
+                                       size_t nsel, const size_t *sel,
+                                       void *const *columns);
+
+/* Decompress the fields `sel` of any chunk, like
+   blosc_filter_fields_decode_columns().  Returns 1, leaving the columns
+   alone, if the chunk is not stored field-split (e.g. a constant chunk),
+   in which case it must be decompressed whole. */
+int blosc_filter_decode_fields(size_t cd_nelmts, const unsigned cd_values[],
+                               const void *src, size_t srcsize,
+                               size_t nsel, const size_t *sel,
+                               void *const *columns);
+
+
+/* Collective writes (FILTER_BLOSC_MPI_WRITES, blosc_filter.h) */
+#if defined(FILTER_BLOSC_MPI_WRITES)
+/* Chunks compressed ahead by blosc_write_chunks_mpi() (blosc_direct.c).
+   If the chunk of `nbytes` bytes at `src`, of the dataset with the
+   given cd_values, is one of them, copy it compressed into `dest` and
+   return 0 with its size in `cbytes`; return 1 otherwise. */
+int blosc_mpi_take_prepared(size_t cd_nelmts, const unsigned cd_values[],
+                            const void *src, size_t nbytes, void *dest,
+                            size_t destsize, size_t *cbytes);
+#endif
+
+
+/* Buffer pool (blosc_buffer_pool.c) */
+
+/* Get a buffer of at least `size` bytes, recycled from the calling
+   thread's pool when possible.  The real size of the buffer is returned
+   in `capacity`.  The buffer can always be released with free(). */
+void *blosc_filter_buffer_get(size_t size, size_t *capacity);
+
+/* Give a malloc'ed buffer of `capacity` bytes back to the calling
+   thread's pool, or free it if the pool is full. */
+void blosc_filter_buffer_put(void *buf, size_t capacity);
+
+/* Free the buffers held by the calling thread's pool */
+void blosc_filter_buffer_flush(void);
+
+/* Take `nbytes` of the memory budget, waiting for other threads to give
+   some back if `wait`, or failing at once otherwise.  What the calling
+   thread holds itself is not waited for, so a call gets what it asks
+   for once no other thread holds any, however much it is.  Budget must
+   be given back by the thread that took it.  Returns a negative value
+   on failure. */
+int blosc_budget_acquire(size_t nbytes, int wait);
+
+/* Take the memory budget of up to `njobs` jobs of `jobsize` bytes each,
+   waiting for the first one only: with a tight budget a pipeline runs
+   with fewer jobs in flight instead of waiting for all of them.  Returns
+   the number of jobs taken, 0 on failure. */
+size_t blosc_budget_acquire_jobs(size_t njobs, size_t jobsize);
+
+/* Give `nbytes` back to the memory budget */
+void blosc_budget_release(size_t nbytes);
+
+
+
+/* Performance counters (blosc_stats.c) */
+
+/* Monotonic wall clock, in seconds */
+double blosc_stats_now(void);
+
+/* Account for one call of blosc_filter() with `codec` */
+void blosc_stats_record(int reverse, const char *codec, size_t nbytes_in,
+                        size_t nbytes_out, double seconds,
+                        int incompressible);
+
+/* Start tracing a call of blosc_filter() that began at `start`, filling
+   in `event`.  Returns 0 at once when tracing is off, 1 otherwise, in
+   which case blosc_trace_end() must be called when it is done, with the
+   codec the chunk turned out to use (NULL keeps the one given here). */
+int blosc_trace_begin(blosc_filter_trace_event_t *event, int reverse,
+                      size_t cd_nelmts, const unsigned cd_values[],
+                      const char *codec, size_t nbytes, size_t cbytes,
+                      double start);
+
+void blosc_trace_end(blosc_filter_trace_event_t *event, const char *codec,
+                     size_t nbytes, size_t cbytes, int status);
+
+/* Account for a buffer that could not be allocated */
+void blosc_stats_alloc_failure(void);
+
+
+/* Zone maps (blosc_zonemap.c), kept up to date by the direct chunk
+   writers */
+
+typedef struct blosc_zonemap blosc_zonemap_t;
+
+/* Open the zone map of `dset` into *mapp, creating it afresh (with no
+   chunk indexed) if `create` is set.  Returns 1 if it was opened, 0,
+   with *mapp NULL, if there is none and `create` is not set. */
+int blosc_zonemap_open(const char *func, hid_t dset, int create,
+                       blosc_zonemap_t **mapp);
+
+/* The zone of the box of extent `ext` at `lo` within the C order array
+   of dimensions `bufdims` at `buf`, of values as the dataset holds them */
+void blosc_zonemap_compute(const blosc_zonemap_t *map, const void *buf,
+                           const hsize_t *bufdims, const hsize_t *lo,
+                           const hsize_t *ext, blosc_zone_t *zone);
+
+/* Store the zones of the `n` chunks with the grid indices in `cidx`,
+   rank values each, growing the map along the first dimension */
+int blosc_zonemap_put(blosc_zonemap_t *map, size_t n, const hsize_t *cidx,
+                      const blosc_zone_t *zones);
+
+/* Free the map, saving its chunk grid first if it was created or put
+   to, so that maps only opened for queries write nothing */
+int blosc_zonemap_close(blosc_zonemap_t *map);
+
+/* Whether each chunk of `dset`, by linear index over its chunk grid (in
+   `nchunks`), may hold values in [lo, hi], to free() */
+unsigned char *blosc_zonemap_wanted(const char *func, hid_t dset, double lo,
+                                    double hi, hsize_t *nchunks);
+
+
+/* Worker threads (blosc_workers.c), a group of jobs on the threads
+   shared by the whole process */
+
+typedef struct blosc_workers blosc_workers_t;
+typedef void (*blosc_work_fn)(void *arg);
+
+/* Number of online processors */
+int blosc_workers_ncpus(void);
+
+/* A group running at most `nthreads` jobs at once (0 for as many as the
+   pool has threads) */
+blosc_workers_t *blosc_workers_create(int nthreads);
+
+/* Wait for the submitted jobs and free the group */
+void blosc_workers_destroy(blosc_workers_t *workers);
+
+/* Queue fn(arg); *done is set to 1 once it has run */
+int blosc_workers_submit(blosc_workers_t *workers, blosc_work_fn fn,
+                         void *arg, int *done);
+
+/* The same, preferring a thread on the NUMA node of `near`, the memory
+   the job works on most */
+int blosc_workers_submit_near(blosc_workers_t *workers, blosc_work_fn fn,
+                              void *arg, const void *near, int *done);
+
+/* Wait until the job owning `done` has run */
+void blosc_workers_wait(blosc_workers_t *workers, int *done);
+
+/* Whether the job owning `done` has run, without waiting */
+int blosc_workers_poll(blosc_workers_t *workers, int *done);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,425 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Data kernels of the Blosc filter: the loops that run over whole
+    chunks besides Blosc itself.  They either lean on memcmp(), memcpy()
+    and memset(), which C libraries provide in vectorized form for the
+    host CPU, or are simple enough loops for compilers to vectorize.
+
+    Those doing most of the work (constant detection, trimming, delta
+    coding, shuffling and zone statistics) are built for several
+    instruction sets, AVX2 and AVX-512 on x86-64, and the best one the CPU
+    has is picked once at run time, so that one build runs at full speed
+    on any of them.
+
+*/
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+void blosc_kernel_fill(void *dest, size_t nbytes, const void *value,
+                       size_t typesize){
+
+    char *d = (char *)dest;
+    const char *v = (const char *)value;
+    size_t i, done;
+
+    /* Items made of a single repeated byte (zeros above all) */
+    for (i = 1; i < typesize && v[i] == v[0]; i++);
+    if (i >= typesize) {
+        memset(d, v[0], nbytes);
+        return;
+    }
+
+    /* Otherwise copy the first item, then double what has been filled */
+    done = typesize < nbytes ? typesize : nbytes;
+    memcpy(d, v, done);
+    while (done < nbytes) {
+        i = done < nbytes - done ? done : nbytes - done;
+        memcpy(d + done, d, i);
+        done += i;
+    }
+}
+
+/* The kernels built for several instruction sets, picked once from what
+   the CPU has (blosc_kernels_isa.h) */
+typedef struct {
+    const char *name;
+    int (*is_constant)(const void *buf, size_t nbytes, size_t typesize);
+    void (*trim)(void *buf, size_t nbytes, size_t typesize, int keep_bits);
+    void (*delta)(void *buf, size_t nbytes, size_t typesize,
+                  size_t blocksize, int encode);
+    void (*shuffle)(void *dest, const void *src, size_t nbytes,
+                    size_t typesize);
+    void (*unshuffle)(void *dest, const void *src, size_t nbytes,
+                      size_t typesize);
+    void (*zone)(const void *buf, size_t nitems, int kind, const void *fill,
+                 blosc_zone_t *zone);
+} kernel_table_t;
+
+/* 64-bit integers as doubles, rounded down (or up) when they have more
+   bits than a double holds */
+#define TWO_TO_63 9223372036854775808.0
+#define TWO_TO_64 18446744073709551616.0
+
+static double lower_int64(int64_t v){
+    double d = (double)v;
+    return d >= TWO_TO_63 || (int64_t)d > v ? nextafter(d, -HUGE_VAL) : d;
+}
+
+static double upper_int64(int64_t v){
+    double d = (double)v;
+    return d < TWO_TO_63 && (int64_t)d < v ? nextafter(d, HUGE_VAL) : d;
+}
+
+static double lower_uint64(uint64_t v){
+    double d = (double)v;
+    return d >= TWO_TO_64 || (uint64_t)d > v ? nextafter(d, -HUGE_VAL) : d;
+}
+
+static double upper_uint64(uint64_t v){
+    double d = (double)v;
+    return d < TWO_TO_64 && (uint64_t)d < v ? nextafter(d, HUGE_VAL) : d;
+}
+
+#define NOT_NAN(x) 0
+#define IS_NAN(x) ((x) != (x))
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#define X86_KERNELS
+
+#define KERNEL_ISA generic
+#define KERNEL_TARGET
+#include "blosc_kernels_isa.h"
+
+#define KERNEL_ISA avx2
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#include "blosc_kernels_isa.h"
+
+#define KERNEL_ISA avx512
+#define KERNEL_TARGET __attribute__((target("avx512f,avx512bw")))
+#include "blosc_kernels_isa.h"
+
+/* Best first */
+static const kernel_table_t *const kernel_tables[] = {
+    &kernels_avx512, &kernels_avx2, &kernels_generic
+};
+
+static int kernels_supported(const kernel_table_t *table){
+
+    if (table == &kernels_avx512) {
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    }
+    if (table == &kernels_avx2) return __builtin_cpu_supports("avx2");
+    return 1;
+}
+
+#elif defined(__aarch64__)
+
+/* Advanced SIMD is part of the base architecture, so the kernels built
+   for it are the NEON ones */
+#define KERNEL_ISA neon
+#define KERNEL_TARGET
+#include "blosc_kernels_isa.h"
+
+static const kernel_table_t *const kernel_tables[] = {&kernels_neon};
+
+static int kernels_supported(const kernel_table_t *table){
+    (void)table;
+    return 1;
+}
+
+#else
+
+#define KERNEL_ISA generic
+#define KERNEL_TARGET
+#include "blosc_kernels_isa.h"
+
+static const kernel_table_t *const kernel_tables[] = {&kernels_generic};
+
+static int kernels_supported(const kernel_table_t *table){
+    (void)table;
+    return 1;
+}
+
+#endif
+
+#define NKERNEL_TABLES (sizeof(kernel_tables) / sizeof(kernel_tables[0]))
+
+/* The table in use.  blosc_filter_set_isa() may change it while other
+   threads run kernels, hence the atomic accesses. */
+static const kernel_table_t *kernels = NULL;
+
+/* The table for `isa`, the best one the CPU supports when NULL */
+static const kernel_table_t *find_kernels(const char *isa){
+
+    size_t i;
+
+    for (i = 0; i < NKERNEL_TABLES; i++) {
+        if ((isa == NULL || strcmp(isa, kernel_tables[i]->name) == 0) &&
+            kernels_supported(kernel_tables[i])) return kernel_tables[i];
+    }
+    return NULL;
+}
+
+/* Pick the best kernels, or those forced by HDF5_BLOSC_ISA if the CPU has
+   them */
+static void pick_kernels(void){
+
+    const kernel_table_t *table;
+    char *envvar;
+
+#if defined(X86_KERNELS)
+    __builtin_cpu_init();
+#endif
+    envvar = getenv("HDF5_BLOSC_ISA");
+    table = envvar != NULL ? find_kernels(envvar) : NULL;
+    BLOSC_ATOMIC_STORE(kernels, table != NULL ? table : find_kernels(NULL));
+}
+
+#if defined(_WIN32)
+
+static const kernel_table_t *get_kernels(void){
+    /* Picking twice is harmless: the same table comes out */
+    if (BLOSC_ATOMIC_LOAD(kernels) == NULL) pick_kernels();
+    return BLOSC_ATOMIC_LOAD(kernels);
+}
+
+#else
+
+#include <pthread.h>
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static const kernel_table_t *get_kernels(void){
+    pthread_once(&kernels_once, pick_kernels);
+    return BLOSC_ATOMIC_LOAD(kernels);
+}
+
+#endif
+
+int blosc_filter_set_isa(const char *isa){
+
+    const kernel_table_t *table;
+
+    get_kernels();
+    table = find_kernels(isa);
+    if (table == NULL) {
+        PUSH_ERR("blosc_filter_set_isa", H5E_BADVALUE,
+                 "Instruction set not supported by the CPU or the build");
+        return -1;
+    }
+    BLOSC_ATOMIC_STORE(kernels, table);
+    return 0;
+}
+
+const char *blosc_filter_get_isa(void){
+    return get_kernels()->name;
+}
+
+int blosc_kernel_is_constant(const void *buf, size_t nbytes, size_t typesize){
+    return get_kernels()->is_constant(buf, nbytes, typesize);
+}
+
+void blosc_kernel_trim(void *buf, size_t nbytes, size_t typesize,
+                       int keep_bits){
+    get_kernels()->trim(buf, nbytes, typesize, keep_bits);
+}
+
+void blosc_kernel_delta_encode(void *buf, size_t nbytes, size_t typesize,
+                               size_t blocksize){
+    get_kernels()->delta(buf, nbytes, typesize, blocksize, 1);
+}
+
+void blosc_kernel_delta_decode(void *buf, size_t nbytes, size_t typesize,
+                               size_t blocksize){
+    get_kernels()->delta(buf, nbytes, typesize, blocksize, 0);
+}
+
+void blosc_kernel_shuffle(void *dest, const void *src, size_t nbytes,
+                          size_t typesize){
+    get_kernels()->shuffle(dest, src, nbytes, typesize);
+}
+
+void blosc_kernel_unshuffle(void *dest, const void *src, size_t nbytes,
+                            size_t typesize){
+    get_kernels()->unshuffle(dest, src, nbytes, typesize);
+}
+
+void blosc_kernel_zone(const void *buf, size_t nitems, int kind,
+                       const void *fill, blosc_zone_t *zone){
+    get_kernels()->zone(buf, nitems, kind, fill, zone);
+}
+
+/* Gathering and scattering fields copies them with a memcpy() of a
+   constant size for the usual ones, which compilers turn into plain
+   loads and stores */
+#define DEFINE_GATHER(n)                                                    \
+static void gather##n(char *d, const char *s, size_t nitems, size_t stride){ \
+    size_t i;                                                               \
+    for (i = 0; i < nitems; i++) memcpy(d + i * n, s + i * stride, n);      \
+}                                                                           \
+static void scatter##n(char *d, const char *s, size_t nitems, size_t stride){\
+    size_t i;                                                               \
+    for (i = 0; i < nitems; i++) memcpy(d + i * stride, s + i * n, n);      \
+}
+
+DEFINE_GATHER(1)
+DEFINE_GATHER(2)
+DEFINE_GATHER(4)
+DEFINE_GATHER(8)
+
+void blosc_kernel_gather(void *dest, const void *src, size_t nitems,
+                         size_t stride, size_t size){
+
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    size_t i;
+
+    switch (size) {
+    case 1: gather1(d, s, nitems, stride); break;
+    case 2: gather2(d, s, nitems, stride); break;
+    case 4: gather4(d, s, nitems, stride); break;
+    case 8: gather8(d, s, nitems, stride); break;
+    default:
+        for (i = 0; i < nitems; i++) {
+            memcpy(d + i * size, s + i * stride, size);
+        }
+    }
+}
+
+void blosc_kernel_scatter(void *dest, const void *src, size_t nitems,
+                          size_t stride, size_t size){
+
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    size_t i;
+
+    switch (size) {
+    case 1: scatter1(d, s, nitems, stride); break;
+    case 2: scatter2(d, s, nitems, stride); break;
+    case 4: scatter4(d, s, nitems, stride); break;
+    case 8: scatter8(d, s, nitems, stride); break;
+    default:
+        for (i = 0; i < nitems; i++) {
+            memcpy(d + i * stride, s + i * size, size);
+        }
+    }
+}
+
+/* CRC-32C goes through the crc32 instruction of SSE 4.2 when the CPU has
+   it, 8 bytes at a time, and otherwise through the slice-by-8 tables
+   below, built on first use */
+#define CRC32C_POLY 0x82f63b78U
+
+static uint32_t crc32c_table[8][256];
+
+static void build_crc32c_table(void){
+
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = (uint32_t)i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+#if defined(_WIN32)
+
+static volatile long crc32c_table_state = 0;
+
+static void init_crc32c_table(void){
+    /* Building the tables twice is harmless: they come out the same */
+    if (crc32c_table_state) return;
+    build_crc32c_table();
+    crc32c_table_state = 1;
+}
+
+#else
+
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32c_table(void){
+    pthread_once(&crc32c_table_once, build_crc32c_table);
+}
+
+#endif
+
+static uint32_t crc32c_tables(uint32_t crc, const unsigned char *p,
+                              size_t nbytes){
+
+    uint32_t lo, hi;
+
+    init_crc32c_table();
+    for (; nbytes >= 8; p += 8, nbytes -= 8) {
+        lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+             (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; nbytes > 0; p++, nbytes--) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p,
+                             size_t nbytes){
+
+    uint64_t crc64 = crc, v;
+
+    for (; nbytes >= 8; p += 8, nbytes -= 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = (uint32_t)crc64;
+    for (; nbytes > 0; p++, nbytes--) crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+uint32_t blosc_kernel_crc32c(const void *buf, size_t nbytes){
+
+    const unsigned char *p = (const unsigned char *)buf;
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(0xffffffffU, p, nbytes);
+    }
+    return ~crc32c_tables(0xffffffffU, p, nbytes);
+}
+
+#else
+
+uint32_t blosc_kernel_crc32c(const void *buf, size_t nbytes){
+    return ~crc32c_tables(0xffffffffU, (const unsigned char *)buf, nbytes);
+}
+
+#endif
@@ -0,0 +1,313 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    The data kernels dispatched on the instruction sets of the CPU.
+
+    There is no include guard: blosc_kernels.c includes this once for
+    each instruction set, with KERNEL_ISA defined to its name (a C
+    identifier) and KERNEL_TARGET to the function attributes compiling
+    for it, and gets a `kernels_<isa>` table of the variants.  The loops
+    are the same for all of them, written so that compilers vectorize
+    them with whatever vectors the target has.
+
+*/
+
+
+#define KERNEL_PASTE2(name, isa) name##_##isa
+#define KERNEL_PASTE(name, isa) KERNEL_PASTE2(name, isa)
+#define K(name) KERNEL_PASTE(name, KERNEL_ISA)
+#define KERNEL_STR2(isa) #isa
+#define KERNEL_STR(isa) KERNEL_STR2(isa)
+
+/* Words compared between early exits of is_constant() */
+#define CONSTANT_RUN 512
+
+KERNEL_TARGET
+static int K(is_constant)(const void *buf, size_t nbytes, size_t typesize){
+
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t pattern, word, diff;
+    size_t nwords, i, j, n;
+
+    if (typesize == 0 || nbytes < typesize || nbytes % typesize != 0) {
+        return 0;
+    }
+    /* Comparing the buffer with itself shifted by one item checks that
+       every item equals the next one, i.e. that all of them are equal */
+    if (8 % typesize != 0 || nbytes < 16) {
+        return memcmp(p, p + typesize, nbytes - typesize) == 0;
+    }
+
+    /* Items dividing a word: every word must equal the first one, which
+       must hold copies of a single item */
+    if (memcmp(p, p + typesize, 8 - typesize) != 0) return 0;
+    memcpy(&pattern, p, 8);
+    nwords = nbytes / 8;
+    for (i = 0; i < nwords; i += n) {
+        n = nwords - i < CONSTANT_RUN ? nwords - i : CONSTANT_RUN;
+        diff = 0;
+        for (j = 0; j < n; j++) {
+            memcpy(&word, p + (i + j) * 8, 8);
+            diff |= word ^ pattern;
+        }
+        if (diff != 0) return 0;
+    }
+    return memcmp(p + nwords * 8, p, nbytes - nwords * 8) == 0;
+}
+
+/* Exponent test and masking become a compare and a blend */
+KERNEL_TARGET
+static void K(trim32)(uint32_t *v, size_t n, int keep_bits){
+
+    const uint32_t exponent = 0x7f800000U;
+    const uint32_t mask = ~((1U << (23 - keep_bits)) - 1);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        v[i] = (v[i] & exponent) == exponent ? v[i] : v[i] & mask;
+    }
+}
+
+KERNEL_TARGET
+static void K(trim64)(uint64_t *v, size_t n, int keep_bits){
+
+    const uint64_t exponent = 0x7ff0000000000000ULL;
+    const uint64_t mask = ~((1ULL << (52 - keep_bits)) - 1);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        v[i] = (v[i] & exponent) == exponent ? v[i] : v[i] & mask;
+    }
+}
+
+KERNEL_TARGET
+static void K(trim)(void *buf, size_t nbytes, size_t typesize,
+                    int keep_bits){
+
+    if (typesize == 4 && keep_bits > 0 && keep_bits < 23) {
+        K(trim32)((uint32_t *)buf, nbytes / 4, keep_bits);
+    } else if (typesize == 8 && keep_bits > 0 && keep_bits < 52) {
+        K(trim64)((uint64_t *)buf, nbytes / 8, keep_bits);
+    }
+}
+
+/* Delta coding works on unsigned items so that it wraps around the same
+   way for signed ones.  Each block keeps its first item and replaces the
+   others by their difference with the previous item.  Encoding runs
+   backwards, reading items before they are overwritten, so it vectorizes;
+   decoding is a running sum and stays a scalar loop, which still runs at
+   memory speed. */
+#define DEFINE_DELTA(bits)                                                  \
+KERNEL_TARGET                                                               \
+static void K(delta_encode##bits)(uint##bits##_t *v, size_t n){            \
+    size_t i;                                                               \
+    for (i = n; i > 1; i--) v[i - 1] -= v[i - 2];                           \
+}                                                                           \
+KERNEL_TARGET                                                               \
+static void K(delta_decode##bits)(uint##bits##_t *v, size_t n){            \
+    size_t i;                                                               \
+    for (i = 1; i < n; i++) v[i] += v[i - 1];                               \
+}
+
+DEFINE_DELTA(8)
+DEFINE_DELTA(16)
+DEFINE_DELTA(32)
+DEFINE_DELTA(64)
+
+#undef DEFINE_DELTA
+
+/* Delta code or decode each block of `blocksize` bytes of `buf` (the whole
+   buffer when `blocksize` is 0) */
+KERNEL_TARGET
+static void K(delta)(void *buf, size_t nbytes, size_t typesize,
+                     size_t blocksize, int encode){
+
+    char *p = (char *)buf;
+    size_t offset, n;
+
+    if (typesize != 1 && typesize != 2 && typesize != 4 && typesize != 8) {
+        return;
+    }
+    blocksize -= blocksize % typesize;
+    if (blocksize == 0) blocksize = nbytes;
+    for (offset = 0; offset < nbytes; offset += n) {
+        n = nbytes - offset < blocksize ? nbytes - offset : blocksize;
+        switch (typesize) {
+        case 1:
+            if (encode) K(delta_encode8)((uint8_t *)(p + offset), n);
+            else K(delta_decode8)((uint8_t *)(p + offset), n);
+            break;
+        case 2:
+            if (encode) K(delta_encode16)((uint16_t *)(p + offset), n / 2);
+            else K(delta_decode16)((uint16_t *)(p + offset), n / 2);
+            break;
+        case 4:
+            if (encode) K(delta_encode32)((uint32_t *)(p + offset), n / 4);
+            else K(delta_decode32)((uint32_t *)(p + offset), n / 4);
+            break;
+        case 8:
+            if (encode) K(delta_encode64)((uint64_t *)(p + offset), n / 8);
+            else K(delta_decode64)((uint64_t *)(p + offset), n / 8);
+            break;
+        }
+    }
+}
+
+/* Shuffling writes (or reads) one stream at a time, so that the inner
+   loop is a strided gather (or scatter) compilers can vectorize.  The
+   usual type sizes get loops of their own over whole items instead,
+   which compilers turn into vector loads and byte permutations. */
+#define DEFINE_SHUFFLE(size)                                                \
+KERNEL_TARGET                                                               \
+static void K(shuffle##size)(unsigned char *d, const unsigned char *s,     \
+                             size_t n){                                     \
+    size_t i, j;                                                            \
+    for (i = 0; i < n; i++) {                                               \
+        for (j = 0; j < size; j++) d[j * n + i] = s[i * size + j];          \
+    }                                                                       \
+}                                                                           \
+KERNEL_TARGET                                                               \
+static void K(unshuffle##size)(unsigned char *d, const unsigned char *s,   \
+                               size_t n){                                   \
+    size_t i, j;                                                            \
+    for (i = 0; i < n; i++) {                                               \
+        for (j = 0; j < size; j++) d[i * size + j] = s[j * n + i];          \
+    }                                                                       \
+}
+
+DEFINE_SHUFFLE(2)
+DEFINE_SHUFFLE(4)
+DEFINE_SHUFFLE(8)
+
+#undef DEFINE_SHUFFLE
+
+KERNEL_TARGET
+static void K(shuffle)(void *dest, const void *src, size_t nbytes,
+                       size_t typesize){
+
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+    size_t n = typesize > 0 ? nbytes / typesize : 0;
+    size_t i, j;
+
+    switch (typesize) {
+    case 2: K(shuffle2)(d, s, n); break;
+    case 4: K(shuffle4)(d, s, n); break;
+    case 8: K(shuffle8)(d, s, n); break;
+    default:
+        for (j = 0; j < typesize; j++) {
+            for (i = 0; i < n; i++) d[j * n + i] = s[i * typesize + j];
+        }
+    }
+    memcpy(d + n * typesize, s + n * typesize, nbytes - n * typesize);
+}
+
+KERNEL_TARGET
+static void K(unshuffle)(void *dest, const void *src, size_t nbytes,
+                         size_t typesize){
+
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+    size_t n = typesize > 0 ? nbytes / typesize : 0;
+    size_t i, j;
+
+    switch (typesize) {
+    case 2: K(unshuffle2)(d, s, n); break;
+    case 4: K(unshuffle4)(d, s, n); break;
+    case 8: K(unshuffle8)(d, s, n); break;
+    default:
+        for (j = 0; j < typesize; j++) {
+            for (i = 0; i < n; i++) d[i * typesize + j] = s[j * n + i];
+        }
+    }
+    memcpy(d + n * typesize, s + n * typesize, nbytes - n * typesize);
+}
+
+/* Zone statistics: one pass keeping the smallest and largest values, and
+   counting those equal to the fill value (and NaNs), which compilers
+   turn into vector min, max and compares.  The extremes are merged into
+   the zone as doubles, rounded outwards when they are not exact. */
+#define DEFINE_ZONE(name, type, lowest, highest, lower, upper, nan_test)    \
+KERNEL_TARGET                                                               \
+static void K(zone_##name)(const type *v, size_t n, const type *fill,      \
+                           blosc_zone_t *zone){                             \
+    type mn = highest, mx = lowest, x, f = fill != NULL ? *fill : 0;        \
+    unsigned long long nnan = 0, nfill = 0;                                 \
+    size_t i;                                                               \
+    for (i = 0; i < n; i++) {                                               \
+        x = v[i];                                                           \
+        mn = x < mn ? x : mn;                                               \
+        mx = x > mx ? x : mx;                                               \
+        nfill += x == f;                                                    \
+        nnan += nan_test(x);                                                \
+    }                                                                       \
+    if (n - nnan > 0) {                                                     \
+        if (lower(mn) < zone->min) zone->min = lower(mn);                   \
+        if (upper(mx) > zone->max) zone->max = upper(mx);                   \
+    }                                                                       \
+    zone->nnan += nnan;                                                     \
+    zone->nfill += nfill;                                                   \
+}
+
+DEFINE_ZONE(int8, int8_t, INT8_MIN, INT8_MAX, (double), (double), NOT_NAN)
+DEFINE_ZONE(int16, int16_t, INT16_MIN, INT16_MAX, (double), (double),
+            NOT_NAN)
+DEFINE_ZONE(int32, int32_t, INT32_MIN, INT32_MAX, (double), (double),
+            NOT_NAN)
+DEFINE_ZONE(int64, int64_t, INT64_MIN, INT64_MAX, lower_int64, upper_int64,
+            NOT_NAN)
+DEFINE_ZONE(uint8, uint8_t, 0, UINT8_MAX, (double), (double), NOT_NAN)
+DEFINE_ZONE(uint16, uint16_t, 0, UINT16_MAX, (double), (double), NOT_NAN)
+DEFINE_ZONE(uint32, uint32_t, 0, UINT32_MAX, (double), (double), NOT_NAN)
+DEFINE_ZONE(uint64, uint64_t, 0, UINT64_MAX, lower_uint64, upper_uint64,
+            NOT_NAN)
+DEFINE_ZONE(float, float, -HUGE_VALF, HUGE_VALF, (double), (double),
+            IS_NAN)
+DEFINE_ZONE(double, double, -HUGE_VAL, HUGE_VAL, (double), (double),
+            IS_NAN)
+
+#undef DEFINE_ZONE
+
+KERNEL_TARGET
+static void K(zone)(const void *buf, size_t nitems, int kind,
+                    const void *fill, blosc_zone_t *zone){
+
+    switch (kind) {
+#define ZONE_CASE(KIND, name, type)                                         \
+    case KIND:                                                              \
+        K(zone_##name)((const type *)buf, nitems, (const type *)fill, zone); \
+        break;
+    ZONE_CASE(BLOSC_ZONE_INT8, int8, int8_t)
+    ZONE_CASE(BLOSC_ZONE_INT16, int16, int16_t)
+    ZONE_CASE(BLOSC_ZONE_INT32, int32, int32_t)
+    ZONE_CASE(BLOSC_ZONE_INT64, int64, int64_t)
+    ZONE_CASE(BLOSC_ZONE_UINT8, uint8, uint8_t)
+    ZONE_CASE(BLOSC_ZONE_UINT16, uint16, uint16_t)
+    ZONE_CASE(BLOSC_ZONE_UINT32, uint32, uint32_t)
+    ZONE_CASE(BLOSC_ZONE_UINT64, uint64, uint64_t)
+    ZONE_CASE(BLOSC_ZONE_FLOAT, float, float)
+    ZONE_CASE(BLOSC_ZONE_DOUBLE, double, double)
+#undef ZONE_CASE
+    }
+}
+
+static const kernel_table_t K(kernels) = {
+    KERNEL_STR(KERNEL_ISA),
+    K(is_constant),
+    K(trim),
+    K(delta),
+    K(shuffle),
+    K(unshuffle),
+    K(zone)
+};
+
+#undef CONSTANT_RUN
+#undef KERNEL_STR
+#undef KERNEL_STR2
+#undef K
+#undef KERNEL_PASTE
+#undef KERNEL_PASTE2
+#undef KERNEL_TARGET
+#undef KERNEL_ISA
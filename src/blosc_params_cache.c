@@ -0,0 +1,128 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Per-thread cache of the compression parameters of the Blosc filter.
+
+    HDF5 calls the filter once per chunk, each time with the cd_values of
+    the dataset, which then have to be parsed and checked against the
+    compressors of the Blosc library again.  The parameters prepared
+    from them are kept here, keyed by the cd_values, for the few datasets
+    a thread is working on at a time.
+
+*/
+
+
+#include <string.h>
+#include "blosc_filter_internal.h"
+
+#define CACHE_ENTRIES 8         /* Datasets remembered per thread */
+
+#if defined(_WIN32)
+
+/* No thread-local cache on Windows yet: parameters are always parsed */
+
+const blosc_params_t *blosc_params_cache_get(size_t cd_nelmts,
+                                             const unsigned cd_values[]){
+    (void)cd_nelmts;
+    (void)cd_values;
+    return NULL;
+}
+
+void blosc_params_cache_put(size_t cd_nelmts, const unsigned cd_values[],
+                            const blosc_params_t *params){
+    (void)cd_nelmts;
+    (void)cd_values;
+    (void)params;
+}
+
+#else
+
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct {
+    size_t cd_nelmts;           /* 0 for an unused entry */
+    unsigned cd_values[BLOSC_NPARAMS];
+    blosc_params_t params;
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t entries[CACHE_ENTRIES];
+    int last;                   /* Entry of the last hit */
+    int next;                   /* Entry replaced on the next miss */
+} params_cache_t;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void create_cache_key(void){
+    pthread_key_create(&cache_key, free);
+}
+
+static params_cache_t *get_cache(int create){
+
+    params_cache_t *cache;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    cache = (params_cache_t *)pthread_getspecific(cache_key);
+    if (cache == NULL && create) {
+        cache = (params_cache_t *)calloc(1, sizeof(params_cache_t));
+        if (cache != NULL && pthread_setspecific(cache_key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static int matches(const cache_entry_t *entry, size_t cd_nelmts,
+                   const unsigned cd_values[]){
+    return entry->cd_nelmts == cd_nelmts &&
+           memcmp(entry->cd_values, cd_values,
+                  cd_nelmts * sizeof(unsigned)) == 0;
+}
+
+const blosc_params_t *blosc_params_cache_get(size_t cd_nelmts,
+                                             const unsigned cd_values[]){
+
+    params_cache_t *cache;
+    int i;
+
+    if (cd_nelmts == 0 || cd_nelmts > BLOSC_NPARAMS) return NULL;
+    cache = get_cache(0);
+    if (cache == NULL) return NULL;
+
+    /* Chunks of the same dataset mostly come in a row */
+    if (matches(&cache->entries[cache->last], cd_nelmts, cd_values)) {
+        return &cache->entries[cache->last].params;
+    }
+    for (i = 0; i < CACHE_ENTRIES; i++) {
+        if (matches(&cache->entries[i], cd_nelmts, cd_values)) {
+            cache->last = i;
+            return &cache->entries[i].params;
+        }
+    }
+    return NULL;
+}
+
+void blosc_params_cache_put(size_t cd_nelmts, const unsigned cd_values[],
+                            const blosc_params_t *params){
+
+    params_cache_t *cache;
+    cache_entry_t *entry;
+
+    if (cd_nelmts == 0 || cd_nelmts > BLOSC_NPARAMS) return;
+    cache = get_cache(1);
+    if (cache == NULL) return;
+
+    entry = &cache->entries[cache->next];
+    entry->cd_nelmts = cd_nelmts;
+    memcpy(entry->cd_values, cd_values, cd_nelmts * sizeof(unsigned));
+    entry->params = *params;
+    cache->last = cache->next;
+    cache->next = (cache->next + 1) % CACHE_ENTRIES;
+}
+
+#endif
@@ -38,5 +38,10 @@ H5Z_class_t blosc_H5Filter[1] = {{
 H5PL_type_t H5PLget_plugin_type(void) {return H5PL_TYPE_FILTER;}
 
 
-const void* H5PLget_plugin_info(void) {return blosc_H5Filter;}
+const void* H5PLget_plugin_info(void) {
+    /* HDF5 asks right after loading the plugin: a good time to pick the
+       data kernels for this CPU, once and for all */
+    blosc_filter_get_isa();
+    return blosc_H5Filter;
+}
 
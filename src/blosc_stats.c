@@ -0,0 +1,579 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Process-wide performance counters of the Blosc filter.
+
+    Every call of blosc_filter() is accounted here with atomic additions,
+    so that threads running the filter at once don't wait on each other.  When the HDF5_BLOSC_STATS
+    environment variable is set (to anything but "0"), the counters are
+    printed to stderr when the process exits.
+
+    Calls are also traced here, to a callback or in the JSON trace event
+    format to a file.  Tracing is off unless asked for, and then costs
+    one flag check per call.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Lower bounds of the compression ratio histogram bins, in hundredths */
+static const unsigned ratio_bounds[FILTER_BLOSC_RATIO_BINS] = {
+    0, 125, 150, 200, 300, 400, 800, 1600
+};
+
+/* The counters of one direction, wall time in nanoseconds for integer
+   additions */
+typedef struct {
+    unsigned long long chunks;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long nanoseconds;
+} direction_counters_t;
+
+/* The counters, each updated atomically */
+static struct {
+    direction_counters_t direction[2];  /* Compress, decompress */
+    unsigned long long incompressible;
+    unsigned long long alloc_failures;
+    unsigned long long ratio_hist[FILTER_BLOSC_RATIO_BINS];
+} counters;
+
+/* Latency histograms, by compressor and direction, updated atomically
+   like the counters.  Compressors are only ever added, under the stats
+   mutex, a name being written before `ncodecs` counts it. */
+#define CODEC_NAME_SIZE 16
+static char codec_names[FILTER_BLOSC_MAX_CODECS][CODEC_NAME_SIZE];
+static int ncodecs = 0;
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long max_nanoseconds;
+    unsigned long long bins[FILTER_BLOSC_LATENCY_BINS];
+} latency_counters_t;
+
+static latency_counters_t latency[FILTER_BLOSC_MAX_CODECS][2];
+
+/* The trace callback, if tracing is on */
+static int tracing = 0;
+static blosc_filter_trace_fn trace_fn = NULL;
+static void *trace_arg = NULL;
+
+/* The trace file, when tracing to one */
+static FILE *trace_file = NULL;
+static int trace_events = 0;
+static int trace_atexit = 0;
+
+#if defined(_WIN32)
+
+/* No threads on Windows yet */
+#define LOCK_STATS()
+#define UNLOCK_STATS()
+#define LOCK_TRACE()
+#define UNLOCK_TRACE()
+#define LOCK_TRACE_FILE()
+#define UNLOCK_TRACE_FILE()
+
+static unsigned long thread_id(void){
+    return 1;
+}
+
+double blosc_stats_now(void){
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void init_stats(void);
+
+static void call_init_stats(void){
+
+    static int initialized = 0;
+
+    if (!initialized) {
+        initialized = 1;
+        init_stats();
+    }
+}
+
+#else
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static unsigned long nthreads_seen = 0;
+
+#define LOCK_STATS() pthread_mutex_lock(&stats_mutex)
+#define UNLOCK_STATS() pthread_mutex_unlock(&stats_mutex)
+#define LOCK_TRACE() pthread_mutex_lock(&trace_mutex)
+#define UNLOCK_TRACE() pthread_mutex_unlock(&trace_mutex)
+#define LOCK_TRACE_FILE() pthread_mutex_lock(&trace_file_mutex)
+#define UNLOCK_TRACE_FILE() pthread_mutex_unlock(&trace_file_mutex)
+
+static void make_thread_key(void){
+    pthread_key_create(&thread_key, NULL);
+}
+
+/* Threads are numbered as they first get traced, which makes for
+   shorter ids in traces than pthread_self() */
+static unsigned long thread_id(void){
+
+    void *id;
+
+    pthread_once(&thread_key_once, make_thread_key);
+    id = pthread_getspecific(thread_key);
+    if (id == NULL) {
+        LOCK_TRACE();
+        id = (void *)(size_t)++nthreads_seen;
+        UNLOCK_TRACE();
+        pthread_setspecific(thread_key, id);
+    }
+    return (unsigned long)(size_t)id;
+}
+
+double blosc_stats_now(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void init_stats(void);
+
+static void call_init_stats(void){
+    pthread_once(&stats_once, init_stats);
+}
+
+#endif
+
+/* Print the counters of one direction; speeds are given in uncompressed
+   bytes per second */
+static void print_direction(FILE *f, const char *name,
+                            const blosc_filter_direction_stats_t *d,
+                            unsigned long long uncompressed){
+
+    fprintf(f, "  %-10s %llu chunks, %llu bytes in, %llu bytes out, "
+            "%.3f s", name, d->chunks, d->bytes_in, d->bytes_out, d->seconds);
+    if (d->seconds > 0) {
+        fprintf(f, " (%.1f MB/s)", uncompressed / d->seconds / 1e6);
+    }
+    fprintf(f, "\n");
+}
+
+/* Print the percentiles of a latency histogram, if not empty */
+static void print_latency(FILE *f, const char *codec, const char *name,
+                          const blosc_filter_latency_t *h){
+
+    if (h->count == 0) return;
+    fprintf(f, "  %s %-10s %llu calls, p50 %.1f us, p99 %.1f us, "
+            "p99.9 %.1f us, max %.1f us\n", codec, name, h->count,
+            blosc_filter_latency_quantile(h, 0.5) * 1e6,
+            blosc_filter_latency_quantile(h, 0.99) * 1e6,
+            blosc_filter_latency_quantile(h, 0.999) * 1e6,
+            h->max_seconds * 1e6);
+}
+
+/* Print the counters to stderr, registered with atexit() */
+static void dump_stats(void){
+
+    blosc_filter_stats_t s;
+    blosc_filter_latency_t h;
+    int i, n;
+
+    blosc_filter_get_stats(&s);
+    fprintf(stderr, "Blosc filter statistics:\n");
+    print_direction(stderr, "compress", &s.compress, s.compress.bytes_in);
+    print_direction(stderr, "decompress", &s.decompress,
+                    s.decompress.bytes_out);
+    fprintf(stderr, "  incompressible chunks: %llu\n", s.incompressible);
+    fprintf(stderr, "  allocation failures: %llu\n", s.alloc_failures);
+    fprintf(stderr, "  compression ratios:");
+    for (i = 0; i < FILTER_BLOSC_RATIO_BINS; i++) {
+        fprintf(stderr, " >=%.2f: %llu", ratio_bounds[i] / 100.,
+                s.ratio_hist[i]);
+    }
+    fprintf(stderr, "\n");
+
+    n = BLOSC_ATOMIC_LOAD(ncodecs);
+    for (i = 0; i < n; i++) {
+        blosc_filter_get_latency(codec_names[i], 0, &h);
+        print_latency(stderr, codec_names[i], "compress", &h);
+        blosc_filter_get_latency(codec_names[i], 1, &h);
+        print_latency(stderr, codec_names[i], "decompress", &h);
+    }
+}
+
+static void init_stats(void){
+
+    char *envvar = getenv("HDF5_BLOSC_STATS");
+
+    if (envvar != NULL && *envvar != '\0' && strcmp(envvar, "0") != 0) {
+        atexit(dump_stats);
+    }
+    envvar = getenv("HDF5_BLOSC_TRACE");
+    if (envvar != NULL && *envvar != '\0' &&
+        blosc_filter_trace_to_file(envvar) < 0) {
+        fprintf(stderr, "Blosc filter: can't create trace file %s\n",
+                envvar);
+    }
+}
+
+static void get_direction(const direction_counters_t *c,
+                          blosc_filter_direction_stats_t *d){
+    d->chunks = BLOSC_ATOMIC_LOAD(c->chunks);
+    d->bytes_in = BLOSC_ATOMIC_LOAD(c->bytes_in);
+    d->bytes_out = BLOSC_ATOMIC_LOAD(c->bytes_out);
+    d->seconds = BLOSC_ATOMIC_LOAD(c->nanoseconds) * 1e-9;
+}
+
+void blosc_filter_get_stats(blosc_filter_stats_t *s){
+
+    int i;
+
+    get_direction(&counters.direction[0], &s->compress);
+    get_direction(&counters.direction[1], &s->decompress);
+    s->incompressible = BLOSC_ATOMIC_LOAD(counters.incompressible);
+    s->alloc_failures = BLOSC_ATOMIC_LOAD(counters.alloc_failures);
+    for (i = 0; i < FILTER_BLOSC_RATIO_BINS; i++) {
+        s->ratio_hist[i] = BLOSC_ATOMIC_LOAD(counters.ratio_hist[i]);
+    }
+}
+
+static void reset_latency(latency_counters_t *h){
+
+    int i;
+
+    BLOSC_ATOMIC_STORE(h->count, 0);
+    BLOSC_ATOMIC_STORE(h->max_nanoseconds, 0);
+    for (i = 0; i < FILTER_BLOSC_LATENCY_BINS; i++) {
+        BLOSC_ATOMIC_STORE(h->bins[i], 0);
+    }
+}
+
+static void reset_direction(direction_counters_t *c){
+    BLOSC_ATOMIC_STORE(c->chunks, 0);
+    BLOSC_ATOMIC_STORE(c->bytes_in, 0);
+    BLOSC_ATOMIC_STORE(c->bytes_out, 0);
+    BLOSC_ATOMIC_STORE(c->nanoseconds, 0);
+}
+
+void blosc_filter_reset_stats(void){
+
+    int i;
+
+    reset_direction(&counters.direction[0]);
+    reset_direction(&counters.direction[1]);
+    BLOSC_ATOMIC_STORE(counters.incompressible, 0);
+    BLOSC_ATOMIC_STORE(counters.alloc_failures, 0);
+    for (i = 0; i < FILTER_BLOSC_RATIO_BINS; i++) {
+        BLOSC_ATOMIC_STORE(counters.ratio_hist[i], 0);
+    }
+    for (i = 0; i < FILTER_BLOSC_MAX_CODECS; i++) {
+        reset_latency(&latency[i][0]);
+        reset_latency(&latency[i][1]);
+    }
+}
+
+/* Latency bins: 1 us wide below 2 * LATENCY_SUB us, then LATENCY_SUB of
+   them per power of two, the bin of v us (v >> m < 2 * LATENCY_SUB)
+   being LATENCY_SUB * m + (v >> m) */
+#define LATENCY_SUB 16
+
+static int latency_bin(double seconds){
+
+    double us = seconds * 1e6;
+    unsigned long long v;
+    int m = 0;
+
+    if (!(us > 0)) return 0;
+    if (us >= blosc_filter_latency_bound(FILTER_BLOSC_LATENCY_BINS - 1) * 1e6) {
+        return FILTER_BLOSC_LATENCY_BINS - 1;
+    }
+    v = (unsigned long long)us;
+    while ((v >> m) >= 2 * LATENCY_SUB) m++;
+    return LATENCY_SUB * m + (int)(v >> m);
+}
+
+double blosc_filter_latency_bound(int bin){
+
+    int m;
+
+    if (bin <= 0) return 0;
+    if (bin >= FILTER_BLOSC_LATENCY_BINS) bin = FILTER_BLOSC_LATENCY_BINS;
+    if (bin < 2 * LATENCY_SUB) return bin * 1e-6;
+    m = bin / LATENCY_SUB - 1;
+    return (double)((unsigned long long)(bin - LATENCY_SUB * m) << m) * 1e-6;
+}
+
+double blosc_filter_latency_quantile(const blosc_filter_latency_t *hist,
+                                     double q){
+
+    unsigned long long rank, seen = 0;
+    double upper;
+    int i;
+
+    if (hist->count == 0) return 0;
+    if (q < 0) q = 0;
+    if (q > 1) q = 1;
+    rank = (unsigned long long)(q * hist->count);
+    if (rank < q * hist->count || rank < 1) rank++;
+    for (i = 0; i < FILTER_BLOSC_LATENCY_BINS - 1; i++) {
+        seen += hist->bins[i];
+        if (seen >= rank) break;
+    }
+    upper = blosc_filter_latency_bound(i + 1);
+    return upper < hist->max_seconds ? upper : hist->max_seconds;
+}
+
+/* Look `codec` up in the first `n` slots of the histograms */
+static int find_codec(const char *codec, int n){
+
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(codec_names[i], codec) == 0) return i;
+    }
+    return -1;
+}
+
+/* The slot of the histograms of `codec`, taking the stats mutex only to
+   add it */
+static int codec_slot(const char *codec){
+
+    int i, n;
+
+    if (codec == NULL) codec = "unknown";
+    i = find_codec(codec, BLOSC_ATOMIC_LOAD(ncodecs));
+    if (i >= 0) return i;
+    LOCK_STATS();
+    n = BLOSC_ATOMIC_LOAD(ncodecs);
+    i = find_codec(codec, n);
+    if (i < 0 && n == FILTER_BLOSC_MAX_CODECS) i = n - 1;
+    if (i < 0) {
+        strncpy(codec_names[n], codec, CODEC_NAME_SIZE - 1);
+        BLOSC_ATOMIC_STORE(ncodecs, n + 1);
+        i = n;
+    }
+    UNLOCK_STATS();
+    return i;
+}
+
+void blosc_filter_get_latency(const char *codec, int reverse,
+                              blosc_filter_latency_t *hist){
+
+    const latency_counters_t *h;
+    double max_seconds;
+    int i, j, n = BLOSC_ATOMIC_LOAD(ncodecs);
+
+    memset(hist, 0, sizeof(*hist));
+    for (i = 0; i < n; i++) {
+        if (codec != NULL && strcmp(codec_names[i], codec) != 0) continue;
+        h = &latency[i][reverse != 0];
+        hist->count += BLOSC_ATOMIC_LOAD(h->count);
+        max_seconds = BLOSC_ATOMIC_LOAD(h->max_nanoseconds) * 1e-9;
+        if (max_seconds > hist->max_seconds) hist->max_seconds = max_seconds;
+        for (j = 0; j < FILTER_BLOSC_LATENCY_BINS; j++) {
+            hist->bins[j] += BLOSC_ATOMIC_LOAD(h->bins[j]);
+        }
+    }
+}
+
+void blosc_stats_record(int reverse, const char *codec, size_t nbytes_in,
+                        size_t nbytes_out, double seconds,
+                        int incompressible){
+
+    direction_counters_t *d = &counters.direction[reverse != 0];
+    latency_counters_t *h;
+    unsigned long long ns, max;
+    double ratio;
+    int i, bin = latency_bin(seconds);
+
+    call_init_stats();
+
+    /* Ratio of a compressed chunk, in hundredths, for the histogram */
+    ratio = nbytes_out > 0 ? (double)nbytes_in * 100 / nbytes_out : 100;
+
+    BLOSC_ATOMIC_ADD(d->chunks, 1);
+    BLOSC_ATOMIC_ADD(d->bytes_in, nbytes_in);
+    BLOSC_ATOMIC_ADD(d->bytes_out, nbytes_out);
+    ns = seconds > 0 ? (unsigned long long)(seconds * 1e9) : 0;
+    BLOSC_ATOMIC_ADD(d->nanoseconds, ns);
+    if (!reverse) {
+        for (i = FILTER_BLOSC_RATIO_BINS - 1; i > 0; i--) {
+            if (ratio >= ratio_bounds[i]) break;
+        }
+        BLOSC_ATOMIC_ADD(counters.ratio_hist[i], 1);
+        if (incompressible) BLOSC_ATOMIC_ADD(counters.incompressible, 1);
+    }
+
+    h = &latency[codec_slot(codec)][reverse != 0];
+    BLOSC_ATOMIC_ADD(h->count, 1);
+    BLOSC_ATOMIC_ADD(h->bins[bin], 1);
+    max = BLOSC_ATOMIC_LOAD(h->max_nanoseconds);
+    while (ns > max && !BLOSC_ATOMIC_CAS(h->max_nanoseconds, max, ns)) {
+        /* `max` now holds what another thread stored */
+    }
+}
+
+void blosc_stats_alloc_failure(void){
+    call_init_stats();
+    BLOSC_ATOMIC_ADD(counters.alloc_failures, 1);
+}
+
+
+/* Tracing */
+
+void blosc_filter_set_trace(blosc_filter_trace_fn fn, void *arg){
+    LOCK_TRACE();
+    trace_fn = fn;
+    trace_arg = arg;
+    BLOSC_ATOMIC_STORE(tracing, fn != NULL);
+    UNLOCK_TRACE();
+}
+
+/* FNV-1a hash of the cd_values, standing for the dataset */
+static unsigned long long hash_cd_values(size_t cd_nelmts,
+                                         const unsigned cd_values[]){
+
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < cd_nelmts; i++) {
+        h = (h ^ cd_values[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Report `event` to the callback */
+static void trace(int phase, const blosc_filter_trace_event_t *event){
+
+    blosc_filter_trace_fn fn;
+    void *arg;
+
+    LOCK_TRACE();
+    fn = trace_fn;
+    arg = trace_arg;
+    UNLOCK_TRACE();
+    if (fn != NULL) fn(phase, event, arg);
+}
+
+int blosc_trace_begin(blosc_filter_trace_event_t *event, int reverse,
+                      size_t cd_nelmts, const unsigned cd_values[],
+                      const char *codec, size_t nbytes, size_t cbytes,
+                      double start){
+
+    call_init_stats();
+    if (!BLOSC_ATOMIC_LOAD(tracing)) return 0;
+
+    event->reverse = reverse != 0;
+    event->dataset = hash_cd_values(cd_nelmts, cd_values);
+    event->codec = codec != NULL ? codec : "unknown";
+    event->nbytes = nbytes;
+    event->cbytes = cbytes;
+    event->thread = thread_id();
+    event->time = start;
+    event->seconds = 0;
+    event->status = 0;
+    trace(FILTER_BLOSC_TRACE_BEGIN, event);
+    return 1;
+}
+
+void blosc_trace_end(blosc_filter_trace_event_t *event, const char *codec,
+                     size_t nbytes, size_t cbytes, int status){
+
+    if (codec != NULL) event->codec = codec;
+    event->nbytes = nbytes;
+    event->cbytes = cbytes;
+    event->seconds = blosc_stats_now() - event->time;
+    event->status = status;
+    trace(FILTER_BLOSC_TRACE_END, event);
+}
+
+/* The callback writing trace events to the trace file, timed in
+   microseconds of the clock of the counters */
+static void write_trace_event(int phase,
+                              const blosc_filter_trace_event_t *event,
+                              void *arg){
+
+    double t = event->time + (phase == FILTER_BLOSC_TRACE_END ?
+                              event->seconds : 0);
+
+    (void)arg;
+    LOCK_TRACE_FILE();
+    if (trace_file != NULL) {
+        fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"blosc\","
+                "\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%lu,"
+                "\"args\":{\"dataset\":\"%016llx\",\"codec\":\"%s\","
+                "\"nbytes\":%llu,\"cbytes\":%llu",
+                trace_events++ > 0 ? "," : "",
+                event->reverse ? "decompress" : "compress",
+                phase == FILTER_BLOSC_TRACE_END ? "E" : "B",
+                t * 1e6, (long)getpid(), event->thread,
+                event->dataset, event->codec,
+                (unsigned long long)event->nbytes,
+                (unsigned long long)event->cbytes);
+        if (phase == FILTER_BLOSC_TRACE_END) {
+            fprintf(trace_file, ",\"status\":%d", event->status);
+        }
+        fprintf(trace_file, "}}");
+    }
+    UNLOCK_TRACE_FILE();
+}
+
+/* Finish the trace file, registered with atexit() */
+static void close_trace_file(void){
+    blosc_filter_trace_to_file(NULL);
+}
+
+int blosc_filter_trace_to_file(const char *path){
+
+    FILE *f = NULL;
+    int r = 0, first = 0;
+
+    if (path != NULL) {
+        f = fopen(path, "w");
+        if (f == NULL) return -1;
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    }
+
+    LOCK_TRACE_FILE();
+    if (trace_file != NULL) {
+        fprintf(trace_file, "\n]}\n");
+        if (fclose(trace_file) != 0) r = -1;
+    }
+    trace_file = f;
+    trace_events = 0;
+    if (f != NULL && !trace_atexit) first = trace_atexit = 1;
+    UNLOCK_TRACE_FILE();
+
+    if (f != NULL) {
+        if (first) atexit(close_trace_file);
+        blosc_filter_set_trace(write_trace_event, NULL);
+    } else {
+        /* Only stop tracing if the file was what it went to */
+        LOCK_TRACE();
+        if (trace_fn == write_trace_event) {
+            trace_fn = NULL;
+            BLOSC_ATOMIC_STORE(tracing, 0);
+        }
+        UNLOCK_TRACE();
+    }
+    return r;
+}
@@ -0,0 +1,676 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    The worker threads of the Blosc filter.
+
+    One pool of threads serves the whole process: the direct chunk
+    functions, the tools and blosc_filter() itself.  Each caller gets a
+    group of the pool with blosc_workers_create(), which caps how many
+    of its jobs run at once, so that a call asking for 2 threads does not
+    take the whole machine away from the host application.  Jobs of a
+    group are started in the order they are submitted.  Each job comes
+    with a `done` flag that is set once the job has run, so that callers
+    can collect results in order while later jobs are still running.
+
+    Every thread has a queue of its own and takes work from the queues
+    of the others when it runs out, those of the threads on its own NUMA
+    node first.  A job submitted with a buffer goes to a thread of the
+    node holding the buffer, so that chunks are compressed next to their
+    memory.  Threads can be pinned to a list of CPUs; otherwise, on
+    machines with several NUMA nodes, each one is kept on the CPUs of its
+    node.  A pool of 0 threads runs every job in the thread submitting
+    it, for applications that bring their own threads.  Threads empty
+    their buffer pools when they run out of work after a group is
+    destroyed, as they live as long as the process.
+
+*/
+
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* For pthread_setaffinity_np() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blosc_filter_internal.h"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+/* The most NUMA nodes and CPUs looked at */
+#define MAX_NODES 64
+#define MAX_CPUS 1024
+
+int blosc_workers_ncpus(void){
+
+    long ncpus = 1;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return ncpus > 0 ? (int)ncpus : 1;
+}
+
+/* Parse a CPU list like "0-3,8,10-11" into `cpus`; returns how many
+   there are, -1 if the list is not valid */
+static int parse_cpus(const char *list, int *cpus, int maxcpus){
+
+    char *end;
+    long lo, hi;
+    int n = 0;
+
+    while (*list != '\0' && *list != '\n') {
+        lo = strtol(list, &end, 10);
+        if (end == list || lo < 0) return -1;
+        hi = lo;
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list || hi < lo) return -1;
+        }
+        for (; lo <= hi; lo++) {
+            if (n == maxcpus || lo >= MAX_CPUS) return -1;
+            cpus[n++] = (int)lo;
+        }
+        list = end;
+        if (*list == ',') list++;
+        else if (*list != '\0' && *list != '\n') return -1;
+    }
+    return n;
+}
+
+
+#if defined(_WIN32)
+
+/* No threads on Windows yet: jobs run when they are submitted */
+
+struct blosc_workers {
+    int unused;
+};
+
+int blosc_filter_set_workers(int nthreads, const char *cpus){
+
+    int list[MAX_CPUS];
+
+    (void)nthreads;
+    if (cpus != NULL && parse_cpus(cpus, list, MAX_CPUS) <= 0) {
+        PUSH_ERR("blosc_filter_set_workers", H5E_BADVALUE, "Bad CPU list");
+        return -1;
+    }
+    return 0;
+}
+
+blosc_workers_t *blosc_workers_create(int nthreads){
+    (void)nthreads;
+    return (blosc_workers_t *)calloc(1, sizeof(blosc_workers_t));
+}
+
+void blosc_workers_destroy(blosc_workers_t *workers){
+    free(workers);
+}
+
+int blosc_workers_submit_near(blosc_workers_t *workers, blosc_work_fn fn,
+                              void *arg, const void *near, int *done){
+    (void)workers;
+    (void)near;
+    fn(arg);
+    *done = 1;
+    return 0;
+}
+
+void blosc_workers_wait(blosc_workers_t *workers, int *done){
+    (void)workers;
+    (void)done;
+}
+
+int blosc_workers_poll(blosc_workers_t *workers, int *done){
+    (void)workers;
+    return *done;
+}
+
+#else
+
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+typedef struct job {
+    blosc_work_fn fn;
+    void *arg;
+    int *done;
+    int node;                   /* NUMA node of its data, -1 if unknown */
+    blosc_workers_t *group;
+    struct job *next;
+} job_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    job_t *head, *tail;         /* Its queue */
+    int node;
+    int cpu;                    /* Pinned to it, -1 if not */
+    int *victims;               /* Threads to take work from, in order */
+    unsigned flushed;           /* pool->flushes when it last emptied its
+                                   buffer pool */
+    pthread_t thread;
+} worker_t;
+
+typedef struct {
+    worker_t *workers;
+    int nthreads;
+    int nstarted;               /* Threads running, all of them but
+                                   while the pool starts */
+    int nnodes;                 /* NUMA nodes the threads are on */
+    int node_cpus[MAX_NODES][MAX_CPUS / 32];    /* CPU bitmaps */
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   /* Signalled when a job is queued */
+    int queued;                 /* Jobs in the queues */
+    int shutdown;
+    unsigned flushes;           /* Groups destroyed so far */
+    unsigned next;              /* Round robin over the threads */
+} pool_t;
+
+struct blosc_workers {
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;   /* Broadcast when a job is done */
+    int limit;                  /* Jobs allowed to run at once */
+    int running;                /* Jobs handed to the pool, not done */
+    job_t *head, *tail;         /* Jobs held back by the limit */
+    int inline_jobs;            /* Run jobs when they are submitted */
+};
+
+/* The pool, started by the first group and stopped by
+   blosc_filter_set_workers() when no group is left */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pool = NULL;
+static int ngroups = 0;
+static int pool_configured = 0;
+static int pool_nthreads = -1;
+static int pool_cpus[MAX_CPUS];
+static int pool_ncpus = 0;
+
+static void set_bit(int *bitmap, int i){
+    bitmap[i / 32] |= 1 << (i % 32);
+}
+
+static int get_bit(const int *bitmap, int i){
+    return (bitmap[i / 32] >> (i % 32)) & 1;
+}
+
+/* Which node each CPU is on, from sysfs, and the ids of the nodes;
+   returns the number of nodes, 1 when the machine does not tell */
+static int read_topology(int *cpu_node, int *node_ids){
+
+    char path[64], line[4096];
+    int cpus[MAX_CPUS];
+    int node, nnodes = 0, n, i;
+    FILE *f;
+
+    for (i = 0; i < MAX_CPUS; i++) cpu_node[i] = -1;
+#if defined(__linux__)
+    for (node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (f == NULL) continue;
+        n = fgets(line, sizeof(line), f) != NULL ?
+            parse_cpus(line, cpus, MAX_CPUS) : -1;
+        fclose(f);
+        if (n <= 0) continue;
+        for (i = 0; i < n; i++) cpu_node[cpus[i]] = node;
+        node_ids[nnodes++] = node;
+    }
+#else
+    (void)path; (void)line; (void)cpus; (void)node; (void)n; (void)f;
+#endif
+    if (nnodes == 0) node_ids[nnodes++] = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (cpu_node[i] < 0) cpu_node[i] = node_ids[0];
+    }
+    return nnodes;
+}
+
+/* NUMA node holding the page of `p`, -1 if unknown */
+static int node_of(const void *p){
+
+#if defined(__linux__) && defined(SYS_move_pages)
+    long pagesize = sysconf(_SC_PAGESIZE);
+    void *page;
+    int status = -1;
+
+    page = (void *)((uintptr_t)p & ~(uintptr_t)(pagesize - 1));
+    /* Without target nodes, move_pages() only says where pages are */
+    if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) == 0 &&
+        status >= 0) return status;
+#else
+    (void)p;
+#endif
+    return -1;
+}
+
+/* Take the oldest job of the queue of `w` */
+static job_t *pop(worker_t *w){
+
+    job_t *job;
+
+    pthread_mutex_lock(&w->mutex);
+    job = w->head;
+    if (job != NULL) {
+        w->head = job->next;
+        if (w->head == NULL) w->tail = NULL;
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return job;
+}
+
+/* Queue a job on a thread of its node, or on any thread */
+static void post(job_t *job){
+
+    worker_t *w = NULL;
+    int i, k;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (k = 0; k < pool->nthreads && w == NULL; k++) {
+        i = (int)(pool->next++ % (unsigned)pool->nthreads);
+        if (job->node < 0 || pool->nnodes == 1 ||
+            pool->workers[i].node == job->node) w = &pool->workers[i];
+    }
+    if (w == NULL) w = &pool->workers[pool->next++ % (unsigned)pool->nthreads];
+    pool->queued++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job->next = NULL;
+    pthread_mutex_lock(&w->mutex);
+    if (w->tail != NULL) {
+        w->tail->next = job;
+    } else {
+        w->head = job;
+    }
+    w->tail = job;
+    pthread_mutex_unlock(&w->mutex);
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Run a job, then hand the next one of its group to the pool */
+static void run(job_t *job){
+
+    blosc_workers_t *group = job->group;
+    job_t *next;
+
+    job->fn(job->arg);
+
+    pthread_mutex_lock(&group->mutex);
+    *job->done = 1;
+    next = group->head;
+    if (next != NULL) {
+        group->head = next->next;
+        if (group->head == NULL) group->tail = NULL;
+    } else {
+        group->running--;
+    }
+    pthread_cond_broadcast(&group->done_cond);
+    pthread_mutex_unlock(&group->mutex);
+    free(job);
+    if (next != NULL) post(next);
+}
+
+/* Look for work in the queue of `w`, then in those of the others */
+static job_t *find_job(worker_t *w){
+
+    job_t *job = pop(w);
+    int i;
+
+    for (i = 0; job == NULL && i < pool->nthreads - 1; i++) {
+        job = pop(&pool->workers[w->victims[i]]);
+    }
+    return job;
+}
+
+static void *worker_main(void *arg){
+
+    worker_t *w = (worker_t *)arg;
+    job_t *job;
+
+    for (;;) {
+        job = find_job(w);
+        if (job != NULL) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->mutex);
+            run(job);
+            continue;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        /* A job counted as queued may not be in its queue yet */
+        while (pool->queued == 0 && !pool->shutdown &&
+               w->flushed == pool->flushes) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->queued == 0 && pool->shutdown) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        if (pool->queued == 0) {
+            /* Out of work since a group was destroyed: the buffers kept
+               for its jobs are given back rather than held for good */
+            w->flushed = pool->flushes;
+            pthread_mutex_unlock(&pool->mutex);
+            blosc_filter_buffer_flush();
+            continue;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+static void pin(worker_t *w){
+
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    if (w->cpu >= 0) {
+        CPU_SET(w->cpu, &set);
+    } else if (pool->nnodes > 1) {
+        for (i = 0; i < MAX_CPUS; i++) {
+            if (get_bit(pool->node_cpus[w->node], i)) CPU_SET(i, &set);
+        }
+    } else {
+        return;
+    }
+    /* Affinity is a hint: threads still run if it cannot be set */
+    pthread_setaffinity_np(w->thread, sizeof(set), &set);
+#else
+    (void)w;
+#endif
+}
+
+static void stop_pool(void){
+
+    int i;
+
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->nstarted; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->workers[i].mutex);
+        free(pool->workers[i].victims);
+    }
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool);
+    pool = NULL;
+}
+
+/* Start the threads, spread over the NUMA nodes; called with pool_mutex
+   held.  Returns -1 if they could not all be started. */
+static int start_pool(int nthreads){
+
+    static int cpu_node[MAX_CPUS];
+    int node_ids[MAX_NODES], order[MAX_CPUS];
+    int nnodes, ncpus, i, j, k, m, n;
+    worker_t *w;
+
+    pool = (pool_t *)calloc(1, sizeof(pool_t));
+    if (pool == NULL) return -1;
+    pool->workers = (worker_t *)calloc(nthreads, sizeof(worker_t));
+    if (pool->workers == NULL) {
+        free(pool);
+        pool = NULL;
+        return -1;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+
+    nnodes = read_topology(cpu_node, node_ids);
+    ncpus = blosc_workers_ncpus();
+    if (ncpus > MAX_CPUS) ncpus = MAX_CPUS;
+    for (i = 0; i < ncpus; i++) set_bit(pool->node_cpus[cpu_node[i]], i);
+
+    /* CPUs to go through, round robin over the nodes unless given */
+    if (pool_ncpus > 0) {
+        n = pool_ncpus;
+        memcpy(order, pool_cpus, n * sizeof(int));
+    } else {
+        n = 0;
+        for (k = 0; n < ncpus && k < ncpus; k++) {
+            for (j = 0; j < nnodes; j++) {
+                for (i = 0, m = 0; i < ncpus; i++) {
+                    if (cpu_node[i] == node_ids[j] && m++ == k) {
+                        order[n++] = i;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    pool->nnodes = nnodes;
+    pool->nthreads = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        w = &pool->workers[i];
+        pthread_mutex_init(&w->mutex, NULL);
+        w->cpu = pool_ncpus > 0 ? order[i % n] : -1;
+        w->node = cpu_node[order[i % n]];
+        w->victims = (int *)malloc((nthreads > 1 ? nthreads - 1 : 1) *
+                                   sizeof(int));
+    }
+    for (i = 0; i < nthreads; i++) {
+        w = &pool->workers[i];
+        if (w->victims == NULL) goto failed;
+        /* The threads of the same node first, the nearest in the pool */
+        for (k = 1, j = 0; k < nthreads; k++) {
+            if (pool->workers[(i + k) % nthreads].node == w->node) {
+                w->victims[j++] = (i + k) % nthreads;
+            }
+        }
+        for (k = 1; k < nthreads; k++) {
+            if (pool->workers[(i + k) % nthreads].node != w->node) {
+                w->victims[j++] = (i + k) % nthreads;
+            }
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        w = &pool->workers[i];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            goto failed;
+        }
+        pool->nstarted++;
+        pin(w);
+    }
+    return 0;
+
+ failed:
+    stop_pool();
+    return -1;
+}
+
+int blosc_filter_set_workers(int nthreads, const char *cpus){
+
+    int list[MAX_CPUS];
+    int n = 0;
+
+    if (cpus != NULL) {
+        n = parse_cpus(cpus, list, MAX_CPUS);
+        if (n <= 0) {
+            PUSH_ERR("blosc_filter_set_workers", H5E_BADVALUE, "Bad CPU list");
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&pool_mutex);
+    if (ngroups > 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        PUSH_ERR("blosc_filter_set_workers", H5E_CANTMODIFY,
+                 "The worker threads are in use");
+        return -1;
+    }
+    stop_pool();
+    pool_configured = 1;
+    pool_nthreads = nthreads;
+    pool_ncpus = n;
+    memcpy(pool_cpus, list, n * sizeof(int));
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+/* Whether the calling thread is one of the pool; called with pool_mutex
+   held */
+static int in_pool(void){
+
+    int i;
+
+    if (pool == NULL) return 0;
+    for (i = 0; i < pool->nthreads; i++) {
+        if (pthread_equal(pool->workers[i].thread, pthread_self())) return 1;
+    }
+    return 0;
+}
+
+blosc_workers_t *blosc_workers_create(int nthreads){
+
+    blosc_workers_t *group;
+    const char *envvar;
+    int size;
+
+    group = (blosc_workers_t *)calloc(1, sizeof(blosc_workers_t));
+    if (group == NULL) return NULL;
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done_cond, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_configured) {
+        pool_configured = 1;
+        envvar = getenv("HDF5_BLOSC_WORKERS");
+        if (envvar != NULL) pool_nthreads = atoi(envvar);
+        envvar = getenv("HDF5_BLOSC_WORKER_CPUS");
+        if (envvar != NULL) {
+            pool_ncpus = parse_cpus(envvar, pool_cpus, MAX_CPUS);
+            if (pool_ncpus < 0) pool_ncpus = 0;
+        }
+    }
+    size = pool_nthreads >= 0 ? pool_nthreads : blosc_workers_ncpus();
+    if (pool == NULL && size > 0 && start_pool(size) < 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        pthread_cond_destroy(&group->done_cond);
+        pthread_mutex_destroy(&group->mutex);
+        free(group);
+        return NULL;
+    }
+    /* Jobs submitted from a job run right away: waiting for them to be
+       picked up could wait on the very thread doing the waiting */
+    if (pool == NULL || in_pool()) {
+        group->inline_jobs = 1;
+    } else {
+        group->limit = nthreads > 0 && nthreads < pool->nthreads ?
+                       nthreads : pool->nthreads;
+    }
+    ngroups++;
+    pthread_mutex_unlock(&pool_mutex);
+    return group;
+}
+
+void blosc_workers_destroy(blosc_workers_t *workers){
+
+    if (workers == NULL) return;
+
+    /* Submitted jobs are still run */
+    pthread_mutex_lock(&workers->mutex);
+    while (workers->running > 0) {
+        pthread_cond_wait(&workers->done_cond, &workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_mutex_destroy(&workers->mutex);
+    free(workers);
+
+    pthread_mutex_lock(&pool_mutex);
+    ngroups--;
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->flushes++;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+int blosc_workers_submit_near(blosc_workers_t *workers, blosc_work_fn fn,
+                              void *arg, const void *near, int *done){
+
+    job_t *job;
+
+    if (workers->inline_jobs) {
+        fn(arg);
+        *done = 1;
+        return 0;
+    }
+
+    job = (job_t *)malloc(sizeof(job_t));
+    if (job == NULL) return -1;
+    job->fn = fn;
+    job->arg = arg;
+    job->done = done;
+    job->node = near != NULL && pool->nnodes > 1 ? node_of(near) : -1;
+    job->group = workers;
+    job->next = NULL;
+
+    pthread_mutex_lock(&workers->mutex);
+    *done = 0;
+    if (workers->running < workers->limit) {
+        workers->running++;
+        pthread_mutex_unlock(&workers->mutex);
+        post(job);
+        return 0;
+    }
+    if (workers->tail != NULL) {
+        workers->tail->next = job;
+    } else {
+        workers->head = job;
+    }
+    workers->tail = job;
+    pthread_mutex_unlock(&workers->mutex);
+    return 0;
+}
+
+void blosc_workers_wait(blosc_workers_t *workers, int *done){
+
+    pthread_mutex_lock(&workers->mutex);
+    while (!*done) {
+        pthread_cond_wait(&workers->done_cond, &workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+int blosc_workers_poll(blosc_workers_t *workers, int *done){
+
+    int r;
+
+    pthread_mutex_lock(&workers->mutex);
+    r = *done;
+    pthread_mutex_unlock(&workers->mutex);
+    return r;
+}
+
+#endif
+
+int blosc_workers_submit(blosc_workers_t *workers, blosc_work_fn fn,
+                         void *arg, int *done){
+    return blosc_workers_submit_near(workers, fn, arg, NULL, done);
+}
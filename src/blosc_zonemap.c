@@ -0,0 +1,665 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Zone maps of datasets compressed with the Blosc filter.
+
+    A zone map keeps the range of values of every chunk of a dataset, in
+    a companion dataset next to it (the name of the dataset with a
+    ".zonemap" suffix) holding one blosc_zone_t record per chunk, in C
+    order of the chunk grid, so that range queries only read the chunks
+    that may match.  The records of chunks nobody indexed are all zeros
+    (the fill value of the companion), i.e. not valid, and always read.
+    The chunk grid the map was written for is kept in its "chunk_grid"
+    attribute: along the first dimension the grid may grow (appending
+    rows only adds records at the end), along the others it may not.
+
+    The zones are computed by the direct chunk writers on the chunks they
+    compress, with blosc_zonemap_compute().  The filter itself can't, as
+    HDF5 does not allow calls back into the library from a filter.
+
+*/
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+
+/* Maximum rank of the datasets handled here, same as blosc_set_local() */
+#define MAX_NDIMS 32
+
+#define ZONEMAP_SUFFIX ".zonemap"
+#define ZONEMAP_GRID "chunk_grid"
+
+/* Records in a chunk of the companion dataset */
+#define ZONEMAP_CHUNK 1024
+
+struct blosc_zonemap {
+    hid_t map;                  /* The companion dataset */
+    hid_t rectype;              /* blosc_zone_t in memory */
+    int kind;                   /* BLOSC_ZONE_* */
+    int trim_bits;              /* Mantissa bits kept by the filter, if
+                                   it trims precision */
+    size_t typesize;
+    int ndims;
+    hsize_t grid[MAX_NDIMS];    /* Chunks along each dimension */
+    hsize_t nrecords;           /* Records in the companion */
+    int dirty;                  /* Written to, so the grid is saved on
+                                   close */
+    union {                     /* Fill value of the dataset, in its type */
+        double d;
+        unsigned long long u;
+    } fill;
+};
+
+/* The record type, the same in memory and in the file */
+static hid_t zone_type(void){
+
+    hid_t type = H5Tcreate(H5T_COMPOUND, sizeof(blosc_zone_t));
+
+    if (type < 0) return -1;
+    if (H5Tinsert(type, "min", HOFFSET(blosc_zone_t, min),
+                  H5T_NATIVE_DOUBLE) < 0 ||
+        H5Tinsert(type, "max", HOFFSET(blosc_zone_t, max),
+                  H5T_NATIVE_DOUBLE) < 0 ||
+        H5Tinsert(type, "nnan", HOFFSET(blosc_zone_t, nnan),
+                  H5T_NATIVE_ULLONG) < 0 ||
+        H5Tinsert(type, "nfill", HOFFSET(blosc_zone_t, nfill),
+                  H5T_NATIVE_ULLONG) < 0 ||
+        H5Tinsert(type, "valid", HOFFSET(blosc_zone_t, valid),
+                  H5T_NATIVE_INT) < 0) {
+        H5Tclose(type);
+        return -1;
+    }
+    return type;
+}
+
+/* The BLOSC_ZONE_* kind of a dataset type, with the matching native type
+   in `native`, or -1 for types zone maps are not kept for */
+static int zone_kind(hid_t type, hid_t *native){
+
+    const hid_t natives[] = {
+        H5T_NATIVE_INT8, H5T_NATIVE_INT16, H5T_NATIVE_INT32,
+        H5T_NATIVE_INT64, H5T_NATIVE_UINT8, H5T_NATIVE_UINT16,
+        H5T_NATIVE_UINT32, H5T_NATIVE_UINT64, H5T_NATIVE_FLOAT,
+        H5T_NATIVE_DOUBLE
+    };
+    int kind;
+
+    for (kind = BLOSC_ZONE_INT8; kind <= BLOSC_ZONE_DOUBLE; kind++) {
+        if (H5Tequal(type, natives[kind]) > 0) {
+            *native = natives[kind];
+            return kind;
+        }
+    }
+    return -1;
+}
+
+/* The path of the companion dataset of `dset`, to free() */
+static char *companion_name(const char *func, hid_t dset){
+
+    ssize_t len = H5Iget_name(dset, NULL, 0);
+    char *name;
+
+    if (len <= 0) {
+        PUSH_ERR(func, H5E_BADVALUE, "Zone maps need a named dataset");
+        return NULL;
+    }
+    name = (char *)malloc((size_t)len + sizeof(ZONEMAP_SUFFIX));
+    if (name == NULL) {
+        PUSH_ERR(func, H5E_CANTALLOC, "Can't allocate zone map name");
+        return NULL;
+    }
+    H5Iget_name(dset, name, (size_t)len + 1);
+    strcat(name, ZONEMAP_SUFFIX);
+    return name;
+}
+
+/* Read the chunk grid the map was last written for into `grid` */
+static int read_grid(hid_t map, int ndims, hsize_t *grid){
+
+    hid_t attr, space = -1;
+    int r = -1;
+
+    attr = H5Aopen(map, ZONEMAP_GRID, H5P_DEFAULT);
+    if (attr < 0) return -1;
+    space = H5Aget_space(attr);
+    if (space >= 0 && H5Sget_simple_extent_npoints(space) == ndims &&
+        H5Aread(attr, H5T_NATIVE_HSIZE, grid) >= 0) r = 0;
+    if (space >= 0) H5Sclose(space);
+    H5Aclose(attr);
+    return r;
+}
+
+static int write_grid(hid_t map, int ndims, const hsize_t *grid){
+
+    hsize_t n = (hsize_t)ndims;
+    hid_t attr = -1, space;
+    int r = -1;
+
+    space = H5Screate_simple(1, &n, NULL);
+    if (space < 0) return -1;
+    if (H5Aexists(map, ZONEMAP_GRID) > 0) {
+        attr = H5Aopen(map, ZONEMAP_GRID, H5P_DEFAULT);
+    } else {
+        attr = H5Acreate(map, ZONEMAP_GRID, H5T_NATIVE_HSIZE, space,
+                         H5P_DEFAULT, H5P_DEFAULT);
+    }
+    if (attr >= 0 && H5Awrite(attr, H5T_NATIVE_HSIZE, grid) >= 0) r = 0;
+    if (attr >= 0) H5Aclose(attr);
+    H5Sclose(space);
+    return r;
+}
+
+/* Create the companion dataset `name`, with a record per chunk */
+static hid_t create_companion(hid_t file, const char *name, hid_t rectype,
+                              hsize_t nrecords){
+
+    hsize_t maxdims = H5S_UNLIMITED, chunk = ZONEMAP_CHUNK;
+    hid_t space, dcpl = -1, map = -1;
+
+    space = H5Screate_simple(1, &nrecords, &maxdims);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if (space >= 0 && dcpl >= 0 && H5Pset_chunk(dcpl, 1, &chunk) >= 0 &&
+        H5Pset_deflate(dcpl, 1) >= 0) {
+        map = H5Dcreate(file, name, rectype, space, H5P_DEFAULT, dcpl,
+                        H5P_DEFAULT);
+    }
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (space >= 0) H5Sclose(space);
+    return map;
+}
+
+int blosc_zonemap_open(const char *func, hid_t dset, int create,
+                       blosc_zonemap_t **mapp){
+
+    blosc_zonemap_t *map = NULL;
+    hsize_t dims[MAX_NDIMS], chunkdims[MAX_NDIMS], grid[MAX_NDIMS];
+    hsize_t nchunks = 1;
+    hid_t file = -1, type = -1, space = -1, dcpl = -1, native = -1;
+    unsigned cd_values[BLOSC_MAX_SLOTS];
+    size_t cd_nelmts = BLOSC_MAX_SLOTS;
+    unsigned flags;
+    H5D_fill_value_t fill_status;
+    char *name = NULL;
+    int i, exists, r = -1;
+
+    *mapp = NULL;
+    name = companion_name(func, dset);
+    if (name == NULL) return -1;
+    file = H5Iget_file_id(dset);
+    if (file < 0) goto done;
+    exists = H5Lexists(file, name, H5P_DEFAULT);
+    if (exists < 0) goto done;
+    if (!exists && !create) {
+        r = 0;
+        goto done;
+    }
+
+    map = (blosc_zonemap_t *)calloc(1, sizeof(blosc_zonemap_t));
+    if (map == NULL) {
+        PUSH_ERR(func, H5E_CANTALLOC, "Can't allocate zone map");
+        goto done;
+    }
+    map->map = map->rectype = -1;
+
+    type = H5Dget_type(dset);
+    space = H5Dget_space(dset);
+    dcpl = H5Dget_create_plist(dset);
+    if (type < 0 || space < 0 || dcpl < 0) goto done;
+    map->kind = zone_kind(type, &native);
+    map->typesize = H5Tget_size(type);
+    map->ndims = H5Sget_simple_extent_ndims(space);
+    if (map->kind < 0 || H5Pget_layout(dcpl) != H5D_CHUNKED ||
+        map->ndims < 1 || map->ndims > MAX_NDIMS) {
+        PUSH_ERR(func, H5E_BADTYPE, "Zone maps need a chunked dataset of a "
+                 "native integer or floating-point type");
+        goto done;
+    }
+    if (H5Sget_simple_extent_dims(space, dims, NULL) < 0 ||
+        H5Pget_chunk(dcpl, MAX_NDIMS, chunkdims) != map->ndims) goto done;
+    for (i = 0; i < map->ndims; i++) {
+        map->grid[i] = (dims[i] + chunkdims[i] - 1) / chunkdims[i];
+        nchunks *= map->grid[i];
+    }
+
+    /* Zones are of the values as stored, so after trimming */
+    if (GET_FILTER(dcpl, FILTER_BLOSC, &flags, &cd_nelmts, cd_values, 0,
+                   NULL) >= 0 && cd_nelmts >= 15) {
+        map->trim_bits = (int)cd_values[14];
+    }
+    if (H5Pfill_value_defined(dcpl, &fill_status) >= 0 &&
+        fill_status != H5D_FILL_VALUE_UNDEFINED &&
+        H5Pget_fill_value(dcpl, native, &map->fill) < 0) goto done;
+
+    map->rectype = zone_type();
+    if (map->rectype < 0) goto done;
+    if (exists && create && H5Ldelete(file, name, H5P_DEFAULT) < 0) {
+        goto done;
+    }
+    if (create) {
+        map->map = create_companion(file, name, map->rectype, nchunks);
+        if (map->map < 0) goto done;
+        map->nrecords = nchunks;
+        map->dirty = 1;
+    } else {
+        map->map = H5Dopen(file, name, H5P_DEFAULT);
+        if (map->map < 0) goto done;
+        H5Sclose(space);
+        space = H5Dget_space(map->map);
+        if (space < 0) goto done;
+        map->nrecords = (hsize_t)H5Sget_simple_extent_npoints(space);
+        if (read_grid(map->map, map->ndims, grid) < 0) {
+            PUSH_ERR(func, H5E_BADVALUE, "Invalid zone map");
+            goto done;
+        }
+        for (i = 1; i < map->ndims; i++) {
+            if (grid[i] != map->grid[i]) {
+                PUSH_ERR(func, H5E_BADVALUE, "Zone map out of date, build "
+                         "it again with blosc_zonemap_build()");
+                goto done;
+            }
+        }
+    }
+    r = 1;
+
+ done:
+    if (r > 0) {
+        *mapp = map;
+    } else if (map != NULL) {
+        if (map->map >= 0) H5Dclose(map->map);
+        if (map->rectype >= 0) H5Tclose(map->rectype);
+        free(map);
+    }
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (space >= 0) H5Sclose(space);
+    if (type >= 0) H5Tclose(type);
+    if (file >= 0) H5Fclose(file);
+    free(name);
+    return r;
+}
+
+/* Trim a value as the filter does */
+static double trim_value(int kind, double v, int keep_bits){
+
+    float f;
+
+    if (!isfinite(v)) return v;
+    if (kind == BLOSC_ZONE_FLOAT) {
+        f = (float)v;
+        blosc_kernel_trim(&f, sizeof(f), sizeof(f), keep_bits);
+        return f;
+    }
+    blosc_kernel_trim(&v, sizeof(v), sizeof(v), keep_bits);
+    return v;
+}
+
+/* Advance the multidimensional index `idx` within [lo, hi).  Returns 0
+   once every index has been visited. */
+static int next_index(int ndims, const hsize_t *lo, const hsize_t *hi,
+                      hsize_t *idx){
+
+    int i;
+
+    for (i = ndims - 1; i >= 0; i--) {
+        if (++idx[i] < hi[i]) return 1;
+        idx[i] = lo[i];
+    }
+    return 0;
+}
+
+void blosc_zonemap_compute(const blosc_zonemap_t *map, const void *buf,
+                           const hsize_t *bufdims, const hsize_t *lo,
+                           const hsize_t *ext, blosc_zone_t *zone){
+
+    size_t stride[MAX_NDIMS], nitems, off;
+    hsize_t zero[MAX_NDIMS], idx[MAX_NDIMS];
+    int i, k;
+
+    zone->min = HUGE_VAL;
+    zone->max = -HUGE_VAL;
+    zone->nnan = zone->nfill = 0;
+    zone->valid = 1;
+
+    /* Contiguous runs span dimension k and every full one after it, as in
+       copy_runs() */
+    stride[map->ndims - 1] = 1;
+    for (i = map->ndims - 1; i > 0; i--) {
+        stride[i - 1] = stride[i] * bufdims[i];
+    }
+    k = map->ndims - 1;
+    while (k > 0 && ext[k] == bufdims[k]) k--;
+    nitems = ext[k] * stride[k];
+
+    for (i = 0; i < map->ndims; i++) {
+        zero[i] = idx[i] = 0;
+    }
+    do {
+        off = 0;
+        for (i = 0; i < map->ndims; i++) {
+            off += (lo[i] + (i < k ? idx[i] : 0)) * stride[i];
+        }
+        blosc_kernel_zone((const char *)buf + off * map->typesize, nitems,
+                          map->kind, &map->fill, zone);
+    } while (k > 0 && next_index(k, zero, ext, idx));
+
+    /* Trimming never moves a value past another, so it maps the range of
+       the values to that of the trimmed ones */
+    if (map->trim_bits > 0 && (map->kind == BLOSC_ZONE_FLOAT ||
+                               map->kind == BLOSC_ZONE_DOUBLE) &&
+        zone->min <= zone->max) {
+        zone->min = trim_value(map->kind, zone->min, map->trim_bits);
+        zone->max = trim_value(map->kind, zone->max, map->trim_bits);
+    }
+}
+
+/* The index of the chunk with indices `cidx` in the record order */
+static hsize_t record_of(const blosc_zonemap_t *map, const hsize_t *cidx){
+
+    hsize_t rec = 0;
+    int i;
+
+    for (i = 0; i < map->ndims; i++) {
+        rec = rec * map->grid[i] + cidx[i];
+    }
+    return rec;
+}
+
+int blosc_zonemap_put(blosc_zonemap_t *map, size_t n, const hsize_t *cidx,
+                      const blosc_zone_t *zones){
+
+    hsize_t *coords, count = n, need = 0;
+    hid_t fspace = -1, mspace = -1;
+    size_t i;
+    int r = -1;
+
+    if (n == 0) return 0;
+    map->dirty = 1;
+    coords = (hsize_t *)malloc(n * sizeof(hsize_t));
+    if (coords == NULL) {
+        PUSH_ERR("blosc_zonemap_put", H5E_CANTALLOC,
+                 "Can't allocate zone map records");
+        return -1;
+    }
+    /* Appended rows add chunks along the first dimension only, whose
+       records go at the end */
+    for (i = 0; i < n; i++) {
+        if (cidx[i * map->ndims] >= map->grid[0]) {
+            map->grid[0] = cidx[i * map->ndims] + 1;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        coords[i] = record_of(map, cidx + i * map->ndims);
+        if (coords[i] >= need) need = coords[i] + 1;
+    }
+    if (need > map->nrecords) {
+        if (H5Dset_extent(map->map, &need) < 0) goto done;
+        map->nrecords = need;
+    }
+
+    fspace = H5Dget_space(map->map);
+    mspace = H5Screate_simple(1, &count, NULL);
+    if (fspace < 0 || mspace < 0 ||
+        H5Sselect_elements(fspace, H5S_SELECT_SET, n, coords) < 0 ||
+        H5Dwrite(map->map, map->rectype, mspace, fspace, H5P_DEFAULT,
+                 zones) < 0) goto done;
+    r = 0;
+
+ done:
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    free(coords);
+    return r;
+}
+
+int blosc_zonemap_close(blosc_zonemap_t *map){
+
+    int r = 0;
+
+    if (map == NULL) return 0;
+    /* Queries leave the file alone, read-only as it may be */
+    if (map->dirty && write_grid(map->map, map->ndims, map->grid) < 0) {
+        r = -1;
+    }
+    H5Dclose(map->map);
+    H5Tclose(map->rectype);
+    free(map);
+    return r;
+}
+
+/* Read every record of the map, to free() */
+static blosc_zone_t *read_zones(blosc_zonemap_t *map){
+
+    blosc_zone_t *zones;
+
+    zones = (blosc_zone_t *)calloc(map->nrecords > 0 ? map->nrecords : 1,
+                                   sizeof(blosc_zone_t));
+    if (zones == NULL) {
+        PUSH_ERR("blosc_zonemap", H5E_CANTALLOC,
+                 "Can't allocate zone map records");
+        return NULL;
+    }
+    if (map->nrecords > 0 &&
+        H5Dread(map->map, map->rectype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                zones) < 0) {
+        free(zones);
+        return NULL;
+    }
+    return zones;
+}
+
+/* Open the zone map of `dset` for a query, failing if there is none */
+static blosc_zonemap_t *open_for_query(const char *func, hid_t dset){
+
+    blosc_zonemap_t *map;
+    int r = blosc_zonemap_open(func, dset, 0, &map);
+
+    if (r == 0) {
+        PUSH_ERR(func, H5E_NOTFOUND, "Dataset has no zone map");
+    }
+    return r > 0 ? map : NULL;
+}
+
+unsigned char *blosc_zonemap_wanted(const char *func, hid_t dset, double lo,
+                                    double hi, hsize_t *nchunks){
+
+    blosc_zonemap_t *map = open_for_query(func, dset);
+    blosc_zone_t *zones = NULL;
+    unsigned char *wanted = NULL;
+    hsize_t i, n = 1;
+    int k;
+
+    if (map == NULL) return NULL;
+    for (k = 0; k < map->ndims; k++) {
+        n *= map->grid[k];
+    }
+    zones = read_zones(map);
+    if (zones != NULL) {
+        wanted = (unsigned char *)malloc(n > 0 ? n : 1);
+        if (wanted == NULL) {
+            PUSH_ERR(func, H5E_CANTALLOC, "Can't allocate chunk list");
+        }
+    }
+    /* Chunks past the records (rows appended since) are not indexed */
+    for (i = 0; wanted != NULL && i < n; i++) {
+        wanted[i] = i >= map->nrecords || !zones[i].valid ||
+                    (zones[i].max >= lo && zones[i].min <= hi);
+    }
+    *nchunks = n;
+    free(zones);
+    blosc_zonemap_close(map);
+    return wanted;
+}
+
+int blosc_zonemap_build(hid_t dset, int nthreads){
+
+    blosc_zonemap_t *map = NULL;
+    blosc_zone_t *zones = NULL;
+    hsize_t dims[MAX_NDIMS], chunkdims[MAX_NDIMS], start[MAX_NDIMS];
+    hsize_t count[MAX_NDIMS], lo[MAX_NDIMS], ext[MAX_NDIMS];
+    hsize_t cidx[MAX_NDIMS], chi[MAX_NDIMS], zero[MAX_NDIMS];
+    hsize_t *idx = NULL, row;
+    hid_t space = -1, dcpl = -1;
+    size_t nbytes, n, nper = 1;
+    char *buf = NULL;
+    int i, r = -1;
+
+    if (blosc_zonemap_open("blosc_zonemap_build", dset, 1, &map) < 0) {
+        return -1;
+    }
+    space = H5Dget_space(dset);
+    dcpl = H5Dget_create_plist(dset);
+    if (space < 0 || dcpl < 0 ||
+        H5Sget_simple_extent_dims(space, dims, NULL) < 0 ||
+        H5Pget_chunk(dcpl, MAX_NDIMS, chunkdims) != map->ndims) goto done;
+
+    /* Chunks are read a row of them at a time, all those sharing their
+       index along the first dimension */
+    nbytes = map->typesize * (size_t)chunkdims[0];
+    for (i = 1; i < map->ndims; i++) {
+        nbytes *= (size_t)dims[i];
+        nper *= (size_t)map->grid[i];
+    }
+    buf = (char *)malloc(nbytes > 0 ? nbytes : 1);
+    zones = (blosc_zone_t *)malloc(nper * sizeof(blosc_zone_t));
+    idx = (hsize_t *)malloc(nper * map->ndims * sizeof(hsize_t));
+    if (buf == NULL || zones == NULL || idx == NULL) {
+        PUSH_ERR("blosc_zonemap_build", H5E_CANTALLOC,
+                 "Can't allocate chunk buffers");
+        goto done;
+    }
+
+    /* An empty dataset has no chunks to index */
+    for (i = 0; i < map->ndims; i++) {
+        if (dims[i] == 0) {
+            r = 0;
+            goto done;
+        }
+    }
+
+    for (row = 0; row < map->grid[0]; row++) {
+        for (i = 0; i < map->ndims; i++) {
+            start[i] = 0;
+            count[i] = dims[i];
+            zero[i] = cidx[i] = 0;
+            chi[i] = map->grid[i];
+        }
+        start[0] = row * chunkdims[0];
+        count[0] = dims[0] - start[0] < chunkdims[0] ? dims[0] - start[0] :
+                                                       chunkdims[0];
+        if (blosc_read_chunks(dset, start, count, buf, nthreads) < 0) {
+            goto done;
+        }
+        n = 0;
+        chi[0] = 1;
+        do {
+            /* The chunk within the row read, clipped to the dataset */
+            for (i = 0; i < map->ndims; i++) {
+                lo[i] = cidx[i] * chunkdims[i];
+                ext[i] = i == 0 ? count[0] :
+                         dims[i] - lo[i] < chunkdims[i] ? dims[i] - lo[i] :
+                                                          chunkdims[i];
+                idx[n * map->ndims + i] = i == 0 ? row : cidx[i];
+            }
+            blosc_zonemap_compute(map, buf, count, lo, ext, &zones[n++]);
+        } while (next_index(map->ndims, zero, chi, cidx));
+        if (blosc_zonemap_put(map, n, idx, zones) < 0) goto done;
+    }
+    r = 0;
+
+ done:
+    if (blosc_zonemap_close(map) < 0) r = -1;
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (space >= 0) H5Sclose(space);
+    free(buf);
+    free(zones);
+    free(idx);
+    return r;
+}
+
+int blosc_zonemap_get(hid_t dset, const hsize_t *offset, blosc_zone_t *zone){
+
+    blosc_zonemap_t *map = open_for_query("blosc_zonemap_get", dset);
+    hsize_t cidx[MAX_NDIMS], chunkdims[MAX_NDIMS], rec, one = 1;
+    hid_t fspace = -1, mspace = -1, dcpl;
+    int i, r = -1;
+
+    if (map == NULL) return -1;
+    memset(zone, 0, sizeof(*zone));
+    dcpl = H5Dget_create_plist(dset);
+    if (dcpl < 0 || H5Pget_chunk(dcpl, MAX_NDIMS, chunkdims) != map->ndims) {
+        goto done;
+    }
+    for (i = 0; i < map->ndims; i++) {
+        cidx[i] = offset[i] / chunkdims[i];
+        if (cidx[i] >= map->grid[i]) {
+            PUSH_ERR("blosc_zonemap_get", H5E_BADRANGE,
+                     "Chunk offset out of the dataset bounds");
+            goto done;
+        }
+    }
+    rec = record_of(map, cidx);
+    if (rec >= map->nrecords) {                 /* Not indexed */
+        r = 0;
+        goto done;
+    }
+    fspace = H5Dget_space(map->map);
+    mspace = H5Screate_simple(1, &one, NULL);
+    if (fspace >= 0 && mspace >= 0 &&
+        H5Sselect_elements(fspace, H5S_SELECT_SET, 1, &rec) >= 0 &&
+        H5Dread(map->map, map->rectype, mspace, fspace, H5P_DEFAULT,
+                zone) >= 0) r = 0;
+
+ done:
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    blosc_zonemap_close(map);
+    return r;
+}
+
+hssize_t blosc_zonemap_select(hid_t dset, double lo, double hi,
+                              hsize_t *offsets, size_t maxchunks){
+
+    unsigned char *wanted;
+    hsize_t nchunks, i, rest, chunkdims[MAX_NDIMS], grid[MAX_NDIMS];
+    hid_t dcpl, space;
+    hsize_t dims[MAX_NDIMS];
+    hssize_t n = 0;
+    int k, ndims;
+
+    wanted = blosc_zonemap_wanted("blosc_zonemap_select", dset, lo, hi,
+                                  &nchunks);
+    if (wanted == NULL) return -1;
+    dcpl = H5Dget_create_plist(dset);
+    space = H5Dget_space(dset);
+    ndims = dcpl >= 0 ? H5Pget_chunk(dcpl, MAX_NDIMS, chunkdims) : -1;
+    if (space < 0 || ndims < 1 ||
+        H5Sget_simple_extent_dims(space, dims, NULL) != ndims) {
+        n = -1;
+        goto done;
+    }
+    for (k = 0; k < ndims; k++) {
+        grid[k] = (dims[k] + chunkdims[k] - 1) / chunkdims[k];
+    }
+    for (i = 0; i < nchunks; i++) {
+        if (!wanted[i]) continue;
+        if ((size_t)n < maxchunks) {
+            for (k = ndims - 1, rest = i; k >= 0; k--) {
+                offsets[n * ndims + k] = rest % grid[k] * chunkdims[k];
+                rest /= grid[k];
+            }
+        }
+        n++;
+    }
+
+ done:
+    if (space >= 0) H5Sclose(space);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    free(wanted);
+    return n;
+}
@@ -9,7 +9,9 @@
 
     To compile this program:
 
-    h5cc blosc_filter.c example.c -o example -lblosc -lpthread
+    h5cc blosc_filter.c blosc_buffer_pool.c blosc_stats.c blosc_kernels.c \
+        blosc_params_cache.c blosc_dict.c blosc_fields.c example.c \
+        -o example -lblosc -lpthread
 
     To run:
 
@@ -87,6 +89,8 @@ int main(){
     cd_values[4] = 4;       /* compression level */
     cd_values[5] = 1;       /* 0: shuffle not active, 1: shuffle active */
     cd_values[6] = BLOSC_LZ4HC; /* the actual compressor to use */
+    /* An 8th param (cd_values[7]) would set the number of threads used
+       to (de)compress each chunk; it defaults to 1. */
 
     /* Set the filter with 7 params */
     r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7, cd_values);
@@ -0,0 +1,441 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Codec advisor: samples the chunks of the datasets of an HDF5 file and
+    tries every compressor, compression level and shuffle mode on them,
+    to recommend the cd_values[4] to cd_values[6] of each dataset.
+
+    The cd_values of each trial are filled in by blosc_set_local() and
+    the samples compressed and decompressed with the chunk codec of the
+    filter, so ratios and speeds are those blosc_filter() would get.
+    Trials run in parallel on a pool of threads, one trial per thread at a
+    time, each compressing with one Blosc thread as HDF5 would.  For each
+    dataset the trials no other one beats on ratio, compression and
+    decompression speed at the same time are printed, fastest first, and
+    the one of best ratio that still compresses and decompresses at the
+    speeds given is recommended.
+
+    To run:
+
+    $ ./h5blosc-advise [-n samples] [-c compressors] [-l levels]
+          [-s shuffles] [-m MB/s] [-t nthreads] file.h5 [dataset ...]
+
+      -n  chunks sampled per dataset (default: 8)
+      -c  compressors (default: all those blosc_list_compressors() reports)
+      -l  compression levels (default: 1,3,5,7,9)
+      -s  shuffle modes, 0 none, 1 byte, 2 bit (default: 0,1,2)
+      -m  slowest acceptable compression and decompression speed,
+          in uncompressed MB/s (default: 200)
+      -t  threads running trials (default: one per processor)
+
+    Without dataset names every chunkable dataset of the file is sampled.
+    The recommendation comes as a line like
+
+        /group/dataset: cd_values[4..6] = {5, 2, 5}  (-c zstd -l 5 -s 2)
+
+    holding what goes in the cd_values given to H5Pset_filter(), and the
+    options of h5blosc-transcode doing the same.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+#include "h5blosc_tools.h"
+
+#define MIN_SECONDS 0.02        /* Samples are compressed again until then */
+
+typedef struct {
+    const char *codecs[MAX_ITEMS];
+    int ncodecs;
+    int levels[MAX_ITEMS];
+    int nlevels;
+    int shuffles[MAX_ITEMS];
+    int nshuffles;
+    int nsamples;
+    double min_speed;
+    int nthreads;
+} options_t;
+
+/* The chunks sampled from a dataset */
+typedef struct {
+    char *data;                 /* nsamples chunks, one after the other */
+    int nsamples;
+    size_t chunksize;
+} samples_t;
+
+/* One compressor, level and shuffle, and how it did */
+typedef struct {
+    const samples_t *samples;
+    const char *codec;
+    int clevel;
+    int shuffle;
+    unsigned cd_values[MAX_CD_VALUES];
+    size_t cd_nelmts;
+    double ratio;
+    double cspeed, dspeed;      /* MB/s, uncompressed */
+    int failed;
+    int done;
+} trial_t;
+
+
+/* Worker job: compress and decompress the samples with a trial's
+   cd_values, over and over for MIN_SECONDS at least */
+static void run_trial(void *arg){
+
+    trial_t *trial = (trial_t *)arg;
+    const samples_t *s = trial->samples;
+    size_t outsize = blosc_filter_encode_bound(trial->cd_nelmts,
+                                               trial->cd_values,
+                                               s->chunksize);
+    char *src = (char *)malloc(s->chunksize);
+    char *out = (char *)malloc(outsize);
+    char *back = (char *)malloc(s->chunksize);
+    double ctime = 0, dtime = 0, t0, nbytes = 0, cbytes = 0;
+    size_t n;
+    int i, r, rounds = 0;
+
+    trial->failed = 1;
+    if (src == NULL || out == NULL || back == NULL) goto done;
+    while (rounds == 0 || (ctime < MIN_SECONDS && dtime < MIN_SECONDS)) {
+        for (i = 0; i < s->nsamples; i++) {
+            /* The pre-filters may run in place */
+            memcpy(src, s->data + i * s->chunksize, s->chunksize);
+            t0 = blosc_stats_now();
+            r = blosc_filter_encode(trial->cd_nelmts, trial->cd_values, 1,
+                                    src, s->chunksize, out, outsize, &n);
+            ctime += blosc_stats_now() - t0;
+            if (r < 0) goto done;
+            t0 = blosc_stats_now();
+            if (r > 0) {
+                /* Stored as is: reading it back is a copy */
+                memcpy(back, src, s->chunksize);
+                n = s->chunksize;
+            } else if (blosc_filter_decode(trial->cd_nelmts, trial->cd_values,
+                                           1, out, n, back,
+                                           s->chunksize) < 0) {
+                goto done;
+            }
+            dtime += blosc_stats_now() - t0;
+            if (rounds == 0) {
+                if (memcmp(back, s->data + i * s->chunksize,
+                           s->chunksize) != 0) goto done;
+                cbytes += n;
+            }
+        }
+        rounds++;
+    }
+    nbytes = (double)s->chunksize * s->nsamples;
+    trial->ratio = nbytes / cbytes;
+    trial->cspeed = nbytes * rounds / 1e6 / (ctime > 0 ? ctime : 1e-9);
+    trial->dspeed = nbytes * rounds / 1e6 / (dtime > 0 ? dtime : 1e-9);
+    trial->failed = 0;
+
+ done:
+    free(src);
+    free(out);
+    free(back);
+}
+
+/* Read `nsamples` chunks spread over the dataset, padded with zeros past
+   its edges */
+static int read_samples(hid_t dset, hid_t type, int ndims, const hsize_t *dims,
+                        const hsize_t *chunkdims, samples_t *s){
+
+    hsize_t nchunks = 1, idx, start[MAX_NDIMS], count[MAX_NDIMS];
+    hsize_t zero[MAX_NDIMS], grid[MAX_NDIMS];
+    hid_t fspace = -1, mspace = -1;
+    int i, k, r = -1;
+
+    for (i = 0; i < ndims; i++) {
+        grid[i] = (dims[i] + chunkdims[i] - 1) / chunkdims[i];
+        nchunks *= grid[i];
+        zero[i] = 0;
+    }
+    if (nchunks == 0) return 0;
+    if ((hsize_t)s->nsamples > nchunks) s->nsamples = (int)nchunks;
+    s->data = (char *)calloc((size_t)s->nsamples, s->chunksize);
+    if (s->data == NULL) return -1;
+
+    fspace = H5Dget_space(dset);
+    mspace = H5Screate_simple(ndims, chunkdims, NULL);
+    if (fspace < 0 || mspace < 0) goto done;
+    for (k = 0; k < s->nsamples; k++) {
+        idx = (hsize_t)k * nchunks / s->nsamples;
+        for (i = ndims - 1; i >= 0; i--) {
+            start[i] = idx % grid[i] * chunkdims[i];
+            idx /= grid[i];
+            count[i] = dims[i] - start[i];
+            if (count[i] > chunkdims[i]) count[i] = chunkdims[i];
+        }
+        if (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count,
+                                NULL) < 0 ||
+            H5Sselect_hyperslab(mspace, H5S_SELECT_SET, zero, NULL, count,
+                                NULL) < 0 ||
+            H5Dread(dset, type, mspace, fspace, H5P_DEFAULT,
+                    s->data + k * s->chunksize) < 0) goto done;
+    }
+    r = 0;
+
+ done:
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    return r;
+}
+
+/* The cd_values blosc_set_local() fills in for a trial */
+static int trial_cd_values(hid_t type, hid_t space, int ndims,
+                           const hsize_t *chunkdims, trial_t *trial){
+
+    unsigned cd_values[7] = {0};
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    int r = -1;
+
+    cd_values[4] = (unsigned)trial->clevel;
+    cd_values[5] = (unsigned)trial->shuffle;
+    cd_values[6] = (unsigned)blosc_compname_to_compcode(trial->codec);
+    trial->cd_nelmts = MAX_CD_VALUES;
+    if (dcpl >= 0 && H5Pset_chunk(dcpl, ndims, chunkdims) >= 0 &&
+        H5Pset_filter(dcpl, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7,
+                      cd_values) >= 0 &&
+        blosc_set_local(dcpl, type, space) >= 0 &&
+        GET_FILTER(dcpl, FILTER_BLOSC, NULL, &trial->cd_nelmts,
+                   trial->cd_values, 0, NULL) >= 0) r = 0;
+    if (trial->cd_nelmts > MAX_CD_VALUES) trial->cd_nelmts = MAX_CD_VALUES;
+    if (dcpl >= 0) H5Pclose(dcpl);
+    return r;
+}
+
+/* Whether trial `b` is at least as good as `a` in every way, and better
+   in one */
+static int dominates(const trial_t *b, const trial_t *a){
+    return b->ratio >= a->ratio && b->cspeed >= a->cspeed &&
+           b->dspeed >= a->dspeed &&
+           (b->ratio > a->ratio || b->cspeed > a->cspeed ||
+            b->dspeed > a->dspeed);
+}
+
+static int by_speed(const void *a, const void *b){
+
+    const trial_t *x = *(const trial_t *const *)a;
+    const trial_t *y = *(const trial_t *const *)b;
+
+    return (x->cspeed < y->cspeed) - (x->cspeed > y->cspeed);
+}
+
+/* Print the trials no other one dominates, and the recommended one */
+static void report(const char *name, const options_t *opts, trial_t *trials,
+                   int ntrials, const samples_t *s){
+
+    trial_t **front = (trial_t **)malloc(ntrials * sizeof(trial_t *));
+    const trial_t *best = NULL, *fastest = NULL;
+    int i, j, nfront = 0;
+
+    if (front == NULL) return;
+    for (i = 0; i < ntrials; i++) {
+        if (trials[i].failed) continue;
+        for (j = 0; j < ntrials; j++) {
+            if (!trials[j].failed && dominates(&trials[j], &trials[i])) break;
+        }
+        if (j == ntrials) front[nfront++] = &trials[i];
+    }
+    qsort(front, nfront, sizeof(trial_t *), by_speed);
+    for (i = 0; i < nfront; i++) {
+        if (front[i]->cspeed >= opts->min_speed &&
+            front[i]->dspeed >= opts->min_speed &&
+            (best == NULL || front[i]->ratio > best->ratio)) best = front[i];
+    }
+    if (best == NULL && nfront > 0) fastest = best = front[0];
+
+    printf("%s: %d chunks of %lu bytes sampled\n", name, s->nsamples,
+           (unsigned long)s->chunksize);
+    printf("  %-10s %6s %8s %8s %12s %12s\n", "compressor", "clevel",
+           "shuffle", "ratio", "comp MB/s", "decomp MB/s");
+    for (i = 0; i < nfront; i++) {
+        printf("%c %-10s %6d %8d %8.2f %12.0f %12.0f\n",
+               front[i] == best ? '*' : ' ', front[i]->codec,
+               front[i]->clevel, front[i]->shuffle, front[i]->ratio,
+               front[i]->cspeed, front[i]->dspeed);
+    }
+    if (best != NULL) {
+        printf("%s: cd_values[4..6] = {%d, %d, %d}  (-c %s -l %d -s %d)%s\n",
+               name, best->clevel, best->shuffle,
+               blosc_compname_to_compcode(best->codec), best->codec,
+               best->clevel, best->shuffle,
+               fastest != NULL ? "  (none reaches -m: fastest)" : "");
+    } else {
+        printf("%s: no trial succeeded\n", name);
+    }
+    printf("\n");
+    free(front);
+}
+
+/* Sample dataset `name` of `file` and run every trial on it */
+static int advise(const char *name, hid_t file, const options_t *opts){
+
+    hsize_t dims[MAX_NDIMS], chunkdims[MAX_NDIMS];
+    hid_t dset, type = -1, space = -1, dcpl = -1;
+    samples_t s;
+    trial_t *trials = NULL;
+    blosc_workers_t *workers = NULL;
+    int ndims, ntrials = 0, c, l, h, i, r = -1;
+
+    memset(&s, 0, sizeof(s));
+    s.nsamples = opts->nsamples;
+    dset = H5Dopen(file, name, H5P_DEFAULT);
+    if (dset < 0) {
+        fprintf(stderr, "%s: can't open\n", name);
+        return -1;
+    }
+    type = H5Dget_type(dset);
+    space = H5Dget_space(dset);
+    dcpl = H5Dget_create_plist(dset);
+    if (type < 0 || space < 0 || dcpl < 0) goto done;
+    ndims = H5Sget_simple_extent_ndims(space);
+    if (ndims <= 0 || ndims > MAX_NDIMS ||
+        H5Sget_simple_extent_type(space) != H5S_SIMPLE ||
+        h5blosc_has_pointers(type)) {
+        r = 0;                  /* Not something to chunk */
+        goto done;
+    }
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    if (H5Pget_layout(dcpl) != H5D_CHUNKED ||
+        H5Pget_chunk(dcpl, MAX_NDIMS, chunkdims) != ndims) {
+        h5blosc_choose_chunks(ndims, dims, H5Tget_size(type), chunkdims);
+    }
+    s.chunksize = H5Tget_size(type);
+    for (i = 0; i < ndims; i++) {
+        s.chunksize *= chunkdims[i];
+    }
+    if (read_samples(dset, type, ndims, dims, chunkdims, &s) < 0) {
+        fprintf(stderr, "%s: can't read samples\n", name);
+        goto done;
+    }
+    if (s.data == NULL) {
+        r = 0;                  /* Empty */
+        goto done;
+    }
+
+    trials = (trial_t *)calloc(opts->ncodecs * opts->nlevels *
+                               opts->nshuffles, sizeof(trial_t));
+    workers = blosc_workers_create(opts->nthreads);
+    if (trials == NULL || workers == NULL) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        goto done;
+    }
+    for (c = 0; c < opts->ncodecs; c++) {
+        for (l = 0; l < opts->nlevels; l++) {
+            for (h = 0; h < opts->nshuffles; h++) {
+                trial_t *trial = &trials[ntrials];
+                trial->samples = &s;
+                trial->codec = opts->codecs[c];
+                trial->clevel = opts->levels[l];
+                trial->shuffle = opts->shuffles[h];
+                if (trial_cd_values(type, space, ndims, chunkdims,
+                                    trial) < 0) continue;
+                if (blosc_workers_submit(workers, run_trial, trial,
+                                         &trial->done) < 0) {
+                    run_trial(trial);
+                }
+                ntrials++;
+            }
+        }
+    }
+    for (i = 0; i < ntrials; i++) {
+        blosc_workers_wait(workers, &trials[i].done);
+    }
+    report(name, opts, trials, ntrials, &s);
+    r = 0;
+
+ done:
+    blosc_workers_destroy(workers);
+    free(trials);
+    free(s.data);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (space >= 0) H5Sclose(space);
+    if (type >= 0) H5Tclose(type);
+    H5Dclose(dset);
+    return r;
+}
+
+/* h5blosc_visit() callback sampling every dataset found */
+static void visit_object(const char *name, hid_t loc, H5I_type_t type,
+                         void *arg){
+
+    if (type == H5I_DATASET) advise(name, loc, (const options_t *)arg);
+}
+
+int main(int argc, char **argv){
+
+    static char compressors[256];
+    options_t opts;
+    char *version, *date;
+    hid_t file;
+    int i, c, failed = 0;
+
+    memset(&opts, 0, sizeof(opts));
+    strncpy(compressors, blosc_list_compressors(), sizeof(compressors) - 1);
+    opts.ncodecs = h5blosc_split_list(compressors, opts.codecs);
+    for (i = 0; i < 5; i++) opts.levels[i] = 2 * i + 1;
+    opts.nlevels = 5;
+    for (i = 0; i < 3; i++) opts.shuffles[i] = i;
+    opts.nshuffles = 3;
+    opts.nsamples = 8;
+    opts.min_speed = 200;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            opts.nsamples = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            opts.ncodecs = h5blosc_split_list(argv[i + 1], opts.codecs);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            opts.nlevels = h5blosc_parse_ints(argv[i + 1], opts.levels);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            opts.nshuffles = h5blosc_parse_ints(argv[i + 1], opts.shuffles);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            opts.min_speed = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            opts.nthreads = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i >= argc || argv[i][0] == '-') {
+        fprintf(stderr, "Usage: %s [-n samples] [-c compressors] [-l levels] "
+                "[-s shuffles] [-m MB/s] [-t nthreads] file.h5 "
+                "[dataset ...]\n", argv[0]);
+        return 2;
+    }
+    for (c = 0; c < opts.ncodecs; c++) {
+        if (blosc_compname_to_compcode(opts.codecs[c]) < 0) {
+            fprintf(stderr, "Unknown compressor %s\n", opts.codecs[c]);
+            return 2;
+        }
+    }
+    if (opts.nsamples < 1) opts.nsamples = 1;
+    if (opts.nthreads <= 0) opts.nthreads = blosc_workers_ncpus();
+
+    if (register_blosc(&version, &date) < 0) return 1;
+    free(version);
+    free(date);
+
+    file = H5Fopen(argv[i], H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file < 0) {
+        fprintf(stderr, "Can't open %s\n", argv[i]);
+        return 1;
+    }
+    if (i + 1 < argc) {
+        for (i++; i < argc; i++) {
+            if (advise(argv[i], file, &opts) < 0) failed = 1;
+        }
+    } else if (h5blosc_visit(file, visit_object, &opts) < 0) {
+        failed = 1;
+    }
+    H5Fclose(file);
+    return failed;
+}
@@ -0,0 +1,114 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Helpers shared by the command line tools and benchmarks of the Blosc
+    filter.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "h5blosc_tools.h"
+
+typedef struct {
+    h5blosc_visit_t fn;
+    void *arg;
+} visit_t;
+
+
+int h5blosc_has_pointers(hid_t type){
+
+    hid_t sub;
+    int i, n, r = 0;
+
+    switch (H5Tget_class(type)) {
+    case H5T_VLEN:
+    case H5T_REFERENCE:
+        return 1;
+    case H5T_STRING:
+        return H5Tis_variable_str(type) > 0;
+    case H5T_ARRAY:
+        sub = H5Tget_super(type);
+        r = h5blosc_has_pointers(sub);
+        H5Tclose(sub);
+        return r;
+    case H5T_COMPOUND:
+        n = H5Tget_nmembers(type);
+        for (i = 0; i < n && !r; i++) {
+            sub = H5Tget_member_type(type, (unsigned)i);
+            r = h5blosc_has_pointers(sub);
+            H5Tclose(sub);
+        }
+        return r;
+    default:
+        return 0;
+    }
+}
+
+void h5blosc_choose_chunks(int ndims, const hsize_t *dims, size_t typesize,
+                           hsize_t *chunkdims){
+
+    size_t nbytes = typesize;
+    int i;
+
+    for (i = ndims - 1; i >= 0; i--) {
+        hsize_t n = dims[i] > 0 ? dims[i] : 1;
+        if (nbytes * n > CHUNK_TARGET) {
+            n = CHUNK_TARGET / nbytes;
+            if (n == 0) n = 1;
+        }
+        chunkdims[i] = n;
+        nbytes *= n;
+    }
+}
+
+/* H5Lvisit() callback */
+static herr_t visit_link(hid_t group, const char *name,
+                         const H5L_info_t *info, void *data){
+
+    visit_t *v = (visit_t *)data;
+    H5I_type_t type;
+    hid_t obj;
+
+    if (info->type != H5L_TYPE_HARD) return 0;
+    obj = H5Oopen(group, name, H5P_DEFAULT);
+    if (obj < 0) return 0;
+    type = H5Iget_type(obj);
+    H5Oclose(obj);
+    v->fn(name, group, type, v->arg);
+    return 0;
+}
+
+int h5blosc_visit(hid_t loc, h5blosc_visit_t fn, void *arg){
+
+    visit_t v;
+
+    v.fn = fn;
+    v.arg = arg;
+    return H5Lvisit(loc, H5_INDEX_NAME, H5_ITER_INC, visit_link, &v) < 0 ?
+           -1 : 0;
+}
+
+int h5blosc_split_list(char *list, const char **items){
+
+    int n = 0;
+    char *item;
+
+    for (item = strtok(list, ","); item != NULL && n < MAX_ITEMS;
+         item = strtok(NULL, ",")) {
+        items[n++] = item;
+    }
+    return n;
+}
+
+int h5blosc_parse_ints(char *list, int *values){
+
+    const char *items[MAX_ITEMS];
+    int i, n = h5blosc_split_list(list, items);
+
+    for (i = 0; i < n; i++) values[i] = atoi(items[i]);
+    return n;
+}
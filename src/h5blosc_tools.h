@@ -0,0 +1,56 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Helpers shared by the command line tools and benchmarks of the Blosc
+    filter (h5blosc-advise, h5blosc-transcode, bench_blosc).  Nothing in
+    here is part of the public API.
+
+*/
+
+
+#ifndef H5BLOSC_TOOLS_H
+#define H5BLOSC_TOOLS_H
+
+#include "hdf5.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_NDIMS 32
+#define MAX_ITEMS 32            /* In a comma separated option */
+#define MAX_CD_VALUES 256       /* What HDF5 gives back of a filter's cd_values */
+#define CHUNK_TARGET (1024 * 1024)      /* Bytes in a chunk we choose */
+
+/* Whether values of `type` point to data stored elsewhere in the file
+   (variable-length data and references), which Blosc can't be used on */
+int h5blosc_has_pointers(hid_t type);
+
+/* Chunks of about CHUNK_TARGET bytes for a dataset that has none: whole
+   rows of the last dimensions, as many as fit */
+void h5blosc_choose_chunks(int ndims, const hsize_t *dims, size_t typesize,
+                           hsize_t *chunkdims);
+
+/* Called by h5blosc_visit() for every object found through a hard link,
+   `type` being H5I_GROUP, H5I_DATASET or H5I_DATATYPE */
+typedef void (*h5blosc_visit_t)(const char *name, hid_t loc, H5I_type_t type,
+                                void *arg);
+
+/* Walk what is below `loc`, groups before what they hold.  Returns -1 on
+   errors. */
+int h5blosc_visit(hid_t loc, h5blosc_visit_t fn, void *arg);
+
+/* Split a comma separated list in place, into MAX_ITEMS items at most.
+   Returns how many there are. */
+int h5blosc_split_list(char *list, const char **items);
+
+/* The same for a list of integers */
+int h5blosc_parse_ints(char *list, int *values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,920 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Offline transcoder: copies the datasets of an HDF5 file into a new
+    file, recompressed with Blosc, without going through the filter
+    pipeline of HDF5 for the chunks it can handle itself.
+
+    The chunks of the input are listed with H5Dget_chunk_info() and read
+    as stored with H5Dread_chunk() on the main thread.  Worker threads
+    decode them (Blosc, or gzip and shuffle when built with zlib) and
+    compress them with the Blosc parameters of the output, and the main
+    thread writes them with H5Dwrite_chunk().  Chunks already compressed
+    with the same Blosc parameters are copied as they are.  Chunks using
+    other filters are read through the pipeline, and datasets that are
+    not chunked are cut into chunks of about CHUNK_TARGET bytes, spanning
+    the last dimensions.  Datasets of variable-length or reference types,
+    and scalar ones, are copied with H5Dread()/H5Dwrite() as they are.
+    Groups are copied too, and then the attributes of everything copied,
+    object references (e.g. those of dimension scales) pointing to the
+    objects of the same name in the output.  Attributes that can't be
+    copied, like references to regions or to named datatypes, are
+    reported and make the exit status 1.
+
+    To run:
+
+    $ ./h5blosc-transcode [-c compressor] [-l clevel] [-s shuffle] [-k]
+          [-t nthreads] [-v] input.h5 output.h5 [dataset ...]
+
+      -c  Blosc compressor (default: blosclz)
+      -l  compression level (default: 5)
+      -s  shuffle, 0 none, 1 byte, 2 bit (default: 1)
+      -k  store a checksum with each chunk
+      -t  worker threads (default: one per processor)
+      -v  read every dataset and attribute back and compare it with the
+          input
+
+    Without dataset names every group and dataset of the input is copied,
+    otherwise the datasets named and their attributes.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+#include "blosc_filter_internal.h"
+#include "h5blosc_tools.h"
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#define MAX_FILTERS 8           /* Filters of an input pipeline */
+
+/* How workers get the data out of an input chunk */
+enum {
+    DECODE_NONE,                /* Stored as is, or read through HDF5 */
+    DECODE_BLOSC,               /* Stored by the Blosc filter */
+    DECODE_ZLIB                 /* Stored by deflate and shuffle */
+};
+
+/* Output parameters, from the command line */
+typedef struct {
+    unsigned cd_values[18];
+    size_t cd_nelmts;
+    int nthreads;
+    int verify;
+} options_t;
+
+/* A dataset being transcoded */
+typedef struct {
+    hid_t in, out;
+    hid_t type;
+    int ndims;
+    hsize_t dims[MAX_NDIMS];
+    hsize_t chunkdims[MAX_NDIMS];
+    size_t chunksize;
+    int in_chunked;
+    int decode;                 /* DECODE_* for the chunks of the input */
+    int nfilters;               /* Input filters, for DECODE_ZLIB */
+    H5Z_filter_t filters[MAX_FILTERS];
+    size_t shuffle_typesize[MAX_FILTERS];
+    size_t in_nelmts;           /* Blosc cd_values of the input */
+    unsigned in_cd_values[MAX_CD_VALUES];
+    size_t out_nelmts;          /* Blosc cd_values of the output */
+    unsigned out_cd_values[MAX_CD_VALUES];
+    int same_blosc;             /* Input chunks can be copied as they are */
+    size_t outsize;
+} transcode_t;
+
+/* A chunk on its way from the input to the output */
+typedef struct {
+    const transcode_t *tc;
+    hsize_t offset[MAX_NDIMS];
+    unsigned mask;              /* Filters skipped by the input */
+    int decode;
+    char *in;                   /* The chunk as read, chunksize at least */
+    size_t insize, incap;
+    char *raw;                  /* Scratch buffer, chunksize */
+    char *out;                  /* The compressed chunk, outsize */
+    const char *result;         /* What to write */
+    size_t nbytes;
+    int status;                 /* 0, 1 to store as is, <0 on errors */
+    int busy;
+    int done;
+} job_t;
+
+typedef struct {
+    const options_t *opts;
+    hid_t out_file;
+    int failed;
+} visit_t;
+
+/* The attributes of an object being copied */
+typedef struct {
+    const char *name;           /* Of the object */
+    hid_t out;
+    const visit_t *v;
+    int failed;
+} attr_copy_t;
+
+
+static void print_error(const char *name, const char *msg){
+    fprintf(stderr, "%s: %s\n", name, msg);
+}
+
+#if defined(HAVE_ZLIB)
+/* Undo the gzip and shuffle filters of an input chunk, last one first.
+   Returns the buffer holding the result, NULL on errors. */
+static char *decode_zlib(job_t *job){
+
+    const transcode_t *tc = job->tc;
+    char *cur = job->in, *next = job->raw, *tmp;
+    size_t size = job->insize;
+    uLongf n;
+    int i;
+
+    for (i = tc->nfilters - 1; i >= 0; i--) {
+        if (job->mask & (1U << i)) continue;
+        if (tc->filters[i] == H5Z_FILTER_DEFLATE) {
+            n = (uLongf)tc->chunksize;
+            if (uncompress((Bytef *)next, &n, (const Bytef *)cur,
+                           (uLong)size) != Z_OK) return NULL;
+            size = (size_t)n;
+        } else {
+            blosc_kernel_unshuffle(next, cur, size,
+                                   tc->shuffle_typesize[i]);
+        }
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    return size == tc->chunksize ? cur : NULL;
+}
+#endif
+
+/* Worker job: decode an input chunk and compress it for the output */
+static void transcode_chunk(void *arg){
+
+    job_t *job = (job_t *)arg;
+    const transcode_t *tc = job->tc;
+    char *src = job->in;
+    size_t cbytes;
+    int r;
+
+    job->status = -1;
+    if (job->decode == DECODE_BLOSC && !(job->mask & 1)) {
+        r = blosc_filter_decode(tc->in_nelmts, tc->in_cd_values, 1, job->in,
+                                job->insize, job->raw, tc->chunksize);
+        if (r < 0) {
+            job->status = r;
+            return;
+        }
+        src = job->raw;
+    }
+#if defined(HAVE_ZLIB)
+    else if (job->decode == DECODE_ZLIB) {
+        src = decode_zlib(job);
+        if (src == NULL) return;
+    }
+#endif
+    else if (job->insize != tc->chunksize) {
+        return;
+    }
+
+    r = blosc_filter_encode(tc->out_nelmts, tc->out_cd_values, 1, src,
+                            tc->chunksize, job->out, tc->outsize, &cbytes);
+    if (r < 0) return;
+    if (r > 0) {
+        job->result = src;
+        job->nbytes = tc->chunksize;
+    } else {
+        job->result = job->out;
+        job->nbytes = cbytes;
+    }
+    job->status = r;
+}
+
+/* Write a chunk the workers are done with */
+static int write_job(const char *name, job_t *job){
+
+    const transcode_t *tc = job->tc;
+
+    if (job->status < 0) {
+        print_error(name, job->status == -2 ? "chunk checksum mismatch" :
+                                              "can't transcode a chunk");
+        return -1;
+    }
+    if (H5Dwrite_chunk(tc->out, H5P_DEFAULT, job->status > 0 ? 1 : 0,
+                       job->offset, job->nbytes, job->result) < 0) {
+        print_error(name, "can't write a chunk");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the chunk at `job->offset` of the input through the pipeline,
+   padded with zeros past the edges of the dataset */
+static int read_through_pipeline(const transcode_t *tc, job_t *job){
+
+    hsize_t count[MAX_NDIMS], zero[MAX_NDIMS];
+    hid_t fspace = -1, mspace = -1;
+    int i, r = -1;
+
+    for (i = 0; i < tc->ndims; i++) {
+        zero[i] = 0;
+        count[i] = tc->dims[i] - job->offset[i];
+        if (count[i] > tc->chunkdims[i]) count[i] = tc->chunkdims[i];
+    }
+    memset(job->in, 0, tc->chunksize);
+    fspace = H5Dget_space(tc->in);
+    if (fspace < 0) goto done;
+    if (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, job->offset, NULL, count,
+                            NULL) < 0) goto done;
+    mspace = H5Screate_simple(tc->ndims, tc->chunkdims, NULL);
+    if (mspace < 0) goto done;
+    if (H5Sselect_hyperslab(mspace, H5S_SELECT_SET, zero, NULL, count,
+                            NULL) < 0) goto done;
+    r = H5Dread(tc->in, tc->type, mspace, fspace, H5P_DEFAULT, job->in);
+
+ done:
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    return r < 0 ? -1 : 0;
+}
+
+/* Read input chunk `idx` into `job`, `space` being the dataspace of the
+   input.  Returns 1 if it has been copied to the output as it is, 0 if it
+   has to go through the workers. */
+static int read_chunk(const char *name, const transcode_t *tc, hid_t space,
+                      hsize_t idx, job_t *job){
+
+    hsize_t size;
+    haddr_t addr;
+    unsigned mask;
+    int i;
+
+    job->decode = DECODE_NONE;
+    if (!tc->in_chunked) {
+        /* Walk the chunks we chose, in C order */
+        for (i = tc->ndims - 1; i >= 0; i--) {
+            hsize_t n = (tc->dims[i] + tc->chunkdims[i] - 1) /
+                        tc->chunkdims[i];
+            job->offset[i] = idx % n * tc->chunkdims[i];
+            idx /= n;
+        }
+        job->mask = 0;
+        job->insize = tc->chunksize;
+        return read_through_pipeline(tc, job);
+    }
+
+    if (H5Dget_chunk_info(tc->in, space, idx, job->offset, &mask, &addr,
+                          &size) < 0) {
+        print_error(name, "can't get chunk info");
+        return -1;
+    }
+    job->mask = mask;
+    if (tc->decode == DECODE_NONE) {
+        /* Other filters: let HDF5 undo them */
+        job->insize = tc->chunksize;
+        return read_through_pipeline(tc, job);
+    }
+    if (size > job->incap) {
+        free(job->in);
+        job->in = (char *)malloc((size_t)size);
+        if (job->in == NULL) {
+            job->incap = 0;
+            print_error(name, "out of memory");
+            return -1;
+        }
+        job->incap = (size_t)size;
+    }
+    if (H5Dread_chunk(tc->in, H5P_DEFAULT, job->offset, &mask,
+                      job->in) < 0) {
+        print_error(name, "can't read a chunk");
+        return -1;
+    }
+    job->insize = (size_t)size;
+    job->decode = tc->decode;
+
+    if (tc->same_blosc && mask == 0) {
+        /* Blosc to the same Blosc: nothing to redo */
+        if (H5Dwrite_chunk(tc->out, H5P_DEFAULT, 0, job->offset,
+                           job->insize, job->in) < 0) {
+            print_error(name, "can't write a chunk");
+            return -1;
+        }
+        return 1;
+    }
+    if (tc->nfilters > 0 && mask == (1U << tc->nfilters) - 1) {
+        job->decode = DECODE_NONE;      /* Every filter was skipped */
+    }
+    return 0;
+}
+
+/* Copy the chunks of a dataset through the workers */
+static int transcode_chunks(const char *name, const options_t *opts,
+                            const transcode_t *tc){
+
+    blosc_workers_t *workers;
+    job_t *jobs;
+    hsize_t nchunks = 1, idx;
+    size_t njobs = 0, jobsize, cur = 0, i;
+    hid_t space = H5Dget_space(tc->in);
+    int r = -1, k;
+
+    if (space < 0) return -1;
+    if (tc->in_chunked) {
+        if (H5Dget_num_chunks(tc->in, space, &nchunks) < 0) {
+            H5Sclose(space);
+            print_error(name, "can't count chunks");
+            return -1;
+        }
+    } else {
+        for (k = 0; k < tc->ndims; k++) {
+            nchunks *= (tc->dims[k] + tc->chunkdims[k] - 1) /
+                       tc->chunkdims[k];
+        }
+    }
+
+    /* As many jobs in flight as the memory budget allows, up to two per
+       thread */
+    jobsize = 2 * tc->chunksize + tc->outsize;
+    njobs = blosc_budget_acquire_jobs(2 * (size_t)opts->nthreads, jobsize);
+    workers = blosc_workers_create(opts->nthreads);
+    jobs = njobs > 0 ? (job_t *)calloc(njobs, sizeof(job_t)) : NULL;
+    if (workers == NULL || jobs == NULL) goto nomem;
+    for (i = 0; i < njobs; i++) {
+        jobs[i].tc = tc;
+        jobs[i].incap = tc->chunksize;
+        jobs[i].in = (char *)malloc(tc->chunksize);
+        jobs[i].raw = (char *)malloc(tc->chunksize);
+        jobs[i].out = (char *)malloc(tc->outsize);
+        if (jobs[i].in == NULL || jobs[i].raw == NULL ||
+            jobs[i].out == NULL) goto nomem;
+    }
+
+    /* Jobs are reused in turn: reading the next chunk only waits for the
+       workers when they fall behind */
+    for (idx = 0; idx < nchunks; idx++) {
+        if (jobs[cur].busy) {
+            blosc_workers_wait(workers, &jobs[cur].done);
+            jobs[cur].busy = 0;
+            if (write_job(name, &jobs[cur]) < 0) goto done;
+        }
+        k = read_chunk(name, tc, space, idx, &jobs[cur]);
+        if (k < 0) goto done;
+        if (k > 0) continue;
+        if (blosc_workers_submit_near(workers, transcode_chunk, &jobs[cur],
+                                      jobs[cur].in, &jobs[cur].done) < 0)
+            goto nomem;
+        jobs[cur].busy = 1;
+        cur = (cur + 1) % njobs;
+    }
+    r = 0;
+    goto done;
+
+ nomem:
+    print_error(name, "out of memory");
+
+ done:
+    /* Write what is still in flight, in order */
+    for (i = 0; jobs != NULL && i < njobs; i++) {
+        job_t *job = &jobs[(cur + i) % njobs];
+        if (!job->busy) continue;
+        blosc_workers_wait(workers, &job->done);
+        job->busy = 0;
+        if (r == 0 && write_job(name, job) < 0) r = -1;
+    }
+    blosc_workers_destroy(workers);
+    for (i = 0; jobs != NULL && i < njobs; i++) {
+        free(jobs[i].in);
+        free(jobs[i].raw);
+        free(jobs[i].out);
+    }
+    free(jobs);
+    blosc_budget_release(njobs * jobsize);
+    H5Sclose(space);
+    return r;
+}
+
+/* Copy a whole dataset with H5Dread()/H5Dwrite() */
+static int copy_dataset(const char *name, hid_t in, hid_t out, hid_t type){
+
+    hid_t space = H5Dget_space(in);
+    hssize_t npoints = H5Sget_simple_extent_npoints(space);
+    size_t nbytes = (size_t)(npoints > 0 ? npoints : 1) * H5Tget_size(type);
+    void *buf = malloc(nbytes);
+    int r = -1;
+
+    if (buf == NULL) {
+        print_error(name, "out of memory");
+    } else if (npoints == 0) {
+        r = 0;
+    } else if (H5Dread(in, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf) < 0 ||
+               H5Dwrite(out, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf) < 0) {
+        print_error(name, "can't copy");
+    } else {
+        r = 0;
+    }
+    if (r == 0 && npoints > 0 && h5blosc_has_pointers(type)) {
+        H5Dvlen_reclaim(type, space, H5P_DEFAULT, buf);
+    }
+    free(buf);
+    H5Sclose(space);
+    return r;
+}
+
+/* Compare the output with the input, one chunk of the output at a time */
+static int verify_dataset(const char *name, const transcode_t *tc){
+
+    hsize_t idx[MAX_NDIMS], count[MAX_NDIMS];
+    hid_t fspace = -1, mspace = -1;
+    char *a = (char *)malloc(tc->chunksize), *b = (char *)malloc(tc->chunksize);
+    size_t n;
+    int i, r = -1, more = 1;
+
+    for (i = 0; i < tc->ndims; i++) {
+        idx[i] = 0;
+        if (tc->dims[i] == 0) more = 0;
+    }
+    fspace = H5Dget_space(tc->in);
+    if (a == NULL || b == NULL || fspace < 0) goto done;
+    while (more) {
+        n = H5Tget_size(tc->type);
+        for (i = 0; i < tc->ndims; i++) {
+            count[i] = tc->dims[i] - idx[i];
+            if (count[i] > tc->chunkdims[i]) count[i] = tc->chunkdims[i];
+            n *= count[i];
+        }
+        mspace = H5Screate_simple(tc->ndims, count, NULL);
+        if (mspace < 0 ||
+            H5Sselect_hyperslab(fspace, H5S_SELECT_SET, idx, NULL, count,
+                                NULL) < 0 ||
+            H5Dread(tc->in, tc->type, mspace, fspace, H5P_DEFAULT, a) < 0 ||
+            H5Dread(tc->out, tc->type, mspace, fspace, H5P_DEFAULT, b) < 0) {
+            goto done;
+        }
+        H5Sclose(mspace);
+        mspace = -1;
+        if (memcmp(a, b, n) != 0) {
+            print_error(name, "output differs from input");
+            more = 0;
+            goto done;
+        }
+        /* Next chunk, in C order */
+        for (i = tc->ndims - 1; i >= 0; i--) {
+            idx[i] += tc->chunkdims[i];
+            if (idx[i] < tc->dims[i]) break;
+            idx[i] = 0;
+        }
+        more = i >= 0;
+    }
+    r = 0;
+
+ done:
+    if (r < 0 && more) print_error(name, "can't verify");
+    if (mspace >= 0) H5Sclose(mspace);
+    if (fspace >= 0) H5Sclose(fspace);
+    free(a);
+    free(b);
+    return r;
+}
+
+/* Find out how the chunks of the input can be decoded */
+static void inspect_filters(hid_t dcpl, transcode_t *tc){
+
+    unsigned flags, cd_values[MAX_CD_VALUES];
+    size_t nelmts;
+    int i, zlib_only = 1;
+
+    tc->nfilters = H5Pget_nfilters(dcpl);
+    tc->decode = DECODE_NONE;
+    if (tc->nfilters <= 0) {
+        tc->nfilters = 0;
+        return;
+    }
+    if (tc->nfilters > MAX_FILTERS) return;
+    for (i = 0; i < tc->nfilters; i++) {
+        nelmts = MAX_CD_VALUES;
+        tc->filters[i] = GET_FILTER_BY_IDX(dcpl, (unsigned)i, &flags, &nelmts,
+                                           cd_values, 0, NULL);
+        if (tc->filters[i] == FILTER_BLOSC && tc->nfilters == 1) {
+            tc->in_nelmts = nelmts < MAX_CD_VALUES ? nelmts : MAX_CD_VALUES;
+            memcpy(tc->in_cd_values, cd_values,
+                   tc->in_nelmts * sizeof(unsigned));
+            tc->decode = DECODE_BLOSC;
+            return;
+        }
+        if (tc->filters[i] == H5Z_FILTER_SHUFFLE && nelmts >= 1) {
+            tc->shuffle_typesize[i] = cd_values[0];
+        } else if (tc->filters[i] != H5Z_FILTER_DEFLATE) {
+            zlib_only = 0;
+        }
+    }
+#if defined(HAVE_ZLIB)
+    if (zlib_only) tc->decode = DECODE_ZLIB;
+#else
+    (void)zlib_only;
+#endif
+}
+
+/* Transcode dataset `name` of `in_file` */
+static int transcode(const char *name, hid_t in_file, const visit_t *v){
+
+    transcode_t tc;
+    hid_t space = -1, in_dcpl = -1, out_dcpl = -1, lcpl = -1, dcpl = -1;
+    H5S_class_t cls;
+    int plain, i, r = -1;
+
+    memset(&tc, 0, sizeof(tc));
+    tc.out = tc.type = -1;
+    tc.in = H5Dopen(in_file, name, H5P_DEFAULT);
+    if (tc.in < 0) {
+        print_error(name, "can't open");
+        return -1;
+    }
+    tc.type = H5Dget_type(tc.in);
+    space = H5Dget_space(tc.in);
+    in_dcpl = H5Dget_create_plist(tc.in);
+    if (tc.type < 0 || space < 0 || in_dcpl < 0) goto done;
+    cls = H5Sget_simple_extent_type(space);
+    tc.ndims = H5Sget_simple_extent_ndims(space);
+    if (tc.ndims < 0 || tc.ndims > MAX_NDIMS) goto done;
+    H5Sget_simple_extent_dims(space, tc.dims, NULL);
+
+    /* Blosc does not make sense for what points elsewhere */
+    plain = cls == H5S_SIMPLE && tc.ndims > 0 && !h5blosc_has_pointers(tc.type);
+
+    /* Same creation properties (fill value, chunk shape...), with Blosc
+       as the only filter */
+    out_dcpl = H5Pcopy(in_dcpl);
+    if (out_dcpl < 0) goto done;
+    if (plain) {
+        tc.in_chunked = H5Pget_layout(in_dcpl) == H5D_CHUNKED;
+        if (tc.in_chunked) {
+            if (H5Pget_chunk(in_dcpl, MAX_NDIMS, tc.chunkdims) != tc.ndims) {
+                goto done;
+            }
+            inspect_filters(in_dcpl, &tc);
+            if (H5Premove_filter(out_dcpl, H5Z_FILTER_ALL) < 0) goto done;
+        } else {
+            h5blosc_choose_chunks(tc.ndims, tc.dims, H5Tget_size(tc.type),
+                                  tc.chunkdims);
+            if (H5Pset_chunk(out_dcpl, tc.ndims, tc.chunkdims) < 0) goto done;
+        }
+        if (H5Pset_filter(out_dcpl, FILTER_BLOSC, H5Z_FLAG_OPTIONAL,
+                          v->opts->cd_nelmts, v->opts->cd_values) < 0) {
+            goto done;
+        }
+    }
+    lcpl = H5Pcreate(H5P_LINK_CREATE);
+    if (lcpl < 0 || H5Pset_create_intermediate_group(lcpl, 1) < 0) goto done;
+    tc.out = H5Dcreate(v->out_file, name, tc.type, space, lcpl, out_dcpl,
+                       H5P_DEFAULT);
+    if (tc.out < 0) {
+        print_error(name, "can't create in the output");
+        goto done;
+    }
+    if (!plain) {
+        r = copy_dataset(name, tc.in, tc.out, tc.type);
+        goto done;
+    }
+
+    /* The cd_values blosc_set_local() filled in for the output */
+    dcpl = H5Dget_create_plist(tc.out);
+    if (dcpl < 0) goto done;
+    tc.out_nelmts = MAX_CD_VALUES;
+    if (GET_FILTER(dcpl, FILTER_BLOSC, NULL, &tc.out_nelmts, tc.out_cd_values,
+                   0, NULL) < 0) goto done;
+    if (tc.out_nelmts > MAX_CD_VALUES) tc.out_nelmts = MAX_CD_VALUES;
+    tc.chunksize = H5Tget_size(tc.type);
+    for (i = 0; i < tc.ndims; i++) {
+        tc.chunksize *= tc.chunkdims[i];
+    }
+    tc.outsize = blosc_filter_encode_bound(tc.out_nelmts, tc.out_cd_values,
+                                           tc.chunksize);
+    tc.same_blosc = tc.decode == DECODE_BLOSC &&
+                    tc.in_nelmts == tc.out_nelmts &&
+                    memcmp(tc.in_cd_values, tc.out_cd_values,
+                           tc.in_nelmts * sizeof(unsigned)) == 0;
+
+    r = transcode_chunks(name, v->opts, &tc);
+    if (r == 0 && v->opts->verify) r = verify_dataset(name, &tc);
+
+ done:
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (lcpl >= 0) H5Pclose(lcpl);
+    if (out_dcpl >= 0) H5Pclose(out_dcpl);
+    if (in_dcpl >= 0) H5Pclose(in_dcpl);
+    if (space >= 0) H5Sclose(space);
+    if (tc.out >= 0) H5Dclose(tc.out);
+    if (tc.type >= 0) H5Tclose(tc.type);
+    H5Dclose(tc.in);
+    return r;
+}
+
+/* Make object reference `ref`, read from the input where `in` is, point
+   to the object of the same name in `out_file` */
+static int translate_ref(hobj_ref_t *ref, hid_t in, hid_t out_file){
+
+    char *path = NULL;
+    ssize_t len;
+    hid_t obj;
+    int r = -1;
+
+    H5E_BEGIN_TRY {
+        obj = H5Rdereference2(in, H5P_DEFAULT, H5R_OBJECT, ref);
+    } H5E_END_TRY;
+    if (obj < 0) return -1;
+    len = H5Iget_name(obj, NULL, 0);
+    if (len > 0) path = (char *)malloc((size_t)len + 1);
+    if (path != NULL && H5Iget_name(obj, path, (size_t)len + 1) == len) {
+        H5E_BEGIN_TRY {
+            r = H5Rcreate(ref, out_file, path, H5R_OBJECT, -1);
+        } H5E_END_TRY;
+    }
+    free(path);
+    H5Oclose(obj);
+    return r < 0 ? -1 : 0;
+}
+
+/* Translate the object references in the `n` values of memory type `type`
+   at `buf`, read from the input where `in` is, for `out_file`.  Returns -1
+   if one can't be: a reference to a region, or to an object that has not
+   been copied. */
+static int translate_refs(hid_t type, char *buf, size_t n, hid_t in,
+                          hid_t out_file){
+
+    hsize_t dims[MAX_NDIMS];
+    size_t size = H5Tget_size(type), offset, k;
+    hid_t sub;
+    hvl_t *vl;
+    int i, m, r = 0;
+
+    switch (H5Tget_class(type)) {
+    case H5T_REFERENCE:
+        if (H5Tequal(type, H5T_STD_REF_OBJ) <= 0) return -1;
+        for (k = 0; k < n && r == 0; k++) {
+            r = translate_ref((hobj_ref_t *)(buf + k * size), in, out_file);
+        }
+        return r;
+    case H5T_ARRAY:
+        /* The elements of the arrays follow each other */
+        m = H5Tget_array_ndims(type);
+        if (m < 0 || m > MAX_NDIMS) return -1;
+        H5Tget_array_dims2(type, dims);
+        for (i = 0; i < m; i++) {
+            n *= (size_t)dims[i];
+        }
+        sub = H5Tget_super(type);
+        r = translate_refs(sub, buf, n, in, out_file);
+        H5Tclose(sub);
+        return r;
+    case H5T_VLEN:
+        sub = H5Tget_super(type);
+        for (k = 0; k < n && r == 0; k++) {
+            vl = (hvl_t *)(buf + k * size);
+            r = translate_refs(sub, (char *)vl->p, vl->len, in, out_file);
+        }
+        H5Tclose(sub);
+        return r;
+    case H5T_COMPOUND:
+        m = H5Tget_nmembers(type);
+        for (i = 0; i < m && r == 0; i++) {
+            sub = H5Tget_member_type(type, (unsigned)i);
+            offset = H5Tget_member_offset(type, (unsigned)i);
+            for (k = 0; k < n && r == 0 && h5blosc_has_pointers(sub); k++) {
+                r = translate_refs(sub, buf + k * size + offset, 1, in,
+                                   out_file);
+            }
+            H5Tclose(sub);
+        }
+        return r;
+    default:
+        return 0;
+    }
+}
+
+/* H5Aiterate() callback copying an attribute to the output */
+static herr_t copy_attribute(hid_t loc, const char *attr_name,
+                             const H5A_info_t *info, void *data){
+
+    attr_copy_t *c = (attr_copy_t *)data;
+    hid_t in = -1, out = -1, ftype = -1, mtype = -1, space = -1;
+    hssize_t npoints = 0;
+    size_t nbytes;
+    char *buf = NULL, *back = NULL;
+    const char *msg = "not copied";
+    int pointers = 0, read = 0, r = -1;
+
+    (void)info;
+    in = H5Aopen(loc, attr_name, H5P_DEFAULT);
+    if (in < 0) goto done;
+    mtype = H5Aget_type(in);
+    if (mtype < 0) goto done;
+    /* A transient copy, should the type be a named one of the input */
+    ftype = H5Tcopy(mtype);
+    H5Tclose(mtype);
+    mtype = -1;
+    space = H5Aget_space(in);
+    if (ftype < 0 || space < 0) goto done;
+    mtype = H5Tget_native_type(ftype, H5T_DIR_DEFAULT);
+    npoints = H5Sget_simple_extent_npoints(space);
+    if (mtype < 0 || npoints < 0) goto done;
+    pointers = h5blosc_has_pointers(mtype);
+    nbytes = (size_t)(npoints > 0 ? npoints : 1) * H5Tget_size(mtype);
+    buf = (char *)calloc(1, nbytes);
+    back = (char *)calloc(1, nbytes);
+    if (buf == NULL || back == NULL) goto done;
+    if (npoints > 0) {
+        if (H5Aread(in, mtype, buf) < 0) goto done;
+        read = 1;
+        if (pointers && translate_refs(mtype, buf, (size_t)npoints, loc,
+                                       c->v->out_file) < 0) goto done;
+    }
+    out = H5Acreate2(c->out, attr_name, ftype, space, H5P_DEFAULT,
+                     H5P_DEFAULT);
+    if (out < 0 || (npoints > 0 && H5Awrite(out, mtype, buf) < 0)) goto done;
+    r = 0;
+    if (c->v->opts->verify && npoints > 0 && !pointers) {
+        if (H5Aread(out, mtype, back) < 0 || memcmp(buf, back, nbytes) != 0) {
+            msg = "differs from input";
+            r = -1;
+        }
+    }
+
+ done:
+    if (r < 0) {
+        fprintf(stderr, "%s: attribute %s %s\n", c->name, attr_name, msg);
+        c->failed = 1;
+    }
+    if (read && pointers) H5Dvlen_reclaim(mtype, space, H5P_DEFAULT, buf);
+    free(buf);
+    free(back);
+    if (out >= 0) H5Aclose(out);
+    if (mtype >= 0) H5Tclose(mtype);
+    if (ftype >= 0) H5Tclose(ftype);
+    if (space >= 0) H5Sclose(space);
+    if (in >= 0) H5Aclose(in);
+    return 0;
+}
+
+/* Copy the attributes of object `name` of the input where `loc` is to the
+   object of the same name in the output, once everything is there for
+   the references among them to point to */
+static int copy_attributes(const char *name, hid_t loc, const visit_t *v){
+
+    attr_copy_t c;
+    hsize_t idx = 0;
+    hid_t in, out;
+
+    in = H5Oopen(loc, name, H5P_DEFAULT);
+    if (in < 0) {
+        print_error(name, "can't open");
+        return -1;
+    }
+    H5E_BEGIN_TRY {
+        out = H5Oopen(v->out_file, name, H5P_DEFAULT);
+    } H5E_END_TRY;
+    if (out < 0) {
+        /* Not copied, e.g. a named datatype */
+        H5Oclose(in);
+        return 0;
+    }
+    c.name = name;
+    c.out = out;
+    c.v = v;
+    c.failed = 0;
+    if (H5Aiterate2(in, H5_INDEX_NAME, H5_ITER_INC, &idx, copy_attribute,
+                    &c) < 0) {
+        print_error(name, "can't list attributes");
+        c.failed = 1;
+    }
+    H5Oclose(out);
+    H5Oclose(in);
+    return c.failed ? -1 : 0;
+}
+
+/* h5blosc_visit() callback transcoding every dataset found, and creating
+   every group */
+static void visit_object(const char *name, hid_t loc, H5I_type_t type,
+                         void *arg){
+
+    visit_t *v = (visit_t *)arg;
+    hid_t group;
+
+    if (type == H5I_DATASET && transcode(name, loc, v) < 0) v->failed = 1;
+    if (type == H5I_GROUP) {
+        /* Visited before what it holds */
+        group = H5Gcreate(v->out_file, name, H5P_DEFAULT, H5P_DEFAULT,
+                          H5P_DEFAULT);
+        if (group < 0) {
+            print_error(name, "can't create in the output");
+            v->failed = 1;
+        } else {
+            H5Gclose(group);
+        }
+    }
+}
+
+/* h5blosc_visit() callback copying the attributes of everything found */
+static void visit_attributes(const char *name, hid_t loc, H5I_type_t type,
+                             void *arg){
+
+    visit_t *v = (visit_t *)arg;
+
+    (void)type;
+    if (copy_attributes(name, loc, v) < 0) v->failed = 1;
+}
+
+int main(int argc, char **argv){
+
+    options_t opts;
+    visit_t v;
+    const char *compname = "blosclz";
+    char *version, *date;
+    hid_t in_file, fcpl;
+    int i, compcode;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.cd_values[4] = DEFAULT_CLEVEL;
+    opts.cd_values[5] = 1;
+    opts.cd_nelmts = 7;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-k") == 0) {
+            opts.cd_values[17] = FILTER_BLOSC_CHECKSUM_CRC32C;
+            opts.cd_nelmts = 18;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            opts.verify = 1;
+        } else if (i + 1 >= argc) {
+            break;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            compname = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0) {
+            opts.cd_values[4] = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            opts.cd_values[5] = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            opts.nthreads = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (argc - i < 2 || (i < argc && argv[i][0] == '-')) {
+        fprintf(stderr, "Usage: %s [-c compressor] [-l clevel] [-s shuffle] "
+                "[-k] [-t nthreads] [-v] input.h5 output.h5 [dataset ...]\n",
+                argv[0]);
+        return 2;
+    }
+    compcode = blosc_compname_to_compcode(compname);
+    if (compcode < 0) {
+        fprintf(stderr, "Unknown compressor %s\n", compname);
+        return 2;
+    }
+    opts.cd_values[6] = (unsigned)compcode;
+    if (opts.nthreads <= 0) opts.nthreads = blosc_workers_ncpus();
+
+    if (register_blosc(&version, &date) < 0) return 1;
+    free(version);
+    free(date);
+
+    in_file = H5Fopen(argv[i], H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (in_file < 0) {
+        fprintf(stderr, "Can't open %s\n", argv[i]);
+        return 1;
+    }
+    /* Keep the file format of the input, e.g. for older readers */
+    fcpl = H5Fget_create_plist(in_file);
+    v.opts = &opts;
+    v.failed = 0;
+    v.out_file = H5Fcreate(argv[i + 1], H5F_ACC_TRUNC, fcpl, H5P_DEFAULT);
+    H5Pclose(fcpl);
+    if (v.out_file < 0) {
+        fprintf(stderr, "Can't create %s\n", argv[i + 1]);
+        H5Fclose(in_file);
+        return 1;
+    }
+
+    /* Attributes last, for their references to have something to point
+       to */
+    if (i + 2 < argc) {
+        for (i += 2; i < argc; i++) {
+            if (transcode(argv[i], in_file, &v) < 0 ||
+                copy_attributes(argv[i], in_file, &v) < 0) v.failed = 1;
+        }
+    } else if (h5blosc_visit(in_file, visit_object, &v) < 0 ||
+               copy_attributes("/", in_file, &v) < 0 ||
+               h5blosc_visit(in_file, visit_attributes, &v) < 0) {
+        v.failed = 1;
+    }
+
+    H5Fclose(v.out_file);
+    H5Fclose(in_file);
+    return v.failed;
+}
@@ -0,0 +1,1199 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Test program for the direct chunk functions of the Blosc filter.
+    Results are checked against what HDF5 reads through the filter
+    pipeline.
+
+    To run:
+
+    $ ./test_direct
+    Success!
+
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+
+#define NDIMS 3
+#define SHAPE {20,90,70}
+#define CHUNKSHAPE {4,32,32}
+#define SIZE (20*90*70)
+#define N_CHUNK0 (4*32*32)
+#define APPEND_COLS 8
+
+/* Records with padding after `flag` */
+typedef struct {
+    long long t;
+    char flag;
+    double x;
+    float y;
+    int z;
+} record_t;
+
+/* Some of their members, in another order */
+typedef struct {
+    int z;
+    double x;
+} pick_t;
+
+/* Compare a hyperslab of a dataset of `type` read with
+   blosc_read_hyperslab() and blosc_read_chunks() with H5Dread() */
+static int check_typed_hyperslab(hid_t dset, hid_t type, const hsize_t *start,
+                                 const hsize_t *count){
+
+    hid_t fspace, mspace;
+    size_t n = count[0] * count[1] * count[2] * H5Tget_size(type);
+    char *expected = malloc(n);
+    char *got = malloc(n);
+    int r = -1;
+
+    fspace = H5Dget_space(dset);
+    H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL);
+    mspace = H5Screate_simple(NDIMS, count, NULL);
+    if (H5Dread(dset, type, mspace, fspace, H5P_DEFAULT, expected) < 0)
+        goto failed;
+    if (blosc_read_hyperslab(dset, start, count, got) < 0) goto failed;
+    if (memcmp(expected, got, n) != 0) goto mismatch;
+    memset(got, 0, n);
+    if (blosc_read_chunks(dset, start, count, got, 3) < 0) goto failed;
+    if (memcmp(expected, got, n) != 0) goto mismatch;
+    r = 0;
+    goto failed;
+
+ mismatch:
+    fprintf(stderr, "Mismatch reading [%d:%d, %d:%d, %d:%d]\n",
+            (int)start[0], (int)(start[0] + count[0]),
+            (int)start[1], (int)(start[1] + count[1]),
+            (int)start[2], (int)(start[2] + count[2]));
+
+ failed:
+    H5Sclose(mspace);
+    H5Sclose(fspace);
+    free(expected);
+    free(got);
+    return r;
+}
+
+static int check_hyperslab(hid_t dset, const hsize_t *start,
+                           const hsize_t *count){
+    return check_typed_hyperslab(dset, H5T_NATIVE_FLOAT, start, count);
+}
+
+/* Check that two datasets store the chunk at `offset` the same way */
+static int check_same_chunk(hid_t dset1, hid_t dset2, const hsize_t *offset){
+
+    hsize_t size1, size2;
+    uint32_t mask1, mask2;
+    char *chunk1 = NULL, *chunk2 = NULL;
+    int r = -1;
+
+    if (H5Dget_chunk_storage_size(dset1, offset, &size1) < 0) goto failed;
+    if (H5Dget_chunk_storage_size(dset2, offset, &size2) < 0) goto failed;
+    if (size1 != size2) goto failed;
+    chunk1 = malloc(size1);
+    chunk2 = malloc(size2);
+    if (H5Dread_chunk(dset1, H5P_DEFAULT, offset, &mask1, chunk1) < 0) goto failed;
+    if (H5Dread_chunk(dset2, H5P_DEFAULT, offset, &mask2, chunk2) < 0) goto failed;
+    if (mask1 != mask2 || memcmp(chunk1, chunk2, size1) != 0) goto failed;
+    r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Chunks differ\n");
+    free(chunk1);
+    free(chunk2);
+    return r;
+}
+
+/* Check that chunk `offset` of `dset` is stored as a constant chunk, in a
+   few bytes only */
+static int check_constant_chunk(hid_t dset, const hsize_t *offset){
+
+    hsize_t size;
+
+    if (H5Dget_chunk_storage_size(dset, offset, &size) < 0 || size > 32) {
+        fprintf(stderr, "Constant chunk not detected\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Flip a byte in the middle of chunk `offset` of `dset` as stored, which
+   must have gone through the filter */
+static int corrupt_chunk(hid_t dset, const hsize_t *offset){
+
+    hsize_t size;
+    uint32_t mask;
+    char *chunk = NULL;
+    int r = -1;
+
+    if (H5Dget_chunk_storage_size(dset, offset, &size) < 0) goto failed;
+    chunk = malloc(size);
+    if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &mask, chunk) < 0 ||
+        mask != 0) goto failed;
+    chunk[size / 2] ^= 0x10;
+    if (H5Dwrite_chunk(dset, H5P_DEFAULT, mask, offset, size, chunk) < 0)
+        goto failed;
+    r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Can't corrupt chunk\n");
+    free(chunk);
+    return r;
+}
+
+/* Make the Blosc header of chunk `offset` of `dset` claim four times the
+   bytes of a chunk */
+static int break_header(hid_t dset, const hsize_t *offset){
+
+    hsize_t size;
+    uint32_t mask, nbytes;
+    char *chunk = NULL;
+    int r = -1;
+
+    if (H5Dget_chunk_storage_size(dset, offset, &size) < 0) goto failed;
+    chunk = malloc(size);
+    if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &mask, chunk) < 0 ||
+        mask != 0 || size < 16) goto failed;
+    memcpy(&nbytes, chunk + 4, sizeof(nbytes));
+    nbytes *= 4;
+    memcpy(chunk + 4, &nbytes, sizeof(nbytes));
+    if (H5Dwrite_chunk(dset, H5P_DEFAULT, mask, offset, size, chunk) < 0)
+        goto failed;
+    r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Can't break chunk header\n");
+    free(chunk);
+    return r;
+}
+
+/* Get the name of the codec chunk `offset` of `dset` was compressed with */
+static const char *chunk_codec(hid_t dset, const hsize_t *offset){
+
+    static char name[32];
+    hsize_t size;
+    uint32_t mask;
+    const char *compname;
+    size_t typesize;
+    int flags;
+    char *chunk;
+
+    name[0] = '\0';
+    if (H5Dget_chunk_storage_size(dset, offset, &size) < 0) return name;
+    chunk = malloc(size);
+    if (H5Dread_chunk(dset, H5P_DEFAULT, offset, &mask, chunk) >= 0 &&
+        mask == 0) {
+        blosc_cbuffer_metainfo(chunk, &typesize, &flags);
+        if (blosc_compcode_to_compname(flags >> 5, &compname) >= 0) {
+            strncpy(name, compname, sizeof(name) - 1);
+        }
+    }
+    free(chunk);
+    return name;
+}
+
+/* Get cd_values[slot] as stored in the dataset, -1 if it is not stored */
+static int get_slot(hid_t dset, int slot){
+
+    unsigned int cd_values[32] = {0};
+    size_t nelements = 32;
+    unsigned int flags;
+    hid_t dcpl = H5Dget_create_plist(dset);
+    int r = -1;
+
+    if (H5Pget_filter_by_id(dcpl, FILTER_BLOSC, &flags, &nelements, cd_values,
+                            0, NULL, NULL) >= 0 && (size_t)slot < nelements) {
+        r = (int)cd_values[slot];
+    }
+    H5Pclose(dcpl);
+    return r;
+}
+
+/* The codec the adaptive policies should pick for `chunk`, which is
+   compressed whole, when stronger codecs are wanted: the one of `dset`
+   unless lz4hc, then zstd, makes it at least 10% smaller */
+static const char *policy_codec(hid_t dset, const void *chunk, size_t nbytes){
+
+    static const char *stronger[] = {"lz4hc", "zstd"};
+    const char *best;
+    char *buf = malloc(nbytes);
+    unsigned ratio, best_ratio = 0;
+    int i, cbytes;
+
+    if (blosc_compcode_to_compname(get_slot(dset, 6), &best) < 0) best = "";
+    for (i = -1; i < 2 && buf != NULL; i++) {
+        if (i >= 0 && blosc_compname_to_compcode(stronger[i]) < 0) continue;
+        cbytes = blosc_compress_ctx(get_slot(dset, 4), get_slot(dset, 5),
+                                    4, nbytes, chunk, buf, nbytes,
+                                    i < 0 ? best : stronger[i],
+                                    get_slot(dset, 9), 1);
+        ratio = cbytes > 0 ? (unsigned)(nbytes * 100 / cbytes) : 100;
+        if (i < 0) best_ratio = ratio;
+        else if (ratio * 100 >= best_ratio * 110) {
+            best = stronger[i];
+            best_ratio = ratio;
+        }
+    }
+    free(buf);
+    return best;
+}
+
+/* Check the shuffle blosc_set_local() picks for `type` when cd_values
+   stops before the shuffle slot */
+static int check_auto_shuffle(hid_t fid, hid_t sid, hid_t plist, hid_t type,
+                              unsigned int expected){
+
+    unsigned int cd_values[12] = {0};
+    size_t nelements = 12;
+    unsigned int flags;
+    hid_t dset, dcpl;
+    int r = -1;
+
+    dset = H5Dcreate(fid, "auto_shuffle", type, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if (dset < 0) return -1;
+    dcpl = H5Dget_create_plist(dset);
+    if (H5Pget_filter_by_id(dcpl, FILTER_BLOSC, &flags, &nelements, cd_values,
+                            0, NULL, NULL) >= 0 &&
+        nelements >= 6 && cd_values[4] == 5 && cd_values[5] == expected) r = 0;
+    if (r < 0) fprintf(stderr, "Unexpected automatic shuffle\n");
+    H5Pclose(dcpl);
+    H5Dclose(dset);
+    H5Ldelete(fid, "auto_shuffle", H5P_DEFAULT);
+    return r;
+}
+
+/* Check that `dset` holds the first `nrows` rows of APPEND_COLS values
+   of `expected`, in `got` */
+static int check_appended(hid_t dset, const long long *expected,
+                          long long *got, hsize_t nrows){
+
+    hsize_t dims[2];
+    hid_t space = H5Dget_space(dset);
+    int r = -1;
+
+    if (H5Sget_simple_extent_dims(space, dims, NULL) != 2 ||
+        dims[0] != nrows || dims[1] != APPEND_COLS) goto failed;
+    if (H5Dread(dset, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, got) < 0)
+        goto failed;
+    if (memcmp(expected, got, nrows * APPEND_COLS * sizeof(long long)) != 0)
+        goto failed;
+    r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Appended rows differ\n");
+    H5Sclose(space);
+    return r;
+}
+
+/* Trace events of the tests, all from decompressing blosclz chunks */
+typedef struct {
+    int begins;
+    int ends;
+    int bad;
+} trace_count_t;
+
+static void count_trace(int phase, const blosc_filter_trace_event_t *event,
+                        void *arg){
+
+    trace_count_t *count = (trace_count_t *)arg;
+
+    if (!event->reverse || event->thread == 0 ||
+        strcmp(event->codec, "blosclz") != 0) count->bad++;
+    if (phase == FILTER_BLOSC_TRACE_BEGIN) {
+        count->begins++;
+        if (event->cbytes == 0) count->bad++;
+    } else {
+        count->ends++;
+        if (event->status != 0 || event->nbytes == 0 || event->seconds < 0)
+            count->bad++;
+    }
+}
+
+/* HDF5 error handler counting the errors it is called for */
+static herr_t count_errors(hid_t stack, void *arg){
+
+    (void)stack;
+    (*(int *)arg)++;
+    return 0;
+}
+
+/* Check that the file at `path` holds a whole JSON trace with events of
+   both phases */
+static int check_trace_file(const char *path){
+
+    static char text[1 << 16];
+    FILE *f = fopen(path, "r");
+    size_t n;
+    int r = -1;
+
+    if (f == NULL) goto failed;
+    n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    text[n] = '\0';
+    if (n > 4 && n < sizeof(text) - 1 &&
+        strncmp(text, "{\"displayTimeUnit\"", 18) == 0 &&
+        strstr(text, "\"ph\":\"B\"") != NULL && strstr(text, "\"ph\":\"E\"") != NULL &&
+        strcmp(text + n - 4, "\n]}\n") == 0) r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Unexpected trace file\n");
+    remove(path);
+    return r;
+}
+
+/* Write attribute `name` of `obj` */
+static int put_attribute(hid_t obj, const char *name, hid_t type,
+                         hid_t space, const void *buf){
+
+    hid_t attr = H5Acreate2(obj, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    int r;
+
+    if (attr < 0) return -1;
+    r = H5Awrite(attr, type, buf);
+    H5Aclose(attr);
+    return r < 0 ? -1 : 0;
+}
+
+/* Write the input of the transcode_gzip test: a dataset with the deflate
+   and shuffle filters, and attributes like those of netCDF-4, references
+   to a dimension scale among them */
+static int write_transcode_input(const char *path){
+
+    typedef struct {
+        hobj_ref_t dataset;
+        int dimension;
+    } dimref_t;
+    static float temp[64 * 64];
+    const hsize_t dims[] = {64, 64}, chunkdims[] = {16, 64}, two = 2;
+    const float range[] = {0, 48};
+    const char *history = "test_direct";
+    const char title[16] = "grid", units[16] = "K";
+    const char scale[16] = "DIMENSION_SCALE";
+    hid_t fid, grp = -1, sid = -1, xsid = -1, scalar = -1, vec = -1;
+    hid_t dcpl = -1, dset = -1, x = -1, str = -1, vstr = -1, vref = -1;
+    hid_t dimtype = -1;
+    hobj_ref_t xref;
+    hvl_t dimlist[2];
+    dimref_t back[2];
+    int i, r = -1;
+
+    for (i = 0; i < 64 * 64; i++) {
+        temp[i] = (float)(i % 97) / 2;
+    }
+    fid = H5Fcreate(path, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (fid < 0) return -1;
+    sid = H5Screate_simple(2, dims, NULL);
+    xsid = H5Screate_simple(1, dims, NULL);
+    scalar = H5Screate(H5S_SCALAR);
+    vec = H5Screate_simple(1, &two, NULL);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    str = H5Tcopy(H5T_C_S1);
+    vstr = H5Tcopy(H5T_C_S1);
+    vref = H5Tvlen_create(H5T_STD_REF_OBJ);
+    dimtype = H5Tcreate(H5T_COMPOUND, sizeof(dimref_t));
+    if (sid < 0 || xsid < 0 || scalar < 0 || vec < 0 || dcpl < 0 ||
+        str < 0 || vstr < 0 || vref < 0 || dimtype < 0) goto failed;
+    if (H5Tset_size(str, 16) < 0 || H5Tset_size(vstr, H5T_VARIABLE) < 0 ||
+        H5Tinsert(dimtype, "dataset", HOFFSET(dimref_t, dataset),
+                  H5T_STD_REF_OBJ) < 0 ||
+        H5Tinsert(dimtype, "dimension", HOFFSET(dimref_t, dimension),
+                  H5T_NATIVE_INT) < 0) goto failed;
+    if (H5Pset_chunk(dcpl, 2, chunkdims) < 0 || H5Pset_shuffle(dcpl) < 0 ||
+        H5Pset_deflate(dcpl, 4) < 0) goto failed;
+
+    grp = H5Gcreate(fid, "grid", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (grp < 0) goto failed;
+    dset = H5Dcreate(grp, "temp", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, dcpl,
+                     H5P_DEFAULT);
+    x = H5Dcreate(grp, "x", H5T_NATIVE_FLOAT, xsid, H5P_DEFAULT, H5P_DEFAULT,
+                  H5P_DEFAULT);
+    if (dset < 0 || x < 0) goto failed;
+    if (H5Dwrite(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                 temp) < 0 ||
+        H5Dwrite(x, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                 temp) < 0) goto failed;
+
+    /* Both dimensions of temp have x as scale */
+    if (H5Rcreate(&xref, grp, "x", H5R_OBJECT, -1) < 0) goto failed;
+    for (i = 0; i < 2; i++) {
+        dimlist[i].len = 1;
+        dimlist[i].p = &xref;
+        if (H5Rcreate(&back[i].dataset, grp, "temp", H5R_OBJECT, -1) < 0)
+            goto failed;
+        back[i].dimension = i;
+    }
+    if (put_attribute(fid, "history", vstr, scalar, &history) < 0 ||
+        put_attribute(grp, "title", str, scalar, title) < 0 ||
+        put_attribute(dset, "units", str, scalar, units) < 0 ||
+        put_attribute(dset, "valid_range", H5T_NATIVE_FLOAT, vec,
+                      range) < 0 ||
+        put_attribute(dset, "DIMENSION_LIST", vref, vec, dimlist) < 0 ||
+        put_attribute(x, "CLASS", str, scalar, scale) < 0 ||
+        put_attribute(x, "REFERENCE_LIST", dimtype, vec, back) < 0)
+        goto failed;
+    r = 0;
+
+ failed:
+    if (r < 0) fprintf(stderr, "Can't write %s\n", path);
+    if (x >= 0) H5Dclose(x);
+    if (dset >= 0) H5Dclose(dset);
+    if (grp >= 0) H5Gclose(grp);
+    if (dimtype >= 0) H5Tclose(dimtype);
+    if (vref >= 0) H5Tclose(vref);
+    if (vstr >= 0) H5Tclose(vstr);
+    if (str >= 0) H5Tclose(str);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (vec >= 0) H5Sclose(vec);
+    if (scalar >= 0) H5Sclose(scalar);
+    if (xsid >= 0) H5Sclose(xsid);
+    if (sid >= 0) H5Sclose(sid);
+    H5Fclose(fid);
+    return r;
+}
+
+int main(){
+
+    static float data[SIZE];
+    static float data_out[SIZE];
+    static long long series[SIZE], series_out[SIZE];
+    static float zoned[SIZE], zoned_out[SIZE];
+    static float chunk0[N_CHUNK0];
+    const hsize_t shape[] = SHAPE;
+    const hsize_t chunkshape[] = CHUNKSHAPE;
+    const hsize_t point[] = {7, 45, 33}, one[] = {1, 1, 1};
+    const hsize_t row[] = {3, 10, 0}, row_count[] = {1, 1, 70};
+    const hsize_t box[] = {2, 20, 30}, box_count[] = {9, 50, 40};
+    const hsize_t tile[] = {0, 32, 32}, tile_count[] = {8, 32, 32};
+    const hsize_t all[] = {0, 0, 0}, second[] = {4, 32, 0};
+    const hsize_t part[] = {0, 0, 0}, part_count[] = {12, 90, 70};
+    unsigned int cd_values[20] = {0};
+    static record_t records[SIZE], records_out[SIZE];
+    static pick_t picked[SIZE], picked_out[SIZE];
+    hid_t rectype = -1, picktype = -1, fspace = -1, mspace = -1;
+    char *version, *date;
+    blosc_filter_stats_t stats;
+    blosc_filter_latency_t latency;
+    trace_count_t traced = {0, 0, 0};
+    unsigned int bits;
+    float trimmed;
+    unsigned long long nratios = 0;
+    hsize_t coded_size = 0, plain_size = 0;
+    size_t in_flight, peak;
+    const char *isas[] = {"generic", "avx2", "avx512", "neon"};
+    const hsize_t small_chunkshape[] = {1, 4, 70};
+    const hsize_t third[] = {8, 0, 0}, first_row[] = {4, 90, 70};
+    const hsize_t app_last[] = {11000, 0};
+    hsize_t offsets[45 * NDIMS];
+    blosc_zone_t zone;
+    const char *picked_codec;
+    unsigned long long ncompressed;
+    H5E_auto2_t old_handler;
+    void *old_data;
+    int nerrors = 0;
+    int r, i;
+    int return_code = 1;
+
+    hid_t fid = -1, sid = -1, dset = -1, dset2 = -1, dset3 = -1, plist = -1;
+    hid_t plist2 = -1, dset4 = -1;
+    const hsize_t app_shape[] = {0, APPEND_COLS}, app_chunkshape[] = {1000, APPEND_COLS};
+    const hsize_t app_maxshape[] = {H5S_UNLIMITED, APPEND_COLS};
+    const hsize_t huge_chunkshape[] = {1 << 26, APPEND_COLS};
+    blosc_appender_t *app = NULL;
+    hid_t app_sid = -1;
+
+    for(i=0; i<SIZE; i++){
+        data[i] = i % 1000;
+    }
+
+    r = register_blosc(&version, &date);
+    if(r<0) goto failed;
+
+    /* The thread override replaces HDF5_BLOSC_NTHREADS, unset here */
+    if(blosc_filter_set_nthreads(4) != 0) goto failed;
+    if(blosc_filter_set_nthreads(0) != 4) goto failed;
+
+    sid = H5Screate_simple(NDIMS, shape, NULL);
+    if(sid<0) goto failed;
+
+    fid = H5Fcreate("test_direct.h5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if(fid<0) goto failed;
+
+    plist = H5Pcreate(H5P_DATASET_CREATE);
+    if(plist<0) goto failed;
+
+    r = H5Pset_chunk(plist, NDIMS, chunkshape);
+    if(r<0) goto failed;
+
+    cd_values[4] = 5;
+    cd_values[5] = 1;
+    cd_values[6] = BLOSC_BLOSCLZ;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7, cd_values);
+    if(r<0) goto failed;
+
+    dset = H5Dcreate(fid, "dset", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset<0) goto failed;
+
+    /* Leave the last chunks unwritten so that they hold the fill value */
+    H5Sselect_hyperslab(sid, H5S_SELECT_SET, part, NULL, part_count, NULL);
+    r = H5Dwrite(dset, H5T_NATIVE_FLOAT, sid, sid, H5P_DEFAULT, &data);
+    if(r<0) goto failed;
+    r = H5Dflush(dset);
+    if(r<0) goto failed;
+
+    /* Partial chunk reads */
+    if(check_hyperslab(dset, point, one) < 0) goto failed;
+    if(check_hyperslab(dset, row, row_count) < 0) goto failed;
+    if(check_hyperslab(dset, box, box_count) < 0) goto failed;
+    /* Whole chunks decompressed in place */
+    if(check_hyperslab(dset, tile, tile_count) < 0) goto failed;
+    if(check_hyperslab(dset, all, shape) < 0) goto failed;
+
+    /* Parallel writes, checked against the filter pipeline */
+    dset2 = H5Dcreate(fid, "dset2", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset2<0) goto failed;
+    r = blosc_write_chunks(dset2, all, shape, data, 3);
+    if(r<0) goto failed;
+    r = H5Dread(dset2, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    for(i=0;i<SIZE;i++){
+        if(data[i] != data_out[i]) goto failed;
+    }
+    if(check_same_chunk(dset, dset2, all) < 0) goto failed;
+
+    /* Shuffle chosen from the type */
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 0, NULL);
+    if(r<0) goto failed;
+    if(check_auto_shuffle(fid, sid, plist, H5T_NATIVE_FLOAT, BLOSC_BITSHUFFLE) < 0) goto failed;
+    if(check_auto_shuffle(fid, sid, plist, H5T_NATIVE_INT, BLOSC_SHUFFLE) < 0) goto failed;
+    if(check_auto_shuffle(fid, sid, plist, H5T_NATIVE_UCHAR, BLOSC_NOSHUFFLE) < 0) goto failed;
+
+    /* Constant chunks: zeros, then a non-zero value, then real data */
+    for(i=0; i<SIZE; i++){
+        data_out[i] = i < 4*90*70 ? 0.f : i < 8*90*70 ? 3.5f : data[i];
+    }
+    dset3 = H5Dcreate(fid, "constant", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = H5Dwrite(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    if(check_hyperslab(dset3, box, box_count) < 0) goto failed;
+    if(check_hyperslab(dset3, all, shape) < 0) goto failed;
+    if(check_constant_chunk(dset3, all) < 0) goto failed;
+    if(check_constant_chunk(dset3, second) < 0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+
+    /* Precision trimming keeps 4 mantissa bits of floats, and is turned
+       off for integers */
+    cd_values[14] = 4;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 15, cd_values);
+    if(r<0) goto failed;
+    dset3 = H5Dcreate(fid, "trimmed", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = H5Dwrite(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data);
+    if(r<0) goto failed;
+    /* Reopen it, as the chunk cache still holds the untrimmed chunks */
+    H5Dclose(dset3);
+    dset3 = H5Dopen(fid, "trimmed", H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = H5Dread(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    for(i=0; i<SIZE; i++){
+        memcpy(&bits, &data[i], 4);
+        bits &= ~((1U << (23 - 4)) - 1);
+        memcpy(&trimmed, &bits, 4);
+        if(data_out[i] != trimmed) goto failed;
+    }
+    H5Dclose(dset3);
+    dset3 = H5Dcreate(fid, "not_trimmed", H5T_NATIVE_INT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    if(get_slot(dset3, 14) != 0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+    cd_values[14] = 0;
+
+    /* Codec chosen per chunk: a reachable target ratio keeps the codec of
+       the dataset, an unreachable one (or a speed any codec reaches) makes
+       the filter try the others and keep the one compressing the first
+       chunk best, which the stats file it under */
+    for(i=0; i<N_CHUNK0; i++){
+        chunk0[i] = data[(i / 1024) * 90 * 70 + (i / 32 % 32) * 70 + i % 32];
+    }
+    for(i=0; i<3; i++){
+        cd_values[12] = i < 2 ? FILTER_BLOSC_POLICY_RATIO : FILTER_BLOSC_POLICY_SPEED;
+        cd_values[13] = i == 0 ? 100 : i == 1 ? 100000 : 1;
+        r = H5Premove_filter(plist, FILTER_BLOSC);
+        if(r<0) goto failed;
+        r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 14, cd_values);
+        if(r<0) goto failed;
+        dset3 = H5Dcreate(fid, i == 0 ? "policy1" : i == 1 ? "policy2" : "policy3",
+                          H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        picked_codec = i == 0 ? "blosclz" : policy_codec(dset3, chunk0, sizeof(chunk0));
+        blosc_filter_get_latency(picked_codec, 0, &latency);
+        ncompressed = latency.count;
+        r = H5Dwrite(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data);
+        if(r<0) goto failed;
+        if(check_hyperslab(dset3, all, shape) < 0) goto failed;
+        if(strcmp(chunk_codec(dset3, all), picked_codec) != 0) goto failed;
+        blosc_filter_get_latency(picked_codec, 0, &latency);
+        if(latency.count <= ncompressed) goto failed;
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    cd_values[12] = cd_values[13] = 0;
+
+    /* Delta coding of a slowly growing series, in blocks of 4 KB so that
+       partial reads start in the middle of delta blocks */
+    for(i=0; i<SIZE; i++){
+        series[i] = 1600000000000LL + i * 1000LL + i % 7;
+    }
+    for(i=0; i<2; i++){
+        cd_values[9] = 4096;
+        cd_values[15] = i == 0 ? FILTER_BLOSC_DELTA : 0;
+        r = H5Premove_filter(plist, FILTER_BLOSC);
+        if(r<0) goto failed;
+        r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 16, cd_values);
+        if(r<0) goto failed;
+        dset3 = H5Dcreate(fid, i == 0 ? "delta" : "no_delta", H5T_NATIVE_LLONG, sid,
+                          H5P_DEFAULT, plist, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        r = H5Dwrite(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series);
+        if(r<0) goto failed;
+        H5Dclose(dset3);
+        dset3 = H5Dopen(fid, i == 0 ? "delta" : "no_delta", H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        if(get_slot(dset3, 15) != (int)cd_values[15]) goto failed;
+        r = H5Dread(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series_out);
+        if(r<0) goto failed;
+        if(memcmp(series, series_out, sizeof(series)) != 0) goto failed;
+        if(check_typed_hyperslab(dset3, H5T_NATIVE_LLONG, point, one) < 0) goto failed;
+        if(check_typed_hyperslab(dset3, H5T_NATIVE_LLONG, box, box_count) < 0) goto failed;
+        if(i == 0) coded_size = H5Dget_storage_size(dset3);
+        else plain_size = H5Dget_storage_size(dset3);
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    if(coded_size >= plain_size){
+        fprintf(stderr, "Delta coding does not help: %llu >= %llu bytes\n",
+                (unsigned long long)coded_size, (unsigned long long)plain_size);
+        goto failed;
+    }
+    /* Every kernel variant the CPU has writes the same chunks */
+    H5E_BEGIN_TRY {
+        r = blosc_filter_set_isa("mmx");
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    cd_values[15] = FILTER_BLOSC_DELTA;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 16, cd_values);
+    if(r<0) goto failed;
+    dset4 = H5Dopen(fid, "delta", H5P_DEFAULT);
+    if(dset4<0) goto failed;
+    for(i=0; i<4; i++){
+        H5E_BEGIN_TRY {
+            r = blosc_filter_set_isa(isas[i]);
+        } H5E_END_TRY;
+        if(r<0) continue;
+        if(strcmp(blosc_filter_get_isa(), isas[i]) != 0) goto failed;
+        dset3 = H5Dcreate(fid, isas[i], H5T_NATIVE_LLONG, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        r = H5Dwrite(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series);
+        if(r<0) goto failed;
+        if(check_same_chunk(dset4, dset3, all) < 0) goto failed;
+        if(check_same_chunk(dset4, dset3, second) < 0) goto failed;
+        H5Dclose(dset3);
+        dset3 = H5Dopen(fid, isas[i], H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        r = H5Dread(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series_out);
+        if(r<0) goto failed;
+        if(memcmp(series, series_out, sizeof(series)) != 0) goto failed;
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    H5Dclose(dset4);
+    dset4 = -1;
+    r = blosc_filter_set_isa(NULL);
+    if(r<0) goto failed;
+
+    /* Turned off for floats, and fixing an automatic blocksize otherwise */
+    cd_values[9] = 0;
+    cd_values[15] = FILTER_BLOSC_DELTA;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 16, cd_values);
+    if(r<0) goto failed;
+    dset3 = H5Dcreate(fid, "delta_float", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    if(get_slot(dset3, 15) != 0) goto failed;
+    H5Dclose(dset3);
+    dset3 = H5Dcreate(fid, "delta_auto", H5T_NATIVE_INT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    if(get_slot(dset3, 15) != FILTER_BLOSC_DELTA || get_slot(dset3, 9) <= 1) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+    cd_values[15] = 0;
+
+    /* Checksums, on compressible floats and on chunks that do not compress
+       (which are then not left unfiltered), catch corrupted chunks */
+    cd_values[17] = FILTER_BLOSC_CHECKSUM_CRC32C;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 18, cd_values);
+    if(r<0) goto failed;
+    for(i=0; i<SIZE; i++){
+        series[i] = (long long)((unsigned long long)(i + 1) * 0x9e3779b97f4a7c15ULL);
+    }
+    for(i=0; i<2; i++){
+        dset3 = H5Dcreate(fid, i == 0 ? "checksum" : "checksum_raw",
+                          H5T_NATIVE_LLONG, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        if(i == 0) {
+            r = H5Dwrite(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+        } else {
+            r = H5Dwrite(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series);
+        }
+        if(r<0) goto failed;
+        H5Dclose(dset3);
+        dset3 = H5Dopen(fid, i == 0 ? "checksum" : "checksum_raw", H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        if(get_slot(dset3, 17) != FILTER_BLOSC_CHECKSUM_CRC32C) goto failed;
+        r = H5Dread(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series_out);
+        if(r<0) goto failed;
+        if(i == 1 && memcmp(series, series_out, sizeof(series)) != 0) goto failed;
+        if(check_typed_hyperslab(dset3, H5T_NATIVE_LLONG, box, box_count) < 0) goto failed;
+        if(corrupt_chunk(dset3, all) < 0) goto failed;
+        H5Dclose(dset3);
+        dset3 = H5Dopen(fid, i == 0 ? "checksum" : "checksum_raw", H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        H5E_BEGIN_TRY {
+            r = H5Dread(dset3, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, series_out);
+        } H5E_END_TRY;
+        if(r>=0) goto failed;
+        H5E_BEGIN_TRY {
+            r = blosc_read_hyperslab(dset3, all, one, series_out);
+        } H5E_END_TRY;
+        if(r>=0) goto failed;
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    cd_values[17] = 0;
+
+    /* Compound records stored field-split, some of their members read
+       without decompressing the others */
+    rectype = H5Tcreate(H5T_COMPOUND, sizeof(record_t));
+    H5Tinsert(rectype, "t", HOFFSET(record_t, t), H5T_NATIVE_LLONG);
+    H5Tinsert(rectype, "flag", HOFFSET(record_t, flag), H5T_NATIVE_CHAR);
+    H5Tinsert(rectype, "x", HOFFSET(record_t, x), H5T_NATIVE_DOUBLE);
+    H5Tinsert(rectype, "y", HOFFSET(record_t, y), H5T_NATIVE_FLOAT);
+    H5Tinsert(rectype, "z", HOFFSET(record_t, z), H5T_NATIVE_INT);
+    picktype = H5Tcreate(H5T_COMPOUND, sizeof(pick_t));
+    H5Tinsert(picktype, "z", HOFFSET(pick_t, z), H5T_NATIVE_INT);
+    H5Tinsert(picktype, "x", HOFFSET(pick_t, x), H5T_NATIVE_DOUBLE);
+    memset(records, 0, sizeof(records));
+    for(i=0; i<SIZE; i++){
+        records[i].t = 1600000000000LL + i * 10LL;
+        records[i].flag = (char)(i % 3 == 0);
+        records[i].x = (i % 1000) * 0.25;
+        records[i].y = (float)(i % 77);
+        records[i].z = i / 100;
+    }
+    cd_values[18] = FILTER_BLOSC_SPLIT_FIELDS;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 20, cd_values);
+    if(r<0) goto failed;
+    dset3 = H5Dcreate(fid, "split", rectype, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = H5Dwrite(dset3, rectype, H5S_ALL, H5S_ALL, H5P_DEFAULT, records);
+    if(r<0) goto failed;
+    H5Dclose(dset3);
+    dset3 = H5Dopen(fid, "split", H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    /* t, flag, the padding, x, y and z */
+    if(get_slot(dset3, 18) != FILTER_BLOSC_SPLIT_FIELDS || get_slot(dset3, 19) != 6)
+        goto failed;
+    r = H5Dread(dset3, rectype, H5S_ALL, H5S_ALL, H5P_DEFAULT, records_out);
+    if(r<0) goto failed;
+    for(i=0; i<SIZE; i++){
+        if(records_out[i].t != records[i].t || records_out[i].flag != records[i].flag ||
+           records_out[i].x != records[i].x || records_out[i].y != records[i].y ||
+           records_out[i].z != records[i].z) goto failed;
+    }
+    if(check_typed_hyperslab(dset3, rectype, box, box_count) < 0) goto failed;
+    /* Small reads too, which decode the chunks whole */
+    if(check_typed_hyperslab(dset3, rectype, row, row_count) < 0) goto failed;
+    if(check_typed_hyperslab(dset3, rectype, point, one) < 0) goto failed;
+    fspace = H5Dget_space(dset3);
+    H5Sselect_hyperslab(fspace, H5S_SELECT_SET, box, NULL, box_count, NULL);
+    mspace = H5Screate_simple(NDIMS, box_count, NULL);
+    r = H5Dread(dset3, picktype, mspace, fspace, H5P_DEFAULT, picked);
+    if(r<0) goto failed;
+    r = blosc_read_fields(dset3, picktype, box, box_count, picked_out);
+    if(r<0) goto failed;
+    for(i=0; i<(int)(box_count[0] * box_count[1] * box_count[2]); i++){
+        if(picked[i].x != picked_out[i].x || picked[i].z != picked_out[i].z) goto failed;
+    }
+    /* With threads, the fields are compressed side by side on the worker
+       pool, into the same chunks */
+    cd_values[7] = 4;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 20, cd_values);
+    cd_values[7] = 0;
+    if(r<0) goto failed;
+    dset4 = H5Dcreate(fid, "split_threads", rectype, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset4<0) goto failed;
+    r = H5Dwrite(dset4, rectype, H5S_ALL, H5S_ALL, H5P_DEFAULT, records);
+    if(r<0) goto failed;
+    if(check_same_chunk(dset3, dset4, all) < 0) goto failed;
+    memset(records_out, 0, sizeof(records_out));
+    r = H5Dread(dset4, rectype, H5S_ALL, H5S_ALL, H5P_DEFAULT, records_out);
+    if(r<0) goto failed;
+    if(memcmp(records, records_out, sizeof(records)) != 0) goto failed;
+    H5Dclose(dset4);
+    dset4 = -1;
+    r = H5Premove_filter(plist, FILTER_BLOSC);
+    if(r<0) goto failed;
+    r = H5Pset_filter(plist, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 20, cd_values);
+    if(r<0) goto failed;
+    H5Dclose(dset3);
+    /* Turned off for anything but compounds */
+    dset3 = H5Dcreate(fid, "split_float", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    if(get_slot(dset3, 18) != 0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+    cd_values[18] = 0;
+
+    /* Small chunks compressed with a zstd dictionary trained on them */
+    plist2 = H5Pcreate(H5P_DATASET_CREATE);
+    if(plist2<0) goto failed;
+    r = H5Pset_chunk(plist2, NDIMS, small_chunkshape);
+    if(r<0) goto failed;
+    cd_values[6] = BLOSC_ZSTD;
+    r = H5Pset_filter(plist2, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7, cd_values);
+    if(r<0) goto failed;
+    cd_values[6] = BLOSC_BLOSCLZ;
+#ifdef HAVE_ZSTD_DICT
+    for(i=0; i<2; i++){
+        if(i == 1 && blosc_filter_train_dict(plist2, H5T_NATIVE_FLOAT, data,
+                                             sizeof(data), 0) < 0) goto failed;
+        dset3 = H5Dcreate(fid, i == 0 ? "no_dict" : "dict", H5T_NATIVE_FLOAT, sid,
+                          H5P_DEFAULT, plist2, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        r = H5Dwrite(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data);
+        if(r<0) goto failed;
+        H5Dclose(dset3);
+        dset3 = H5Dopen(fid, i == 0 ? "no_dict" : "dict", H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        if((get_slot(dset3, 16) > 0) != (i == 1)) goto failed;
+        r = H5Dread(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+        if(r<0) goto failed;
+        if(memcmp(data, data_out, sizeof(data)) != 0) goto failed;
+        if(check_hyperslab(dset3, box, box_count) < 0) goto failed;
+        if(i == 0) plain_size = H5Dget_storage_size(dset3);
+        else coded_size = H5Dget_storage_size(dset3);
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    if(coded_size >= plain_size){
+        fprintf(stderr, "The dictionary does not help: %llu >= %llu bytes\n",
+                (unsigned long long)coded_size, (unsigned long long)plain_size);
+        goto failed;
+    }
+#else
+    H5E_BEGIN_TRY {
+        r = blosc_filter_train_dict(plist2, H5T_NATIVE_FLOAT, data, sizeof(data), 0);
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+#endif
+
+    /* Rows appended in the background, in pieces not matching chunks,
+       then more of them after reopening, into the last partial chunk */
+    for(i=0; i<SIZE; i++){
+        series[i] = 1000000 + 3 * (long long)i;
+    }
+    H5Pclose(plist2);
+    plist2 = H5Pcreate(H5P_DATASET_CREATE);
+    if(plist2<0) goto failed;
+    r = H5Pset_chunk(plist2, 2, app_chunkshape);
+    if(r<0) goto failed;
+    cd_values[15] = FILTER_BLOSC_DELTA;
+    r = H5Pset_filter(plist2, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 16, cd_values);
+    cd_values[15] = 0;
+    if(r<0) goto failed;
+    app_sid = H5Screate_simple(2, app_shape, app_maxshape);
+    if(app_sid<0) goto failed;
+    dset3 = H5Dcreate(fid, "appended", H5T_NATIVE_LLONG, app_sid, H5P_DEFAULT, plist2, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    app = blosc_appender_open(dset3, 3);
+    if(app == NULL) goto failed;
+    for(i=0; i<10500; i+=333){
+        r = blosc_append(app, series + i * APPEND_COLS, i + 333 <= 10500 ? 333 : 10500 - i);
+        if(r<0) goto failed;
+        if(i == 4662){
+            /* Everything so far is visible once flushed */
+            r = blosc_appender_flush(app);
+            if(r<0) goto failed;
+            if(check_appended(dset3, series, series_out, 4995) < 0) goto failed;
+        }
+    }
+    r = blosc_appender_close(app);
+    app = NULL;
+    if(r<0) goto failed;
+    if(check_appended(dset3, series, series_out, 10500) < 0) goto failed;
+    /* The appender keeps a zone map up to date */
+    r = blosc_zonemap_build(dset3, 2);
+    if(r<0) goto failed;
+    app = blosc_appender_open(dset3, 2);
+    if(app == NULL) goto failed;
+    r = blosc_append(app, series + 10500 * APPEND_COLS, 700);
+    if(r<0) goto failed;
+    /* The worker pool can't be set up again while in use */
+    H5E_BEGIN_TRY {
+        r = blosc_filter_set_workers(2, NULL);
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    r = blosc_appender_close(app);
+    app = NULL;
+    if(r<0) goto failed;
+    H5Dclose(dset3);
+    dset3 = H5Dopen(fid, "appended", H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    if(check_appended(dset3, series, series_out, 11200) < 0) goto failed;
+    r = blosc_zonemap_get(dset3, app_last, &zone);
+    if(r<0 || !zone.valid) goto failed;
+    if(zone.min != series[11000 * APPEND_COLS] ||
+       zone.max != series[11200 * APPEND_COLS - 1]) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+    /* Without pool threads, jobs run in the calling thread; then on two
+       threads pinned to the first CPU */
+    H5E_BEGIN_TRY {
+        r = blosc_filter_set_workers(2, "3-1");
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    for(i=0; i<2; i++){
+        r = blosc_filter_set_workers(i == 0 ? 0 : 2, i == 0 ? NULL : "0");
+        if(r<0) goto failed;
+        if(check_hyperslab(dset2, box, box_count) < 0) goto failed;
+        dset3 = H5Dcreate(fid, i == 0 ? "pool_inline" : "pool_pinned", H5T_NATIVE_FLOAT,
+                          sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+        if(dset3<0) goto failed;
+        r = blosc_write_chunks(dset3, all, shape, data, 0);
+        if(r<0) goto failed;
+        if(check_same_chunk(dset2, dset3, all) < 0) goto failed;
+        H5Dclose(dset3);
+        dset3 = -1;
+    }
+    r = blosc_filter_set_workers(-1, NULL);
+    if(r<0) goto failed;
+
+    /* A memory budget of about three chunk jobs holds, on any number of
+       threads */
+    blosc_filter_set_memory_budget(100000);
+    blosc_filter_get_memory(&in_flight, &peak, 1);
+    dset3 = H5Dcreate(fid, "budget", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = blosc_write_chunks(dset3, all, shape, data, 8);
+    if(r<0) goto failed;
+    if(check_same_chunk(dset2, dset3, all) < 0) goto failed;
+    r = blosc_read_chunks(dset3, all, shape, data_out, 8);
+    if(r<0) goto failed;
+    for(i=0;i<SIZE;i++){
+        if(data[i] != data_out[i]) goto failed;
+    }
+    blosc_filter_get_memory(&in_flight, &peak, 0);
+    if(in_flight != 0 || peak == 0 || peak > 100000) goto failed;
+    /* The filter still decompresses chunks bigger than the budget, which
+       only holds the direct chunk functions */
+    blosc_filter_set_memory_budget(8000);
+    r = H5Dread(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    for(i=0;i<SIZE;i++){
+        if(data[i] != data_out[i]) goto failed;
+    }
+    if(blosc_filter_set_memory_budget(0) != 8000) goto failed;
+    /* A header claiming more than the chunk size is refused too */
+    if(break_header(dset3, all) < 0) goto failed;
+    H5E_BEGIN_TRY {
+        r = H5Dread(dset3, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+
+    /* Zone maps: the values are the index along the first dimension, so
+       each row of chunks holds its own range, but for a NaN */
+    for(i=0; i<SIZE; i++){
+        zoned[i] = (float)(i / (90 * 70));
+        zoned_out[i] = -1;
+    }
+    zoned[8 * 90 * 70] = NAN;
+    dset3 = H5Dcreate(fid, "zoned", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    r = blosc_write_chunks(dset3, all, shape, zoned, 3);
+    if(r<0) goto failed;
+    H5E_BEGIN_TRY {
+        r = blosc_zonemap_get(dset3, second, &zone);
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    r = blosc_zonemap_build(dset3, 3);
+    if(r<0) goto failed;
+    r = blosc_zonemap_get(dset3, second, &zone);
+    if(r<0 || !zone.valid || zone.min != 4 || zone.max != 7 || zone.nnan != 0) goto failed;
+    r = blosc_zonemap_get(dset3, third, &zone);
+    if(r<0 || zone.min != 8 || zone.max != 11 || zone.nnan != 1) goto failed;
+    if(blosc_zonemap_select(dset3, 5, 6, offsets, 45) != 9) goto failed;
+    if(offsets[0] != 4 || offsets[1] != 0 || offsets[2] != 0) goto failed;
+    if(blosc_zonemap_select(dset3, 100, 200, offsets, 45) != 0) goto failed;
+    /* Only the matching chunks are read */
+    if(blosc_read_where(dset3, 5, 6, zoned_out, 3) != 9) goto failed;
+    for(i=0; i<SIZE; i++){
+        if(i / (90 * 70) / 4 == 1 ? zoned_out[i] != zoned[i] : zoned_out[i] != -1)
+            goto failed;
+    }
+    /* Writes update the map, for the chunks they write */
+    for(i=0; i<4 * 90 * 70; i++){
+        zoned[i] += 100;
+    }
+    r = blosc_write_chunks(dset3, all, first_row, zoned, 3);
+    if(r<0) goto failed;
+    if(blosc_zonemap_select(dset3, 100, 200, offsets, 45) != 9) goto failed;
+    if(offsets[0] != 0 || offsets[4] != 0 || offsets[5] != 32) goto failed;
+    H5Dclose(dset3);
+    /* Records have no range */
+    dset3 = H5Dopen(fid, "split", H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    H5E_BEGIN_TRY {
+        r = blosc_zonemap_build(dset3, 1);
+    } H5E_END_TRY;
+    if(r>=0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+
+    /* Fixed-size datasets can't be appended to */
+    H5E_BEGIN_TRY {
+        app = blosc_appender_open(dset, 1);
+    } H5E_END_TRY;
+    if(app != NULL) goto failed;
+
+    /* Chunks beyond the 2 GB of Blosc are refused */
+    r = H5Pset_chunk(plist, 2, huge_chunkshape);
+    if(r<0) goto failed;
+    H5E_BEGIN_TRY {
+        dset3 = H5Dcreate(fid, "dset3", H5T_NATIVE_FLOAT, app_sid, H5P_DEFAULT, plist, H5P_DEFAULT);
+    } H5E_END_TRY;
+    if(dset3>=0) goto failed;
+
+    /* Every chunk written through the filter lands in the histogram */
+    blosc_filter_get_stats(&stats);
+    if(stats.compress.chunks == 0 || stats.decompress.chunks == 0) goto failed;
+    for(i=0; i<FILTER_BLOSC_RATIO_BINS; i++) nratios += stats.ratio_hist[i];
+    if(nratios != stats.compress.chunks) goto failed;
+    /* And in the latency histograms */
+    blosc_filter_get_latency(NULL, 0, &latency);
+    if(latency.count != stats.compress.chunks) goto failed;
+    blosc_filter_get_latency("blosclz", 1, &latency);
+    if(latency.count == 0 || latency.count > stats.decompress.chunks) goto failed;
+    if(blosc_filter_latency_quantile(&latency, 0.99) <= 0 ||
+       blosc_filter_latency_quantile(&latency, 0.5) > blosc_filter_latency_quantile(&latency, 0.99) ||
+       blosc_filter_latency_quantile(&latency, 1) != latency.max_seconds) goto failed;
+    if(blosc_filter_latency_bound(31) != 31e-6 || blosc_filter_latency_bound(48) != 64e-6)
+        goto failed;
+    blosc_filter_reset_stats();
+    blosc_filter_get_stats(&stats);
+    if(stats.compress.chunks != 0 || stats.compress.bytes_in != 0) goto failed;
+    blosc_filter_get_latency(NULL, 1, &latency);
+    if(latency.count != 0) goto failed;
+
+    /* Every call of the filter is traced, once asked for (the dataset is
+       opened again each time, so its chunks are not cached) */
+    H5Dclose(dset);
+    dset = H5Dopen(fid, "dset", H5P_DEFAULT);
+    if(dset<0) goto failed;
+    blosc_filter_set_trace(count_trace, &traced);
+    r = H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    blosc_filter_set_trace(NULL, NULL);
+    blosc_filter_get_stats(&stats);
+    if(traced.begins == 0 || traced.ends != traced.begins || traced.bad != 0 ||
+       (unsigned long long)traced.ends != stats.decompress.chunks) goto failed;
+    H5Dclose(dset);
+    dset = H5Dopen(fid, "dset", H5P_DEFAULT);
+    if(dset<0) goto failed;
+    r = H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    if((unsigned long long)traced.ends != stats.decompress.chunks) goto failed;
+    /* To a trace file too */
+    r = blosc_filter_trace_to_file("test_direct_trace.json");
+    if(r<0) goto failed;
+    H5Dclose(dset);
+    dset = H5Dopen(fid, "dset", H5P_DEFAULT);
+    if(dset<0) goto failed;
+    r = H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data_out);
+    if(r<0) goto failed;
+    r = blosc_filter_trace_to_file(NULL);
+    if(r<0) goto failed;
+    if(check_trace_file("test_direct_trace.json") < 0) goto failed;
+
+    /* Zone maps can be queried in a file opened read-only, without a
+       single error */
+    H5Dclose(dset);
+    dset = -1;
+    H5Dclose(dset2);
+    dset2 = -1;
+    H5Fclose(fid);
+    fid = H5Fopen("test_direct.h5", H5F_ACC_RDONLY, H5P_DEFAULT);
+    if(fid<0) goto failed;
+    dset3 = H5Dopen(fid, "zoned", H5P_DEFAULT);
+    if(dset3<0) goto failed;
+    H5Eget_auto2(H5E_DEFAULT, &old_handler, &old_data);
+    H5Eset_auto2(H5E_DEFAULT, count_errors, &nerrors);
+    r = blosc_zonemap_get(dset3, third, &zone);
+    if(r<0 || zone.min != 8 || zone.max != 11) nerrors++;
+    if(blosc_zonemap_select(dset3, 100, 200, offsets, 45) != 9) nerrors++;
+    if(blosc_read_where(dset3, 5, 6, zoned_out, 3) != 9) nerrors++;
+    H5Eset_auto2(H5E_DEFAULT, old_handler, old_data);
+    if(nerrors != 0) goto failed;
+    H5Dclose(dset3);
+    dset3 = -1;
+
+    /* Transcoded by the transcode_gzip test */
+    if(write_transcode_input("test_transcode.h5") < 0) goto failed;
+
+    fprintf(stdout, "Success!\n");
+
+    return_code = 0;
+
+    failed:
+
+    if(dset>=0)  H5Dclose(dset);
+    if(dset2>=0) H5Dclose(dset2);
+    if(dset3>=0) H5Dclose(dset3);
+    if(dset4>=0) H5Dclose(dset4);
+    if(sid>=0)   H5Sclose(sid);
+    if(plist>=0) H5Pclose(plist);
+    if(plist2>=0) H5Pclose(plist2);
+    if(rectype>=0) H5Tclose(rectype);
+    if(picktype>=0) H5Tclose(picktype);
+    if(fspace>=0) H5Sclose(fspace);
+    if(mspace>=0) H5Sclose(mspace);
+    if(app != NULL) blosc_appender_close(app);
+    if(app_sid>=0) H5Sclose(app_sid);
+    if(fid>=0)   H5Fclose(fid);
+
+    return return_code;
+}
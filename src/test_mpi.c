@@ -0,0 +1,112 @@
+/*
+    Copyright (C) 2010  Francesc Alted
+    http://blosc.org
+    License: MIT (see LICENSE.txt)
+
+    Test program for blosc_write_chunks_mpi(), on any number of ranks.
+    Every rank writes a slab of rows that does not start or end on a
+    chunk boundary, so that ranks share chunks as well as compress their
+    own ahead, and then reads the whole dataset back and checks it.
+
+    To run:
+
+    $ mpirun -np 2 ./test_mpi
+    Success!
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include "hdf5.h"
+#include "blosc_filter.h"
+
+#define CHUNK_ROWS 64
+#define COLS 128
+#define SLAB_ROWS (5 * CHUNK_ROWS / 2)  /* Two chunks and a half per rank */
+
+static float value(hsize_t row, hsize_t col){
+    return (float)((row * COLS + col) % 1000);
+}
+
+int main(int argc, char **argv){
+
+    unsigned int cd_values[7] = {0};
+    hsize_t dims[2], chunkdims[2] = {CHUNK_ROWS, COLS};
+    hsize_t start[2], count[2] = {SLAB_ROWS, COLS};
+    hid_t fapl = -1, fid = -1, sid = -1, dcpl = -1, dset = -1;
+    float *slab = NULL, *all = NULL;
+    char *version, *date;
+    hsize_t i, j, first, last;
+    unsigned long long taken;
+    int rank, nranks, failed = 1, anyfailed;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+    dims[0] = (hsize_t)nranks * SLAB_ROWS;
+    dims[1] = COLS;
+    start[0] = (hsize_t)rank * SLAB_ROWS;
+    start[1] = 0;
+
+    if (register_blosc(&version, &date) < 0) goto done;
+    free(version);
+    free(date);
+    slab = (float *)malloc(SLAB_ROWS * COLS * sizeof(float));
+    all = (float *)malloc(dims[0] * COLS * sizeof(float));
+    if (slab == NULL || all == NULL) goto done;
+    for (i = 0; i < SLAB_ROWS; i++) {
+        for (j = 0; j < COLS; j++) slab[i * COLS + j] = value(start[0] + i, j);
+    }
+
+    fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (fapl < 0 || H5Pset_fapl_mpio(fapl, MPI_COMM_WORLD,
+                                     MPI_INFO_NULL) < 0) goto done;
+    fid = H5Fcreate("test_mpi.h5", H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    sid = H5Screate_simple(2, dims, NULL);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if (fid < 0 || sid < 0 || dcpl < 0) goto done;
+    cd_values[4] = 5;
+    cd_values[5] = 1;
+    cd_values[6] = BLOSC_BLOSCLZ;
+    if (H5Pset_chunk(dcpl, 2, chunkdims) < 0 ||
+        H5Pset_filter(dcpl, FILTER_BLOSC, H5Z_FLAG_OPTIONAL, 7,
+                      cd_values) < 0) goto done;
+    dset = H5Dcreate(fid, "dset", H5T_NATIVE_FLOAT, sid, H5P_DEFAULT, dcpl,
+                     H5P_DEFAULT);
+    if (dset < 0) goto done;
+
+    /* Two threads, to go through the workers even on one processor */
+    taken = blosc_mpi_chunks_taken();
+    if (blosc_write_chunks_mpi(dset, start, count, slab, 2) < 0) goto done;
+
+    /* The chunks wholly in the slab of this rank were compressed ahead */
+    first = (start[0] + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    last = (start[0] + SLAB_ROWS) / CHUNK_ROWS;
+    if (blosc_mpi_chunks_taken() - taken != last - first) goto done;
+
+    /* Compressed, and the same for every rank */
+    if (H5Dget_storage_size(dset) >= dims[0] * COLS * sizeof(float) ||
+        H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                all) < 0) goto done;
+    for (i = 0; i < dims[0]; i++) {
+        for (j = 0; j < COLS; j++) {
+            if (all[i * COLS + j] != value(i, j)) goto done;
+        }
+    }
+    failed = 0;
+
+ done:
+    if (dset >= 0) H5Dclose(dset);
+    if (dcpl >= 0) H5Pclose(dcpl);
+    if (sid >= 0) H5Sclose(sid);
+    if (fid >= 0) H5Fclose(fid);
+    if (fapl >= 0) H5Pclose(fapl);
+    free(slab);
+    free(all);
+    MPI_Allreduce(&failed, &anyfailed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (rank == 0 && anyfailed) fprintf(stderr, "Error!\n");
+    if (rank == 0 && !anyfailed) fprintf(stdout, "Success!\n");
+    MPI_Finalize();
+    return anyfailed;
+}